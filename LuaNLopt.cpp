@@ -10,982 +10,9259 @@
 
 #include <Lua/lua.h>
 #include <Lua/lauxlib.h>
+#include <Lua/lualib.h>
 #include <NLopt/nlopt.h>
 #include <vector>
+#include <string>
+#include <new>
+#include <map>
+#include <algorithm>
+#include <csignal>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
 
 #define LIBNAME		"nlopt"
 #define LIBVERSION	LIBNAME " library for " LUA_VERSION
 static 	const char* nlopt_metaName = "nlopt_opt";
+static 	const char* dataset_metaName = "nlopt_dataset";
+static 	const char* objective_metaName = "nlopt_objective";
+static 	const char* token_metaName = "nlopt_cancel_token";
+static 	const char* async_metaName = "nlopt_async";
+static 	const char* scheduler_metaName = "nlopt_scheduler";
+static 	const char* matrix_metaName = "nlopt_matrix";
+static 	const char* vector_metaName = "nlopt_vector";
+static 	const char* precond_metaName = "nlopt_precond";
+static 	const double s_nan = std::numeric_limits<double>::quiet_NaN();
+// Algorithms implemented by this module are numbered after those of NLopt
+static 	const int X_BAYESOPT = NLOPT_NUM_ALGORITHMS;
+
+// Minimal portability layer; we have to get along with C++03 and the Win32 API of VS 2005.
 
-static void setfieldint( lua_State *L, const char* key, int val )
-{
-	// Expects table on top of stack
-	lua_pushinteger( L, val );
-	lua_setfield( L, -2, key );
-}
+#ifdef _WIN32
+typedef LONG atomic_t;
+static inline long atomic_increment( volatile atomic_t* p ) { return InterlockedIncrement( p ); }
+static inline long atomic_decrement( volatile atomic_t* p ) { return InterlockedDecrement( p ); }
+static inline long atomic_exchange( volatile atomic_t* p, long v ) { return InterlockedExchange( p, v ); }
+static inline long atomic_load( volatile atomic_t* p ) { return InterlockedCompareExchange( p, 0, 0 ); }
+static inline long atomic_cas( volatile atomic_t* p, long expected, long v ) { return InterlockedCompareExchange( p, v, expected ); }
+#else
+typedef long atomic_t;
+static inline long atomic_increment( volatile atomic_t* p ) { return __sync_add_and_fetch( p, 1 ); }
+static inline long atomic_decrement( volatile atomic_t* p ) { return __sync_sub_and_fetch( p, 1 ); }
+// __sync_lock_test_and_set is only an acquire barrier; like InterlockedExchange, earlier stores
+// must be visible before the new value, e.g. the results of a slot before its state
+static inline long atomic_exchange( volatile atomic_t* p, long v ) { __sync_synchronize(); return __sync_lock_test_and_set( p, v ); }
+static inline long atomic_load( volatile atomic_t* p ) { return __sync_fetch_and_add( p, 0 ); }
+static inline long atomic_cas( volatile atomic_t* p, long expected, long v ) { return __sync_val_compare_and_swap( p, expected, v ); }
+#endif
 
-static int algorithm_name( lua_State *L )
-{
-	const lua_Integer i = luaL_checkinteger( L, 1 );
-	if( i < 0 || i >= NLOPT_NUM_ALGORITHMS )
-		luaL_argerror( L, 1, "expecting nlopt.algorithm" );
-	lua_pushstring( L, nlopt_algorithm_name( static_cast<nlopt_algorithm>( i ) ) );
-	return 1;
-}
+// Static tracepoints for bpftrace and perf if built with LUANLOPT_USDT on Linux (requires
+// sys/sdt.h of SystemTap); a tracepoint is a nop unless attached, and gone otherwise.
+#if defined(__linux__) && defined(LUANLOPT_USDT)
+#include <sys/sdt.h>
+#define PROBE2( name, a, b ) DTRACE_PROBE2( luanlopt, name, a, b )
+#define PROBE3( name, a, b, c ) DTRACE_PROBE3( luanlopt, name, a, b, c )
+#define PROBE4( name, a, b, c, d ) DTRACE_PROBE4( luanlopt, name, a, b, c, d )
+#else
+#define PROBE2( name, a, b )
+#define PROBE3( name, a, b, c )
+#define PROBE4( name, a, b, c, d )
+#endif
 
-static int srand( lua_State *L )
+// Monotonic clock in seconds
+#ifdef _WIN32
+static double now_seconds()
 {
-	const lua_Integer i = luaL_checkinteger( L, 1 );
-	if( i < 0 )
-		luaL_argerror( L, 1, "expecting unsigned integer" );
-	nlopt_srand( unsigned long( i ) );
-	return 0;
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency( &freq );
+	QueryPerformanceCounter( &count );
+	return double( count.QuadPart ) / double( freq.QuadPart );
 }
-
-static int srand_time( lua_State *L )
+#else
+static double now_seconds()
 {
-	nlopt_srand_time();
-	return 0;
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
 }
+#endif
 
-static int version( lua_State *L )
+static int hardware_cores()
 {
-	int major, minor, bugfix;
-	nlopt_version( &major, &minor, &bugfix);
-	lua_pushinteger( L, major );
-	lua_pushinteger( L, minor );
-	lua_pushinteger( L, bugfix );
-	return 3;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return int( info.dwNumberOfProcessors );
+#else
+	const long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return ( n > 0 ) ? int( n ) : 1;
+#endif
 }
 
-struct nlopt_opt_holder
+class semaphore
 {
-	nlopt_opt d_obj;
+public:
+#ifdef _WIN32
+	semaphore() { d_h = CreateSemaphore( NULL, 0, 0x7fffffff, NULL ); }
+	~semaphore() { CloseHandle( d_h ); }
+	void post() { ReleaseSemaphore( d_h, 1, NULL ); }
+	void wait() { WaitForSingleObject( d_h, INFINITE ); }
+	bool wait( double seconds ) { return WaitForSingleObject( d_h, DWORD( seconds * 1000.0 ) ) == WAIT_OBJECT_0; }
+private:
+	HANDLE d_h;
+#else
+	semaphore():d_count(0) { pthread_mutex_init( &d_m, 0 ); pthread_cond_init( &d_c, 0 ); }
+	~semaphore() { pthread_cond_destroy( &d_c ); pthread_mutex_destroy( &d_m ); }
+	void post()
+	{
+		pthread_mutex_lock( &d_m );
+		d_count++;
+		pthread_cond_signal( &d_c );
+		pthread_mutex_unlock( &d_m );
+	}
+	void wait()
+	{
+		pthread_mutex_lock( &d_m );
+		while( d_count == 0 )
+			pthread_cond_wait( &d_c, &d_m );
+		d_count--;
+		pthread_mutex_unlock( &d_m );
+	}
+	bool wait( double seconds )
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_REALTIME, &ts );
+		const double end = double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9 + seconds;
+		ts.tv_sec = time_t( end );
+		ts.tv_nsec = long( ( end - double( ts.tv_sec ) ) * 1e9 );
+		pthread_mutex_lock( &d_m );
+		int rc = 0;
+		while( d_count == 0 && rc == 0 )
+			rc = pthread_cond_timedwait( &d_c, &d_m, &ts );
+		const bool ok = d_count > 0;
+		if( ok )
+			d_count--;
+		pthread_mutex_unlock( &d_m );
+		return ok;
+	}
+private:
+	pthread_mutex_t d_m;
+	pthread_cond_t d_c;
+	int d_count;
+#endif
+	semaphore( const semaphore& );
+	semaphore& operator=( const semaphore& );
 };
 
-static void* munge_on_destroy( void* f_data );
-static void* munge_on_copy( void* f_data );
-
-static int create( lua_State *L )
+class mutex
 {
-	const lua_Integer algorithm = luaL_checkinteger( L, 1 );
-	if( algorithm < 0 || algorithm >= NLOPT_NUM_ALGORITHMS )
-		luaL_argerror( L, 1, "expecting nlopt.algorithm" );
-	const lua_Integer n = luaL_checkinteger( L, 2 );
-	if( n < 0 )
-		luaL_argerror( L, 2, "expecting unsigned integer" );
-	nlopt_opt obj = nlopt_create( static_cast<nlopt_algorithm>( algorithm ), (unsigned int) n );
-	if( obj == NULL )
-		luaL_error( L, "nlopt_create out of memory" );
-
-	nlopt_set_munge( obj, munge_on_destroy, munge_on_copy ); 
+public:
+#ifdef _WIN32
+	mutex() { InitializeCriticalSection( &d_cs ); }
+	~mutex() { DeleteCriticalSection( &d_cs ); }
+	void lock() { EnterCriticalSection( &d_cs ); }
+	void unlock() { LeaveCriticalSection( &d_cs ); }
+private:
+	CRITICAL_SECTION d_cs;
+#else
+	mutex() { pthread_mutex_init( &d_m, 0 ); }
+	~mutex() { pthread_mutex_destroy( &d_m ); }
+	void lock() { pthread_mutex_lock( &d_m ); }
+	void unlock() { pthread_mutex_unlock( &d_m ); }
+private:
+	pthread_mutex_t d_m;
+#endif
+	mutex( const mutex& );
+	mutex& operator=( const mutex& );
+};
 
-	nlopt_opt_holder* holder = static_cast<nlopt_opt_holder*>( lua_newuserdata( L, sizeof(nlopt_opt_holder) ) );
-	holder->d_obj = obj;
+struct lock_guard
+{
+	mutex& d_m;
+	lock_guard( mutex& m ):d_m(m) { d_m.lock(); }
+	~lock_guard() { d_m.unlock(); }
+};
 
-    luaL_getmetatable( L, nlopt_metaName );
-	if( !lua_istable(L, -1 ) )
-		luaL_error( L, "internal error: no meta table for '%s'", nlopt_metaName );
-	lua_setmetatable( L, -2 );
-	return 1;
-}
+// Timeline profiling (nlopt.profile_start): each thread records its spans into a buffer of
+// its own without locks; profile_stop writes them as Chrome trace JSON. A buffer is allocated
+// on the first span of a thread; when a thread of thread_handle ends, its buffer is kept for
+// profile_stop and then reused by a new thread. Spans which don't fit are counted as dropped.
+struct profile_span
+{
+	const char* d_name; // a literal
+	double d_start;
+	double d_end;
+};
 
-static const luaL_Reg Reg[] =
+struct profile_buffer
 {
-	{ "create", create },
-	{ "version", version },
-	{ "srand_time", srand_time },
-	{ "srand", srand },
-	{ "algorithm_name", algorithm_name },
-	{ NULL,		NULL	}
+	std::vector<profile_span> d_spans;
+	volatile atomic_t d_count; // the spans before d_count are complete
+	volatile atomic_t d_dropped;
+	int d_tid;
+	bool d_free; // its thread ended; reusable once empty
+	profile_buffer* d_next;
 };
 
-static nlopt_opt_holder* check(lua_State *L, int narg = 1 )
+static const int s_profileCapacity = 1 << 16; // spans per thread
+static volatile atomic_t s_profiling = 0;
+static mutex s_profileLock; // registration of the buffers, start and stop
+static profile_buffer* s_profileBuffers = 0;
+static int s_profileThreads = 0;
+static double s_profileStart = 0.0;
+#ifdef _WIN32
+static DWORD s_profileSlot = TLS_OUT_OF_INDEXES;
+static profile_buffer* thread_profile_buffer() { return static_cast<profile_buffer*>( TlsGetValue( s_profileSlot ) ); }
+static void set_thread_profile_buffer( profile_buffer* b ) { TlsSetValue( s_profileSlot, b ); }
+#else
+static __thread profile_buffer* s_profileBuffer = 0;
+static profile_buffer* thread_profile_buffer() { return s_profileBuffer; }
+static void set_thread_profile_buffer( profile_buffer* b ) { s_profileBuffer = b; }
+#endif
+
+static inline double profile_now()
 {
-	return static_cast<nlopt_opt_holder*>( luaL_checkudata( L, narg, nlopt_metaName ) );
+	// 0 if not profiling; a plain read, the flag only has to be seen eventually
+	return ( s_profiling ) ? now_seconds() : 0.0;
 }
-   
-static int finalize_nlopt_opt_s( lua_State *L )
+
+static void profile_add( const char* name, double start, double end )
 {
-	nlopt_opt_holder* holder = check( L );
-	nlopt_destroy( holder->d_obj );
-	return 0;
+	if( start == 0.0 || end == 0.0 || !s_profiling )
+		return;
+	profile_buffer* b = thread_profile_buffer();
+	if( b == 0 )
+	{
+		lock_guard guard( s_profileLock );
+		// the buffer of an ended thread, once profile_start has reset it
+		for( b = s_profileBuffers; b; b = b->d_next )
+			if( b->d_free && atomic_load( &b->d_count ) == 0 )
+				break;
+		if( b == 0 )
+		{
+			b = new profile_buffer;
+			b->d_spans.resize( s_profileCapacity );
+			b->d_count = 0;
+			b->d_next = s_profileBuffers;
+			s_profileBuffers = b;
+		}
+		b->d_dropped = 0;
+		b->d_free = false;
+		b->d_tid = ++s_profileThreads;
+		set_thread_profile_buffer( b );
+	}
+	const long i = b->d_count;
+	if( i >= long( b->d_spans.size() ) )
+	{
+		atomic_increment( &b->d_dropped );
+		return;
+	}
+	profile_span& s = b->d_spans[i];
+	s.d_name = name;
+	s.d_start = start;
+	s.d_end = end;
+	// publishes the span, unless profile_start has reset the buffer meanwhile
+	atomic_cas( &b->d_count, i, i + 1 );
 }
 
-static int tostring( lua_State *L )
+static void profile_thread_exit()
 {
-	nlopt_opt_holder* obj = check( L );
-	lua_pushfstring( L, "%s %p", nlopt_metaName, obj );
-	return 1;
+	profile_buffer* b = thread_profile_buffer();
+	if( b == 0 )
+		return;
+	lock_guard guard( s_profileLock );
+	b->d_free = true;
+	set_thread_profile_buffer( 0 );
 }
 
-static int copy( lua_State *L )
+class profile_scope
 {
-	nlopt_opt_holder* rhs = check( L );
-	nlopt_opt obj = nlopt_copy( rhs->d_obj );
-	if( obj == NULL )
-		luaL_error( L, "nlopt_copy out of memory" );
+public:
+	explicit profile_scope( const char* name ):d_name(name),d_start(profile_now()) {}
+	~profile_scope() { profile_add( d_name, d_start, profile_now() ); }
+private:
+	const char* d_name;
+	double d_start;
+};
 
-	nlopt_opt_holder* lhs = static_cast<nlopt_opt_holder*>( lua_newuserdata( L, sizeof(nlopt_opt_holder) ) );
-	lhs->d_obj = obj;
+// Live metrics (opt:set_metrics): a shared memory segment of this process with a slot per
+// optimizer, read by other processes such as tracing/nlopt-top.cpp, which has a copy of the
+// layout. The counters are updated with a single atomic increment; the other fields are
+// written under a seqlock, which also serializes the writers, e.g. an optimizer and the
+// copy of optimize_async sharing its slot.
+struct metrics_slot
+{
+	volatile atomic_t d_seq; // odd while the fields after d_errors are written
+	volatile atomic_t d_used; // holders publishing to the slot, 0 if free
+	volatile atomic_t d_evals;
+	volatile atomic_t d_errors;
+	long d_runs;
+	long d_running; // optimizations running
+	double d_best;
+	double d_lastImprovement; // CLOCK_MONOTONIC seconds, like now_seconds()
+	double d_started;
+	char d_label[64];
+};
 
-    luaL_getmetatable( L, nlopt_metaName );
-	if( !lua_istable(L, -1 ) )
-		luaL_error( L, "internal error: no meta table for '%s'", nlopt_metaName );
-	lua_setmetatable( L, -2 );
-	return 1;
-}
+struct metrics_segment
+{
+	char d_magic[8]; // "NLMETR1"
+	long d_pid;
+	long d_slots;
+	long d_slotSize;
+	metrics_slot d_slot[1]; // d_slots
+};
 
-static int get_algorithm( lua_State *L )
+static const int s_metricsSlots = 64;
+static metrics_segment* s_metrics = 0;
+static char s_metricsName[64] = "";
+static mutex s_metricsLock; // creation of the segment and the claiming of slots
+
+static inline void metrics_write_begin( metrics_slot* s )
 {
-	nlopt_opt_holder* holder = check( L );
-	lua_pushinteger( L, nlopt_get_algorithm( holder->d_obj ) );
-	return 1;
+	for( ;; )
+	{
+		const long seq = atomic_load( &s->d_seq );
+		if( !( seq & 1 ) && atomic_cas( &s->d_seq, seq, seq + 1 ) == seq )
+			return;
+	}
 }
+static inline void metrics_write_end( metrics_slot* s ) { atomic_increment( &s->d_seq ); }
 
-static int get_dimension( lua_State *L )
+#ifndef _WIN32
+static void metrics_unlink()
 {
-	nlopt_opt_holder* holder = check( L );
-	lua_pushinteger( L, nlopt_get_dimension( holder->d_obj ) );
-	return 1;
+	::shm_unlink( s_metricsName );
 }
+#endif
 
-static int set_lower_bounds( lua_State *L )
+static bool metrics_open()
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TTABLE );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	for( int i = 0; i < n; i++ )
+	// creates the segment on first use; it is removed when the process exits
+	if( s_metrics )
+		return true;
+#ifdef _WIN32
+	return false;
+#else
+	::sprintf( s_metricsName, "/luanlopt.%ld", long( ::getpid() ) );
+	const size_t size = sizeof(metrics_segment) + ( s_metricsSlots - 1 ) * sizeof(metrics_slot);
+	const int fd = ::shm_open( s_metricsName, O_CREAT | O_RDWR | O_TRUNC, 0644 );
+	if( fd < 0 )
+		return false;
+	void* p = MAP_FAILED;
+	if( ::ftruncate( fd, off_t( size ) ) == 0 )
+		p = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if( p == MAP_FAILED )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		lb[i] = lua_tonumber( L, -1 );
-		lua_pop( L, 1 );
+		::shm_unlink( s_metricsName );
+		return false;
 	}
-	lua_pushinteger( L, nlopt_set_lower_bounds( holder->d_obj, &lb[0] ) );
-	return 1;
+	metrics_segment* seg = static_cast<metrics_segment*>( p );
+	seg->d_pid = long( ::getpid() );
+	seg->d_slots = s_metricsSlots;
+	seg->d_slotSize = sizeof(metrics_slot);
+	::memcpy( seg->d_magic, "NLMETR1", 8 ); // last, readers check it first
+	s_metrics = seg;
+	::atexit( metrics_unlink );
+	return true;
+#endif
 }
 
-static int set_upper_bounds( lua_State *L )
+static metrics_slot* metrics_claim( const char* label )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TTABLE );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	for( int i = 0; i < n; i++ )
+	lock_guard guard( s_metricsLock );
+	if( !metrics_open() )
+		return 0;
+	for( int i = 0; i < s_metricsSlots; i++ )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		lb[i] = lua_tonumber( L, -1 );
-		lua_pop( L, 1 );
+		metrics_slot* s = &s_metrics->d_slot[i];
+		if( atomic_load( &s->d_used ) )
+			continue;
+		metrics_write_begin( s );
+		atomic_exchange( &s->d_evals, 0 );
+		atomic_exchange( &s->d_errors, 0 );
+		s->d_runs = 0;
+		s->d_running = 0;
+		s->d_best = s_nan;
+		s->d_lastImprovement = s->d_started = now_seconds();
+		::strncpy( s->d_label, label, sizeof(s->d_label) - 1 );
+		s->d_label[ sizeof(s->d_label) - 1 ] = 0;
+		atomic_exchange( &s->d_used, 1 );
+		metrics_write_end( s );
+		return s;
 	}
-	lua_pushinteger( L, nlopt_set_upper_bounds( holder->d_obj, &lb[0] ) );
-	return 1;
+	return 0;
 }
 
-static int set_lower_bounds1( lua_State *L )
+static metrics_slot* metrics_retain( metrics_slot* s )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double lb = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_lower_bounds1( holder->d_obj, lb ) );
-	return 1;
+	if( s )
+		atomic_increment( &s->d_used );
+	return s;
 }
 
-static int set_upper_bounds1( lua_State *L )
+static void metrics_release( metrics_slot* s )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double lb = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_upper_bounds1( holder->d_obj, lb ) );
-	return 1;
+	if( s )
+		atomic_decrement( &s->d_used );
 }
 
-static int get_lower_bounds( lua_State *L )
+static void metrics_run( metrics_slot* s, bool running )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	lua_pushinteger( L, nlopt_get_lower_bounds( holder->d_obj, &lb[0] ) );
-	lua_createtable( L, n, 0 );
-	for( int i = 0; i < n; i++ )
+	metrics_write_begin( s );
+	if( running )
 	{
-		lua_pushnumber( L, lb[i] );
-		lua_rawseti( L, -2, i + 1 );
+		s->d_running++;
+		s->d_runs++;
+		s->d_best = s_nan;
+		s->d_lastImprovement = s->d_started = now_seconds();
+	}else
+		s->d_running--;
+	metrics_write_end( s );
+}
+
+static inline void metrics_record( metrics_slot* s, double f, bool maximize )
+{
+	atomic_increment( &s->d_evals );
+	// checked again under the seqlock, another writer may have improved d_best meanwhile
+	if( f == f && ( s->d_best != s->d_best || ( ( maximize ) ? f > s->d_best : f < s->d_best ) ) )
+	{
+		metrics_write_begin( s );
+		if( s->d_best != s->d_best || ( ( maximize ) ? f > s->d_best : f < s->d_best ) )
+		{
+			s->d_best = f;
+			s->d_lastImprovement = now_seconds();
+		}
+		metrics_write_end( s );
 	}
-	return 2;
 }
 
-static int get_upper_bounds( lua_State *L )
+static void metrics_read( metrics_slot* s, metrics_slot& copy )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	lua_pushinteger( L, nlopt_get_upper_bounds( holder->d_obj, &lb[0] ) );
-	lua_createtable( L, n, 0 );
-	for( int i = 0; i < n; i++ )
+	for( ;; )
 	{
-		lua_pushnumber( L, lb[i] );
-		lua_rawseti( L, -2, i + 1 );
+		const long seq = atomic_load( &s->d_seq );
+		if( seq & 1 )
+			continue;
+		::memcpy( &copy, s, sizeof(copy) );
+		if( atomic_load( &s->d_seq ) == seq )
+			return;
 	}
-	return 2;
 }
 
-struct callback_context
+typedef void (*thread_proc)( void* arg );
+
+struct thread_handle
 {
-	lua_State *L;
-	int ref;
+	thread_proc d_proc;
+	void* d_arg;
+#ifdef _WIN32
+	HANDLE d_h;
+	static unsigned __stdcall trampoline( void* p )
+	{
+		thread_handle* t = static_cast<thread_handle*>( p );
+		t->d_proc( t->d_arg );
+		profile_thread_exit();
+		return 0;
+	}
+	bool start( thread_proc proc, void* arg )
+	{
+		d_proc = proc;
+		d_arg = arg;
+		d_h = (HANDLE)_beginthreadex( NULL, 0, trampoline, this, 0, NULL );
+		return d_h != 0;
+	}
+	void join() { WaitForSingleObject( d_h, INFINITE ); CloseHandle( d_h ); }
+#else
+	pthread_t d_t;
+	static void* trampoline( void* p )
+	{
+		thread_handle* t = static_cast<thread_handle*>( p );
+		t->d_proc( t->d_arg );
+		profile_thread_exit();
+		return 0;
+	}
+	bool start( thread_proc proc, void* arg )
+	{
+		d_proc = proc;
+		d_arg = arg;
+		return pthread_create( &d_t, 0, trampoline, this ) == 0;
+	}
+	void join() { pthread_join( d_t, 0 ); }
+#endif
 };
 
-static double func(unsigned n, const double* x, double* grad, void* f_data)
+// Runs a task over a fixed number of chunks on a set of persistent threads; the calling
+// thread participates as worker 0. Which thread runs which chunk is arbitrary, so callers
+// that need reproducible results keep one partial result per chunk and reduce in chunk order.
+class thread_pool
 {
-	// x points to an array of length n
-	// if the argument grad is not NULL, then grad points to an array of length n
-	// f_data points to a callback_context
+public:
+	typedef void (*task)( void* arg, int chunk, int worker );
 
-	callback_context* ctx = static_cast<callback_context*>( f_data );
-	if( ctx )
+	explicit thread_pool( int threads ):d_task(0),d_arg(0),d_next(0),d_chunks(0),d_pending(0),d_quit(false)
 	{
-		lua_rawgeti( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
-		const int t = lua_gettop( ctx->L );
-
-		lua_pushliteral( ctx->L, "f" );
-		lua_rawget( ctx->L, t );
-		if( !lua_isfunction( ctx->L, -1 ) )
+		for( int i = 1; i < threads; i++ )
 		{
-			lua_pop( ctx->L, 2 ); // t, f
-			return 0.0; // RISK: Fehler melden?
+			worker* w = new worker;
+			w->d_pool = this;
+			w->d_index = i;
+			if( !w->d_thread.start( worker_main, w ) )
+			{
+				delete w;
+				break;
+			}
+			d_workers.push_back( w );
 		}
-		lua_pushinteger( ctx->L, n );
-
-		lua_pushliteral( ctx->L, "x" );
-		lua_rawget( ctx->L, t );
-		if( !lua_istable( ctx->L, -1 ) )
+	}
+	~thread_pool()
+	{
+		d_quit = true;
+		for( size_t i = 0; i < d_workers.size(); i++ )
+			d_workers[i]->d_start.post();
+		for( size_t i = 0; i < d_workers.size(); i++ )
 		{
-			lua_pop( ctx->L, 1 );
-			lua_newtable( ctx->L );
-			lua_pushliteral( ctx->L, "x" );
-			lua_pushvalue( ctx->L, -2 );
-			lua_rawset( ctx->L, t );
+			d_workers[i]->d_thread.join();
+			delete d_workers[i];
 		}
-		const int xt = lua_gettop( ctx->L );
-		unsigned int i;
-		for( i = 0; i < n; i++ )
+	}
+	int size() const { return int( d_workers.size() ) + 1; }
+	void run( task fn, void* arg, int chunks )
+	{
+		if( d_workers.empty() || chunks <= 1 )
 		{
-			lua_pushnumber( ctx->L, x[i] );
-			lua_rawseti( ctx->L, xt, i + 1 );
+			for( int i = 0; i < chunks; i++ )
+				fn( arg, i, 0 );
+			return;
 		}
-		// stack: t, f, n, x
-		if( grad )
+		d_task = fn;
+		d_arg = arg;
+		d_chunks = chunks;
+		atomic_exchange( &d_next, 0 );
+		atomic_exchange( &d_pending, long( d_workers.size() ) );
+		for( size_t i = 0; i < d_workers.size(); i++ )
+			d_workers[i]->d_start.post();
+		drain( 0 );
+		profile_scope prof( "wait" );
+		d_done.wait();
+	}
+private:
+	struct worker
+	{
+		thread_pool* d_pool;
+		int d_index;
+		semaphore d_start;
+		thread_handle d_thread;
+	};
+	static void worker_main( void* arg )
+	{
+		worker* w = static_cast<worker*>( arg );
+		thread_pool* pool = w->d_pool;
+		while( true )
 		{
-			lua_pushliteral( ctx->L, "grad" );
-			lua_rawget( ctx->L, t );
-			if( !lua_istable( ctx->L, -1 ) )
-			{
-				lua_pop( ctx->L, 1 );
-				lua_newtable( ctx->L );
-				lua_pushliteral( ctx->L, "grad" );
-				lua_pushvalue( ctx->L, -2 );
+			const double idle = profile_now();
+			w->d_start.wait();
+			profile_add( "idle", idle, profile_now() );
+			if( pool->d_quit )
+				return;
+			pool->drain( w->d_index );
+			if( atomic_decrement( &pool->d_pending ) == 0 )
+				pool->d_done.post();
+		}
+	}
+	void drain( int worker )
+	{
+		long i;
+		while( ( i = atomic_increment( &d_next ) - 1 ) < d_chunks )
+		{
+			profile_scope prof( "task" );
+			d_task( d_arg, int( i ), worker );
+		}
+	}
+	std::vector<worker*> d_workers;
+	semaphore d_done;
+	task d_task;
+	void* d_arg;
+	volatile atomic_t d_next;
+	long d_chunks;
+	volatile atomic_t d_pending;
+	volatile bool d_quit;
+	thread_pool( const thread_pool& );
+	thread_pool& operator=( const thread_pool& );
+};
+
+// Shares a fixed number of cores among optimizations running on their own threads. A job
+// holds a core while it runs and gives it up at the start of an evaluation if a more urgent
+// job waits (higher priority, or same priority and earlier deadline), or if a job of the same
+// urgency waits and the current time slice is used up.
+class core_scheduler;
+static bool cancel_requested();
+
+struct sched_job
+{
+	core_scheduler* d_sched;
+	int d_priority;
+	double d_deadline; // absolute now_seconds(), HUGE_VAL if none
+	long d_seq; // arrival order, for FIFO among equals
+	semaphore d_grant;
+	double d_since; // start of the current wait or time slice
+	bool d_holding; // holds a core; guarded by the lock of the scheduler
+	// statistics, guarded by the lock of the scheduler
+	double d_start;
+	double d_end;
+	double d_waitTotal;
+	double d_waitMax;
+	long d_waits;
+	long d_yields;
+
+	sched_job( core_scheduler* s, int priority, double deadline ):d_sched(s),d_priority(priority),
+		d_deadline(deadline),d_seq(0),d_since(0),d_holding(false),d_start(0),d_end(0),d_waitTotal(0),d_waitMax(0),
+		d_waits(0),d_yields(0) {}
+	bool more_urgent( const sched_job* rhs ) const
+	{
+		if( d_priority != rhs->d_priority )
+			return d_priority > rhs->d_priority;
+		return d_deadline < rhs->d_deadline;
+	}
+};
+
+class core_scheduler
+{
+public:
+	static const double s_slice; // seconds
+
+	explicit core_scheduler( int cores ):d_refs(1),d_queued(0),d_cores(cores),d_free(cores),
+		d_seq(0),d_submitted(0),d_finished(0) {}
+	void retain() { atomic_increment( &d_refs ); }
+	void release()
+	{
+		if( atomic_decrement( &d_refs ) == 0 )
+			delete this;
+	}
+	bool acquire( sched_job* job )
+	{
+		// false if the run was cancelled or its deadline passed while queued
+		d_lock.lock();
+		const double now = now_seconds();
+		job->d_since = now;
+		if( job->d_start == 0 )
+			job->d_start = now;
+		if( d_free > 0 && d_waiting.empty() )
+		{
+			d_free--;
+			job->d_waits++;
+			job->d_holding = true;
+			d_lock.unlock();
+			return true;
+		}
+		enqueue( job );
+		d_lock.unlock();
+		return wait_grant( job );
+	}
+	void yield( sched_job* job )
+	{
+		// Called at the start of each evaluation of a job holding a core
+		if( atomic_load( &d_queued ) == 0 )
+			return;
+		d_lock.lock();
+		const size_t best = next();
+		const double now = now_seconds();
+		if( best < d_waiting.size() && ( d_waiting[best]->more_urgent( job ) ||
+			( !job->more_urgent( d_waiting[best] ) && now - job->d_since > s_slice ) ) )
+		{
+			job->d_yields++;
+			grant( best, now );
+			job->d_since = now;
+			job->d_holding = false;
+			enqueue( job );
+			d_lock.unlock();
+			// if cancelled meanwhile, the job ends without a core
+			wait_grant( job );
+		}else
+			d_lock.unlock();
+	}
+	void leave( sched_job* job )
+	{
+		lock_guard guard( d_lock );
+		const double now = now_seconds();
+		job->d_end = now;
+		d_finished++;
+		if( !job->d_holding )
+			return;
+		job->d_holding = false;
+		const size_t best = next();
+		if( best < d_waiting.size() )
+			grant( best, now );
+		else
+			d_free++;
+	}
+	void submitted()
+	{
+		lock_guard guard( d_lock );
+		d_submitted++;
+	}
+	void stats( int& cores, int& running, int& queued, long& submitted, long& finished )
+	{
+		lock_guard guard( d_lock );
+		cores = d_cores;
+		queued = int( d_waiting.size() );
+		running = d_cores - d_free;
+		submitted = d_submitted;
+		finished = d_finished;
+	}
+	mutex& lock() { return d_lock; }
+private:
+	~core_scheduler() {}
+	bool wait_grant( sched_job* job )
+	{
+		// polls, so that a queued job sees cancel and deadline of its run
+		profile_scope prof( "queue wait" );
+		while( !job->d_grant.wait( 0.05 ) )
+			if( cancel_requested() && withdraw( job ) )
+				return false;
+		return true;
+	}
+	bool withdraw( sched_job* job )
+	{
+		// false if the job was granted a core meanwhile
+		lock_guard guard( d_lock );
+		for( size_t i = 0; i < d_waiting.size(); i++ )
+			if( d_waiting[i] == job )
+			{
+				d_waiting.erase( d_waiting.begin() + i );
+				atomic_decrement( &d_queued );
+				return true;
+			}
+		return false;
+	}
+	void enqueue( sched_job* job )
+	{
+		job->d_seq = ++d_seq;
+		d_waiting.push_back( job );
+		atomic_increment( &d_queued );
+	}
+	size_t next() const
+	{
+		size_t best = d_waiting.size();
+		for( size_t i = 0; i < d_waiting.size(); i++ )
+		{
+			if( best == d_waiting.size() || d_waiting[i]->more_urgent( d_waiting[best] ) ||
+				( !d_waiting[best]->more_urgent( d_waiting[i] ) && d_waiting[i]->d_seq < d_waiting[best]->d_seq ) )
+				best = i;
+		}
+		return best;
+	}
+	void grant( size_t i, double now )
+	{
+		// hands the core of the caller over to waiting job i
+		sched_job* job = d_waiting[i];
+		d_waiting.erase( d_waiting.begin() + i );
+		atomic_decrement( &d_queued );
+		const double wait = now - job->d_since;
+		job->d_waitTotal += wait;
+		if( wait > job->d_waitMax )
+			job->d_waitMax = wait;
+		job->d_waits++;
+		job->d_since = now;
+		job->d_holding = true;
+		job->d_grant.post();
+	}
+	volatile atomic_t d_refs;
+	volatile atomic_t d_queued;
+	mutex d_lock;
+	std::vector<sched_job*> d_waiting; // a few dozen at most, linear search is fine
+	int d_cores;
+	int d_free;
+	long d_seq;
+	long d_submitted;
+	long d_finished;
+};
+
+const double core_scheduler::s_slice = 0.01;
+
+// Read-only memory mapping of a whole file
+class mapped_file
+{
+public:
+	mapped_file():d_data(0),d_size(0)
+	{
+#ifdef _WIN32
+		d_file = INVALID_HANDLE_VALUE;
+		d_map = NULL;
+#endif
+	}
+	~mapped_file() { close(); }
+	bool open( const char* path )
+	{
+		close();
+#ifdef _WIN32
+		d_file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+		if( d_file == INVALID_HANDLE_VALUE )
+			return false;
+		LARGE_INTEGER size;
+		if( !GetFileSizeEx( d_file, &size ) || size.QuadPart == 0 )
+		{
+			close();
+			return false;
+		}
+		d_size = size_t( size.QuadPart );
+		d_map = CreateFileMappingA( d_file, NULL, PAGE_READONLY, 0, 0, NULL );
+		if( d_map == NULL )
+		{
+			close();
+			return false;
+		}
+		d_data = static_cast<const char*>( MapViewOfFile( d_map, FILE_MAP_READ, 0, 0, 0 ) );
+#else
+		const int fd = ::open( path, O_RDONLY );
+		if( fd < 0 )
+			return false;
+		struct stat st;
+		if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+		{
+			::close( fd );
+			return false;
+		}
+		d_size = size_t( st.st_size );
+		void* p = mmap( 0, d_size, PROT_READ, MAP_SHARED, fd, 0 );
+		::close( fd );
+		d_data = ( p == MAP_FAILED ) ? 0 : static_cast<const char*>( p );
+#endif
+		if( d_data == 0 )
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+	void close()
+	{
+#ifdef _WIN32
+		if( d_data )
+			UnmapViewOfFile( d_data );
+		if( d_map != NULL )
+			CloseHandle( d_map );
+		if( d_file != INVALID_HANDLE_VALUE )
+			CloseHandle( d_file );
+		d_file = INVALID_HANDLE_VALUE;
+		d_map = NULL;
+#else
+		if( d_data )
+			munmap( const_cast<char*>( d_data ), d_size );
+#endif
+		d_data = 0;
+		d_size = 0;
+	}
+	const char* data() const { return d_data; }
+	size_t size() const { return d_size; }
+private:
+	const char* d_data;
+	size_t d_size;
+#ifdef _WIN32
+	HANDLE d_file;
+	HANDLE d_map;
+#endif
+	mapped_file( const mapped_file& );
+	mapped_file& operator=( const mapped_file& );
+};
+
+// Evaluations shared across runs and processes: an open-addressing hash table in a
+// memory-mapped file, keyed by the model name, the function and the bits of x. The file
+// has a fixed capacity; the table is locked for each access, shared for lookups.
+static mutex s_storeLock; // the file locks only exclude other processes
+
+class eval_store
+{
+public:
+	struct header
+	{
+		char d_magic[8];
+		unsigned int d_n;
+		unsigned int d_width; // doubles per record after x: the values, then the gradients
+		unsigned long long d_capacity; // records, a power of two
+		unsigned long long d_count;
+	};
+	struct record
+	{
+		unsigned long long d_hash; // 0 if empty
+		unsigned long long d_model;
+		unsigned int d_func; // 0 objective, then the inequality and equality constraints
+		unsigned int d_flags; // 1 if the gradients are stored
+		// followed by x[n] and d_width values
+	};
+	std::string d_path;
+	std::string d_model;
+	double d_hits, d_misses, d_stored, d_full; // guarded by s_storeLock
+
+	eval_store():d_hits(0),d_misses(0),d_stored(0),d_full(0),d_data(0),d_size(0),d_modelHash(0),d_recSize(0)
+	{
+#ifdef _WIN32
+		d_file = INVALID_HANDLE_VALUE;
+		d_map = NULL;
+#else
+		d_fd = -1;
+#endif
+	}
+	~eval_store() { close(); }
+	// returns 0 or an error message
+	const char* open( const char* path, const std::string& model, unsigned int n, unsigned int width,
+		unsigned long long capacity )
+	{
+		close();
+		d_path = path;
+		d_model = model;
+		d_modelHash = hash_bytes( 0, model.data(), model.size() );
+		unsigned long long cap = 1;
+		while( cap < capacity )
+			cap <<= 1;
+		header h;
+		::memset( &h, 0, sizeof(h) );
+		::memcpy( h.d_magic, "NLSTORE1", 8 );
+		h.d_n = n;
+		h.d_width = width;
+		h.d_capacity = cap;
+#ifdef _WIN32
+		d_file = CreateFileA( path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+		if( d_file == INVALID_HANDLE_VALUE )
+			return "cannot open file";
+#else
+		d_fd = ::open( path, O_RDWR | O_CREAT, 0666 );
+		if( d_fd < 0 )
+			return "cannot open file";
+		::fcntl( d_fd, F_SETFD, FD_CLOEXEC );
+#endif
+		lock( true );
+		const char* err = init( h );
+		unlock();
+		if( err )
+			close();
+		return err;
+	}
+	void close()
+	{
+#ifdef _WIN32
+		if( d_data )
+			UnmapViewOfFile( d_data );
+		if( d_map != NULL )
+			CloseHandle( d_map );
+		if( d_file != INVALID_HANDLE_VALUE )
+			CloseHandle( d_file );
+		d_file = INVALID_HANDLE_VALUE;
+		d_map = NULL;
+#else
+		if( d_data )
+			munmap( d_data, d_size );
+		if( d_fd >= 0 )
+		{
+			// closing any descriptor of the file drops all locks of the process on it
+			lock_guard guard( s_storeLock );
+			::close( d_fd );
+		}
+		d_fd = -1;
+#endif
+		d_data = 0;
+		d_size = 0;
+	}
+	const header* head() const { return reinterpret_cast<const header*>( d_data ); }
+	// m values and, if grad is not 0, m*n gradients of function func at x
+	bool lookup( unsigned int func, unsigned int n, const double* x, unsigned int m, double* values, double* grad )
+	{
+		if( !fits( n, m, grad != 0 ) )
+			return false;
+		const unsigned long long h = hash( func, n, x );
+		lock( false );
+		record* r = find( h, func, n, x );
+		const bool hit = r && r->d_hash != 0 && ( grad == 0 || ( r->d_flags & 1 ) );
+		if( hit )
+		{
+			const double* v = reinterpret_cast<const double*>( r + 1 ) + n;
+			::memcpy( values, v, m * sizeof(double) );
+			if( grad )
+				::memcpy( grad, v + m, size_t( m ) * n * sizeof(double) );
+		}
+		// the pool threads of a batch share the store
+		if( hit )
+			d_hits++;
+		else
+			d_misses++;
+		unlock();
+		return hit;
+	}
+	void insert( unsigned int func, unsigned int n, const double* x, unsigned int m, const double* values,
+		const double* grad )
+	{
+		if( !fits( n, m, grad != 0 ) )
+			return;
+		const unsigned long long h = hash( func, n, x );
+		lock( true );
+		header* hd = reinterpret_cast<header*>( d_data );
+		record* r = find( h, func, n, x );
+		if( r && r->d_hash == 0 && hd->d_count >= hd->d_capacity - hd->d_capacity / 8 )
+			r = 0; // keep the probe sequences short
+		if( r && ( r->d_hash == 0 || ( grad && !( r->d_flags & 1 ) ) ) )
+		{
+			double* v = reinterpret_cast<double*>( r + 1 );
+			::memcpy( v, x, n * sizeof(double) );
+			::memcpy( v + n, values, m * sizeof(double) );
+			if( grad )
+				::memcpy( v + n + m, grad, size_t( m ) * n * sizeof(double) );
+			if( r->d_hash == 0 )
+				hd->d_count++;
+			r->d_model = d_modelHash;
+			r->d_func = func;
+			r->d_flags = ( grad ) ? 1 : 0;
+			r->d_hash = h;
+			d_stored++;
+		}else if( r == 0 )
+			d_full++;
+		unlock();
+	}
+private:
+	static unsigned long long hash_bytes( unsigned long long h, const void* p, size_t len )
+	{
+		// FNV-1a
+		if( h == 0 )
+			h = 14695981039346656037ULL;
+		const unsigned char* s = static_cast<const unsigned char*>( p );
+		for( size_t i = 0; i < len; i++ )
+		{
+			h ^= s[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+	unsigned long long hash( unsigned int func, unsigned int n, const double* x ) const
+	{
+		unsigned long long h = hash_bytes( d_modelHash, &func, sizeof(func) );
+		h = hash_bytes( h, x, n * sizeof(double) );
+		return ( h == 0 ) ? 1 : h;
+	}
+	bool fits( unsigned int n, unsigned int m, bool grad ) const
+	{
+		return d_data && head()->d_n == n && m * ( ( grad ) ? n + 1 : 1 ) <= head()->d_width;
+	}
+	record* find( unsigned long long h, unsigned int func, unsigned int n, const double* x )
+	{
+		// the record of x or the empty one where it belongs; 0 if the table is full
+		const unsigned long long mask = head()->d_capacity - 1;
+		unsigned long long i = h & mask;
+		for( unsigned long long k = 0; k <= mask; k++, i = ( i + 1 ) & mask )
+		{
+			record* r = reinterpret_cast<record*>( d_data + sizeof(header) + i * d_recSize );
+			if( r->d_hash == 0 )
+				return r;
+			if( r->d_hash == h && r->d_model == d_modelHash && r->d_func == func &&
+					::memcmp( r + 1, x, n * sizeof(double) ) == 0 )
+				return r;
+		}
+		return 0;
+	}
+	const char* init( header& h )
+	{
+		// called with the exclusive lock; creates the table if the file is empty
+		header cur;
+#ifdef _WIN32
+		LARGE_INTEGER size;
+		if( !GetFileSizeEx( d_file, &size ) )
+			return "cannot read file";
+		DWORD got = 0;
+		if( size.QuadPart == 0 )
+			cur = h;
+		else if( !ReadFile( d_file, &cur, sizeof(cur), &got, NULL ) || got != sizeof(cur) )
+			return "not an evaluation store";
+#else
+		struct stat st;
+		if( fstat( d_fd, &st ) != 0 )
+			return "cannot read file";
+		if( st.st_size == 0 )
+			cur = h;
+		else if( ::pread( d_fd, &cur, sizeof(cur), 0 ) != ssize_t( sizeof(cur) ) )
+			return "not an evaluation store";
+#endif
+		if( ::memcmp( cur.d_magic, "NLSTORE1", 8 ) != 0 || cur.d_capacity == 0 ||
+				( cur.d_capacity & ( cur.d_capacity - 1 ) ) != 0 )
+			return "not an evaluation store";
+		if( cur.d_n != h.d_n )
+			return "evaluation store has another dimension";
+		d_recSize = sizeof(record) + ( cur.d_n + cur.d_width ) * sizeof(double);
+		d_size = sizeof(header) + size_t( cur.d_capacity ) * d_recSize;
+#ifdef _WIN32
+		const bool create = size.QuadPart == 0;
+		if( create )
+		{
+			size.QuadPart = d_size;
+			if( !SetFilePointerEx( d_file, size, NULL, FILE_BEGIN ) || !SetEndOfFile( d_file ) )
+				return "cannot create file";
+		}
+		d_map = CreateFileMappingA( d_file, NULL, PAGE_READWRITE, 0, 0, NULL );
+		if( d_map == NULL )
+			return "cannot map file";
+		d_data = static_cast<char*>( MapViewOfFile( d_map, FILE_MAP_WRITE, 0, 0, d_size ) );
+		if( d_data == 0 )
+			return "cannot map file";
+#else
+		const bool create = st.st_size == 0;
+		if( create && ::ftruncate( d_fd, off_t( d_size ) ) != 0 )
+			return "cannot create file";
+		if( !create && size_t( st.st_size ) < d_size )
+			return "evaluation store is truncated";
+		void* p = mmap( 0, d_size, PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0 );
+		if( p == MAP_FAILED )
+			return "cannot map file";
+		d_data = static_cast<char*>( p );
+#endif
+		if( create )
+			::memcpy( d_data, &cur, sizeof(cur) );
+		return 0;
+	}
+	void lock( bool exclusive )
+	{
+		s_storeLock.lock();
+#ifdef _WIN32
+		OVERLAPPED ov;
+		::memset( &ov, 0, sizeof(ov) );
+		LockFileEx( d_file, ( exclusive ) ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &ov );
+#else
+		struct flock fl;
+		::memset( &fl, 0, sizeof(fl) );
+		fl.l_type = ( exclusive ) ? F_WRLCK : F_RDLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_len = 1;
+		while( ::fcntl( d_fd, F_SETLKW, &fl ) != 0 && errno == EINTR )
+			;
+#endif
+	}
+	void unlock()
+	{
+#ifdef _WIN32
+		OVERLAPPED ov;
+		::memset( &ov, 0, sizeof(ov) );
+		UnlockFileEx( d_file, 0, 1, 0, &ov );
+#else
+		struct flock fl;
+		::memset( &fl, 0, sizeof(fl) );
+		fl.l_type = F_UNLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_len = 1;
+		::fcntl( d_fd, F_SETLK, &fl );
+#endif
+		s_storeLock.unlock();
+	}
+	char* d_data;
+	size_t d_size;
+	unsigned long long d_modelHash;
+	size_t d_recSize;
+#ifdef _WIN32
+	HANDLE d_file;
+	HANDLE d_map;
+#else
+	int d_fd;
+#endif
+	eval_store( const eval_store& );
+	eval_store& operator=( const eval_store& );
+};
+
+static void setfieldint( lua_State *L, const char* key, int val )
+{
+	// Expects table on top of stack
+	lua_pushinteger( L, val );
+	lua_setfield( L, -2, key );
+}
+
+static int algorithm_name( lua_State *L )
+{
+	const lua_Integer i = luaL_checkinteger( L, 1 );
+	if( i == X_BAYESOPT )
+	{
+		lua_pushliteral( L, "Bayesian optimization, Gaussian process with expected improvement (LuaNLopt)" );
+		return 1;
+	}
+	if( i < 0 || i >= NLOPT_NUM_ALGORITHMS )
+		luaL_argerror( L, 1, "expecting nlopt.algorithm" );
+	lua_pushstring( L, nlopt_algorithm_name( static_cast<nlopt_algorithm>( i ) ) );
+	return 1;
+}
+
+static int srand( lua_State *L )
+{
+	const lua_Integer i = luaL_checkinteger( L, 1 );
+	if( i < 0 )
+		luaL_argerror( L, 1, "expecting unsigned integer" );
+	nlopt_srand( unsigned long( i ) );
+	return 0;
+}
+
+static int srand_time( lua_State *L )
+{
+	nlopt_srand_time();
+	return 0;
+}
+
+static int version( lua_State *L )
+{
+	int major, minor, bugfix;
+	nlopt_version( &major, &minor, &bugfix);
+	lua_pushinteger( L, major );
+	lua_pushinteger( L, minor );
+	lua_pushinteger( L, bugfix );
+	return 3;
+}
+
+// Incremented by the SIGINT/SIGTERM handler, so every token which listens to
+// signals sees the epoch change.
+static volatile atomic_t s_signalEpoch = 0;
+
+// Cancellation flag shared by nlopt_cancel_token objects, possibly of different Lua states
+// and threads.
+struct cancel_flag
+{
+	volatile atomic_t d_refs;
+	volatile atomic_t d_cancelled;
+	volatile atomic_t d_epoch; // s_signalEpoch when created or reset
+	long d_id;
+	bool d_signals;
+
+	bool cancelled()
+	{
+		return atomic_load( &d_cancelled ) != 0 ||
+			( d_signals && atomic_load( &s_signalEpoch ) != atomic_load( &d_epoch ) );
+	}
+	void retain() { atomic_increment( &d_refs ); }
+	void release();
+};
+
+// Live flags by id, so that other Lua states can attach to a token by its number
+static mutex s_tokenLock;
+static std::map<long,cancel_flag*> s_tokens;
+static long s_lastTokenId = 0;
+
+void cancel_flag::release()
+{
+	lock_guard guard( s_tokenLock );
+	if( atomic_decrement( &d_refs ) == 0 )
+	{
+		s_tokens.erase( d_id );
+		delete this;
+	}
+}
+
+// Dense linear algebra for the small systems of the surrogate models; matrices are
+// row-major n x n and are overwritten, the solution replaces b.
+
+static bool cholesky_solve( std::vector<double>& a, std::vector<double>& b, int n )
+{
+	// returns false if a is not positive definite
+	for( int j = 0; j < n; j++ )
+	{
+		double d = a[ j * n + j ];
+		for( int k = 0; k < j; k++ )
+			d -= a[ j * n + k ] * a[ j * n + k ];
+		if( !( d > 0.0 ) )
+			return false;
+		d = std::sqrt( d );
+		a[ j * n + j ] = d;
+		for( int i = j + 1; i < n; i++ )
+		{
+			double s = a[ i * n + j ];
+			for( int k = 0; k < j; k++ )
+				s -= a[ i * n + k ] * a[ j * n + k ];
+			a[ i * n + j ] = s / d;
+		}
+	}
+	for( int i = 0; i < n; i++ )
+	{
+		for( int k = 0; k < i; k++ )
+			b[i] -= a[ i * n + k ] * b[k];
+		b[i] /= a[ i * n + i ];
+	}
+	for( int i = n - 1; i >= 0; i-- )
+	{
+		for( int k = i + 1; k < n; k++ )
+			b[i] -= a[ k * n + i ] * b[k];
+		b[i] /= a[ i * n + i ];
+	}
+	return true;
+}
+
+static bool lu_solve( std::vector<double>& a, std::vector<double>& b, int n )
+{
+	// Gaussian elimination with partial pivoting; returns false if a is singular
+	for( int j = 0; j < n; j++ )
+	{
+		int p = j;
+		for( int i = j + 1; i < n; i++ )
+			if( std::fabs( a[ i * n + j ] ) > std::fabs( a[ p * n + j ] ) )
+				p = i;
+		if( a[ p * n + j ] == 0.0 )
+			return false;
+		if( p != j )
+		{
+			for( int k = 0; k < n; k++ )
+				std::swap( a[ j * n + k ], a[ p * n + k ] );
+			std::swap( b[j], b[p] );
+		}
+		for( int i = j + 1; i < n; i++ )
+		{
+			const double f = a[ i * n + j ] / a[ j * n + j ];
+			if( f == 0.0 )
+				continue;
+			for( int k = j; k < n; k++ )
+				a[ i * n + k ] -= f * a[ j * n + k ];
+			b[i] -= f * b[j];
+		}
+	}
+	for( int i = n - 1; i >= 0; i-- )
+	{
+		for( int k = i + 1; k < n; k++ )
+			b[i] -= a[ i * n + k ] * b[k];
+		b[i] /= a[ i * n + i ];
+	}
+	return true;
+}
+
+// k-d tree built by insertion; the evaluation histories it is used for never delete points.
+class kd_tree
+{
+public:
+	typedef std::pair<double,int> hit; // squared distance, index
+
+	explicit kd_tree( int dim = 0 ):d_dim(dim) {}
+	void reset( int dim )
+	{
+		d_dim = dim;
+		d_points.clear();
+		d_nodes.clear();
+	}
+	int dim() const { return d_dim; }
+	int size() const { return int( d_nodes.size() ); }
+	const double* point( int i ) const { return &d_points[ size_t( i ) * d_dim ]; }
+	int insert( const double* x )
+	{
+		const int idx = size();
+		d_points.insert( d_points.end(), x, x + d_dim );
+		node nd;
+		nd.d_left = nd.d_right = -1;
+		nd.d_axis = 0;
+		int cur = ( idx > 0 ) ? 0 : -1;
+		while( cur >= 0 )
+		{
+			node& c = d_nodes[ cur ];
+			int& next = ( x[ c.d_axis ] < point( cur )[ c.d_axis ] ) ? c.d_left : c.d_right;
+			if( next < 0 )
+			{
+				next = idx;
+				nd.d_axis = ( c.d_axis + 1 ) % d_dim;
+				break;
+			}
+			cur = next;
+		}
+		d_nodes.push_back( nd );
+		return idx;
+	}
+	void nearest( const double* q, int k, std::vector<hit>& res ) const
+	{
+		// k nearest points to q, nearest first; iterative, since trees built from
+		// optimization paths can be deep
+		res.clear();
+		if( k <= 0 || d_nodes.empty() )
+			return;
+		std::vector<hit> stack; // node, lower bound of the squared distance
+		stack.push_back( hit( 0.0, 0 ) );
+		while( !stack.empty() )
+		{
+			const hit top = stack.back();
+			stack.pop_back();
+			if( int( res.size() ) == k && top.first >= res.front().first )
+				continue;
+			const int i = top.second;
+			const double* p = point( i );
+			double d = 0.0;
+			for( int j = 0; j < d_dim; j++ )
+				d += ( q[j] - p[j] ) * ( q[j] - p[j] );
+			if( int( res.size() ) < k )
+			{
+				res.push_back( hit( d, i ) );
+				std::push_heap( res.begin(), res.end() );
+			}else if( d < res.front().first )
+			{
+				std::pop_heap( res.begin(), res.end() );
+				res.back() = hit( d, i );
+				std::push_heap( res.begin(), res.end() );
+			}
+			const node& nd = d_nodes[ i ];
+			const double diff = q[ nd.d_axis ] - p[ nd.d_axis ];
+			const int near = ( diff < 0 ) ? nd.d_left : nd.d_right;
+			const int far = ( diff < 0 ) ? nd.d_right : nd.d_left;
+			if( far >= 0 )
+				stack.push_back( hit( std::max( top.first, diff * diff ), far ) );
+			if( near >= 0 )
+				stack.push_back( hit( top.first, near ) );
+		}
+		std::sort_heap( res.begin(), res.end() );
+	}
+private:
+	struct node
+	{
+		int d_left;
+		int d_right;
+		int d_axis;
+	};
+	int d_dim;
+	std::vector<double> d_points;
+	std::vector<node> d_nodes;
+};
+
+// Local model of an expensive objective, fitted to the nearest points of its evaluation
+// history. In screen mode, points the model predicts to be clearly worse than the best value
+// are answered by the model; in answer mode, all points are answered while the model is
+// trusted. Every true evaluation of a predicted point updates the error statistics.
+class surrogate
+{
+public:
+	enum Model { Quadratic, Rbf };
+	enum Mode { Screen, Answer };
+
+	Model d_model;
+	Mode d_mode;
+	double d_trust; // maximum rmse relative to the range of f
+	int d_neighbors; // 0 = automatic
+	int d_minHistory; // 0 = automatic
+	int d_validate; // in answer mode, evaluate every d_validate-th point anyway
+	long d_calls;
+	long d_hits;
+	long d_validations;
+	double d_absErr;
+	double d_sqErr;
+
+	surrogate():d_model(Quadratic),d_mode(Screen),d_trust(0.1),d_neighbors(0),d_minHistory(0),
+		d_validate(10),d_calls(0),d_hits(0),d_validations(0),d_absErr(0),d_sqErr(0),
+		d_fmin(HUGE_VAL),d_fmax(-HUGE_VAL),d_sinceValidation(0) {}
+	int history() const { return d_tree.size(); }
+	double rmse() const { return ( d_validations ) ? std::sqrt( d_sqErr / d_validations ) : HUGE_VAL; }
+	double relative_error() const
+	{
+		return ( d_fmax > d_fmin ) ? rmse() / ( d_fmax - d_fmin ) : HUGE_VAL;
+	}
+	void set_scale( unsigned n, const double* lb, const double* ub )
+	{
+		d_scale.assign( n, 1.0 );
+		for( unsigned j = 0; j < n; j++ )
+			if( ub[j] - lb[j] > 0 && ub[j] - lb[j] < HUGE_VAL )
+				d_scale[j] = 1.0 / ( ub[j] - lb[j] );
+		d_tree.reset( int( n ) );
+		d_f.clear();
+	}
+	bool predict( unsigned n, const double* x, double& p )
+	{
+		const int m = ( d_model == Quadratic ) ? 2 * int( n ) + 1 : int( n ) + 1;
+		int k = ( d_neighbors > 0 ) ? d_neighbors : 2 * m;
+		if( k < m )
+			k = m;
+		const int minHistory = ( d_minHistory > 0 ) ? d_minHistory : k;
+		if( history() < minHistory || history() < k )
+			return false;
+		scaled( n, x );
+		d_tree.nearest( &d_xs[0], k, d_near );
+		return ( d_model == Quadratic ) ? fit_quadratic( n, p ) : fit_rbf( n, p );
+	}
+	bool answer( double p, bool maximize )
+	{
+		if( d_validations < 3 || !( relative_error() <= d_trust ) )
+			return false;
+		bool use;
+		if( d_mode == Answer )
+			use = d_validate <= 0 || d_sinceValidation + 1 < d_validate;
+		else
+			use = ( maximize ) ? p + 2.0 * rmse() < d_fmax : p - 2.0 * rmse() > d_fmin;
+		if( use )
+		{
+			d_hits++;
+			d_sinceValidation++;
+		}
+		return use;
+	}
+	void add( unsigned n, const double* x, double f, bool predicted, double p )
+	{
+		if( f != f )
+			return;
+		scaled( n, x );
+		d_tree.insert( &d_xs[0] );
+		d_f.push_back( f );
+		if( f < d_fmin )
+			d_fmin = f;
+		if( f > d_fmax )
+			d_fmax = f;
+		if( predicted )
+		{
+			d_validations++;
+			d_absErr += std::fabs( p - f );
+			d_sqErr += ( p - f ) * ( p - f );
+			d_sinceValidation = 0;
+		}
+	}
+	void forget()
+	{
+		// the history and accuracy belong to the previous function; rescaled at the next call
+		d_tree.reset( 0 );
+		d_f.clear();
+		d_validations = 0;
+		d_absErr = d_sqErr = 0;
+		d_fmin = HUGE_VAL;
+		d_fmax = -HUGE_VAL;
+		d_sinceValidation = 0;
+	}
+private:
+	void scaled( unsigned n, const double* x )
+	{
+		d_xs.resize( n );
+		for( unsigned j = 0; j < n; j++ )
+			d_xs[j] = x[j] * ( ( j < d_scale.size() ) ? d_scale[j] : 1.0 );
+	}
+	bool fit_quadratic( unsigned n, double& p )
+	{
+		// Weighted least squares with basis 1, dx_j, dx_j^2 centered at the query point, so
+		// the prediction is the constant coefficient; no cross terms, so that few points do.
+		const int m = 2 * int( n ) + 1;
+		double h2 = 0.0;
+		for( size_t i = 0; i < d_near.size(); i++ )
+			h2 += d_near[i].first;
+		h2 = h2 / d_near.size() + 1e-300;
+		d_a.assign( size_t( m ) * m, 0.0 );
+		d_b.assign( m, 0.0 );
+		d_phi.resize( m );
+		for( size_t i = 0; i < d_near.size(); i++ )
+		{
+			const double* xi = d_tree.point( d_near[i].second );
+			const double w = 1.0 / ( d_near[i].first + h2 );
+			d_phi[0] = 1.0;
+			for( unsigned j = 0; j < n; j++ )
+			{
+				const double dx = xi[j] - d_xs[j];
+				d_phi[ 1 + j ] = dx;
+				d_phi[ 1 + n + j ] = dx * dx;
+			}
+			for( int r = 0; r < m; r++ )
+			{
+				for( int c = 0; c <= r; c++ )
+					d_a[ r * m + c ] += w * d_phi[r] * d_phi[c];
+				d_b[r] += w * d_phi[r] * d_f[ d_near[i].second ];
+			}
+		}
+		for( int r = 0; r < m; r++ )
+		{
+			for( int c = r + 1; c < m; c++ )
+				d_a[ r * m + c ] = d_a[ c * m + r ];
+			d_a[ r * m + r ] *= 1.0 + 1e-10; // ridge
+		}
+		if( !cholesky_solve( d_a, d_b, m ) )
+			return false;
+		p = d_b[0];
+		return p == p;
+	}
+	bool fit_rbf( unsigned n, double& p )
+	{
+		// Cubic radial basis functions with a linear tail, centered at the query point
+		const int k = int( d_near.size() );
+		const int m = k + int( n ) + 1;
+		d_a.assign( size_t( m ) * m, 0.0 );
+		d_b.assign( m, 0.0 );
+		for( int i = 0; i < k; i++ )
+		{
+			const double* xi = d_tree.point( d_near[i].second );
+			for( int j = 0; j < k; j++ )
+			{
+				const double* xj = d_tree.point( d_near[j].second );
+				double r2 = 0.0;
+				for( unsigned l = 0; l < n; l++ )
+					r2 += ( xi[l] - xj[l] ) * ( xi[l] - xj[l] );
+				d_a[ i * m + j ] = r2 * std::sqrt( r2 );
+			}
+			d_a[ i * m + k ] = d_a[ k * m + i ] = 1.0;
+			for( unsigned l = 0; l < n; l++ )
+				d_a[ i * m + k + 1 + l ] = d_a[ ( k + 1 + l ) * m + i ] = xi[l] - d_xs[l];
+			d_b[i] = d_f[ d_near[i].second ];
+		}
+		if( !lu_solve( d_a, d_b, m ) )
+			return false;
+		p = d_b[k];
+		for( int i = 0; i < k; i++ )
+		{
+			const double r = std::sqrt( d_near[i].first );
+			p += d_b[i] * r * r * r;
+		}
+		return p == p;
+	}
+	kd_tree d_tree;
+	std::vector<double> d_f; // by tree index
+	std::vector<double> d_scale;
+	double d_fmin;
+	double d_fmax;
+	long d_sinceValidation;
+	// scratch
+	std::vector<double> d_xs;
+	std::vector<kd_tree::hit> d_near;
+	std::vector<double> d_a;
+	std::vector<double> d_b;
+	std::vector<double> d_phi;
+};
+
+// Reuse of the objective values of nearby points: a point within d_tol of an evaluated one
+// gets its value, the distance measured in units of xtol_abs where it is positive. In strict
+// mode, gradients are only reused for identical points.
+class eval_reuse
+{
+public:
+	enum { Bins = 10 }; // distance 0, then decades below d_tol
+	double d_tol;
+	bool d_strict;
+	int d_maxPoints;
+	long d_hits;
+	long d_misses;
+	double d_sumDist;
+	double d_maxDist;
+	long d_bins[Bins];
+
+	eval_reuse():d_tol(1e-9),d_strict(true),d_maxPoints(100000),d_hits(0),d_misses(0),d_sumDist(0),d_maxDist(0)
+	{
+		for( int i = 0; i < Bins; i++ )
+			d_bins[i] = 0;
+	}
+	int points() const { return d_tree.size(); }
+	bool lookup( nlopt_opt obj, unsigned n, const double* x, double& f, double* grad )
+	{
+		update_scale( obj, n );
+		scaled( n, x );
+		d_tree.nearest( &d_xs[0], 1, d_near );
+		const int i = ( d_near.empty() ) ? -1 : d_near[0].second;
+		const double dist = ( i < 0 ) ? HUGE_VAL : std::sqrt( d_near[0].first );
+		if( !( dist <= d_tol ) || ( grad && ( !d_hasGrad[i] || ( d_strict && dist > 0 ) ) ) )
+		{
+			d_misses++;
+			return false;
+		}
+		f = d_f[i];
+		if( grad )
+			::memcpy( grad, &d_grad[ size_t( i ) * n ], n * sizeof(double) );
+		d_hits++;
+		d_sumDist += dist;
+		if( dist > d_maxDist )
+			d_maxDist = dist;
+		int bin = 0;
+		if( dist > 0 )
+		{
+			double bound = d_tol;
+			bin = 1;
+			while( bin < Bins - 1 && dist <= bound * 0.1 )
+			{
+				bound *= 0.1;
+				bin++;
+			}
+		}
+		d_bins[bin]++;
+		return true;
+	}
+	void add( unsigned n, const double* x, double f, const double* grad )
+	{
+		if( f != f )
+			return;
+		if( d_tree.size() >= d_maxPoints )
+			clear( n );
+		scaled( n, x );
+		d_tree.insert( &d_xs[0] );
+		d_f.push_back( f );
+		d_hasGrad.push_back( grad != 0 );
+		if( grad )
+			d_grad.insert( d_grad.end(), grad, grad + n );
+		else
+			d_grad.resize( d_grad.size() + n, s_nan );
+	}
+	void forget() { clear( unsigned( d_tree.dim() ) ); }
+private:
+	void clear( unsigned n )
+	{
+		d_tree.reset( int( n ) );
+		d_f.clear();
+		d_hasGrad.clear();
+		d_grad.clear();
+	}
+	void update_scale( nlopt_opt obj, unsigned n )
+	{
+		// the points are forgotten if xtol_abs was changed
+		d_tmp.resize( n );
+		nlopt_get_xtol_abs( obj, &d_tmp[0] );
+		for( unsigned j = 0; j < n; j++ )
+			d_tmp[j] = ( d_tmp[j] > 0 ) ? 1.0 / d_tmp[j] : 1.0;
+		if( d_tmp != d_scale || d_tree.dim() != int( n ) )
+		{
+			d_scale = d_tmp;
+			clear( n );
+		}
+	}
+	void scaled( unsigned n, const double* x )
+	{
+		d_xs.resize( n );
+		for( unsigned j = 0; j < n; j++ )
+			d_xs[j] = x[j] * d_scale[j];
+	}
+	kd_tree d_tree;
+	std::vector<double> d_f; // by tree index
+	std::vector<double> d_grad; // n per point
+	std::vector<char> d_hasGrad;
+	std::vector<double> d_scale;
+	// scratch
+	std::vector<double> d_tmp;
+	std::vector<double> d_xs;
+	std::vector<kd_tree::hit> d_near;
+};
+
+// What happens if a callback raises an error
+enum error_policy
+{
+	ErrorRaise,	// stop and re-raise the error from optimize
+	ErrorStop,	// stop, optimize returns normally
+	ErrorNan,	// the evaluation yields NaN, continue
+	ErrorPenalty	// the evaluation yields d_penalty (worse than anything), continue
+};
+static const char* s_errorPolicies[] = { "raise", "stop", "nan", "penalty", 0 };
+
+// Limits of a single evaluation of a Lua callback; zero means no limit
+struct eval_limits
+{
+	double d_instructions;
+	double d_seconds;
+	double d_memory; // bytes
+
+	eval_limits():d_instructions(0),d_seconds(0),d_memory(0) {}
+	bool active() const { return d_instructions > 0 || d_seconds > 0 || d_memory > 0; }
+};
+
+// A function registered with NLopt, so that it can be evaluated outside of nlopt_optimize;
+// d_data is owned by NLopt.
+struct registered_func
+{
+	nlopt_func d_f;
+	nlopt_mfunc d_mf; // instead of d_f for vector valued constraints
+	unsigned d_m;
+	void* d_data;
+	std::vector<double> d_tol; // one per result for constraints
+
+	registered_func():d_f(0),d_mf(0),d_m(1),d_data(0) {}
+	registered_func( nlopt_func f, void* data, double tol = 0 ):d_f(f),d_mf(0),d_m(1),d_data(data),d_tol(1,tol) {}
+	registered_func( nlopt_mfunc mf, unsigned m, void* data, const double* tol ):d_f(0),d_mf(mf),d_m(m),
+		d_data(data),d_tol(m,0.0)
+	{
+		if( tol )
+			d_tol.assign( tol, tol + m );
+	}
+	void eval( unsigned n, const double* x, double* res ) const
+	{
+		if( d_f )
+			res[0] = d_f( n, x, 0, d_data );
+		else
+			d_mf( d_m, res, n, x, 0, d_data );
+	}
+};
+
+// Vector transfers for dimensions 1 to s_smallDimMax without heap and with fixed trip
+// counts, selected by the dimension when the optimizer is created
+static const int s_smallDimMax = 16;
+
+struct small_dim_ops
+{
+	void (*read)( lua_State *L, int t, double* out ); // t[1..n]
+	void (*write)( lua_State *L, int t, const double* in );
+	void (*push_table)( lua_State *L, const double* in );
+	nlopt_func d_unpacked; // Lua objective called as f( x1, ..., xn, f_data, need_grad )
+};
+
+static const small_dim_ops* small_dim_for( unsigned int n );
+
+// Real-time mode: buffers are allocated ahead, the Lua GC only runs between optimize calls
+enum { GcNone, GcPause, GcStep };
+static const char* s_gcModes[] = { "none", "pause", "step", 0 };
+
+struct realtime_settings
+{
+	bool d_on;
+	int d_gc;
+	int d_gcStep; // KB, argument of the LUA_GCSTEP after each run
+
+	realtime_settings():d_on(false),d_gc(GcStep),d_gcStep(0) {}
+};
+
+struct realtime_stats
+{
+	double d_allocs; // by Lua during optimize calls
+	double d_bytes;
+	int d_runs;
+	double d_lastSeconds;
+	double d_maxSeconds;
+
+	realtime_stats():d_allocs(0),d_bytes(0),d_runs(0),d_lastSeconds(0),d_maxSeconds(0) {}
+};
+
+// State kept between opt:resolve calls
+struct warm_start
+{
+	std::vector<double> d_x; // last solution
+	std::vector<double> d_prev; // solution before
+	std::vector<double> d_step0; // initial step estimated at the first resolve
+	std::vector<double> d_step;
+	std::vector<double> d_user; // step set by the user, restored after each resolve; empty for the default
+	int d_solves;
+
+	warm_start():d_solves(0) {}
+};
+
+class process_pool;
+static void destroy_process_pool( process_pool* pool );
+
+// Settings of X_BAYESOPT
+struct bayes_settings
+{
+	int d_initial; // size of the initial design, 0 = automatic
+	int d_batch; // points proposed per iteration (constant liar)
+	int d_threads;
+	int d_restarts; // local optimizations of the acquisition function per proposal
+	int d_refit; // observations between fits of the length scales
+	double d_noise; // relative to the signal variance
+	double d_xi; // exploration margin of the expected improvement, in standard deviations of f
+	unsigned long long d_seed;
+
+	bayes_settings():d_initial(0),d_batch(1),d_threads(1),d_restarts(4),d_refit(5),d_noise(1e-6),
+		d_xi(0.01),d_seed(1) {}
+};
+
+struct nlopt_opt_holder
+{
+	nlopt_opt d_obj;
+	const small_dim_ops* d_small; // 0 if the dimension is larger
+	int d_algorithm; // as given to create, also X_BAYESOPT
+	bayes_settings d_bayes;
+	bool d_incremental;
+	bool d_maximize; // objective set by set_max_objective
+	cancel_flag* d_cancel;
+	int d_errorPolicy;
+	double d_penalty;
+	std::string d_error; // first error of the last optimize call, incl. traceback
+	int d_errors;
+	eval_limits d_limits;
+	int d_exceeded; // evaluations of the last optimize call aborted by d_limits
+	// Lua functions registered; the optimizer can only run on another thread if there are none
+	bool d_luaObjective;
+	int d_luaInequality;
+	int d_luaEquality;
+	registered_func d_objective;
+	std::vector<registered_func> d_inequality;
+	std::vector<registered_func> d_equality;
+	surrogate* d_surrogate; // of a Lua objective, with its history
+	realtime_settings d_rt;
+	realtime_stats d_rtStats;
+	std::vector<double> d_rtX; // x of optimize in real-time mode
+	std::vector<double> d_rtBuf; // other vectors in real-time mode
+	warm_start d_warm;
+	std::vector<double> d_frozen; // value per variable or NaN if free; empty if none is frozen
+	nlopt_opt d_local; // algorithm and stop criteria of the local optimizer for run_frozen, or 0
+	process_pool* d_procPool; // batch evaluations in worker processes; not copied
+	eval_store* d_store; // 0 if evaluations are not stored
+	eval_reuse* d_reuse; // of a Lua objective, with its history
+	metrics_slot* d_metrics; // 0 if not published; not copied, shared with the copy of optimize_async
+	unsigned d_generation; // changed with the functions or their f_data; workers of d_procPool are re-forked
+
+	nlopt_opt_holder( nlopt_opt obj ):d_obj(obj),d_small(small_dim_for(nlopt_get_dimension(obj))),
+		d_algorithm(nlopt_get_algorithm(obj)),d_incremental(false),d_maximize(false),d_cancel(0),
+		d_errorPolicy(ErrorRaise),d_penalty(HUGE_VAL),d_errors(0),d_exceeded(0),
+		d_luaObjective(false),d_luaInequality(0),d_luaEquality(0),d_surrogate(0),d_local(0),d_procPool(0),d_store(0),d_reuse(0),d_metrics(0),d_generation(0) {}
+	~nlopt_opt_holder()
+	{
+		set_cancel( 0 );
+		delete d_surrogate;
+		destroy_process_pool( d_procPool );
+		delete d_store;
+		delete d_reuse;
+		metrics_release( d_metrics );
+		if( d_local )
+			nlopt_destroy( d_local );
+	}
+	void copy_settings( const nlopt_opt_holder& rhs, const std::map<void*,void*>& clones )
+	{
+		// clones maps the f_data of rhs to those of the copy made by nlopt_copy
+		d_objective = remap( rhs.d_objective, clones );
+		d_inequality.clear();
+		for( size_t i = 0; i < rhs.d_inequality.size(); i++ )
+			d_inequality.push_back( remap( rhs.d_inequality[i], clones ) );
+		d_equality.clear();
+		for( size_t i = 0; i < rhs.d_equality.size(); i++ )
+			d_equality.push_back( remap( rhs.d_equality[i], clones ) );
+		d_algorithm = rhs.d_algorithm;
+		d_bayes = rhs.d_bayes;
+		d_rt = rhs.d_rt;
+		d_frozen = rhs.d_frozen;
+		if( d_local )
+			nlopt_destroy( d_local );
+		d_local = ( rhs.d_local ) ? nlopt_copy( rhs.d_local ) : 0;
+		d_incremental = rhs.d_incremental;
+		d_maximize = rhs.d_maximize;
+		d_errorPolicy = rhs.d_errorPolicy;
+		d_penalty = rhs.d_penalty;
+		d_limits = rhs.d_limits;
+		d_luaObjective = rhs.d_luaObjective;
+		d_luaInequality = rhs.d_luaInequality;
+		d_luaEquality = rhs.d_luaEquality;
+		delete d_surrogate;
+		d_surrogate = ( rhs.d_surrogate ) ? new surrogate( *rhs.d_surrogate ) : 0;
+		delete d_reuse;
+		d_reuse = ( rhs.d_reuse ) ? new eval_reuse( *rhs.d_reuse ) : 0;
+		delete d_store;
+		d_store = 0;
+		if( rhs.d_store )
+		{
+			// an own descriptor for this copy; fcntl locks only exclude other processes, the threads
+			// of async runs in this process are serialized by s_storeLock
+			const eval_store::header* h = rhs.d_store->head();
+			d_store = new eval_store;
+			if( d_store->open( rhs.d_store->d_path.c_str(), rhs.d_store->d_model, h->d_n, h->d_width, h->d_capacity ) )
+			{
+				delete d_store;
+				d_store = 0;
+			}
+		}
+		set_cancel( rhs.d_cancel );
+	}
+	static registered_func remap( registered_func f, const std::map<void*,void*>& clones )
+	{
+		std::map<void*,void*>::const_iterator i = clones.find( f.d_data );
+		f.d_data = ( i != clones.end() ) ? i->second : 0;
+		return f;
+	}
+	double* scratch( unsigned int n, std::vector<double>& tmp )
+	{
+		// the preallocated buffer in real-time mode, otherwise tmp
+		if( d_rt.d_on && d_rtBuf.size() > n )
+			return &d_rtBuf[0];
+		tmp.resize( n + 1 );
+		return &tmp[0];
+	}
+	bool thread_safe() const
+	{
+		return !d_luaObjective && d_luaInequality == 0 && d_luaEquality == 0;
+	}
+	void set_cancel( cancel_flag* flag )
+	{
+		if( flag )
+			flag->retain();
+		if( d_cancel )
+			d_cancel->release();
+		d_cancel = flag;
+	}
+};
+
+// The optimize call currently running on this thread; gives the callbacks access to the
+// settings of the optimizer. Runs nest if a callback runs another optimization.
+class eval_guard;
+
+// Progress of an optimize call; written by the optimizing thread only, readable from
+// other threads without locks while it runs.
+struct run_progress
+{
+	volatile atomic_t d_evals;
+	volatile atomic_t d_seq; // odd while d_best is written
+	volatile atomic_t d_cancelled;
+	volatile double d_best;
+	bool d_maximize;
+
+	run_progress( bool maximize = false ):d_evals(0),d_seq(0),d_cancelled(0),
+		d_best( ( maximize ) ? -HUGE_VAL : HUGE_VAL ),d_maximize(maximize) {}
+	void record( double f )
+	{
+		atomic_increment( &d_evals );
+		if( ( d_maximize ) ? f > d_best : f < d_best )
+		{
+			atomic_increment( &d_seq );
+			d_best = f;
+			atomic_increment( &d_seq );
+		}
+	}
+	double best()
+	{
+		for( ;; )
+		{
+			const long seq = atomic_load( &d_seq );
+			if( seq & 1 )
+				continue;
+			const double res = d_best;
+			if( atomic_load( &d_seq ) == seq )
+				return res;
+		}
+	}
+};
+
+struct optimize_run
+{
+	nlopt_opt_holder* d_holder;
+	optimize_run* d_outer;
+	eval_guard* d_guard; // callback evaluation in progress with limits
+	run_progress* d_progress; // only set for optimize_async
+	sched_job* d_sched; // only set for jobs of an nlopt_scheduler
+	bool d_async; // not running on the thread of the Lua state
+	bool d_worker; // a pool thread of a batch; the progress is recorded by the caller
+};
+
+static mutex s_workerLock; // errors of the pool threads of a batch
+
+// Errors of evaluations outside of an optimize run, e.g. by objective:eval; the caller
+// installs the sink and raises the first message.
+struct error_sink
+{
+	std::string d_error;
+	int d_errors;
+	error_sink* d_outer;
+
+	error_sink():d_errors(0),d_outer(0) {}
+};
+
+#ifdef _WIN32
+// __declspec(thread) does not work in DLLs loaded by LoadLibrary before Vista
+static DWORD s_runSlot = TLS_OUT_OF_INDEXES;
+static optimize_run* current_run() { return static_cast<optimize_run*>( TlsGetValue( s_runSlot ) ); }
+static void set_current_run( optimize_run* run ) { TlsSetValue( s_runSlot, run ); }
+static DWORD s_clonesSlot = TLS_OUT_OF_INDEXES;
+static std::map<void*,void*>* current_clones() { return static_cast<std::map<void*,void*>*>( TlsGetValue( s_clonesSlot ) ); }
+static void set_current_clones( std::map<void*,void*>* m ) { TlsSetValue( s_clonesSlot, m ); }
+static DWORD s_sinkSlot = TLS_OUT_OF_INDEXES;
+static error_sink* current_sink() { return static_cast<error_sink*>( TlsGetValue( s_sinkSlot ) ); }
+static void set_current_sink( error_sink* e ) { TlsSetValue( s_sinkSlot, e ); }
+#else
+static __thread optimize_run* s_run = 0;
+static optimize_run* current_run() { return s_run; }
+static void set_current_run( optimize_run* run ) { s_run = run; }
+static __thread std::map<void*,void*>* s_clones = 0;
+static std::map<void*,void*>* current_clones() { return s_clones; }
+static void set_current_clones( std::map<void*,void*>* m ) { s_clones = m; }
+static __thread error_sink* s_sink = 0;
+static error_sink* current_sink() { return s_sink; }
+static void set_current_sink( error_sink* e ) { s_sink = e; }
+#endif
+
+static void begin_run( optimize_run& run, nlopt_opt_holder* holder )
+{
+	run.d_holder = holder;
+	run.d_outer = current_run();
+	run.d_guard = 0;
+	run.d_progress = 0;
+	run.d_sched = 0;
+	run.d_async = false;
+	run.d_worker = false;
+	set_current_run( &run );
+}
+
+static void end_run( optimize_run& run )
+{
+	set_current_run( run.d_outer );
+}
+
+static bool cancel_requested()
+{
+	// Forces the running optimizer to stop if its cancel token was triggered or its
+	// deadline passed; also used while waiting for an external resource.
+	optimize_run* run = current_run();
+	if( run == 0 )
+		return false;
+	if( ( run->d_holder->d_cancel && run->d_holder->d_cancel->cancelled() ) ||
+		( run->d_progress && atomic_load( &run->d_progress->d_cancelled ) ) ||
+		( run->d_sched && run->d_sched->d_deadline != HUGE_VAL && now_seconds() > run->d_sched->d_deadline ) )
+	{
+		nlopt_force_stop( run->d_holder->d_obj );
+		return true;
+	}
+	return false;
+}
+
+static bool stop_requested()
+{
+	// Called before each evaluation; as cancel_requested, and gives up the core to the
+	// other jobs of a scheduler.
+	if( cancel_requested() )
+		return true;
+	optimize_run* run = current_run();
+	if( run && run->d_sched && !run->d_worker )
+		run->d_sched->d_sched->yield( run->d_sched );
+	return false;
+}
+
+static inline double eval_done( double f )
+{
+	// Called by the objectives with the result of each successful evaluation
+	optimize_run* run = current_run();
+	if( run && run->d_worker )
+		return f;
+	if( run && run->d_progress )
+		run->d_progress->record( f );
+	if( run && run->d_holder->d_metrics )
+		metrics_record( run->d_holder->d_metrics, f, run->d_holder->d_maximize );
+	return f;
+}
+
+static double callback_failed( const char* msg, bool constraint = false )
+{
+	// Applies the error policy of the running optimizer; returns the value to hand over
+	// to NLopt instead of the result of the failed evaluation.
+	PROBE2( callback_error, ( msg ) ? msg : "", int( constraint ) );
+	optimize_run* run = current_run();
+	if( run == 0 )
+	{
+		error_sink* e = current_sink();
+		if( e && e->d_errors++ == 0 )
+			e->d_error = ( msg ) ? msg : "error in callback";
+		return s_nan;
+	}
+	nlopt_opt_holder* holder = run->d_holder;
+	if( holder->d_metrics )
+		atomic_increment( &holder->d_metrics->d_errors );
+	if( run->d_worker )
+		s_workerLock.lock();
+	if( holder->d_errors++ == 0 )
+		holder->d_error = ( msg ) ? msg : "error in callback";
+	if( run->d_worker )
+		s_workerLock.unlock();
+	switch( holder->d_errorPolicy )
+	{
+	case ErrorNan:
+		return s_nan;
+	case ErrorPenalty:
+		// NLopt negates the objective when maximizing; constraints are violated if positive
+		return ( holder->d_maximize && !constraint ) ? -holder->d_penalty : holder->d_penalty;
+	default:
+		nlopt_force_stop( holder->d_obj );
+		return s_nan;
+	}
+}
+
+static bool error_stopped()
+{
+	// true once an error stopped the running optimizer under policy "raise" or "stop"
+	optimize_run* run = current_run();
+	if( run == 0 || run->d_holder->d_errorPolicy > ErrorStop )
+		return false;
+	if( !run->d_worker )
+		return run->d_holder->d_errors != 0;
+	lock_guard guard( s_workerLock );
+	return run->d_holder->d_errors != 0;
+}
+
+static int traceback( lua_State *L )
+{
+	// Message handler for lua_pcall, as in lua.c
+	lua_getfield( L, LUA_GLOBALSINDEX, "debug" );
+	if( !lua_istable( L, -1 ) )
+	{
+		lua_pop( L, 1 );
+		return 1;
+	}
+	lua_getfield( L, -1, "traceback" );
+	if( !lua_isfunction( L, -1 ) )
+	{
+		lua_pop( L, 2 );
+		return 1;
+	}
+	lua_pushvalue( L, 1 );
+	lua_pushinteger( L, 2 );
+	lua_call( L, 2, 1 );
+	return 1;
+}
+
+static int pcall_traceback( lua_State *L, int nargs, int nresults )
+{
+	// Like lua_pcall, but the error message includes a traceback. The handler is
+	// created once per state and kept in the registry.
+	static char key;
+	lua_pushlightuserdata( L, &key );
+	lua_rawget( L, LUA_REGISTRYINDEX );
+	if( !lua_isfunction( L, -1 ) )
+	{
+		lua_pop( L, 1 );
+		lua_pushcfunction( L, traceback );
+		lua_pushlightuserdata( L, &key );
+		lua_pushvalue( L, -2 );
+		lua_rawset( L, LUA_REGISTRYINDEX );
+	}
+	const int base = lua_gettop( L ) - nargs - 1; // index of the function
+	lua_insert( L, base );
+	const int res = lua_pcall( L, nargs, nresults, base );
+	lua_remove( L, base );
+	return res;
+}
+
+// Enforces the eval_limits of the running optimizer while a Lua callback runs: a count hook
+// checks instructions and wall-clock time, a wrapper of the allocator checks the memory
+// growth. An exceeded limit raises an error in the callback.
+class eval_guard
+{
+public:
+	eval_guard( lua_State* L ):d_L(L),d_run(current_run()),d_outer(0),d_exceeded(false)
+	{
+		if( d_run == 0 || !d_run->d_holder->d_limits.active() )
+		{
+			d_run = 0;
+			return;
+		}
+		const eval_limits& lim = d_run->d_holder->d_limits;
+		d_limits = lim;
+		d_outer = d_run->d_guard;
+		d_run->d_guard = this;
+		d_oldHook = lua_gethook( L );
+		d_oldMask = lua_gethookmask( L );
+		d_oldCount = lua_gethookcount( L );
+		d_count = 0;
+		d_step = 1000;
+		if( lim.d_instructions > 0 && lim.d_instructions < d_step )
+			d_step = int( lim.d_instructions );
+		if( lim.d_instructions > 0 || lim.d_seconds > 0 )
+		{
+			d_start = ( lim.d_seconds > 0 ) ? now_seconds() : 0.0;
+			lua_sethook( L, hook, LUA_MASKCOUNT, d_step );
+		}
+		d_oldAlloc = lua_getallocf( L, &d_oldUd );
+		if( lim.d_memory > 0 )
+		{
+			d_used = 0;
+			lua_setallocf( L, alloc, this );
+		}
+	}
+	~eval_guard()
+	{
+		if( d_run == 0 )
+			return;
+		if( d_limits.d_memory > 0 )
+			lua_setallocf( d_L, d_oldAlloc, d_oldUd );
+		if( d_limits.d_instructions > 0 || d_limits.d_seconds > 0 )
+			lua_sethook( d_L, d_oldHook, d_oldMask, d_oldCount );
+		d_run->d_guard = d_outer;
+		if( d_exceeded )
+			d_run->d_holder->d_exceeded++;
+	}
+	bool exceeded() const { return d_exceeded; }
+private:
+	static void hook( lua_State* L, lua_Debug* )
+	{
+		optimize_run* run = current_run();
+		eval_guard* g = ( run ) ? run->d_guard : 0;
+		if( g == 0 || g->d_L != L )
+			return;
+		g->d_count += g->d_step;
+		if( g->d_limits.d_instructions > 0 && g->d_count >= g->d_limits.d_instructions )
+		{
+			g->d_exceeded = true;
+			luaL_error( L, "evaluation exceeded %d instructions", int( g->d_limits.d_instructions ) );
+		}
+		if( g->d_limits.d_seconds > 0 && now_seconds() - g->d_start > g->d_limits.d_seconds )
+		{
+			g->d_exceeded = true;
+			luaL_error( L, "evaluation exceeded %f seconds", g->d_limits.d_seconds );
+		}
+	}
+	static void* alloc( void* ud, void* ptr, size_t osize, size_t nsize )
+	{
+		eval_guard* g = static_cast<eval_guard*>( ud );
+		if( nsize > osize && g->d_used + double( nsize - osize ) > g->d_limits.d_memory )
+		{
+			// Lua raises a memory error; shrinking must never fail
+			g->d_exceeded = true;
+			return 0;
+		}
+		void* res = g->d_oldAlloc( g->d_oldUd, ptr, osize, nsize );
+		if( res || nsize == 0 )
+			g->d_used += double( nsize ) - double( ( ptr ) ? osize : 0 );
+		return res;
+	}
+	lua_State* d_L;
+	optimize_run* d_run;
+	eval_guard* d_outer;
+	eval_limits d_limits;
+	bool d_exceeded;
+	lua_Hook d_oldHook;
+	int d_oldMask;
+	int d_oldCount;
+	int d_step;
+	double d_count;
+	double d_start;
+	lua_Alloc d_oldAlloc;
+	void* d_oldUd;
+	double d_used; // net growth since the start of the evaluation
+};
+
+static void* munge_on_destroy( void* f_data );
+static void* munge_on_copy( void* f_data );
+static nlopt_opt copy_opt( nlopt_opt obj, std::map<void*,void*>& clones );
+static int cancel_token( lua_State *L );
+static int install_signal_handlers( lua_State *L );
+static int scheduler( lua_State *L );
+static int block_coordinate( lua_State *L );
+static int external_objective( lua_State *L );
+static int profile_start( lua_State *L );
+static int profile_stop( lua_State *L );
+static int metrics_dump( lua_State *L );
+static int precond_diagonal( lua_State *L );
+static int precond_csr( lua_State *L );
+static int precond_fd_hessian( lua_State *L );
+
+static int create( lua_State *L )
+{
+	const lua_Integer algorithm = luaL_checkinteger( L, 1 );
+	if( algorithm < 0 || ( algorithm >= NLOPT_NUM_ALGORITHMS && algorithm != X_BAYESOPT ) )
+		luaL_argerror( L, 1, "expecting nlopt.algorithm" );
+	const lua_Integer n = luaL_checkinteger( L, 2 );
+	if( n < 0 )
+		luaL_argerror( L, 2, "expecting unsigned integer" );
+	// Our own algorithms use an NLopt object for the settings; the algorithm is irrelevant
+	nlopt_opt obj = nlopt_create( ( algorithm == X_BAYESOPT ) ? NLOPT_GN_DIRECT_L :
+		static_cast<nlopt_algorithm>( algorithm ), (unsigned int) n );
+	if( obj == NULL )
+		luaL_error( L, "nlopt_create out of memory" );
+
+	nlopt_set_munge( obj, munge_on_destroy, munge_on_copy ); 
+
+	nlopt_opt_holder* holder = new( lua_newuserdata( L, sizeof(nlopt_opt_holder) ) ) nlopt_opt_holder( obj );
+	holder->d_algorithm = int( algorithm );
+
+    luaL_getmetatable( L, nlopt_metaName );
+	if( !lua_istable(L, -1 ) )
+		luaL_error( L, "internal error: no meta table for '%s'", nlopt_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
+
+static const luaL_Reg Reg[] =
+{
+	{ "create", create },
+	{ "version", version },
+	{ "srand_time", srand_time },
+	{ "srand", srand },
+	{ "algorithm_name", algorithm_name },
+	{ "cancel_token", cancel_token },
+	{ "install_signal_handlers", install_signal_handlers },
+	{ "scheduler", scheduler },
+	{ "block_coordinate", block_coordinate },
+	{ "external_objective", external_objective },
+	{ "profile_start", profile_start },
+	{ "profile_stop", profile_stop },
+	{ "metrics_dump", metrics_dump },
+	{ "precond_diagonal", precond_diagonal },
+	{ "precond_csr", precond_csr },
+	{ "precond_fd_hessian", precond_fd_hessian },
+	{ NULL,		NULL	}
+};
+
+static nlopt_opt_holder* check(lua_State *L, int narg = 1 )
+{
+	return static_cast<nlopt_opt_holder*>( luaL_checkudata( L, narg, nlopt_metaName ) );
+}
+   
+static int finalize_nlopt_opt_s( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L );
+	nlopt_destroy( holder->d_obj );
+	holder->~nlopt_opt_holder();
+	return 0;
+}
+
+static int tostring( lua_State *L )
+{
+	nlopt_opt_holder* obj = check( L );
+	lua_pushfstring( L, "%s %p", nlopt_metaName, obj );
+	return 1;
+}
+
+static int copy( lua_State *L )
+{
+	nlopt_opt_holder* rhs = check( L );
+	std::map<void*,void*> clones;
+	nlopt_opt obj = copy_opt( rhs->d_obj, clones );
+	if( obj == NULL )
+		luaL_error( L, "nlopt_copy out of memory" );
+
+	nlopt_opt_holder* lhs = new( lua_newuserdata( L, sizeof(nlopt_opt_holder) ) ) nlopt_opt_holder( obj );
+	lhs->copy_settings( *rhs, clones );
+
+    luaL_getmetatable( L, nlopt_metaName );
+	if( !lua_istable(L, -1 ) )
+		luaL_error( L, "internal error: no meta table for '%s'", nlopt_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
+
+static int get_algorithm( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L );
+	lua_pushinteger( L, holder->d_algorithm );
+	return 1;
+}
+
+static int get_dimension( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L );
+	lua_pushinteger( L, nlopt_get_dimension( holder->d_obj ) );
+	return 1;
+}
+
+static int set_lower_bounds( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	if( holder->d_small )
+	{
+		double b[s_smallDimMax];
+		holder->d_small->read( L, 2, b );
+		lua_pushinteger( L, nlopt_set_lower_bounds( holder->d_obj, b ) );
+		return 1;
+	}
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, 2 );
+		lb[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	lua_pushinteger( L, nlopt_set_lower_bounds( holder->d_obj, lb ) );
+	return 1;
+}
+
+static int set_upper_bounds( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	if( holder->d_small )
+	{
+		double b[s_smallDimMax];
+		holder->d_small->read( L, 2, b );
+		lua_pushinteger( L, nlopt_set_upper_bounds( holder->d_obj, b ) );
+		return 1;
+	}
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, 2 );
+		lb[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	lua_pushinteger( L, nlopt_set_upper_bounds( holder->d_obj, lb ) );
+	return 1;
+}
+
+static int set_lower_bounds1( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double lb = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_lower_bounds1( holder->d_obj, lb ) );
+	return 1;
+}
+
+static int set_upper_bounds1( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double lb = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_upper_bounds1( holder->d_obj, lb ) );
+	return 1;
+}
+
+static int get_lower_bounds( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	if( holder->d_small )
+	{
+		double b[s_smallDimMax];
+		lua_pushinteger( L, nlopt_get_lower_bounds( holder->d_obj, b ) );
+		holder->d_small->push_table( L, b );
+		return 2;
+	}
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	lua_pushinteger( L, nlopt_get_lower_bounds( holder->d_obj, lb ) );
+	lua_createtable( L, n, 0 );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, lb[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 2;
+}
+
+static int get_upper_bounds( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	if( holder->d_small )
+	{
+		double b[s_smallDimMax];
+		lua_pushinteger( L, nlopt_get_upper_bounds( holder->d_obj, b ) );
+		holder->d_small->push_table( L, b );
+		return 2;
+	}
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	lua_pushinteger( L, nlopt_get_upper_bounds( holder->d_obj, lb ) );
+	lua_createtable( L, n, 0 );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, lb[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 2;
+}
+
+// Base of everything we hand over to NLopt as f_data; NLopt copies and frees
+// f_data through munge_on_copy and munge_on_destroy.
+struct func_context
+{
+	virtual ~func_context() {}
+	virtual func_context* clone() const = 0;
+	// real-time mode: creates ahead what the evaluations would create on first use
+	virtual void prepare( unsigned int, unsigned int ) {}
+	// an optimization with this objective starts
+	virtual void start_run() {}
+	// replaces f_data by the value at idx; false if there is no f_data
+	virtual bool set_f_data( lua_State*, int ) { return false; }
+	// evaluates count rows of x, each followed by room for f; false if not supported
+	virtual bool eval_batch( unsigned, int, double*, int ) { return false; }
+};
+
+struct callback_context : public func_context
+{
+	lua_State *L;
+	int ref;
+	std::vector<double> d_lastX; // x as currently stored in the "x" table, empty if unknown
+	std::vector<unsigned int> d_diff; // indices where x differs from d_lastX
+	double d_prevF;
+	bool d_prevValid; // d_prevF and d_lastX are from a successful call
+	int d_changed; // number of entries in the "changed" table
+	long d_calls; // of the Lua function, numbers the evaluations for the tracepoints
+
+	callback_context():L(0),ref(LUA_NOREF),d_prevF(0.0),d_prevValid(false),d_changed(0),d_calls(0) {}
+	~callback_context();
+	func_context* clone() const;
+	void prepare( unsigned int n, unsigned int m );
+	bool set_f_data( lua_State* from, int idx )
+	{
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+		lua_pushvalue( from, idx );
+		if( from != L )
+			lua_xmove( from, L, 1 );
+		lua_setfield( L, -2, "f_data" );
+		lua_pop( L, 1 );
+		return true;
+	}
+};
+
+// Userdata of type nlopt_objective: an objective implemented in C++ which can be passed
+// to set_min_objective/set_max_objective instead of a Lua function. Each registration
+// gets its own clone of d_proto.
+struct native_objective
+{
+	func_context* d_proto;
+	nlopt_func d_func;
+	unsigned int d_dim; // number of parameters expected or 0 if any
+};
+
+static native_objective* to_objective( lua_State *L, int narg )
+{
+	void* p = lua_touserdata( L, narg );
+	if( p == 0 || !lua_getmetatable( L, narg ) )
+		return 0;
+	luaL_getmetatable( L, objective_metaName );
+	const bool ok = lua_rawequal( L, -1, -2 ) != 0;
+	lua_pop( L, 2 );
+	return ( ok ) ? static_cast<native_objective*>( p ) : 0;
+}
+
+static func_context* clone_objective( lua_State *L, nlopt_opt_holder* holder, native_objective* obj )
+{
+	if( obj->d_dim != 0 && obj->d_dim != nlopt_get_dimension( holder->d_obj ) )
+		luaL_error( L, "objective expects %d parameters, but optimizer has dimension %d",
+			int( obj->d_dim ), int( nlopt_get_dimension( holder->d_obj ) ) );
+	return obj->d_proto->clone();
+}
+
+// Collects the indices where x differs bitwise from prev; blocks of unchanged values are
+// skipped by memcmp, which the C runtime implements with vector instructions.
+static void diff_vector( const double* prev, const double* x, unsigned n, std::vector<unsigned int>& changed )
+{
+	changed.clear();
+	const unsigned int B = 8;
+	for( unsigned int b = 0; b < n; b += B )
+	{
+		const unsigned int len = ( n - b < B ) ? n - b : B;
+		if( ::memcmp( prev + b, x + b, len * sizeof(double) ) == 0 )
+			continue;
+		for( unsigned int i = b; i < b + len; i++ )
+			if( ::memcmp( prev + i, x + i, sizeof(double) ) != 0 )
+				changed.push_back( i );
+	}
+}
+
+static bool incremental_enabled()
+{
+	optimize_run* run = current_run();
+	return run && run->d_holder->d_incremental;
+}
+
+static eval_store* store_for( void* f_data, unsigned int& func )
+{
+	// the evaluation store of the running optimizer and the number of the function there
+	optimize_run* run = current_run();
+	if( run == 0 || run->d_holder->d_store == 0 )
+		return 0;
+	nlopt_opt_holder* holder = run->d_holder;
+	if( holder->d_objective.d_data == f_data )
+	{
+		func = 0;
+		return holder->d_store;
+	}
+	size_t i;
+	for( i = 0; i < holder->d_inequality.size(); i++ )
+		if( holder->d_inequality[i].d_data == f_data )
+		{
+			func = unsigned( 1 + i );
+			return holder->d_store;
+		}
+	for( i = 0; i < holder->d_equality.size(); i++ )
+		if( holder->d_equality[i].d_data == f_data )
+		{
+			func = unsigned( 1 + holder->d_inequality.size() + i );
+			return holder->d_store;
+		}
+	return 0;
+}
+
+static bool realtime_enabled()
+{
+	optimize_run* run = current_run();
+	return run && run->d_holder->d_rt.d_on;
+}
+
+static void push_x( callback_context* ctx, int t, unsigned n, const double* x )
+{
+	// Pushes the reusable "x" table; only the entries which changed since the last call
+	// are written. Callbacks must treat x as read-only.
+	lua_pushliteral( ctx->L, "x" );
+	lua_rawget( ctx->L, t );
+	if( !lua_istable( ctx->L, -1 ) )
+	{
+		lua_pop( ctx->L, 1 );
+		lua_createtable( ctx->L, n, 0 );
+		lua_pushliteral( ctx->L, "x" );
+		lua_pushvalue( ctx->L, -2 );
+		lua_rawset( ctx->L, t );
+		ctx->d_lastX.clear();
+	}
+	const int xt = lua_gettop( ctx->L );
+	unsigned int i;
+	if( ctx->d_lastX.size() == n )
+	{
+		diff_vector( &ctx->d_lastX[0], x, n, ctx->d_diff );
+		for( i = 0; i < ctx->d_diff.size(); i++ )
+		{
+			const unsigned int j = ctx->d_diff[i];
+			lua_pushnumber( ctx->L, x[j] );
+			lua_rawseti( ctx->L, xt, j + 1 );
+			ctx->d_lastX[j] = x[j];
+		}
+	}else
+	{
+		ctx->d_prevValid = false;
+		ctx->d_lastX.assign( x, x + n );
+		for( i = 0; i < n; i++ )
+		{
+			lua_pushnumber( ctx->L, x[i] );
+			lua_rawseti( ctx->L, xt, i + 1 );
+		}
+	}
+}
+
+static void push_changed( callback_context* ctx, int t )
+{
+	// Pushes the list of indices changed by push_x and the previous result, or nil, nil
+	// if unknown
+	if( !ctx->d_prevValid )
+	{
+		lua_pushnil( ctx->L );
+		lua_pushnil( ctx->L );
+		return;
+	}
+	lua_pushliteral( ctx->L, "changed" );
+	lua_rawget( ctx->L, t );
+	if( !lua_istable( ctx->L, -1 ) )
+	{
+		lua_pop( ctx->L, 1 );
+		lua_newtable( ctx->L );
+		lua_pushliteral( ctx->L, "changed" );
+		lua_pushvalue( ctx->L, -2 );
+		lua_rawset( ctx->L, t );
+	}
+	const int k = int( ctx->d_diff.size() );
+	int i;
+	for( i = 0; i < k; i++ )
+	{
+		lua_pushinteger( ctx->L, ctx->d_diff[i] + 1 );
+		lua_rawseti( ctx->L, -2, i + 1 );
+	}
+	for( i = k; i < ctx->d_changed; i++ )
+	{
+		lua_pushnil( ctx->L );
+		lua_rawseti( ctx->L, -2, i + 1 );
+	}
+	ctx->d_changed = k;
+	lua_pushnumber( ctx->L, ctx->d_prevF );
+}
+
+// The evaluation store, eval reuse and surrogate of the running optimizer around a call of
+// a Lua function
+struct known_values
+{
+	eval_store* d_store;
+	unsigned int d_stored; // number of the function in d_store
+	eval_reuse* d_reuse;
+	surrogate* d_sur;
+	double d_predicted;
+	bool d_hasPrediction;
+
+	known_values():d_store(0),d_stored(0),d_reuse(0),d_sur(0),d_predicted(0.0),d_hasPrediction(false) {}
+	bool lookup( unsigned n, const double* x, double* grad, void* f_data, double& f )
+	{
+		// true if f, and grad if not 0, are known without calling the function
+		d_store = store_for( f_data, d_stored );
+		if( d_store && d_store->lookup( d_stored, n, x, 1, &f, grad ) )
+			return true;
+		optimize_run* run = current_run();
+		d_reuse = ( n > 0 && run && run->d_holder->d_objective.d_data == f_data ) ?
+			run->d_holder->d_reuse : 0;
+		if( d_reuse && d_reuse->lookup( run->d_holder->d_obj, n, x, f, grad ) )
+			return true;
+		d_sur = ( grad == 0 && n > 0 && run && run->d_holder->d_objective.d_data == f_data ) ?
+			run->d_holder->d_surrogate : 0;
+		if( d_sur )
+		{
+			if( d_sur->history() == 0 )
+			{
+				std::vector<double> lb( n ), ub( n );
+				nlopt_get_lower_bounds( run->d_holder->d_obj, &lb[0] );
+				nlopt_get_upper_bounds( run->d_holder->d_obj, &ub[0] );
+				d_sur->set_scale( n, &lb[0], &ub[0] );
+			}
+			d_sur->d_calls++;
+			d_hasPrediction = d_sur->predict( n, x, d_predicted );
+			if( d_hasPrediction && d_sur->answer( d_predicted, run->d_holder->d_maximize ) )
+			{
+				f = d_predicted;
+				return true;
+			}
+		}
+		return false;
+	}
+	void add( unsigned n, const double* x, double f, const double* grad )
+	{
+		// the result of the call
+		if( d_sur )
+			d_sur->add( n, x, f, d_hasPrediction, d_predicted );
+		if( d_store )
+			d_store->insert( d_stored, n, x, 1, &f, grad );
+		if( d_reuse )
+			d_reuse->add( n, x, f, grad );
+	}
+};
+
+static double call_func( unsigned n, const double* x, double* grad, void* f_data, bool constraint )
+{
+	// x points to an array of length n
+	// if the argument grad is not NULL, then grad points to an array of length n
+	// f_data points to a callback_context
+
+	callback_context* ctx = static_cast<callback_context*>( static_cast<func_context*>( f_data ) );
+	if( stop_requested() )
+		return s_nan; // never accepted as an improvement
+	known_values known;
+	double f;
+	if( known.lookup( n, x, grad, f_data, f ) )
+		return eval_done( f );
+	if( ctx )
+	{
+		const double marshal = profile_now();
+		lua_rawgeti( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
+		const int t = lua_gettop( ctx->L );
+
+		lua_pushliteral( ctx->L, "f" );
+		lua_rawget( ctx->L, t );
+		if( !lua_isfunction( ctx->L, -1 ) )
+		{
+			lua_pop( ctx->L, 2 ); // t, f
+			return callback_failed( ( constraint ) ? "constraint is not a function" :
+				"objective is not a function", constraint );
+		}
+		lua_pushinteger( ctx->L, n );
+
+		push_x( ctx, t, n, x );
+		unsigned int i;
+		// stack: t, f, n, x
+		if( grad )
+		{
+			lua_pushliteral( ctx->L, "grad" );
+			lua_rawget( ctx->L, t );
+			if( !lua_istable( ctx->L, -1 ) )
+			{
+				lua_pop( ctx->L, 1 );
+				lua_newtable( ctx->L );
+				lua_pushliteral( ctx->L, "grad" );
+				lua_pushvalue( ctx->L, -2 );
+				lua_rawset( ctx->L, t );
+			}
+			const int gradt = lua_gettop( ctx->L );
+			for( i = 0; i < n; i++ )
+			{
+				lua_pushnumber( ctx->L, grad[i] );
+				lua_rawseti( ctx->L, gradt, i + 1 );
+			}
+		}else
+		{
+			if( !realtime_enabled() )
+			{
+				lua_pushliteral( ctx->L, "grad" );
+				lua_pushnil( ctx->L );
+				lua_rawset( ctx->L, t );
+			}
+			lua_pushnil( ctx->L );
+		}
+		// stack: t, f, n, x, grad | nil
+		lua_pushliteral( ctx->L, "f_data" );
+		lua_rawget( ctx->L, t );
+		// stack: t, f, n, x, grad | nil, f_data | nil
+		int nargs = 4;
+		const bool incremental = incremental_enabled();
+		if( incremental )
+		{
+			push_changed( ctx, t );
+			nargs += 2;
+		}
+		// stack: t, f, n, x, grad | nil, f_data | nil [, changed | nil, prev_f | nil ]
+		int rc;
+		bool exceeded;
+		ctx->d_calls++;
+		PROBE3( func_entry, n, 1, ctx->d_calls );
+		const double called = profile_now();
+		{
+			eval_guard guard( ctx->L );
+			rc = pcall_traceback( ctx->L, nargs, 1 );
+			exceeded = guard.exceeded();
+		}
+		const double returned = profile_now();
+		PROBE4( func_exit, n, 1, ctx->d_calls, rc );
+		profile_add( "marshal", marshal, called );
+		profile_add( "func", called, returned );
+		if( rc == 0 )
+		{
+			// stack: t, res
+			const double res = lua_tonumber( ctx->L, -1 );
+			lua_pop( ctx->L, 1 );
+			ctx->d_prevF = res;
+			ctx->d_prevValid = true;
+			// stack: t
+			if( grad )
+			{
+				lua_pushliteral( ctx->L, "grad" );
+				lua_rawget( ctx->L, t );
+				const int gradt = lua_gettop( ctx->L );
+				for( i = 0; i < n; i++ )
+				{
+					lua_rawgeti( ctx->L, gradt, i + 1 );
+					grad[i] = lua_tonumber( ctx->L, -1 );
+					lua_pop( ctx->L, 1 );
+				}
+				lua_pop( ctx->L, 1 );
+			}
+			lua_pop( ctx->L, 1 );
+			known.add( n, x, res, grad );
+			profile_add( "marshal", returned, profile_now() );
+			return eval_done( res );
+		}else
+		{
+			// stack: t, msg
+			// an evaluation aborted by the eval limits doesn't count as error; a constraint
+			// is reported infeasible as by mfunc
+			const double res = ( exceeded ) ? ( ( constraint ) ? HUGE_VAL : s_nan ) :
+				callback_failed( lua_tostring( ctx->L, -1 ), constraint );
+			lua_pop( ctx->L, 2 );
+			ctx->d_prevValid = false;
+			return res;
+		}
+	}else if( constraint )
+		return callback_failed( "constraint without context", true );
+	else
+		return callback_failed( "objective without context" );
+}
+
+static double func(unsigned n, const double* x, double* grad, void* f_data)
+{
+	return call_func( n, x, grad, f_data, false );
+}
+
+static double cfunc(unsigned n, const double* x, double* grad, void* f_data)
+{
+	// scalar constraints; failures are reported as violated under the "penalty" policy
+	return call_func( n, x, grad, f_data, true );
+}
+
+callback_context::~callback_context()
+{
+	luaL_unref( L, LUA_REGISTRYINDEX, ref );
+}
+
+func_context* callback_context::clone() const
+{
+	lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+	const int source = lua_gettop( L );
+	callback_context* ctx_new = new callback_context;
+	ctx_new->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx_new->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, -1 );
+	lua_rawget( L, source );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, -1 );
+	lua_rawget( L, source );
+	lua_rawset( L, t );
+
+	lua_pop( L, 2 ); // source and t
+	return ctx_new;
+}
+
+static void prepare_table( lua_State *L, int t, const char* name, unsigned int size, bool init )
+{
+	lua_getfield( L, t, name );
+	const bool exists = lua_istable( L, -1 );
+	lua_pop( L, 1 );
+	if( exists )
+		return;
+	lua_createtable( L, size, 0 );
+	if( init )
+		for( unsigned int i = 0; i < size; i++ )
+		{
+			lua_pushnumber( L, 0.0 );
+			lua_rawseti( L, -2, i + 1 );
+		}
+	lua_setfield( L, t, name );
+}
+
+void callback_context::prepare( unsigned int n, unsigned int m )
+{
+	lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+	const int t = lua_gettop( L );
+	lua_getfield( L, t, "x" );
+	if( !lua_istable( L, -1 ) )
+		d_lastX.clear();
+	lua_pop( L, 1 );
+	prepare_table( L, t, "x", n, false );
+	prepare_table( L, t, "grad", n * m, false );
+	prepare_table( L, t, "changed", n, false );
+	if( m > 1 )
+		prepare_table( L, t, "result", m, true );
+	lua_pop( L, 1 );
+	d_lastX.reserve( n );
+	d_diff.reserve( n );
+}
+
+static void* munge_on_destroy( void* f_data )
+{
+	delete static_cast<func_context*>( f_data );
+	return 0;
+}
+
+static void* munge_on_copy( void* f_data )
+{
+	func_context* ctx = static_cast<func_context*>( f_data );
+	if( ctx )
+	{
+		func_context* res = ctx->clone();
+		if( std::map<void*,void*>* clones = current_clones() )
+			(*clones)[ f_data ] = res;
+		return res;
+	}else
+		return NULL;
+}
+
+static nlopt_opt copy_opt( nlopt_opt obj, std::map<void*,void*>& clones )
+{
+	// nlopt_copy, recording which f_data was cloned to which
+	std::map<void*,void*>* outer = current_clones();
+	set_current_clones( &clones );
+	nlopt_opt res = nlopt_copy( obj );
+	set_current_clones( outer );
+	return res;
+}
+
+template<int N>
+struct small_dim
+{
+	static void read( lua_State *L, int t, double* out )
+	{
+		for( int i = 0; i < N; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_gettable( L, t );
+			out[i] = lua_tonumber( L, -1 );
+			lua_pop( L, 1 );
+		}
+	}
+	static void write( lua_State *L, int t, const double* in )
+	{
+		for( int i = 0; i < N; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_pushnumber( L, in[i] );
+			lua_settable( L, t );
+		}
+	}
+	static void push_table( lua_State *L, const double* in )
+	{
+		lua_createtable( L, N, 0 );
+		for( int i = 0; i < N; i++ )
+		{
+			lua_pushnumber( L, in[i] );
+			lua_rawseti( L, -2, i + 1 );
+		}
+	}
+	static double unpacked( unsigned, const double* x, double* grad, void* f_data )
+	{
+		// f( x1, ..., xN, f_data, need_grad ) returns f, g1, ..., gN; the gradient is only
+		// read if need_grad is true
+		callback_context* ctx = static_cast<callback_context*>( static_cast<func_context*>( f_data ) );
+		if( stop_requested() )
+			return s_nan;
+		known_values known;
+		double f;
+		if( known.lookup( N, x, grad, f_data, f ) )
+			return eval_done( f );
+		lua_State *L = ctx->L;
+		if( !lua_checkstack( L, N + 5 ) )
+			return callback_failed( "stack overflow" );
+		const double marshal = profile_now();
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ctx->ref );
+		const int t = lua_gettop( L );
+		lua_pushliteral( L, "f" );
+		lua_rawget( L, t );
+		if( !lua_isfunction( L, -1 ) )
+		{
+			lua_pop( L, 2 ); // t, f
+			return callback_failed( "objective is not a function" );
+		}
+		for( int i = 0; i < N; i++ )
+			lua_pushnumber( L, x[i] );
+		lua_pushliteral( L, "f_data" );
+		lua_rawget( L, t );
+		lua_pushboolean( L, grad != 0 );
+		int rc;
+		bool exceeded;
+		ctx->d_calls++;
+		PROBE3( func_entry, N, 1, ctx->d_calls );
+		const double called = profile_now();
+		{
+			eval_guard guard( L );
+			rc = pcall_traceback( L, N + 2, N + 1 );
+			exceeded = guard.exceeded();
+		}
+		const double returned = profile_now();
+		PROBE4( func_exit, N, 1, ctx->d_calls, rc );
+		profile_add( "marshal", marshal, called );
+		profile_add( "func", called, returned );
+		if( rc != 0 )
+		{
+			// stack: t, msg
+			const double res = ( exceeded ) ? s_nan : callback_failed( lua_tostring( L, -1 ) );
+			lua_pop( L, 2 );
+			return res;
+		}
+		// stack: t, f, g1, ..., gN
+		const double res = lua_tonumber( L, t + 1 );
+		if( grad )
+			for( int i = 0; i < N; i++ )
+			{
+				if( !lua_isnumber( L, t + 2 + i ) )
+				{
+					lua_settop( L, t - 1 );
+					return callback_failed( "objective returned no gradient" );
+				}
+				grad[i] = lua_tonumber( L, t + 2 + i );
+			}
+		lua_settop( L, t - 1 );
+		known.add( N, x, res, grad );
+		profile_add( "marshal", returned, profile_now() );
+		return eval_done( res );
+	}
+};
+
+#define SMALL_DIM( N ) { small_dim<N>::read, small_dim<N>::write, small_dim<N>::push_table, small_dim<N>::unpacked }
+static const small_dim_ops s_smallDims[s_smallDimMax] =
+{
+	SMALL_DIM( 1 ), SMALL_DIM( 2 ), SMALL_DIM( 3 ), SMALL_DIM( 4 ),
+	SMALL_DIM( 5 ), SMALL_DIM( 6 ), SMALL_DIM( 7 ), SMALL_DIM( 8 ),
+	SMALL_DIM( 9 ), SMALL_DIM( 10 ), SMALL_DIM( 11 ), SMALL_DIM( 12 ),
+	SMALL_DIM( 13 ), SMALL_DIM( 14 ), SMALL_DIM( 15 ), SMALL_DIM( 16 )
+};
+#undef SMALL_DIM
+
+static const small_dim_ops* small_dim_for( unsigned int n )
+{
+	return ( n >= 1 && n <= unsigned( s_smallDimMax ) ) ? &s_smallDims[ n - 1 ] : 0;
+}
+
+static nlopt_func lua_objective_func( lua_State *L, nlopt_opt_holder* holder, int opts )
+{
+	// options of set_min_objective/set_max_objective: { unpacked = true }
+	if( !lua_istable( L, opts ) )
+		return func;
+	lua_getfield( L, opts, "unpacked" );
+	const bool unpacked = lua_toboolean( L, -1 ) != 0;
+	lua_pop( L, 1 );
+	if( !unpacked )
+		return func;
+	if( holder->d_small == 0 )
+		luaL_argerror( L, opts, "unpacked objectives need 1 to 16 dimensions" );
+	return holder->d_small->d_unpacked;
+}
+
+static void forget_history( nlopt_opt_holder* holder )
+{
+	// the points seen so far belong to the previous objective or f_data
+	if( holder->d_surrogate )
+		holder->d_surrogate->forget();
+	if( holder->d_reuse )
+		holder->d_reuse->forget();
+}
+
+static int set_min_objective( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	holder->d_maximize = false;
+	forget_history( holder );
+	if( native_objective* obj = to_objective( L, 2 ) )
+	{
+		func_context* ctx = clone_objective( L, holder, obj );
+		holder->d_luaObjective = false;
+		holder->d_objective = registered_func( obj->d_func, ctx );
+		lua_pushinteger( L, nlopt_set_min_objective( holder->d_obj, obj->d_func, ctx ) );
+		return 1;
+	}
+	luaL_checktype( L, 2, LUA_TFUNCTION );
+	const nlopt_func f = lua_objective_func( L, holder, 4 );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 2 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	holder->d_luaObjective = true;
+	holder->d_objective = registered_func( f, static_cast<func_context*>( ctx ) );
+	lua_pushinteger( L, nlopt_set_min_objective( holder->d_obj, f, static_cast<func_context*>( ctx ) ) );
+
+	// NOTE: der call ist asynchron; in munge_on_destroy wieder freigegeben.
+	return 1;
+}
+
+static int set_max_objective( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	holder->d_maximize = true;
+	forget_history( holder );
+	if( native_objective* obj = to_objective( L, 2 ) )
+	{
+		func_context* ctx = clone_objective( L, holder, obj );
+		holder->d_luaObjective = false;
+		holder->d_objective = registered_func( obj->d_func, ctx );
+		lua_pushinteger( L, nlopt_set_max_objective( holder->d_obj, obj->d_func, ctx ) );
+		return 1;
+	}
+	luaL_checktype( L, 2, LUA_TFUNCTION );
+	const nlopt_func f = lua_objective_func( L, holder, 4 );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 2 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	holder->d_luaObjective = true;
+	holder->d_objective = registered_func( f, static_cast<func_context*>( ctx ) );
+	lua_pushinteger( L, nlopt_set_max_objective( holder->d_obj, f, static_cast<func_context*>( ctx ) ) );
+
+	// NOTE: der call ist asynchron; in munge_on_destroy wieder freigegeben.
+	return 1;
+}
+
+static int add_inequality_constraint( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	luaL_checktype( L, 2, LUA_TFUNCTION );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 2 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	const nlopt_result res = nlopt_add_inequality_constraint( holder->d_obj, cfunc, static_cast<func_context*>( ctx ), lua_tonumber( L, 4 ) );
+	if( res > 0 )
+	{
+		holder->d_luaInequality++;
+		holder->d_inequality.push_back( registered_func( cfunc, static_cast<func_context*>( ctx ), lua_tonumber( L, 4 ) ) );
+	}
+	lua_pushinteger( L, res );
+
+	return 1;
+}
+
+static int add_equality_constraint( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	luaL_checktype( L, 2, LUA_TFUNCTION );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 2 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	const nlopt_result res = nlopt_add_equality_constraint( holder->d_obj, cfunc, static_cast<func_context*>( ctx ), lua_tonumber( L, 4 ) );
+	if( res > 0 )
+	{
+		holder->d_luaEquality++;
+		holder->d_equality.push_back( registered_func( cfunc, static_cast<func_context*>( ctx ), lua_tonumber( L, 4 ) ) );
+	}
+	lua_pushinteger( L, res );
+
+	return 1;
+}
+
+static int remove_inequality_constraints( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	holder->d_luaInequality = 0;
+	holder->d_inequality.clear();
+	lua_pushinteger( L, nlopt_remove_inequality_constraints( holder->d_obj ) );
+	return 1;
+}
+
+static int remove_equality_constraints( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	holder->d_luaEquality = 0;
+	holder->d_equality.clear();
+	lua_pushinteger( L, nlopt_remove_equality_constraints( holder->d_obj ) );
+	return 1;
+}
+
+static void mfunc(unsigned m, double *result, unsigned n, const double* x, double* grad, void* f_data)
+{
+	// x points to an array of length n
+	// result, an array of length m
+	// if the argument grad is not NULL, then grad points to an array of length m*n
+	// f_data points to a callback_context
+
+	callback_context* ctx = static_cast<callback_context*>( static_cast<func_context*>( f_data ) );
+	if( stop_requested() )
+	{
+		for( unsigned int j = 0; j < m; j++ )
+			result[j] = s_nan;
+		return;
+	}
+	unsigned int stored = 0;
+	eval_store* store = store_for( f_data, stored );
+	if( store && store->lookup( stored, n, x, m, result, grad ) )
+		return;
+	if( ctx )
+	{
+		const double marshal = profile_now();
+		lua_rawgeti( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
+		const int t = lua_gettop( ctx->L );
+
+		lua_pushliteral( ctx->L, "f" );
+		lua_rawget( ctx->L, t );
+		if( !lua_isfunction( ctx->L, -1 ) )
+		{
+			lua_pop( ctx->L, 2 ); // t, f
+			const double res = callback_failed( "constraint is not a function", true );
+			for( unsigned int j = 0; j < m; j++ )
+				result[j] = res;
+			return;
+		}
+
+		lua_pushinteger( ctx->L, m );
+
+		// The content of result is undefined on entry and is overwritten by the callback;
+		// the table is only initialized when created.
+		lua_pushliteral( ctx->L, "result" );
+		lua_rawget( ctx->L, t );
+		unsigned int i;
+		if( !lua_istable( ctx->L, -1 ) )
+		{
+			lua_pop( ctx->L, 1 );
+			lua_createtable( ctx->L, m, 0 );
+			lua_pushliteral( ctx->L, "result" );
+			lua_pushvalue( ctx->L, -2 );
+			lua_rawset( ctx->L, t );
+			for( i = 0; i < m; i++ )
+			{
+				lua_pushnumber( ctx->L, 0.0 );
+				lua_rawseti( ctx->L, -2, i + 1 );
+			}
+		}
+		// stack: t, f, m, result
+
+		lua_pushinteger( ctx->L, n );
+
+		push_x( ctx, t, n, x );
+		// stack: t, f, m, result, n, x
+		if( grad )
+		{
+			lua_pushliteral( ctx->L, "grad" );
+			lua_rawget( ctx->L, t );
+			if( !lua_istable( ctx->L, -1 ) )
+			{
+				lua_pop( ctx->L, 1 );
+				lua_newtable( ctx->L );
+				lua_pushliteral( ctx->L, "grad" );
+				lua_pushvalue( ctx->L, -2 );
 				lua_rawset( ctx->L, t );
 			}
-			const int gradt = lua_gettop( ctx->L );
-			for( i = 0; i < n; i++ )
+			const int gradt = lua_gettop( ctx->L );
+			for( i = 0; i < ( n * m ); i++ )
+			{
+				lua_pushnumber( ctx->L, grad[i] );
+				lua_rawseti( ctx->L, gradt, i + 1 );
+			}
+		}else
+		{
+			if( !realtime_enabled() )
+			{
+				lua_pushliteral( ctx->L, "grad" );
+				lua_pushnil( ctx->L );
+				lua_rawset( ctx->L, t );
+			}
+			lua_pushnil( ctx->L );
+		}
+		// stack: t, f, m, result, n, x, grad | nil
+		lua_pushliteral( ctx->L, "f_data" );
+		lua_rawget( ctx->L, t );
+		// stack: t, f, m, result, n, x, grad | nil, f_data | nil
+		int rc;
+		bool exceeded;
+		ctx->d_calls++;
+		PROBE3( mfunc_entry, n, m, ctx->d_calls );
+		const double called = profile_now();
+		{
+			eval_guard guard( ctx->L );
+			rc = pcall_traceback( ctx->L, 6, 0 );
+			exceeded = guard.exceeded();
+		}
+		const double returned = profile_now();
+		PROBE4( mfunc_exit, n, m, ctx->d_calls, rc );
+		profile_add( "marshal", marshal, called );
+		profile_add( "mfunc", called, returned );
+		if( rc == 0 )
+		{
+			// stack: t
+			lua_pushliteral( ctx->L, "result" );
+			lua_rawget( ctx->L, t );
+			const int resultt = lua_gettop( ctx->L );
+			for( i = 0; i < m; i++ )
+			{
+				lua_rawgeti( ctx->L, resultt, i + 1 );
+				result[i] = lua_tonumber( ctx->L, -1 );
+				lua_pop( ctx->L, 1 );
+			}
+			if( grad )
+			{
+				lua_pushliteral( ctx->L, "grad" );
+				lua_rawget( ctx->L, t );
+				const int gradt = lua_gettop( ctx->L );
+				for( i = 0; i < ( n * m ); i++ )
+				{
+					lua_rawgeti( ctx->L, gradt, i + 1 );
+					grad[i] = lua_tonumber( ctx->L, -1 );
+					lua_pop( ctx->L, 1 );
+				}
+				lua_pop( ctx->L, 1 );
+			}
+
+			lua_pop( ctx->L, 1 );
+			if( store )
+				store->insert( stored, n, x, m, result, grad );
+			profile_add( "marshal", returned, profile_now() );
+			return;
+		}else
+		{
+			// stack: t, msg
+			// an evaluation aborted by the eval limits is infeasible
+			const double res = ( exceeded ) ? HUGE_VAL : callback_failed( lua_tostring( ctx->L, -1 ), true );
+			lua_pop( ctx->L, 2 );
+			for( i = 0; i < m; i++ )
+				result[i] = res;
+			return;
+		}
+	}else
+	{
+		const double res = callback_failed( "constraint without context", true );
+		for( unsigned int j = 0; j < m; j++ )
+			result[j] = res;
+	}
+}
+
+static int add_inequality_mconstraint( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	const int m = (const int)luaL_checkinteger( L, 2 );
+	luaL_checktype( L, 3, LUA_TFUNCTION );
+	if( !lua_isnil( L, 5 ) && lua_istable( L, 5 ) )
+		luaL_argerror( L, 5, "expecting table or nil" );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 4 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	const double *tol = 0;
+
+	nlopt_result res;
+	if( lua_isnil( L, 5 ) )
+	{
+		res = nlopt_add_inequality_mconstraint( holder->d_obj, m, mfunc, static_cast<func_context*>( ctx ), 0 );
+		if( res > 0 )
+			holder->d_inequality.push_back( registered_func( mfunc, m, static_cast<func_context*>( ctx ), 0 ) );
+	}else
+	{
+		std::vector<double> tol( m );
+		for( int i = 0; i < m; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_gettable( L, 5 );
+			tol[i] = lua_tonumber( L, -1 );
+			lua_pop( L, 1 );
+		}
+		res = nlopt_add_inequality_mconstraint( holder->d_obj, lua_tonumber( L, 2 ), mfunc, static_cast<func_context*>( ctx ), &tol[0] );
+		if( res > 0 )
+			holder->d_inequality.push_back( registered_func( mfunc, m, static_cast<func_context*>( ctx ), &tol[0] ) );
+	}
+	if( res > 0 )
+		holder->d_luaInequality++;
+	lua_pushinteger( L, res );
+
+	return 1;
+}
+
+static int add_equality_mconstraint( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	const int m = (const int)luaL_checkinteger( L, 2 );
+	luaL_checktype( L, 3, LUA_TFUNCTION );
+	if( !lua_isnil( L, 5 ) && lua_istable( L, 5 ) )
+		luaL_argerror( L, 5, "expecting table or nil" );
+
+	callback_context* ctx = new callback_context;
+	ctx->L = L;
+	lua_newtable( L );
+	const int t = lua_gettop( L );
+	lua_pushvalue( L, t );
+	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+	lua_pushliteral( L, "f" );
+	lua_pushvalue( L, 3 );
+	lua_rawset( L, t );
+
+	lua_pushliteral( L, "f_data" );
+	lua_pushvalue( L, 4 );
+	lua_rawset( L, t );
+
+	lua_pop( L, 1 ); // t
+
+	const double *tol = 0;
+
+	nlopt_result res;
+	if( lua_isnil( L, 5 ) )
+	{
+		res = nlopt_add_equality_mconstraint( holder->d_obj, m, mfunc, static_cast<func_context*>( ctx ), 0 );
+		if( res > 0 )
+			holder->d_equality.push_back( registered_func( mfunc, m, static_cast<func_context*>( ctx ), 0 ) );
+	}else
+	{
+		std::vector<double> tol( m );
+		for( int i = 0; i < m; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_gettable( L, 5 );
+			tol[i] = lua_tonumber( L, -1 );
+			lua_pop( L, 1 );
+		}
+		res = nlopt_add_equality_mconstraint( holder->d_obj, lua_tonumber( L, 2 ), mfunc, static_cast<func_context*>( ctx ), &tol[0] );
+		if( res > 0 )
+			holder->d_equality.push_back( registered_func( mfunc, m, static_cast<func_context*>( ctx ), &tol[0] ) );
+	}
+	if( res > 0 )
+		holder->d_luaEquality++;
+	lua_pushinteger( L, res );
+
+	return 1;
+}
+
+static int set_stopval( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double val = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_stopval( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_stopval( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_stopval( holder->d_obj ) );
+	return 1;
+}
+
+static int set_ftol_rel( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double val = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_ftol_rel( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_ftol_rel( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_ftol_rel( holder->d_obj ) );
+	return 1;
+}
+
+static int set_ftol_abs( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double val = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_ftol_abs( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_ftol_abs( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_ftol_abs( holder->d_obj ) );
+	return 1;
+}
+
+static int set_xtol_rel( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double val = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_xtol_rel( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_xtol_rel( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_xtol_rel( holder->d_obj ) );
+	return 1;
+}
+
+static int set_xtol_abs( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, 2 );
+		lb[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	lua_pushinteger( L, nlopt_set_xtol_abs( holder->d_obj, lb ) );
+	return 1;
+}
+
+static int get_xtol_abs( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* lb = holder->scratch( n, tmp );
+	lua_pushinteger( L, nlopt_get_xtol_abs( holder->d_obj, lb ) );
+	lua_createtable( L, n, 0 );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, lb[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 2;
+}
+
+static int set_xtol_abs1( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double tol = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_xtol_abs1( holder->d_obj, tol ) );
+	return 1;
+}
+
+static int set_maxeval( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const int val = luaL_checkinteger( L, 2 );
+	lua_pushinteger( L, nlopt_set_maxeval( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_maxeval( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushinteger( L, nlopt_get_maxeval( holder->d_obj ) );
+	return 1;
+}
+
+static int set_maxtime( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double val = luaL_checknumber( L, 2 );
+	lua_pushinteger( L, nlopt_set_maxtime( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_maxtime( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_maxtime( holder->d_obj ) );
+	return 1;
+}
+
+static int force_stop( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_force_stop( holder->d_obj ) );
+	return 1;
+}
+
+static int set_force_stop( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const int val = luaL_checkinteger( L, 2 );
+	lua_pushinteger( L, nlopt_set_force_stop( holder->d_obj, val ) );
+	return 1;
+}
+
+static int get_force_stop( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushinteger( L, nlopt_get_force_stop( holder->d_obj ) );
+	return 1;
+}
+
+static nlopt_result bayesopt( nlopt_opt_holder* holder, double* x, double* opt_f );
+
+static void prepare_func( const registered_func& f, unsigned int n )
+{
+	if( f.d_data )
+		static_cast<func_context*>( f.d_data )->prepare( n, f.d_m );
+}
+
+static void prepare_realtime( nlopt_opt_holder* holder )
+{
+	const unsigned int n = nlopt_get_dimension( holder->d_obj );
+	holder->d_rtX.resize( n + 1 );
+	holder->d_rtBuf.resize( 2 * n + 1 ); // get_initial_step needs two vectors
+	prepare_func( holder->d_objective, n );
+	size_t i;
+	for( i = 0; i < holder->d_inequality.size(); i++ )
+		prepare_func( holder->d_inequality[i], n );
+	for( i = 0; i < holder->d_equality.size(); i++ )
+		prepare_func( holder->d_equality[i], n );
+}
+
+// Around an optimize call in real-time mode: stops the GC and counts the allocations of Lua;
+// heap allocations of the C++ code are not seen by this counter
+class realtime_guard
+{
+public:
+	realtime_guard( lua_State* L, nlopt_opt_holder* holder ):d_L(L),d_holder(holder)
+	{
+		if( !holder->d_rt.d_on )
+		{
+			d_holder = 0;
+			return;
+		}
+		// objectives set after set_realtime get their tables here, outside the hot path
+		prepare_realtime( holder );
+		if( holder->d_rt.d_gc != GcNone )
+			lua_gc( L, LUA_GCSTOP, 0 );
+		d_oldAlloc = lua_getallocf( L, &d_oldUd );
+		lua_setallocf( L, alloc, this );
+		d_start = now_seconds();
+	}
+	~realtime_guard()
+	{
+		if( d_holder == 0 )
+			return;
+		realtime_stats& st = d_holder->d_rtStats;
+		st.d_lastSeconds = now_seconds() - d_start;
+		if( st.d_lastSeconds > st.d_maxSeconds )
+			st.d_maxSeconds = st.d_lastSeconds;
+		st.d_runs++;
+		lua_setallocf( d_L, d_oldAlloc, d_oldUd );
+		if( d_holder->d_rt.d_gc == GcStep )
+			lua_gc( d_L, LUA_GCSTEP, d_holder->d_rt.d_gcStep );
+		else if( d_holder->d_rt.d_gc == GcPause )
+			lua_gc( d_L, LUA_GCRESTART, 0 );
+	}
+private:
+	static void* alloc( void* ud, void* ptr, size_t osize, size_t nsize )
+	{
+		realtime_guard* g = static_cast<realtime_guard*>( ud );
+		const size_t old = ( ptr ) ? osize : 0;
+		if( nsize > old )
+		{
+			g->d_holder->d_rtStats.d_allocs++;
+			g->d_holder->d_rtStats.d_bytes += double( nsize - old );
+		}
+		return g->d_oldAlloc( g->d_oldUd, ptr, osize, nsize );
+	}
+	lua_State* d_L;
+	nlopt_opt_holder* d_holder;
+	lua_Alloc d_oldAlloc;
+	void* d_oldUd;
+	double d_start;
+};
+
+static nlopt_result run_frozen( nlopt_opt_holder* holder, double* x, double* opt_f, int* evals = 0 );
+
+static void copy_stop_criteria( nlopt_opt from, nlopt_opt to, const std::vector<int>* free )
+{
+	// The tolerances and stop criteria of from; free maps the variables of to to those of
+	// from, 0 if both have the same
+	const unsigned n = nlopt_get_dimension( from ), k = nlopt_get_dimension( to );
+	std::vector<double> v( n + 1 ), vr( k + 1 );
+	nlopt_get_xtol_abs( from, &v[0] );
+	for( unsigned i = 0; i < k; i++ )
+		vr[i] = v[ ( free ) ? ( *free )[i] : i ];
+	nlopt_set_xtol_abs( to, &vr[0] );
+	nlopt_set_stopval( to, nlopt_get_stopval( from ) );
+	nlopt_set_ftol_rel( to, nlopt_get_ftol_rel( from ) );
+	nlopt_set_ftol_abs( to, nlopt_get_ftol_abs( from ) );
+	nlopt_set_xtol_rel( to, nlopt_get_xtol_rel( from ) );
+	nlopt_set_maxeval( to, nlopt_get_maxeval( from ) );
+	nlopt_set_maxtime( to, nlopt_get_maxtime( from ) );
+	nlopt_set_population( to, nlopt_get_population( from ) );
+	nlopt_set_vector_storage( to, nlopt_get_vector_storage( from ) );
+}
+
+static nlopt_result run_optimizer( nlopt_opt_holder* holder, double* x, double* opt_f )
+{
+	PROBE3( optimize_entry, holder, nlopt_get_dimension( holder->d_obj ), holder->d_algorithm );
+	profile_scope prof( "optimize" );
+	if( holder->d_metrics )
+		metrics_run( holder->d_metrics, true );
+	if( holder->d_objective.d_data )
+		static_cast<func_context*>( holder->d_objective.d_data )->start_run();
+	nlopt_result res;
+	if( !holder->d_frozen.empty() )
+		res = run_frozen( holder, x, opt_f );
+	else if( holder->d_algorithm == X_BAYESOPT )
+		res = bayesopt( holder, x, opt_f );
+	else
+		res = nlopt_optimize( holder->d_obj, x, opt_f );
+	if( holder->d_metrics )
+		metrics_run( holder->d_metrics, false );
+	PROBE3( optimize_exit, holder, int( res ), holder->d_errors );
+	return res;
+}
+
+static nlopt_result optimize_holder( lua_State *L, nlopt_opt_holder* holder, double* x, double* opt_f )
+{
+	holder->d_error.clear();
+	holder->d_errors = 0;
+	holder->d_exceeded = 0;
+	realtime_guard rt( L, holder );
+	optimize_run run;
+	begin_run( run, holder );
+	const nlopt_result res = run_optimizer( holder, x, opt_f );
+	end_run( run );
+	return res;
+}
+
+static void raise_run_error( lua_State *L, nlopt_opt_holder* holder )
+{
+	// after the results are pushed; under policy "raise" the first callback error is raised
+	if( holder->d_errors && holder->d_errorPolicy == ErrorRaise )
+	{
+		lua_pushlstring( L, holder->d_error.c_str(), holder->d_error.size() );
+		lua_error( L );
+	}
+}
+
+static int optimize( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	double xs[s_smallDimMax];
+	std::vector<double> xv;
+	double* x = xs;
+	int i;
+	if( holder->d_small )
+		holder->d_small->read( L, 2, xs );
+	else
+	{
+		if( holder->d_rt.d_on && holder->d_rtX.size() > unsigned( n ) )
+			x = &holder->d_rtX[0];
+		else
+		{
+			xv.resize( n + 1 );
+			x = &xv[0];
+		}
+		for( i = 0; i < n; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_gettable( L, 2 );
+			x[i] = lua_tonumber( L, -1 );
+			lua_pop( L, 1 );
+		}
+	}
+	double opt_f;
+	const nlopt_result res = optimize_holder( L, holder, x, &opt_f );
+	lua_pushinteger( L, res );
+	lua_pushnumber( L, opt_f );
+	if( holder->d_small )
+		holder->d_small->write( L, 2, x );
+	else
+		for( i = 0; i < n; i++ )
+		{
+			lua_pushinteger( L, i + 1 );
+			lua_pushnumber( L, x[i] );
+			lua_settable( L, 2 );
+		}
+	raise_run_error( L, holder );
+	return 2;
+}
+
+static int set_local_optimizer( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	nlopt_opt_holder* local_opt = check( L, 2 );
+	const nlopt_result res = nlopt_set_local_optimizer(holder->d_obj, local_opt->d_obj );
+	if( res > 0 )
+	{
+		// NLopt keeps its copy to itself; run_frozen needs the settings of the local optimizer
+		if( holder->d_local )
+			nlopt_destroy( holder->d_local );
+		holder->d_local = nlopt_create( nlopt_get_algorithm( local_opt->d_obj ),
+			nlopt_get_dimension( local_opt->d_obj ) );
+		copy_stop_criteria( local_opt->d_obj, holder->d_local, 0 );
+	}
+	lua_pushinteger( L, res );
+	return 1;
+}
+
+static int set_initial_step( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* dx = holder->scratch( n, tmp );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, 2 );
+		dx[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	const nlopt_result res = nlopt_set_initial_step( holder->d_obj, dx );
+	if( res > 0 )
+		holder->d_warm.d_user.assign( dx, dx + n );
+	lua_pushinteger( L, res );
+	return 1;
+}
+
+static int set_initial_step1( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const double dx = luaL_checknumber( L, 2 );
+	const nlopt_result res = nlopt_set_initial_step1( holder->d_obj, dx );
+	if( res > 0 )
+		holder->d_warm.d_user.assign( nlopt_get_dimension( holder->d_obj ), dx );
+	lua_pushinteger( L, res );
+	return 1;
+}
+
+static int get_initial_step( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> tmp;
+	double* x = holder->scratch( 2 * n, tmp );
+	double* dx = x + n;
+	int i;
+	for( i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, 2 );
+		x[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	lua_pushinteger( L, nlopt_get_initial_step( holder->d_obj, x, dx ) );
+	lua_createtable( L, n, 0 );
+	for( i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, dx[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 2;
+}
+
+static int set_population( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const lua_Integer pop = luaL_checkinteger( L, 2 );
+	if( pop < 0 )
+		luaL_argerror( L, 2, "expecting unsigned integer" );
+	lua_pushinteger( L, nlopt_set_population( holder->d_obj, (unsigned int)pop ) );
+	return 1;
+}
+
+static int set_vector_storage( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const lua_Integer M = luaL_checkinteger( L, 2 );
+	if( M < 0 )
+		luaL_argerror( L, 2, "expecting unsigned integer" );
+	lua_pushinteger( L, nlopt_set_vector_storage( holder->d_obj, (unsigned int)M ) );
+	return 1;
+}
+
+static int set_incremental( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_incremental = lua_toboolean( L, 2 ) != 0;
+	return 0;
+}
+
+static int get_vector_storage( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushnumber( L, nlopt_get_vector_storage( holder->d_obj ) );
+	return 1;
+}
+
+// Datasets and native model objectives
+
+// Binary dataset file: 32 byte header followed by the columns of doubles one after the
+// other (column-major, native byte order); produced by nlopt.dataset.convert_csv.
+static const char s_datasetMagic[8] = { 'N', 'L', 'O', 'P', 'T', 'D', 'S', '1' };
+struct dataset_header
+{
+	char d_magic[8];
+	unsigned int d_cols;
+	unsigned int d_reserved;
+	unsigned long long d_rows;
+	unsigned long long d_padding;
+};
+
+struct dataset_data
+{
+	volatile atomic_t d_refs;
+	mapped_file d_map;
+	std::vector<double> d_owned; // used if the dataset was parsed from CSV
+	const double* d_values;
+	size_t d_rows;
+	unsigned int d_cols;
+
+	dataset_data():d_refs(1),d_values(0),d_rows(0),d_cols(0) {}
+	const double* column( unsigned int c ) const { return d_values + c * d_rows; }
+	void retain() { atomic_increment( &d_refs ); }
+	void release() { if( atomic_decrement( &d_refs ) == 0 ) delete this; }
+};
+
+struct dataset_holder
+{
+	dataset_data* d_data;
+};
+
+static bool parse_csv( const char* path, std::vector<double>& values, size_t& rows, unsigned int& cols, std::string& err )
+{
+	// values are returned column-major
+	FILE* f = fopen( path, "rb" );
+	if( f == 0 )
+	{
+		err = "cannot open file";
+		return false;
+	}
+	std::string text;
+	char buf[8192];
+	size_t len;
+	while( ( len = fread( buf, 1, sizeof(buf), f ) ) > 0 )
+		text.append( buf, len );
+	fclose( f );
+
+	std::vector<double> rowMajor;
+	std::vector<double> line;
+	rows = 0;
+	cols = 0;
+	size_t pos = 0;
+	bool first = true;
+	while( pos < text.size() )
+	{
+		size_t end = text.find( '\n', pos );
+		if( end == std::string::npos )
+			end = text.size();
+		std::string l = text.substr( pos, end - pos );
+		pos = end + 1;
+		line.clear();
+		bool numeric = true;
+		const char* p = l.c_str();
+		while( *p )
+		{
+			while( *p == ' ' || *p == '\t' || *p == ',' || *p == ';' || *p == '\r' )
+				p++;
+			if( *p == 0 )
+				break;
+			char* q;
+			const double v = strtod( p, &q );
+			if( q == p )
+			{
+				numeric = false;
+				break;
+			}
+			line.push_back( v );
+			p = q;
+		}
+		if( !numeric )
+		{
+			if( first )
+			{
+				first = false; // header line
+				continue;
+			}
+			err = "non-numeric value in row " + std::string( l, 0, 40 );
+			return false;
+		}
+		first = false;
+		if( line.empty() )
+			continue;
+		if( cols == 0 )
+			cols = (unsigned int)line.size();
+		else if( line.size() != cols )
+		{
+			err = "rows have different number of columns";
+			return false;
+		}
+		rowMajor.insert( rowMajor.end(), line.begin(), line.end() );
+		rows++;
+	}
+	if( rows == 0 )
+	{
+		err = "no data";
+		return false;
+	}
+	values.resize( rowMajor.size() );
+	for( size_t r = 0; r < rows; r++ )
+		for( unsigned int c = 0; c < cols; c++ )
+			values[ c * rows + r ] = rowMajor[ r * cols + c ];
+	return true;
+}
+
+static dataset_data* check_dataset( lua_State *L, int narg = 1 )
+{
+	return static_cast<dataset_holder*>( luaL_checkudata( L, narg, dataset_metaName ) )->d_data;
+}
+
+static void push_dataset( lua_State *L, dataset_data* data )
+{
+	dataset_holder* holder = static_cast<dataset_holder*>( lua_newuserdata( L, sizeof(dataset_holder) ) );
+	holder->d_data = data;
+	luaL_getmetatable( L, dataset_metaName );
+	lua_setmetatable( L, -2 );
+}
+
+static int dataset_load( lua_State *L )
+{
+	const char* path = luaL_checkstring( L, 1 );
+	dataset_data* data = new dataset_data;
+	if( data->d_map.open( path ) && data->d_map.size() >= sizeof(dataset_header) &&
+		::memcmp( data->d_map.data(), s_datasetMagic, sizeof(s_datasetMagic) ) == 0 )
+	{
+		const dataset_header* h = reinterpret_cast<const dataset_header*>( data->d_map.data() );
+		if( ( data->d_map.size() - sizeof(dataset_header) ) / sizeof(double) / ( h->d_cols ? h->d_cols : 1 ) < h->d_rows )
+		{
+			data->release();
+			luaL_error( L, "dataset '%s' is truncated", path );
+		}
+		data->d_rows = size_t( h->d_rows );
+		data->d_cols = h->d_cols;
+		data->d_values = reinterpret_cast<const double*>( data->d_map.data() + sizeof(dataset_header) );
+	}else
+	{
+		data->d_map.close();
+		std::string err;
+		if( !parse_csv( path, data->d_owned, data->d_rows, data->d_cols, err ) )
+		{
+			data->release();
+			luaL_error( L, "cannot load dataset '%s': %s", path, err.c_str() );
+		}
+		data->d_values = &data->d_owned[0];
+	}
+	push_dataset( L, data );
+	return 1;
+}
+
+static int dataset_convert_csv( lua_State *L )
+{
+	const char* from = luaL_checkstring( L, 1 );
+	const char* to = luaL_checkstring( L, 2 );
+	std::vector<double> values;
+	size_t rows;
+	unsigned int cols;
+	std::string err;
+	if( !parse_csv( from, values, rows, cols, err ) )
+		luaL_error( L, "cannot convert '%s': %s", from, err.c_str() );
+	FILE* f = fopen( to, "wb" );
+	if( f == 0 )
+		luaL_error( L, "cannot create '%s'", to );
+	dataset_header h;
+	::memset( &h, 0, sizeof(h) );
+	::memcpy( h.d_magic, s_datasetMagic, sizeof(s_datasetMagic) );
+	h.d_cols = cols;
+	h.d_rows = rows;
+	const bool ok = fwrite( &h, sizeof(h), 1, f ) == 1 &&
+		fwrite( &values[0], sizeof(double), values.size(), f ) == values.size();
+	fclose( f );
+	if( !ok )
+		luaL_error( L, "error writing '%s'", to );
+	lua_pushinteger( L, lua_Integer( rows ) );
+	lua_pushinteger( L, cols );
+	return 2;
+}
+
+static const luaL_Reg DatasetReg[] =
+{
+	{ "load", dataset_load },
+	{ "convert_csv", dataset_convert_csv },
+	{ NULL,		NULL	}
+};
+
+static int dataset_gc( lua_State *L )
+{
+	dataset_holder* holder = static_cast<dataset_holder*>( luaL_checkudata( L, 1, dataset_metaName ) );
+	if( holder->d_data )
+		holder->d_data->release();
+	holder->d_data = 0;
+	return 0;
+}
+
+static int dataset_tostring( lua_State *L )
+{
+	lua_pushfstring( L, "%s %p", dataset_metaName, lua_touserdata( L, 1 ) );
+	return 1;
+}
+
+static int dataset_rows( lua_State *L )
+{
+	lua_pushinteger( L, lua_Integer( check_dataset( L )->d_rows ) );
+	return 1;
+}
+
+static int dataset_cols( lua_State *L )
+{
+	lua_pushinteger( L, check_dataset( L )->d_cols );
+	return 1;
+}
+
+static int dataset_get( lua_State *L )
+{
+	dataset_data* data = check_dataset( L );
+	const lua_Integer row = luaL_checkinteger( L, 2 );
+	const lua_Integer col = luaL_checkinteger( L, 3 );
+	if( row < 1 || size_t( row ) > data->d_rows )
+		luaL_argerror( L, 2, "row out of range" );
+	if( col < 1 || col > lua_Integer( data->d_cols ) )
+		luaL_argerror( L, 3, "column out of range" );
+	lua_pushnumber( L, data->column( (unsigned int)col - 1 )[ row - 1 ] );
+	return 1;
+}
+
+enum model_kind { model_linear, model_polynomial, model_exp_decay, model_lorentzian, model_gaussian };
+
+// Weighted least squares of a model over the rows of a dataset. The rows are processed in
+// blocks of fixed size; each block yields a partial loss and gradient which are summed up
+// in block order, so the result does not depend on the number of threads.
+struct model_context : public func_context
+{
+	enum { BlockSize = 2048 };
+	dataset_data* d_data;
+	model_kind d_kind;
+	unsigned int d_params;
+	unsigned int d_peaks;
+	bool d_baseline;
+	unsigned int d_xcol, d_ycol;
+	int d_wcol; // -1 if unweighted
+	int d_threads;
+	thread_pool* d_pool;
+	std::vector<double> d_partials; // per block: loss, grad[ d_params ]
+	std::vector<double> d_scratch; // per worker: model[ BlockSize ], wr[ BlockSize ], jac[ d_params ][ BlockSize ]
+
+	model_context():d_data(0),d_pool(0) {}
+	~model_context()
+	{
+		delete d_pool;
+		if( d_data )
+			d_data->release();
+	}
+	func_context* clone() const
+	{
+		model_context* ctx = new model_context;
+		ctx->d_data = d_data;
+		d_data->retain();
+		ctx->d_kind = d_kind;
+		ctx->d_params = d_params;
+		ctx->d_peaks = d_peaks;
+		ctx->d_baseline = d_baseline;
+		ctx->d_xcol = d_xcol;
+		ctx->d_ycol = d_ycol;
+		ctx->d_wcol = d_wcol;
+		ctx->d_threads = d_threads;
+		return ctx;
+	}
+	size_t blocks() const { return ( d_data->d_rows + BlockSize - 1 ) / BlockSize; }
+	size_t scratch_size() const { return ( 2 + d_params ) * size_t( BlockSize ); }
+};
+
+struct model_job
+{
+	model_context* d_ctx;
+	const double* d_p;
+	bool d_grad;
+};
+
+// The element-wise kernels of the models: no branches in the loops and no aliasing of the
+// arrays, so that the compiler vectorizes them. exp has no vector form in C++03, so it runs
+// as a separate scalar pass over an array of arguments.
+#if defined(_MSC_VER)
+#define LANE_RESTRICT __restrict
+#elif defined(__GNUC__)
+#define LANE_RESTRICT __restrict__
+#else
+#define LANE_RESTRICT
+#endif
+
+static void lane_exp( double* LANE_RESTRICT e, size_t n )
+{
+	for( size_t i = 0; i < n; i++ )
+		e[i] = ::exp( e[i] );
+}
+
+static void lane_lorentzian( const double* LANE_RESTRICT x, size_t n, double a, double c, double s,
+	double* LANE_RESTRICT m )
+{
+	// m += a * s^2 / ( ( x - c )^2 + s^2 )
+	const double s2 = s * s;
+	for( size_t i = 0; i < n; i++ )
+	{
+		const double d = x[i] - c;
+		m[i] += a * ( s2 * ( 1.0 / ( d * d + s2 ) ) ); // as lane_lorentzian_grad
+	}
+}
+
+static void lane_lorentzian_grad( const double* LANE_RESTRICT x, size_t n, double a, double c, double s,
+	double* LANE_RESTRICT m, double* LANE_RESTRICT ja, double* LANE_RESTRICT jc, double* LANE_RESTRICT js )
+{
+	const double s2 = s * s;
+	for( size_t i = 0; i < n; i++ )
+	{
+		const double d = x[i] - c;
+		const double q = 1.0 / ( d * d + s2 );
+		const double l = s2 * q;
+		m[i] += a * l;
+		ja[i] = l;
+		jc[i] = 2.0 * a * l * d * q;
+		js[i] = 2.0 * a * s * q * ( 1.0 - l );
+	}
+}
+
+static void lane_gaussian( const double* LANE_RESTRICT x, size_t n, double a, double c, double s,
+	double* LANE_RESTRICT m, double* LANE_RESTRICT e )
+{
+	// m += a * exp( -( x - c )^2 / ( 2 s^2 ) ); e receives the exp values
+	const double h = -0.5 / ( s * s );
+	size_t i;
+	for( i = 0; i < n; i++ )
+	{
+		const double d = x[i] - c;
+		e[i] = h * d * d;
+	}
+	lane_exp( e, n );
+	for( i = 0; i < n; i++ )
+		m[i] += a * e[i];
+}
+
+static void lane_gaussian_grad( const double* LANE_RESTRICT x, size_t n, double a, double c, double s,
+	const double* LANE_RESTRICT e, double* LANE_RESTRICT jc, double* LANE_RESTRICT js )
+{
+	// from the exp values of lane_gaussian
+	const double is2 = 1.0 / ( s * s );
+	for( size_t i = 0; i < n; i++ )
+	{
+		const double d = x[i] - c;
+		const double ae = a * e[i] * d * is2;
+		jc[i] = ae;
+		js[i] = ae * d / s;
+	}
+}
+
+static inline double lane_dot( const double* a, const double* b, size_t n )
+{
+	// Four independent accumulators; lets the compiler use SIMD without reassociating
+	// the sum, so the result is bitwise reproducible.
+	double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+	size_t i = 0;
+	for( ; i + 4 <= n; i += 4 )
+	{
+		s0 += a[i] * b[i];
+		s1 += a[i+1] * b[i+1];
+		s2 += a[i+2] * b[i+2];
+		s3 += a[i+3] * b[i+3];
+	}
+	for( ; i < n; i++ )
+		s0 += a[i] * b[i];
+	return ( s0 + s1 ) + ( s2 + s3 );
+}
+
+static void model_block( void* arg, int block, int worker )
+{
+	model_job* job = static_cast<model_job*>( arg );
+	model_context* ctx = job->d_ctx;
+	const double* p = job->d_p;
+	const size_t r0 = size_t( block ) * model_context::BlockSize;
+	const size_t len = ( ctx->d_data->d_rows - r0 < size_t( model_context::BlockSize ) ) ?
+		ctx->d_data->d_rows - r0 : size_t( model_context::BlockSize );
+	const double* x = ctx->d_data->column( ctx->d_xcol ) + r0;
+	const double* y = ctx->d_data->column( ctx->d_ycol ) + r0;
+	const double* w = ( ctx->d_wcol >= 0 ) ? ctx->d_data->column( ctx->d_wcol ) + r0 : 0;
+	double* m = &ctx->d_scratch[ worker * ctx->scratch_size() ];
+	double* wr = m + model_context::BlockSize;
+	double* jac = wr + model_context::BlockSize; // jac[k] = jac + k * BlockSize
+	const size_t B = model_context::BlockSize;
+	const bool g = job->d_grad;
+	size_t i;
+	unsigned int k;
+
+	switch( ctx->d_kind )
+	{
+	case model_linear:
+		for( i = 0; i < len; i++ )
+			m[i] = p[0] + p[1] * x[i];
+		if( g )
+			for( i = 0; i < len; i++ )
+			{
+				jac[i] = 1.0;
+				jac[B + i] = x[i];
+			}
+		break;
+	case model_polynomial:
+		for( i = 0; i < len; i++ )
+		{
+			double v = p[ ctx->d_params - 1 ];
+			for( k = ctx->d_params - 1; k > 0; k-- )
+				v = v * x[i] + p[k - 1];
+			m[i] = v;
+		}
+		if( g )
+		{
+			for( i = 0; i < len; i++ )
+				jac[i] = 1.0;
+			for( k = 1; k < ctx->d_params; k++ )
+				for( i = 0; i < len; i++ )
+					jac[k * B + i] = jac[(k - 1) * B + i] * x[i];
+		}
+		break;
+	case model_exp_decay:
+		// p[0] * exp( -p[1] * x ) + p[2]; the exp values go to jac[0], which is free without g
+		for( i = 0; i < len; i++ )
+			jac[i] = -p[1] * x[i];
+		lane_exp( jac, len );
+		for( i = 0; i < len; i++ )
+			m[i] = p[0] * jac[i] + p[2];
+		if( g )
+			for( i = 0; i < len; i++ )
+			{
+				jac[B + i] = -p[0] * x[i] * jac[i];
+				jac[2 * B + i] = 1.0;
+			}
+		break;
+	case model_lorentzian:
+	case model_gaussian:
+		for( i = 0; i < len; i++ )
+			m[i] = ( ctx->d_baseline ) ? p[ ctx->d_params - 1 ] : 0.0;
+		for( k = 0; k < ctx->d_peaks; k++ )
+		{
+			// amplitude, position, width
+			const double a = p[3 * k];
+			const double c = p[3 * k + 1];
+			const double s = p[3 * k + 2];
+			// without g only ja is used, as buffer of the exp values
+			double* ja = jac + ( ( g ) ? 3 * k * B : 0 );
+			double* jc = ja + B;
+			double* js = jc + B;
+			if( ctx->d_kind == model_lorentzian && g )
+				lane_lorentzian_grad( x, len, a, c, s, m, ja, jc, js );
+			else if( ctx->d_kind == model_lorentzian )
+				lane_lorentzian( x, len, a, c, s, m );
+			else
+			{
+				lane_gaussian( x, len, a, c, s, m, ja );
+				if( g )
+					lane_gaussian_grad( x, len, a, c, s, ja, jc, js );
+			}
+		}
+		if( g && ctx->d_baseline )
+			for( i = 0; i < len; i++ )
+				jac[( ctx->d_params - 1 ) * B + i] = 1.0;
+		break;
+	}
+
+	for( i = 0; i < len; i++ )
+		m[i] = y[i] - m[i]; // residual
+	if( w )
+		for( i = 0; i < len; i++ )
+			wr[i] = w[i] * m[i];
+	else
+		for( i = 0; i < len; i++ )
+			wr[i] = m[i];
+	double* out = &ctx->d_partials[ size_t( block ) * ( 1 + ctx->d_params ) ];
+	out[0] = lane_dot( wr, m, len );
+	if( g )
+		for( k = 0; k < ctx->d_params; k++ )
+			out[1 + k] = -2.0 * lane_dot( wr, jac + k * B, len );
+}
+
+static double model_func( unsigned n, const double* x, double* grad, void* f_data )
+{
+	model_context* ctx = static_cast<model_context*>( static_cast<func_context*>( f_data ) );
+	if( stop_requested() )
+		return s_nan;
+	const size_t blocks = ctx->blocks();
+	if( ctx->d_pool == 0 && ctx->d_threads > 1 && blocks > 1 )
+		ctx->d_pool = new thread_pool( ctx->d_threads );
+	const int workers = ( ctx->d_pool ) ? ctx->d_pool->size() : 1;
+	if( ctx->d_scratch.size() < workers * ctx->scratch_size() )
+		ctx->d_scratch.resize( workers * ctx->scratch_size() );
+	ctx->d_partials.resize( blocks * ( 1 + n ) );
+
+	model_job job;
+	job.d_ctx = ctx;
+	job.d_p = x;
+	job.d_grad = grad != 0;
+	if( ctx->d_pool )
+		ctx->d_pool->run( model_block, &job, int( blocks ) );
+	else
+		for( size_t b = 0; b < blocks; b++ )
+			model_block( &job, int( b ), 0 );
+
+	double res = 0.0;
+	if( grad )
+		for( unsigned int k = 0; k < n; k++ )
+			grad[k] = 0.0;
+	for( size_t b = 0; b < blocks; b++ )
+	{
+		const double* part = &ctx->d_partials[ b * ( 1 + n ) ];
+		res += part[0];
+		if( grad )
+			for( unsigned int k = 0; k < n; k++ )
+				grad[k] += part[1 + k];
+	}
+	return eval_done( res );
+}
+
+static int getfieldint( lua_State *L, int t, const char* key, int def )
+{
+	lua_getfield( L, t, key );
+	const int res = ( lua_isnumber( L, -1 ) ) ? int( lua_tointeger( L, -1 ) ) : def;
+	lua_pop( L, 1 );
+	return res;
+}
+
+static int dataset_model( lua_State *L )
+{
+	static const char *const kinds[] = { "linear", "polynomial", "exp_decay", "lorentzian", "gaussian", NULL };
+	dataset_data* data = check_dataset( L );
+	const int kind = luaL_checkoption( L, 2, NULL, kinds );
+	const int opts = 3;
+	if( !lua_isnoneornil( L, opts ) )
+		luaL_checktype( L, opts, LUA_TTABLE );
+	else
+	{
+		lua_newtable( L );
+		lua_replace( L, opts );
+	}
+
+	model_context* ctx = new model_context;
+	ctx->d_data = data;
+	data->retain();
+	ctx->d_kind = model_kind( kind );
+	ctx->d_xcol = (unsigned int)getfieldint( L, opts, "x", 1 ) - 1;
+	ctx->d_ycol = (unsigned int)getfieldint( L, opts, "y", 2 ) - 1;
+	ctx->d_wcol = getfieldint( L, opts, "weight", 0 ) - 1;
+	ctx->d_threads = getfieldint( L, opts, "threads", 1 );
+	ctx->d_peaks = 0;
+	lua_getfield( L, opts, "baseline" );
+	ctx->d_baseline = lua_toboolean( L, -1 ) != 0;
+	lua_pop( L, 1 );
+	switch( ctx->d_kind )
+	{
+	case model_linear:
+		ctx->d_params = 2;
+		break;
+	case model_polynomial:
+		ctx->d_params = (unsigned int)getfieldint( L, opts, "degree", 1 ) + 1;
+		break;
+	case model_exp_decay:
+		ctx->d_params = 3;
+		break;
+	default:
+		ctx->d_peaks = (unsigned int)getfieldint( L, opts, "peaks", 1 );
+		ctx->d_params = 3 * ctx->d_peaks + ( ( ctx->d_baseline ) ? 1 : 0 );
+		break;
+	}
+	const char* err = 0;
+	if( ctx->d_xcol >= data->d_cols || ctx->d_ycol >= data->d_cols || ctx->d_wcol >= int( data->d_cols ) )
+		err = "column out of range";
+	else if( ctx->d_params < 1 || ctx->d_params > 1024 )
+		err = "invalid degree or number of peaks";
+	if( err )
+	{
+		delete ctx;
+		luaL_argerror( L, opts, err );
+	}
+
+	native_objective* obj = static_cast<native_objective*>( lua_newuserdata( L, sizeof(native_objective) ) );
+	obj->d_proto = ctx;
+	obj->d_func = model_func;
+	obj->d_dim = ctx->d_params;
+	luaL_getmetatable( L, objective_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
+
+static const luaL_Reg DatasetMethods[] =
+{
+	{ "model", dataset_model },
+	{ "get", dataset_get },
+	{ "cols", dataset_cols },
+	{ "rows", dataset_rows },
+	{ NULL,	NULL }
+};
+
+static int objective_gc( lua_State *L )
+{
+	native_objective* obj = static_cast<native_objective*>( luaL_checkudata( L, 1, objective_metaName ) );
+	delete obj->d_proto;
+	obj->d_proto = 0;
+	return 0;
+}
+
+static int objective_tostring( lua_State *L )
+{
+	lua_pushfstring( L, "%s %p", objective_metaName, lua_touserdata( L, 1 ) );
+	return 1;
+}
+
+static int objective_dimension( lua_State *L )
+{
+	native_objective* obj = static_cast<native_objective*>( luaL_checkudata( L, 1, objective_metaName ) );
+	lua_pushinteger( L, obj->d_dim );
+	return 1;
+}
+
+static int objective_eval( lua_State *L )
+{
+	// Evaluates the objective at x; returns f and the gradient
+	native_objective* obj = static_cast<native_objective*>( luaL_checkudata( L, 1, objective_metaName ) );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = ( obj->d_dim ) ? int( obj->d_dim ) : int( lua_objlen( L, 2 ) );
+	std::vector<double> x( n + 1 ), grad( n + 1 );
+	int i;
+	for( i = 0; i < n; i++ )
+	{
+		lua_rawgeti( L, 2, i + 1 );
+		x[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	double f;
+	bool failed;
+	{
+		// not an optimize run, so the first error is raised here
+		error_sink sink;
+		sink.d_outer = current_sink();
+		set_current_sink( &sink );
+		f = obj->d_func( n, &x[0], &grad[0], obj->d_proto );
+		set_current_sink( sink.d_outer );
+		failed = sink.d_errors != 0;
+		if( failed )
+			lua_pushlstring( L, sink.d_error.c_str(), sink.d_error.size() );
+	}
+	if( failed )
+		lua_error( L );
+	lua_pushnumber( L, f );
+	lua_createtable( L, n, 0 );
+	for( i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, grad[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 2;
+}
+
+static const luaL_Reg ObjectiveMethods[] =
+{
+	{ "eval", objective_eval },
+	{ "dimension", objective_dimension },
+	{ NULL,	NULL }
+};
+
+// Sum-of-terms objectives evaluated in worker states
+
+// Plain Lua values (nil, boolean, number, string and tables thereof) are copied to the
+// worker states in this simple serialized form.
+static bool serialize_value( lua_State *L, int idx, std::string& out, int depth = 0 )
+{
+	if( idx < 0 )
+		idx = lua_gettop( L ) + idx + 1;
+	const int t = lua_type( L, idx );
+	out += char( t );
+	switch( t )
+	{
+	case LUA_TNIL:
+		return true;
+	case LUA_TBOOLEAN:
+		out += char( lua_toboolean( L, idx ) );
+		return true;
+	case LUA_TNUMBER:
+		{
+			const double d = lua_tonumber( L, idx );
+			out.append( reinterpret_cast<const char*>( &d ), sizeof(d) );
+		}
+		return true;
+	case LUA_TSTRING:
+		{
+			size_t len;
+			const char* s = lua_tolstring( L, idx, &len );
+			out.append( reinterpret_cast<const char*>( &len ), sizeof(len) );
+			out.append( s, len );
+		}
+		return true;
+	case LUA_TTABLE:
+		if( depth > 32 )
+			return false;
+		lua_pushnil( L );
+		while( lua_next( L, idx ) != 0 )
+		{
+			if( !serialize_value( L, -2, out, depth + 1 ) || !serialize_value( L, -1, out, depth + 1 ) )
+			{
+				lua_pop( L, 2 );
+				return false;
+			}
+			lua_pop( L, 1 );
+		}
+		out += char( LUA_TNONE ); // end of table
+		return true;
+	default:
+		return false;
+	}
+}
+
+static const char* deserialize_value( lua_State *L, const char* p )
+{
+	const int t = (signed char)*p++;
+	switch( t )
+	{
+	case LUA_TBOOLEAN:
+		lua_pushboolean( L, *p++ );
+		break;
+	case LUA_TNUMBER:
+		{
+			double d;
+			::memcpy( &d, p, sizeof(d) );
+			p += sizeof(d);
+			lua_pushnumber( L, d );
+		}
+		break;
+	case LUA_TSTRING:
+		{
+			size_t len;
+			::memcpy( &len, p, sizeof(len) );
+			p += sizeof(len);
+			lua_pushlstring( L, p, len );
+			p += len;
+		}
+		break;
+	case LUA_TTABLE:
+		lua_newtable( L );
+		while( (signed char)*p != LUA_TNONE )
+		{
+			p = deserialize_value( L, p );
+			p = deserialize_value( L, p );
+			lua_rawset( L, -3 );
+		}
+		p++;
+		break;
+	default:
+		lua_pushnil( L );
+		break;
+	}
+	return p;
+}
+
+static int dump_writer( lua_State *, const void* p, size_t sz, void* ud )
+{
+	static_cast<std::string*>( ud )->append( static_cast<const char*>( p ), sz );
+	return 0;
+}
+
+// A Lua state with the term function, f_data and the reusable x and grad tables in its registry
+struct term_state
+{
+	lua_State* L;
+	bool d_owned;
+	int d_fn, d_data, d_x, d_grad;
+	std::string d_err;
+
+	term_state():L(0),d_owned(false),d_fn(LUA_NOREF),d_data(LUA_NOREF),d_x(LUA_NOREF),d_grad(LUA_NOREF) {}
+	void init( lua_State* l, bool owned )
+	{
+		// expects function and f_data on top of stack
+		L = l;
+		d_owned = owned;
+		d_data = luaL_ref( L, LUA_REGISTRYINDEX );
+		d_fn = luaL_ref( L, LUA_REGISTRYINDEX );
+		lua_newtable( L );
+		d_x = luaL_ref( L, LUA_REGISTRYINDEX );
+		lua_newtable( L );
+		d_grad = luaL_ref( L, LUA_REGISTRYINDEX );
+	}
+	void done()
+	{
+		if( L == 0 )
+			return;
+		if( d_owned )
+			lua_close( L );
+		else
+		{
+			luaL_unref( L, LUA_REGISTRYINDEX, d_fn );
+			luaL_unref( L, LUA_REGISTRYINDEX, d_data );
+			luaL_unref( L, LUA_REGISTRYINDEX, d_x );
+			luaL_unref( L, LUA_REGISTRYINDEX, d_grad );
+		}
+		L = 0;
+	}
+	void set_x( unsigned n, const double* x )
+	{
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_x );
+		for( unsigned int i = 0; i < n; i++ )
+		{
+			lua_pushnumber( L, x[i] );
+			lua_rawseti( L, -2, i + 1 );
+		}
+		lua_pop( L, 1 );
+	}
+	bool eval( int term, unsigned n, double& f, double* grad )
+	{
+		// calls fn( term, n, x, grad | nil, f_data )
+		unsigned int i;
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_fn );
+		lua_pushinteger( L, term + 1 );
+		lua_pushinteger( L, n );
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_x );
+		if( grad )
+		{
+			lua_rawgeti( L, LUA_REGISTRYINDEX, d_grad );
+			for( i = 0; i < n; i++ )
+			{
+				lua_pushnumber( L, 0.0 );
+				lua_rawseti( L, -2, i + 1 );
+			}
+		}else
+			lua_pushnil( L );
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_data );
+		if( pcall_traceback( L, 5, 1 ) != 0 )
+		{
+			d_err = lua_tostring( L, -1 ) ? lua_tostring( L, -1 ) : "error in term function";
+			if( d_owned )
+				d_err += "\n(the term function runs in a worker state, which only has the standard "
+					"libraries; pass other data in f_data)";
+			lua_pop( L, 1 );
+			return false;
+		}
+		f = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+		if( grad )
+		{
+			lua_rawgeti( L, LUA_REGISTRYINDEX, d_grad );
+			for( i = 0; i < n; i++ )
+			{
+				lua_rawgeti( L, -1, i + 1 );
+				grad[i] = lua_tonumber( L, -1 );
+				lua_pop( L, 1 );
+			}
+			lua_pop( L, 1 );
+		}
+		return true;
+	}
+};
+
+// Objective f( x ) = sum of term( i, x ) for i = 1..num_terms. With more than one thread the
+// terms are distributed over worker states, each running a copy of the term function. The
+// term values are always added in term order, so the result does not depend on the number
+// of threads. The terms are evaluated in rounds; if the terms are non-negative the user may
+// specify a bound (or ask for the best value seen so far) above which a derivative-free
+// evaluation gives up after the current round.
+struct sum_context : public func_context
+{
+	lua_State* L; // the state which registered the objective
+	term_state d_main;
+	int d_terms;
+	int d_threads;
+	int d_round;
+	bool d_hasBound;
+	double d_bound;
+	bool d_abortAboveBest;
+	double d_best;
+	std::string d_code; // dumped term function
+	std::string d_data; // serialized f_data
+	thread_pool* d_pool;
+	std::vector<term_state> d_states;
+	std::vector<double> d_values; // per term
+	std::vector<double> d_grads; // per term
+	volatile atomic_t d_failed; // set by the pool threads
+
+	sum_context():L(0),d_terms(0),d_threads(1),d_round(16),d_hasBound(false),d_bound(HUGE_VAL),
+		d_abortAboveBest(false),d_best(HUGE_VAL),d_pool(0),d_failed(0) {}
+	~sum_context()
+	{
+		delete d_pool;
+		for( size_t i = 0; i < d_states.size(); i++ )
+			d_states[i].done();
+		d_main.done();
+	}
+	func_context* clone() const
+	{
+		sum_context* ctx = new sum_context;
+		ctx->L = L;
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_main.d_fn );
+		lua_rawgeti( L, LUA_REGISTRYINDEX, d_main.d_data );
+		ctx->d_main.init( L, false );
+		ctx->d_terms = d_terms;
+		ctx->d_threads = d_threads;
+		ctx->d_round = d_round;
+		ctx->d_hasBound = d_hasBound;
+		ctx->d_bound = d_bound;
+		ctx->d_abortAboveBest = d_abortAboveBest;
+		ctx->d_code = d_code;
+		ctx->d_data = d_data;
+		return ctx;
+	}
+	bool create_states()
+	{
+		for( int i = 0; i < d_threads; i++ )
+		{
+			lua_State* S = luaL_newstate();
+			if( S == 0 )
+				return false;
+			luaL_openlibs( S );
+			if( luaL_loadbuffer( S, d_code.data(), d_code.size(), "=term" ) != 0 )
+			{
+				lua_close( S );
+				return false;
+			}
+			deserialize_value( S, d_data.data() );
+			d_states.push_back( term_state() );
+			d_states.back().init( S, true );
+		}
+		d_pool = new thread_pool( d_threads );
+		return true;
+	}
+	void start_run()
+	{
+		// the best value of an earlier run is no bound for this one
+		d_best = HUGE_VAL;
+	}
+	std::string failure()
+	{
+		// first message in state order, so that it doesn't depend on thread timing
+		std::string msg = d_main.d_err;
+		d_main.d_err.clear();
+		for( size_t i = 0; i < d_states.size(); i++ )
+		{
+			if( msg.empty() )
+				msg = d_states[i].d_err;
+			d_states[i].d_err.clear();
+		}
+		return msg;
+	}
+};
+
+struct sum_job
+{
+	sum_context* d_ctx;
+	unsigned d_n;
+	const double* d_x;
+	bool d_grad;
+	int d_from, d_to; // terms of the current round
+	int d_chunks;
+};
+
+static void sum_chunk( void* arg, int chunk, int )
+{
+	// chunk i always runs in state i
+	sum_job* job = static_cast<sum_job*>( arg );
+	sum_context* ctx = job->d_ctx;
+	term_state& s = ( ctx->d_states.empty() ) ? ctx->d_main : ctx->d_states[ chunk ];
+	const int len = job->d_to - job->d_from;
+	const int from = job->d_from + int( ( (long long)len * chunk ) / job->d_chunks );
+	const int to = job->d_from + int( ( (long long)len * ( chunk + 1 ) ) / job->d_chunks );
+	if( from < to )
+		s.set_x( job->d_n, job->d_x );
+	for( int i = from; i < to; i++ )
+	{
+		double* g = ( job->d_grad ) ? &ctx->d_grads[ size_t( i ) * job->d_n ] : 0;
+		if( !s.eval( i, job->d_n, ctx->d_values[i], g ) )
+		{
+			atomic_exchange( &ctx->d_failed, 1 );
+			return;
+		}
+	}
+}
+
+static double sum_func( unsigned n, const double* x, double* grad, void* f_data )
+{
+	sum_context* ctx = static_cast<sum_context*>( static_cast<func_context*>( f_data ) );
+	if( ctx->d_threads > 1 && ctx->d_pool == 0 && !ctx->create_states() )
+	{
+		optimize_run* run = current_run();
+		if( run == 0 || run->d_async )
+			return callback_failed( "cannot create worker states" ); // the registering state is not ours
+		ctx->d_threads = 1; // fall back to the registering state
+	}
+	ctx->d_values.resize( ctx->d_terms );
+	if( grad )
+		ctx->d_grads.resize( size_t( ctx->d_terms ) * n );
+	atomic_exchange( &ctx->d_failed, 0 );
+
+	double bound = ( ctx->d_hasBound ) ? ctx->d_bound : HUGE_VAL;
+	if( ctx->d_abortAboveBest && ctx->d_best < bound )
+		bound = ctx->d_best;
+
+	sum_job job;
+	job.d_ctx = ctx;
+	job.d_n = n;
+	job.d_x = x;
+	job.d_grad = grad != 0;
+	double res = 0.0;
+	bool aborted = false;
+	for( int from = 0; from < ctx->d_terms && !aborted; from += ctx->d_round )
+	{
+		job.d_from = from;
+		job.d_to = ( from + ctx->d_round < ctx->d_terms ) ? from + ctx->d_round : ctx->d_terms;
+		job.d_chunks = ( ctx->d_states.empty() ) ? 1 : int( ctx->d_states.size() );
+		if( ctx->d_pool )
+			ctx->d_pool->run( sum_chunk, &job, job.d_chunks );
+		else
+			sum_chunk( &job, 0, 0 );
+		if( atomic_load( &ctx->d_failed ) )
+			return callback_failed( ctx->failure().c_str() );
+		if( stop_requested() )
+			return s_nan;
+		for( int i = job.d_from; i < job.d_to; i++ )
+			res += ctx->d_values[i];
+		if( grad == 0 && res > bound )
+			aborted = true;
+	}
+	if( grad )
+	{
+		for( unsigned int k = 0; k < n; k++ )
+			grad[k] = 0.0;
+		for( int i = 0; i < ctx->d_terms; i++ )
+			for( unsigned int k = 0; k < n; k++ )
+				grad[k] += ctx->d_grads[ size_t( i ) * n + k ];
+	}
+	if( !aborted && res < ctx->d_best )
+		ctx->d_best = res;
+	return eval_done( res );
+}
+
+static int set_min_objective_sum( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	luaL_checktype( L, 2, LUA_TFUNCTION );
+	const lua_Integer terms = luaL_checkinteger( L, 3 );
+	if( terms < 1 )
+		luaL_argerror( L, 3, "expecting positive integer" );
+	const int opts = 4;
+	if( !lua_isnoneornil( L, opts ) )
+		luaL_checktype( L, opts, LUA_TTABLE );
+	else
+	{
+		lua_newtable( L );
+		lua_replace( L, opts );
+	}
+
+	sum_context* ctx = new sum_context;
+	ctx->L = L;
+	ctx->d_terms = int( terms );
+	ctx->d_threads = getfieldint( L, opts, "threads", 1 );
+	if( ctx->d_threads < 1 )
+		ctx->d_threads = 1;
+	ctx->d_round = getfieldint( L, opts, "round", 16 );
+	if( ctx->d_round < 1 )
+		ctx->d_round = 1;
+	lua_getfield( L, opts, "bound" );
+	if( lua_isnumber( L, -1 ) )
+	{
+		ctx->d_hasBound = true;
+		ctx->d_bound = lua_tonumber( L, -1 );
+	}
+	lua_pop( L, 1 );
+	lua_getfield( L, opts, "abort_above_best" );
+	ctx->d_abortAboveBest = lua_toboolean( L, -1 ) != 0;
+	lua_pop( L, 1 );
+
+	const char* err = 0;
+	int errArg = 2;
+	if( ctx->d_threads > 1 )
+	{
+		lua_getfield( L, opts, "f_data" );
+		if( lua_iscfunction( L, 2 ) || lua_getupvalue( L, 2, 1 ) != 0 )
+			err = "term function must be a Lua function without upvalues if threads > 1";
+		else if( !serialize_value( L, -1, ctx->d_data ) )
+		{
+			err = "f_data must only contain nil, booleans, numbers, strings and tables if threads > 1";
+			errArg = opts;
+		}
+		else
+		{
+			// only the bytecode; the worker states don't see the globals of L
+			lua_pushvalue( L, 2 );
+			lua_dump( L, dump_writer, &ctx->d_code );
+			lua_pop( L, 1 );
+		}
+		lua_settop( L, opts );
+	}
+	if( err )
+	{
+		delete ctx;
+		luaL_argerror( L, errArg, err );
+	}
+	lua_pushvalue( L, 2 );
+	lua_getfield( L, opts, "f_data" );
+	ctx->d_main.init( L, false );
+
+	holder->d_maximize = false;
+	forget_history( holder );
+	holder->d_luaObjective = ctx->d_threads <= 1;
+	holder->d_objective = registered_func( sum_func, static_cast<func_context*>( ctx ) );
+	lua_pushinteger( L, nlopt_set_min_objective( holder->d_obj, sum_func, static_cast<func_context*>( ctx ) ) );
+	return 1;
+}
+
+// Cancellation tokens
+
+struct token_holder
+{
+	cancel_flag* d_flag;
+};
+
+static cancel_flag* check_token( lua_State *L, int narg = 1 )
+{
+	return static_cast<token_holder*>( luaL_checkudata( L, narg, token_metaName ) )->d_flag;
+}
+
+static int cancel_token( lua_State *L )
+{
+	// nlopt.cancel_token( [ integer id | { signals = boolean } ] )
+	cancel_flag* flag = 0;
+	if( lua_isnumber( L, 1 ) )
+	{
+		const long id = long( lua_tointeger( L, 1 ) );
+		lock_guard guard( s_tokenLock );
+		std::map<long,cancel_flag*>::const_iterator i = s_tokens.find( id );
+		if( i != s_tokens.end() )
+		{
+			flag = i->second;
+			atomic_increment( &flag->d_refs );
+		}
+	}else
+	{
+		bool signals = true;
+		if( lua_istable( L, 1 ) )
+		{
+			lua_getfield( L, 1, "signals" );
+			if( !lua_isnil( L, -1 ) )
+				signals = lua_toboolean( L, -1 ) != 0;
+			lua_pop( L, 1 );
+		}
+		flag = new cancel_flag;
+		flag->d_refs = 1;
+		flag->d_cancelled = 0;
+		flag->d_epoch = atomic_load( &s_signalEpoch );
+		flag->d_signals = signals;
+		lock_guard guard( s_tokenLock );
+		flag->d_id = ++s_lastTokenId;
+		s_tokens[ flag->d_id ] = flag;
+	}
+	if( flag == 0 )
+		luaL_argerror( L, 1, "no cancel token with this id" );
+	token_holder* holder = static_cast<token_holder*>( lua_newuserdata( L, sizeof(token_holder) ) );
+	holder->d_flag = flag;
+	luaL_getmetatable( L, token_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
+
+static int token_gc( lua_State *L )
+{
+	token_holder* holder = static_cast<token_holder*>( luaL_checkudata( L, 1, token_metaName ) );
+	if( holder->d_flag )
+		holder->d_flag->release();
+	holder->d_flag = 0;
+	return 0;
+}
+
+static int token_tostring( lua_State *L )
+{
+	lua_pushfstring( L, "%s %d", token_metaName, int( check_token( L )->d_id ) );
+	return 1;
+}
+
+static int token_cancel( lua_State *L )
+{
+	atomic_exchange( &check_token( L )->d_cancelled, 1 );
+	return 0;
+}
+
+static int token_reset( lua_State *L )
+{
+	cancel_flag* flag = check_token( L );
+	atomic_exchange( &flag->d_epoch, atomic_load( &s_signalEpoch ) );
+	atomic_exchange( &flag->d_cancelled, 0 );
+	return 0;
+}
+
+static int token_cancelled( lua_State *L )
+{
+	lua_pushboolean( L, check_token( L )->cancelled() );
+	return 1;
+}
+
+static int token_id( lua_State *L )
+{
+	lua_pushinteger( L, check_token( L )->d_id );
+	return 1;
+}
+
+static const luaL_Reg TokenMethods[] =
+{
+	{ "id", token_id },
+	{ "cancelled", token_cancelled },
+	{ "reset", token_reset },
+	{ "cancel", token_cancel },
+	{ NULL,	NULL }
+};
+
+static void on_signal( int )
+{
+	// Only async-signal-safe work here; the handler is reset to the default by the
+	// system, so a second signal terminates the process as usual.
+	atomic_increment( &s_signalEpoch );
+}
+
+static int install_signal_handlers( lua_State * )
+{
+#ifdef _WIN32
+	signal( SIGINT, on_signal );
+	signal( SIGTERM, on_signal );
+#else
+	struct sigaction sa;
+	::memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = on_signal;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGINT, &sa, 0 );
+	sigaction( SIGTERM, &sa, 0 );
+#endif
+	return 0;
+}
+
+static int set_cancel_token( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->set_cancel( ( lua_isnoneornil( L, 2 ) ) ? 0 : check_token( L, 2 ) );
+	return 0;
+}
+
+static int set_error_policy( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_errorPolicy = luaL_checkoption( L, 2, 0, s_errorPolicies );
+	holder->d_penalty = luaL_optnumber( L, 3, HUGE_VAL );
+	return 0;
+}
+
+static int get_error_policy( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_pushstring( L, s_errorPolicies[ holder->d_errorPolicy ] );
+	lua_pushnumber( L, holder->d_penalty );
+	return 2;
+}
+
+static int last_error( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	if( holder->d_errors == 0 )
+		return 0;
+	lua_pushlstring( L, holder->d_error.c_str(), holder->d_error.size() );
+	lua_pushinteger( L, holder->d_errors );
+	return 2;
+}
+
+static int set_eval_limits( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	eval_limits lim;
+	if( !lua_isnoneornil( L, 2 ) )
+	{
+		luaL_checktype( L, 2, LUA_TTABLE );
+		lua_getfield( L, 2, "max_instructions" );
+		lim.d_instructions = lua_tonumber( L, -1 );
+		lua_getfield( L, 2, "max_seconds" );
+		lim.d_seconds = lua_tonumber( L, -1 );
+		lua_getfield( L, 2, "max_memory_kb" );
+		lim.d_memory = lua_tonumber( L, -1 ) * 1024.0;
+		lua_pop( L, 3 );
+	}
+	holder->d_limits = lim;
+	return 0;
+}
+
+static int get_eval_limits( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	lua_createtable( L, 0, 4 );
+	lua_pushnumber( L, holder->d_limits.d_instructions );
+	lua_setfield( L, -2, "max_instructions" );
+	lua_pushnumber( L, holder->d_limits.d_seconds );
+	lua_setfield( L, -2, "max_seconds" );
+	lua_pushnumber( L, holder->d_limits.d_memory / 1024.0 );
+	lua_setfield( L, -2, "max_memory_kb" );
+	lua_pushinteger( L, holder->d_exceeded );
+	lua_setfield( L, -2, "exceeded" );
+	return 1;
+}
+
+// Background optimization
+
+struct async_job
+{
+	nlopt_opt_holder* d_holder; // private copy of the optimizer, destroyed on the Lua thread
+	std::vector<double> d_x;
+	double d_f;
+	nlopt_result d_res;
+	run_progress d_progress;
+	thread_handle d_thread;
+	semaphore d_finished;
+	volatile atomic_t d_done;
+	bool d_started; // d_thread has to be joined
+	sched_job* d_sched;
+
+	async_job( nlopt_opt_holder* holder ):d_holder(holder),d_f(0),d_res(NLOPT_FAILURE),
+		d_progress(holder->d_maximize),d_done(0),d_started(false),d_sched(0) {}
+	~async_job()
+	{
+		nlopt_destroy( d_holder->d_obj );
+		delete d_holder;
+		if( d_sched )
+			d_sched->d_sched->release();
+		delete d_sched;
+	}
+	void join()
+	{
+		if( d_started )
+			d_thread.join();
+		d_started = false;
+	}
+};
+
+static void async_proc( void* arg )
+{
+	async_job* job = static_cast<async_job*>( arg );
+	optimize_run run;
+	job->d_holder->d_error.clear();
+	job->d_holder->d_errors = 0;
+	job->d_holder->d_exceeded = 0;
+	begin_run( run, job->d_holder );
+	run.d_progress = &job->d_progress;
+	run.d_sched = job->d_sched;
+	run.d_async = job->d_started;
+	if( job->d_sched && !job->d_sched->d_sched->acquire( job->d_sched ) )
+		job->d_res = NLOPT_FORCED_STOP;
+	else
+		job->d_res = run_optimizer( job->d_holder, ( job->d_x.empty() ) ? 0 : &job->d_x[0], &job->d_f );
+	if( job->d_sched )
+		job->d_sched->d_sched->leave( job->d_sched );
+	end_run( run );
+	atomic_exchange( &job->d_done, 1 );
+	job->d_finished.post();
+}
+
+static async_job* push_async_job( lua_State *L, nlopt_opt_holder* holder, int xarg )
+{
+	luaL_checktype( L, xarg, LUA_TTABLE );
+	// The job runs on a copy so that the optimizer can be used or collected meanwhile
+	std::map<void*,void*> clones;
+	nlopt_opt obj = copy_opt( holder->d_obj, clones );
+	if( obj == NULL )
+		luaL_error( L, "nlopt_copy out of memory" );
+	nlopt_opt_holder* copy = new nlopt_opt_holder( obj );
+	copy->copy_settings( *holder, clones );
+	copy->d_metrics = metrics_retain( holder->d_metrics );
+
+	async_job** ud = static_cast<async_job**>( lua_newuserdata( L, sizeof(async_job*) ) );
+	*ud = 0;
+	luaL_getmetatable( L, async_metaName );
+	lua_setmetatable( L, -2 );
+	async_job* job = new async_job( copy );
+	*ud = job;
+
+	const int n = nlopt_get_dimension( obj );
+	job->d_x.resize( n );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushinteger( L, i + 1 );
+		lua_gettable( L, xarg );
+		job->d_x[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	return job;
+}
+
+static void start_async_job( async_job* job )
+{
+	// Lua callbacks can only be called on this thread; the optimization then runs here and
+	// the handle is done on return.
+	if( job->d_holder->thread_safe() )
+	{
+		job->d_started = true; // read by async_proc
+		if( !job->d_thread.start( async_proc, job ) )
+			job->d_started = false;
+	}
+	if( !job->d_started )
+		async_proc( job );
+}
+
+static int optimize_async( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	start_async_job( push_async_job( L, holder, 2 ) );
+	return 1;
+}
+
+static async_job* check_async( lua_State *L )
+{
+	async_job* job = *static_cast<async_job**>( luaL_checkudata( L, 1, async_metaName ) );
+	if( job == 0 )
+		luaL_argerror( L, 1, "invalid nlopt_async" );
+	return job;
+}
+
+static bool async_wait( async_job* job, double timeout )
+{
+	if( atomic_load( &job->d_done ) || !job->d_started )
+		return true;
+	if( timeout < 0 )
+		job->d_finished.wait();
+	else if( !job->d_finished.wait( timeout ) )
+		return false;
+	return true;
+}
+
+static int async_gc( lua_State *L )
+{
+	async_job** ud = static_cast<async_job**>( luaL_checkudata( L, 1, async_metaName ) );
+	if( *ud )
+	{
+		// contexts of the copy may refer to this Lua state, so wait for the thread
+		atomic_exchange( &(*ud)->d_progress.d_cancelled, 1 );
+		async_wait( *ud, -1 );
+		(*ud)->join();
+		delete *ud;
+	}
+	*ud = 0;
+	return 0;
+}
+
+static int async_tostring( lua_State *L )
+{
+	async_job* job = check_async( L );
+	lua_pushfstring( L, "%s %p (%s)", async_metaName, job,
+		( atomic_load( &job->d_done ) ) ? "done" : "running" );
+	return 1;
+}
+
+static int async_done( lua_State *L )
+{
+	lua_pushboolean( L, atomic_load( &check_async( L )->d_done ) != 0 );
+	return 1;
+}
+
+static int async_wait( lua_State *L )
+{
+	async_job* job = check_async( L );
+	lua_pushboolean( L, async_wait( job, luaL_optnumber( L, 2, -1 ) ) );
+	return 1;
+}
+
+static int async_cancel( lua_State *L )
+{
+	atomic_exchange( &check_async( L )->d_progress.d_cancelled, 1 );
+	return 0;
+}
+
+static int async_progress( lua_State *L )
+{
+	async_job* job = check_async( L );
+	lua_pushinteger( L, atomic_load( &job->d_progress.d_evals ) );
+	lua_pushnumber( L, job->d_progress.best() );
+	return 2;
+}
+
+static int async_result( lua_State *L )
+{
+	// Same results as optimize; waits until done
+	async_job* job = check_async( L );
+	async_wait( job, -1 );
+	job->join();
+	nlopt_opt_holder* holder = job->d_holder;
+	if( holder->d_errors && holder->d_errorPolicy == ErrorRaise )
+	{
+		lua_pushlstring( L, holder->d_error.c_str(), holder->d_error.size() );
+		lua_error( L );
+	}
+	lua_pushinteger( L, job->d_res );
+	lua_pushnumber( L, job->d_f );
+	const int n = int( job->d_x.size() );
+	lua_createtable( L, n, 0 );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, job->d_x[i] );
+		lua_rawseti( L, -2, i + 1 );
+	}
+	return 3;
+}
+
+static int async_stats( lua_State *L )
+{
+	async_job* job = check_async( L );
+	const long evals = atomic_load( &job->d_progress.d_evals );
+	lua_createtable( L, 0, 8 );
+	lua_pushinteger( L, evals );
+	lua_setfield( L, -2, "evals" );
+	if( job->d_sched )
+	{
+		lock_guard guard( job->d_sched->d_sched->lock() );
+		const sched_job* s = job->d_sched;
+		const double end = ( s->d_end > 0 ) ? s->d_end : now_seconds();
+		const double secs = ( s->d_start > 0 ) ? end - s->d_start : 0.0;
+		lua_pushnumber( L, secs );
+		lua_setfield( L, -2, "seconds" );
+		lua_pushnumber( L, ( secs > 0 ) ? evals / secs : 0.0 );
+		lua_setfield( L, -2, "throughput" );
+		lua_pushnumber( L, s->d_waitTotal );
+		lua_setfield( L, -2, "queue_wait" );
+		lua_pushnumber( L, s->d_waitMax );
+		lua_setfield( L, -2, "queue_wait_max" );
+		lua_pushnumber( L, ( s->d_waits ) ? s->d_waitTotal / s->d_waits : 0.0 );
+		lua_setfield( L, -2, "queue_wait_mean" );
+		lua_pushinteger( L, s->d_yields );
+		lua_setfield( L, -2, "yields" );
+		lua_pushinteger( L, s->d_priority );
+		lua_setfield( L, -2, "priority" );
+	}
+	return 1;
+}
+
+static const luaL_Reg AsyncMethods[] =
+{
+	{ "stats", async_stats },
+	{ "done", async_done },
+	{ "wait", async_wait },
+	{ "result", async_result },
+	{ "cancel", async_cancel },
+	{ "progress", async_progress },
+	{ NULL,	NULL }
+};
+
+// Job scheduler
+
+static core_scheduler* check_scheduler( lua_State *L )
+{
+	core_scheduler* s = *static_cast<core_scheduler**>( luaL_checkudata( L, 1, scheduler_metaName ) );
+	if( s == 0 )
+		luaL_argerror( L, 1, "invalid nlopt_scheduler" );
+	return s;
+}
+
+static int scheduler( lua_State *L )
+{
+	// nlopt.scheduler( { cores = integer } )
+	int cores = hardware_cores();
+	if( !lua_isnoneornil( L, 1 ) )
+	{
+		luaL_checktype( L, 1, LUA_TTABLE );
+		cores = getfieldint( L, 1, "cores", cores );
+		if( cores < 1 )
+			luaL_argerror( L, 1, "cores must be positive" );
+	}
+	core_scheduler** ud = static_cast<core_scheduler**>( lua_newuserdata( L, sizeof(core_scheduler*) ) );
+	*ud = new core_scheduler( cores );
+	luaL_getmetatable( L, scheduler_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
+
+static int scheduler_gc( lua_State *L )
+{
+	// running jobs keep the scheduler alive
+	core_scheduler** ud = static_cast<core_scheduler**>( luaL_checkudata( L, 1, scheduler_metaName ) );
+	if( *ud )
+		(*ud)->release();
+	*ud = 0;
+	return 0;
+}
+
+static int scheduler_tostring( lua_State *L )
+{
+	lua_pushfstring( L, "%s %p", scheduler_metaName, check_scheduler( L ) );
+	return 1;
+}
+
+static int scheduler_submit( lua_State *L )
+{
+	// sched:submit( nlopt_opt, array x, [ { priority = integer, deadline = seconds } ] )
+	core_scheduler* s = check_scheduler( L );
+	nlopt_opt_holder* holder = check( L, 2 );
+	if( !holder->thread_safe() )
+		luaL_argerror( L, 2, "only optimizers without Lua objective and constraint functions can be scheduled" );
+	int priority = 0;
+	double deadline = HUGE_VAL;
+	if( !lua_isnoneornil( L, 4 ) )
+	{
+		luaL_checktype( L, 4, LUA_TTABLE );
+		priority = getfieldint( L, 4, "priority", 0 );
+		lua_getfield( L, 4, "deadline" );
+		if( lua_isnumber( L, -1 ) )
+			deadline = now_seconds() + lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	async_job* job = push_async_job( L, holder, 3 );
+	s->retain();
+	job->d_sched = new sched_job( s, priority, deadline );
+	s->submitted();
+	start_async_job( job );
+	return 1;
+}
+
+static int scheduler_stats( lua_State *L )
+{
+	core_scheduler* s = check_scheduler( L );
+	int cores, running, queued;
+	long submitted, finished;
+	s->stats( cores, running, queued, submitted, finished );
+	lua_createtable( L, 0, 5 );
+	lua_pushinteger( L, cores );
+	lua_setfield( L, -2, "cores" );
+	lua_pushinteger( L, running );
+	lua_setfield( L, -2, "running" );
+	lua_pushinteger( L, queued );
+	lua_setfield( L, -2, "queued" );
+	lua_pushinteger( L, submitted );
+	lua_setfield( L, -2, "submitted" );
+	lua_pushinteger( L, finished );
+	lua_setfield( L, -2, "finished" );
+	return 1;
+}
+
+static const luaL_Reg SchedulerMethods[] =
+{
+	{ "submit", scheduler_submit },
+	{ "stats", scheduler_stats },
+	{ NULL,	NULL }
+};
+
+// Sampling
+
+// Row-major matrix of sample results; each row holds x[1..n], f and the constraint values,
+// inequality constraints first.
+struct sample_matrix
+{
+	int d_rows;
+	int d_cols;
+	int d_n;
+	int d_inequality; // number of inequality constraint columns, then equality columns
+	bool d_maximize;
+	std::vector<double> d_tol; // per constraint column
+	std::vector<double> d_values;
+
+	double* row( int i ) { return &d_values[ size_t( i ) * d_cols ]; }
+	bool feasible( int i )
+	{
+		const double* r = row( i );
+		const double f = r[ d_n ];
+		if( f != f )
+			return false;
+		for( size_t j = 0; j < d_tol.size(); j++ )
+		{
+			const double c = r[ d_n + 1 + j ];
+			if( c != c )
+				return false;
+			if( int( j ) < d_inequality ? c > d_tol[j] : std::fabs( c ) > d_tol[j] )
+				return false;
+		}
+		return true;
+	}
+};
+
+// xorshift64*, so that samples are reproducible on all platforms
+struct sample_rng
+{
+	unsigned long long d_s;
+	explicit sample_rng( unsigned long long seed ):d_s( seed ? seed : 0x9E3779B97F4A7C15ULL ) {}
+	double next()
+	{
+		d_s ^= d_s >> 12;
+		d_s ^= d_s << 25;
+		d_s ^= d_s >> 27;
+		return double( ( d_s * 2685821657736338717ULL ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+	}
+};
+
+// Direction numbers for dimensions 2..21 from Joe and Kuo (new-joe-kuo-6.21201): degree s,
+// coefficients a and the initial m[1..s]
+static const struct { int s; int a; int m[7]; } s_sobol[] =
+{
+	{ 1, 0, { 1 } },
+	{ 2, 1, { 1, 3 } },
+	{ 3, 1, { 1, 3, 1 } },
+	{ 3, 2, { 1, 1, 1 } },
+	{ 4, 1, { 1, 1, 3, 3 } },
+	{ 4, 4, { 1, 3, 5, 13 } },
+	{ 5, 2, { 1, 1, 5, 5, 17 } },
+	{ 5, 4, { 1, 1, 5, 5, 5 } },
+	{ 5, 7, { 1, 1, 7, 11, 19 } },
+	{ 5, 11, { 1, 1, 5, 1, 1 } },
+	{ 5, 13, { 1, 1, 1, 3, 11 } },
+	{ 5, 14, { 1, 3, 5, 5, 31 } },
+	{ 6, 1, { 1, 3, 3, 9, 7, 49 } },
+	{ 6, 13, { 1, 1, 1, 15, 21, 21 } },
+	{ 6, 16, { 1, 3, 1, 13, 27, 49 } },
+	{ 6, 19, { 1, 1, 1, 15, 7, 5 } },
+	{ 6, 22, { 1, 3, 1, 15, 13, 25 } },
+	{ 6, 25, { 1, 1, 5, 5, 19, 61 } },
+	{ 7, 1, { 1, 3, 7, 11, 23, 15, 103 } },
+	{ 7, 4, { 1, 3, 7, 13, 13, 15, 69 } },
+};
+static const int s_sobolMaxDim = 1 + sizeof(s_sobol) / sizeof(s_sobol[0]);
+
+static void sobol_points( int n, int count, double* out, int stride )
+{
+	// Gray code construction; point 0 (the origin) is skipped
+	const int bits = 32;
+	std::vector<unsigned int> v( size_t( n ) * bits );
+	for( int k = 0; k < bits; k++ )
+		v[k] = 1u << ( bits - 1 - k );
+	for( int d = 1; d < n; d++ )
+	{
+		unsigned int* vd = &v[ size_t( d ) * bits ];
+		const int deg = s_sobol[ d - 1 ].s;
+		const int a = s_sobol[ d - 1 ].a;
+		for( int k = 0; k < deg && k < bits; k++ )
+			vd[k] = unsigned( s_sobol[ d - 1 ].m[k] ) << ( bits - 1 - k );
+		for( int k = deg; k < bits; k++ )
+		{
+			vd[k] = vd[ k - deg ] ^ ( vd[ k - deg ] >> deg );
+			for( int j = 1; j < deg; j++ )
+				if( ( a >> ( deg - 1 - j ) ) & 1 )
+					vd[k] ^= vd[ k - j ];
+		}
+	}
+	std::vector<unsigned int> x( n, 0 );
+	for( int i = 0; i < count; i++ )
+	{
+		// index of the lowest zero bit of i
+		int c = 0;
+		for( unsigned int b = unsigned( i ); b & 1; b >>= 1 )
+			c++;
+		double* p = out + size_t( i ) * stride;
+		for( int d = 0; d < n; d++ )
+		{
+			x[d] ^= v[ size_t( d ) * bits + c ];
+			p[d] = double( x[d] ) / 4294967296.0;
+		}
+	}
+}
+
+static void halton_points( int n, int count, double* out, int stride )
+{
+	std::vector<int> primes;
+	for( int c = 2; int( primes.size() ) < n; c++ )
+	{
+		bool prime = true;
+		for( size_t j = 0; j < primes.size() && primes[j] * primes[j] <= c; j++ )
+			if( c % primes[j] == 0 )
+				prime = false;
+		if( prime )
+			primes.push_back( c );
+	}
+	for( int i = 0; i < count; i++ )
+	{
+		double* p = out + size_t( i ) * stride;
+		for( int d = 0; d < n; d++ )
+		{
+			// radical inverse of i + 1, so that the origin is skipped as with Sobol
+			const int b = primes[d];
+			double f = 1.0, r = 0.0;
+			for( int k = i + 1; k > 0; k /= b )
+			{
+				f /= b;
+				r += f * ( k % b );
+			}
+			p[d] = r;
+		}
+	}
+}
+
+static void lhs_points( int n, int count, double* out, int stride, sample_rng& rng )
+{
+	std::vector<int> perm( count );
+	for( int d = 0; d < n; d++ )
+	{
+		for( int i = 0; i < count; i++ )
+			perm[i] = i;
+		for( int i = count - 1; i > 0; i-- )
+		{
+			const int j = int( rng.next() * ( i + 1 ) );
+			std::swap( perm[i], perm[ ( j > i ) ? i : j ] );
+		}
+		for( int i = 0; i < count; i++ )
+			out[ size_t( i ) * stride + d ] = ( perm[i] + rng.next() ) / count;
+	}
+}
+
+// Evaluation workers in forked processes, for objectives which are not thread-safe or may
+// crash. x and the results are exchanged through fixed-size slots in a shared anonymous
+// mapping; the processes only signal each other through two fd based counters.
+#ifdef _WIN32
+class process_pool {};
+
+static void destroy_process_pool( process_pool* )
+{
+	// never created on Windows
+}
+#else
+class fd_counter
+{
+public:
+	fd_counter()
+	{
+#ifdef __linux__
+		d_fd[0] = d_fd[1] = ::eventfd( 0, EFD_SEMAPHORE | EFD_NONBLOCK );
+#else
+		if( ::pipe( d_fd ) != 0 )
+			d_fd[0] = d_fd[1] = -1;
+		else
+			::fcntl( d_fd[0], F_SETFL, O_NONBLOCK );
+#endif
+	}
+	~fd_counter()
+	{
+		if( d_fd[0] >= 0 )
+			::close( d_fd[0] );
+		if( d_fd[1] >= 0 && d_fd[1] != d_fd[0] )
+			::close( d_fd[1] );
+	}
+	bool ok() const { return d_fd[0] >= 0; }
+	void post()
+	{
+#ifdef __linux__
+		const unsigned long long v = 1;
+#else
+		const char v = 0;
+#endif
+		while( ::write( d_fd[1], &v, sizeof(v) ) < 0 && errno == EINTR )
+			;
+	}
+	bool wait( int ms )
+	{
+		// false on timeout or if another process took the count first
+		pollfd p;
+		p.fd = d_fd[0];
+		p.events = POLLIN;
+		p.revents = 0;
+		if( ::poll( &p, 1, ms ) <= 0 )
+			return false;
+#ifdef __linux__
+		unsigned long long v;
+#else
+		char v;
+#endif
+		return ::read( d_fd[0], &v, sizeof(v) ) == ssize_t( sizeof(v) );
+	}
+private:
+	int d_fd[2];
+	fd_counter( const fd_counter& );
+	fd_counter& operator=( const fd_counter& );
+};
+
+// The workers may be forked while other threads of the module run. The locks of the module
+// are taken around fork, so that the child gets them unlocked and the data they guard
+// consistent; the C runtime does the same for malloc.
+static void fork_prepare()
+{
+	s_tokenLock.lock();
+	s_storeLock.lock();
+	s_metricsLock.lock();
+	s_profileLock.lock();
+	s_workerLock.lock();
+}
+
+static void fork_release()
+{
+	s_workerLock.unlock();
+	s_profileLock.unlock();
+	s_metricsLock.unlock();
+	s_storeLock.unlock();
+	s_tokenLock.unlock();
+}
+
+static pthread_once_t s_forkOnce = PTHREAD_ONCE_INIT;
+
+static void install_fork_handlers()
+{
+	pthread_atfork( fork_prepare, fork_release, fork_release );
+}
+
+class process_pool
+{
+public:
+	enum { SlotFree, SlotQueued, SlotDone, SlotRunning }; // SlotRunning + worker index
+	enum { MaxTries = 3 }; // a point which crashed this many workers fails
+	enum { MsgSize = 256 };
+
+	process_pool( int workers, int slots ):d_workers(workers),d_slots(slots),d_evals(0),d_restarts(0),
+		d_requeued(0),d_failed(0),d_map(0),d_mapSize(0),d_state(0),d_quit(0),d_msg(0),d_data(0),d_stride(0),d_n(0),
+		d_generation(0),d_work(0),d_done(0),d_outstanding(0)
+	{
+		pthread_once( &s_forkOnce, install_fork_handlers );
+	}
+	~process_pool() { stop(); }
+	// Evaluates the rows of m with funcs; false if the workers could not be started.
+	// The workers are forked on first use and again if funcs or the generation change.
+	bool run( const std::vector<registered_func>& funcs, unsigned generation, sample_matrix* m )
+	{
+		if( ( d_map == 0 || !same( funcs, generation, m->d_n ) ) && !start( funcs, generation, m->d_n ) )
+			return false;
+		int next = 0;
+		d_outstanding = 0;
+		for( int s = 0; s < d_slots && next < m->d_rows; s++ )
+			queue( s, m, next++ );
+		while( d_outstanding > 0 )
+		{
+			const double waited = profile_now();
+			const bool signalled = d_done->wait( 100 );
+			profile_add( "wait", waited, profile_now() );
+			for( int s = 0; s < d_slots; s++ )
+			{
+				if( atomic_load( &d_state[s] ) != SlotDone )
+					continue;
+				std::copy( slot( s ) + d_n, slot( s ) + d_stride, m->row( d_row[s] ) + d_n );
+				// the worker already applied the error policy to the values
+				if( message( s )[0] )
+					callback_failed( message( s ) );
+				atomic_exchange( &d_state[s], SlotFree );
+				d_outstanding--;
+				d_evals++;
+				if( next < m->d_rows && !stop_requested() && !error_stopped() )
+					queue( s, m, next++ );
+			}
+			if( !signalled )
+			{
+				if( !reap( m ) )
+				{
+					// no worker is left and none can be forked
+					for( int s = 0; s < d_slots; s++ )
+						if( atomic_load( &d_state[s] ) != SlotFree )
+							fail( m, d_row[s], "no evaluation worker could be started" );
+					while( next < m->d_rows )
+						fail( m, next++, "no evaluation worker could be started" );
+					stop();
+					return true;
+				}
+				// a worker may have died between taking a count and a slot
+				for( int s = 0; s < d_slots; s++ )
+					if( atomic_load( &d_state[s] ) == SlotQueued )
+					{
+						d_work->post();
+						break;
+					}
+			}
+		}
+		return true;
+	}
+	int d_workers;
+	int d_slots;
+	double d_evals;
+	int d_restarts;
+	int d_requeued;
+	int d_failed;
+private:
+	double* slot( int s ) { return d_data + size_t( s ) * d_stride; }
+	char* message( int s ) { return d_msg + size_t( s ) * MsgSize; }
+	bool same( const std::vector<registered_func>& funcs, unsigned generation, int n ) const
+	{
+		if( n != d_n || generation != d_generation || funcs.size() != d_funcs.size() )
+			return false;
+		for( size_t k = 0; k < funcs.size(); k++ )
+			if( funcs[k].d_data != d_funcs[k].d_data || funcs[k].d_m != d_funcs[k].d_m )
+				return false;
+		return true;
+	}
+	void queue( int s, sample_matrix* m, int row )
+	{
+		std::copy( m->row( row ), m->row( row ) + d_n, slot( s ) );
+		d_row[s] = row;
+		d_tries[s] = 0;
+		atomic_exchange( &d_state[s], SlotQueued );
+		d_outstanding++;
+		d_work->post();
+	}
+	void fail( sample_matrix* m, int row, const char* msg )
+	{
+		double* r = m->row( row );
+		std::fill( r + d_n, r + d_stride, s_nan );
+		d_failed++;
+		callback_failed( msg );
+	}
+	bool start( const std::vector<registered_func>& funcs, unsigned generation, int n )
+	{
+		stop();
+		d_funcs = funcs;
+		d_generation = generation;
+		d_n = n;
+		d_stride = n;
+		for( size_t k = 0; k < funcs.size(); k++ )
+			d_stride += funcs[k].d_m;
+		// the slot states and the quit flag
+		const size_t states = ( ( d_slots + 1 ) * sizeof(atomic_t) + sizeof(double) - 1 ) / sizeof(double) * sizeof(double);
+		const size_t msgs = size_t( d_slots ) * MsgSize;
+		d_mapSize = states + msgs + size_t( d_slots ) * d_stride * sizeof(double);
+		void* p = ::mmap( 0, d_mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+		if( p == MAP_FAILED )
+			return false;
+		d_map = p;
+		d_state = static_cast<volatile atomic_t*>( p );
+		d_quit = d_state + d_slots;
+		d_msg = static_cast<char*>( p ) + states;
+		d_data = reinterpret_cast<double*>( d_msg + msgs );
+		d_row.assign( d_slots, 0 );
+		d_tries.assign( d_slots, 0 );
+		d_work = new fd_counter;
+		d_done = new fd_counter;
+		d_pids.assign( d_workers, -1 );
+		if( !d_work->ok() || !d_done->ok() )
+		{
+			stop();
+			return false;
+		}
+		for( int w = 0; w < d_workers; w++ )
+			if( !spawn( w ) )
+			{
+				stop();
+				return false;
+			}
+		return true;
+	}
+	void stop()
+	{
+		// asks the workers to quit; those still busy with an evaluation after a grace period
+		// are killed, they keep no state
+		if( d_map )
+		{
+			atomic_exchange( d_quit, 1 );
+			for( size_t w = 0; w < d_pids.size(); w++ )
+				d_work->post();
+		}
+		const double until = now_seconds() + 1.0;
+		for( size_t w = 0; w < d_pids.size(); w++ )
+		{
+			if( d_pids[w] <= 0 )
+				continue;
+			pid_t r;
+			while( ( r = ::waitpid( d_pids[w], 0, WNOHANG ) ) == 0 || ( r < 0 && errno == EINTR ) )
+			{
+				if( now_seconds() > until )
+				{
+					::kill( d_pids[w], SIGKILL );
+					while( ::waitpid( d_pids[w], 0, 0 ) < 0 && errno == EINTR )
+						;
+					break;
+				}
+				::usleep( 5000 );
+			}
+		}
+		d_pids.clear();
+		if( d_map )
+			::munmap( d_map, d_mapSize );
+		d_map = 0;
+		delete d_work;
+		delete d_done;
+		d_work = d_done = 0;
+		d_funcs.clear();
+	}
+	bool spawn( int w )
+	{
+		::fflush( 0 ); // else buffered output would be written twice
+		const pid_t pid = ::fork();
+		if( pid < 0 )
+			return false;
+		if( pid == 0 )
+			worker_main( w );
+		d_pids[w] = pid;
+		return true;
+	}
+	bool reap( sample_matrix* m )
+	{
+		// restarts crashed workers and queues their points again; false if no worker is left
+		int alive = 0;
+		for( int w = 0; w < d_workers; w++ )
+		{
+			if( d_pids[w] > 0 && ::waitpid( d_pids[w], 0, WNOHANG ) == d_pids[w] )
+			{
+				d_restarts++;
+				for( int s = 0; s < d_slots; s++ )
+				{
+					if( atomic_load( &d_state[s] ) != SlotRunning + w )
+						continue;
+					if( ++d_tries[s] >= MaxTries )
+					{
+						fail( m, d_row[s], "evaluation worker crashed" );
+						atomic_exchange( &d_state[s], SlotFree );
+						d_outstanding--;
+					}else
+					{
+						atomic_exchange( &d_state[s], SlotQueued );
+						d_requeued++;
+						d_work->post();
+					}
+				}
+				d_pids[w] = -1;
+			}
+			// also retries workers which could not be forked before
+			if( d_pids[w] <= 0 )
+				spawn( w );
+			if( d_pids[w] > 0 )
+				alive++;
+		}
+		return alive > 0;
+	}
+	void worker_main( int w )
+	{
+		// runs in the child on the copy of the address space; never returns. The errors are
+		// recorded by the copy of the run, as in the parent, and passed on with the results;
+		// the parent also publishes the metrics, the shared segment is not written here. The
+		// threads of the parent are not in the child, so its cores are not shared with them.
+		const pid_t parent = ::getppid();
+		optimize_run* run = current_run();
+		if( run )
+		{
+			run->d_holder->d_metrics = 0;
+			run->d_sched = 0;
+		}
+		for( ;; )
+		{
+			if( ::getppid() != parent || atomic_load( d_quit ) )
+				::_exit( 0 );
+			if( !d_work->wait( 200 ) )
+				continue;
+			for( int s = 0; s < d_slots; s++ )
+			{
+				if( atomic_cas( &d_state[s], SlotQueued, SlotRunning + w ) != SlotQueued )
+					continue;
+				double* x = slot( s );
+				double* res = x + d_n;
+				if( run )
+					run->d_holder->d_errors = 0;
+				for( size_t k = 0; k < d_funcs.size(); k++ )
+				{
+					d_funcs[k].eval( d_n, x, res );
+					res += d_funcs[k].d_m;
+				}
+				char* msg = message( s );
+				msg[0] = 0;
+				if( run && run->d_holder->d_errors )
+				{
+					const std::string& e = run->d_holder->d_error;
+					const size_t len = std::min( e.size(), size_t( MsgSize - 1 ) );
+					::memcpy( msg, e.data(), len );
+					msg[len] = 0;
+					if( len == 0 )
+						::strcpy( msg, "error in callback" );
+				}
+				atomic_exchange( &d_state[s], SlotDone );
+				d_done->post();
+				break;
+			}
+		}
+	}
+	void* d_map;
+	size_t d_mapSize;
+	volatile atomic_t* d_state; // per slot, shared
+	volatile atomic_t* d_quit; // set by stop, shared
+	char* d_msg; // per slot error message of the worker, empty if none, shared
+	double* d_data; // per slot x and results, shared
+	int d_stride;
+	int d_n;
+	unsigned d_generation; // of the functions of the holder the workers were forked with
+	std::vector<registered_func> d_funcs;
+	std::vector<pid_t> d_pids;
+	std::vector<int> d_row; // of the matrix, per slot
+	std::vector<int> d_tries;
+	fd_counter* d_work; // queued points
+	fd_counter* d_done; // finished points
+	int d_outstanding;
+	process_pool( const process_pool& );
+	process_pool& operator=( const process_pool& );
+};
+
+static void destroy_process_pool( process_pool* pool )
+{
+	delete pool;
+}
+#endif
+
+// External simulator objectives
+
+// A long-lived child process running "cmd" through the shell; requests are written to its
+// stdin and replies read from its stdout.
+class child_process
+{
+public:
+	enum { Timeout = -2 }; // of receive
+	double d_timeout; // seconds per reply, 0 = none
+#ifdef _WIN32
+	child_process():d_timeout(0),d_proc(0),d_in(0),d_out(0) {}
+	~child_process() { stop(); }
+	bool running() const { return d_proc != 0; }
+	bool start( const std::string& cmd )
+	{
+		stop();
+		SECURITY_ATTRIBUTES sa;
+		sa.nLength = sizeof(sa);
+		sa.lpSecurityDescriptor = NULL;
+		sa.bInheritHandle = TRUE;
+		HANDLE inR, outW;
+		if( !CreatePipe( &inR, &d_in, &sa, 0 ) )
+			return false;
+		if( !CreatePipe( &d_out, &outW, &sa, 0 ) )
+		{
+			CloseHandle( inR );
+			CloseHandle( d_in );
+			d_in = 0;
+			return false;
+		}
+		SetHandleInformation( d_in, HANDLE_FLAG_INHERIT, 0 );
+		SetHandleInformation( d_out, HANDLE_FLAG_INHERIT, 0 );
+		STARTUPINFOA si;
+		::memset( &si, 0, sizeof(si) );
+		si.cb = sizeof(si);
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = inR;
+		si.hStdOutput = outW;
+		si.hStdError = GetStdHandle( STD_ERROR_HANDLE );
+		const std::string line = "cmd.exe /c " + cmd;
+		std::vector<char> buf( line.begin(), line.end() );
+		buf.push_back( 0 );
+		PROCESS_INFORMATION pi;
+		const BOOL ok = CreateProcessA( NULL, &buf[0], NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi );
+		CloseHandle( inR );
+		CloseHandle( outW );
+		if( !ok )
+		{
+			CloseHandle( d_in );
+			CloseHandle( d_out );
+			d_in = d_out = 0;
+			return false;
+		}
+		CloseHandle( pi.hThread );
+		d_proc = pi.hProcess;
+		d_buf.clear();
+		return true;
+	}
+	void stop()
+	{
+		if( d_proc == 0 )
+			return;
+		CloseHandle( d_in );
+		CloseHandle( d_out );
+		if( WaitForSingleObject( d_proc, 100 ) != WAIT_OBJECT_0 )
+			TerminateProcess( d_proc, 1 );
+		CloseHandle( d_proc );
+		d_proc = d_in = d_out = 0;
+	}
+	bool send( const char* p, size_t len )
+	{
+		while( len > 0 )
+		{
+			DWORD n = 0;
+			if( !WriteFile( d_in, p, DWORD( len ), &n, NULL ) || n == 0 )
+				return false;
+			p += n;
+			len -= n;
+		}
+		return true;
+	}
+private:
+	int receive( char* p, size_t len, int ms )
+	{
+		// anonymous pipes cannot be waited for, so they are polled
+		DWORD avail = 0;
+		for( int waited = 0; ; waited += 5 )
+		{
+			if( !PeekNamedPipe( d_out, NULL, 0, NULL, &avail, NULL ) )
+				return -1;
+			if( avail > 0 )
+				break;
+			if( waited >= ms )
+				return Timeout;
+			Sleep( 5 );
+		}
+		DWORD n = 0;
+		if( !ReadFile( d_out, p, DWORD( ( len < avail ) ? len : avail ), &n, NULL ) )
+			return -1;
+		return int( n );
+	}
+	HANDLE d_proc, d_in, d_out;
+#else
+	child_process():d_timeout(0),d_pid(0),d_owner(0),d_fd(-1) {}
+	~child_process() { stop(); }
+	// a forked evaluation worker does not talk to the children of its parent
+	bool running() const { return d_pid != 0 && d_owner == ::getpid(); }
+	bool start( const std::string& cmd )
+	{
+		stop();
+		// a socket instead of pipes, so a crashed child gives EPIPE instead of SIGPIPE
+		int sv[2];
+		if( ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 )
+			return false;
+		::fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+		const pid_t pid = ::fork();
+		if( pid == 0 )
+		{
+			::dup2( sv[1], 0 );
+			::dup2( sv[1], 1 );
+			::close( sv[0] );
+			::close( sv[1] );
+			::execl( "/bin/sh", "sh", "-c", cmd.c_str(), (char*)0 );
+			::_exit( 127 );
+		}
+		::close( sv[1] );
+		if( pid < 0 )
+		{
+			::close( sv[0] );
+			return false;
+		}
+#ifdef SO_NOSIGPIPE
+		int one = 1;
+		::setsockopt( sv[0], SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+		d_pid = pid;
+		d_owner = ::getpid();
+		d_fd = sv[0];
+		d_buf.clear();
+		return true;
+	}
+	void stop()
+	{
+		if( d_pid == 0 )
+			return;
+		::close( d_fd );
+		if( d_owner == ::getpid() )
+		{
+			// closing stdin ends a well-behaved simulator
+			int status;
+			int i = 0;
+			while( ::waitpid( d_pid, &status, WNOHANG ) == 0 )
+			{
+				if( i++ == 20 )
+				{
+					::kill( d_pid, SIGKILL );
+					::waitpid( d_pid, &status, 0 );
+					break;
+				}
+				::usleep( 5000 );
+			}
+		}
+		d_pid = 0;
+		d_fd = -1;
+	}
+	bool send( const char* p, size_t len )
+	{
+#ifdef MSG_NOSIGNAL
+		const int flags = MSG_NOSIGNAL;
+#else
+		const int flags = 0;
+#endif
+		while( len > 0 )
+		{
+			const ssize_t n = ::send( d_fd, p, len, flags );
+			if( n < 0 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				return false;
+			p += n;
+			len -= size_t( n );
+		}
+		return true;
+	}
+private:
+	int receive( char* p, size_t len, int ms )
+	{
+		pollfd pf;
+		pf.fd = d_fd;
+		pf.events = POLLIN;
+		pf.revents = 0;
+		const int rc = ::poll( &pf, 1, ms );
+		if( rc == 0 || ( rc < 0 && errno == EINTR ) )
+			return Timeout;
+		if( rc < 0 )
+			return -1;
+		ssize_t n;
+		do
+			n = ::recv( d_fd, p, len, 0 );
+		while( n < 0 && errno == EINTR );
+		return int( n );
+	}
+	pid_t d_pid;
+	pid_t d_owner;
+	int d_fd;
+#endif
+public:
+	bool read_exact( char* p, size_t len )
+	{
+		while( d_buf.size() < len )
+			if( !fill() )
+				return false;
+		::memcpy( p, d_buf.data(), len );
+		d_buf.erase( 0, len );
+		return true;
+	}
+	bool read_line( std::string& line )
+	{
+		size_t pos;
+		while( ( pos = d_buf.find( '\n' ) ) == std::string::npos )
+			if( !fill() )
+				return false;
+		line.assign( d_buf, 0, pos );
+		d_buf.erase( 0, pos + 1 );
+		return true;
+	}
+private:
+	bool fill()
+	{
+		// false on errors, after d_timeout and if the running optimizer was cancelled
+		char tmp[4096];
+		const double start = now_seconds();
+		for( ;; )
+		{
+			const int n = receive( tmp, sizeof(tmp), 100 );
+			if( n > 0 )
 			{
-				lua_pushnumber( ctx->L, grad[i] );
-				lua_rawseti( ctx->L, gradt, i + 1 );
+				d_buf.append( tmp, size_t( n ) );
+				return true;
 			}
-		}else
+			if( n != Timeout || cancel_requested() || ( d_timeout > 0 && now_seconds() - start > d_timeout ) )
+				return false;
+		}
+	}
+	std::string d_buf; // received but not yet consumed
+	child_process( const child_process& );
+	child_process& operator=( const child_process& );
+};
+
+// The instances of an external objective; shared by all clones of the objective, so
+// parallel evaluations are distributed over the instances.
+struct external_pool
+{
+	std::string d_cmd;
+	bool d_binary;
+	std::vector<child_process*> d_procs;
+	std::vector<char> d_busy;
+	mutex d_lock;
+	semaphore d_free; // one count per idle instance
+	volatile atomic_t d_refs;
+	volatile atomic_t d_restarts;
+
+	external_pool( const std::string& cmd, bool binary, int instances, double timeout ):
+		d_cmd(cmd),d_binary(binary),d_busy(instances,0),d_refs(1),d_restarts(0)
+	{
+		for( int i = 0; i < instances; i++ )
 		{
-			lua_pushliteral( ctx->L, "grad" );
-			lua_pushnil( ctx->L );
-			lua_rawset( ctx->L, t );
-			lua_pushnil( ctx->L );
+			d_procs.push_back( new child_process );
+			d_procs.back()->d_timeout = timeout;
+			d_free.post();
 		}
-		// stack: t, f, n, x, grad | nil
-		lua_pushliteral( ctx->L, "f_data" );
-		lua_rawget( ctx->L, t );
-		// stack: t, f, n, x, grad | nil, f_data | nil
-		if( lua_pcall( ctx->L, 4, 1, 0 ) == 0 )
+	}
+	~external_pool()
+	{
+		for( size_t i = 0; i < d_procs.size(); i++ )
+			delete d_procs[i];
+	}
+	void retain() { atomic_increment( &d_refs ); }
+	void release()
+	{
+		if( atomic_decrement( &d_refs ) == 0 )
+			delete this;
+	}
+	int acquire()
+	{
+		// an idle instance, or -1 if the running optimizer was cancelled while waiting
+		const double waited = profile_now();
+		while( !d_free.wait( 0.1 ) )
+			if( cancel_requested() )
+				return -1;
+		profile_add( "queue wait", waited, profile_now() );
+		return take();
+	}
+	void acquire_idle( std::vector<int>& out )
+	{
+		// at least one instance and all others idle right now; waiting for more than one
+		// could deadlock with another batch holding the rest
+		out.clear();
+		const int i = acquire();
+		if( i < 0 )
+			return;
+		out.push_back( i );
+		while( d_free.wait( 0.0 ) )
+			out.push_back( take() );
+	}
+	void release( int i )
+	{
 		{
-			// stack: t, res
-			const double res = lua_tonumber( ctx->L, -1 );
-			lua_pop( ctx->L, 1 );
-			// stack: t
-			if( grad )
+			lock_guard guard( d_lock );
+			d_busy[i] = 0;
+		}
+		d_free.post();
+	}
+	bool ensure( int i )
+	{
+		child_process* p = d_procs[i];
+		return p->running() || p->start( d_cmd );
+	}
+	bool request( int i, unsigned n, const double* x, bool grad )
+	{
+		if( d_binary )
+		{
+			std::vector<char> buf( sizeof(int) + n * sizeof(double) );
+			const int flag = ( grad ) ? 1 : 0;
+			::memcpy( &buf[0], &flag, sizeof(int) );
+			if( n > 0 )
+				::memcpy( &buf[ sizeof(int) ], x, n * sizeof(double) );
+			return d_procs[i]->send( &buf[0], buf.size() );
+		}
+		std::string line = ( grad ) ? "1" : "0";
+		char tmp[32];
+		for( unsigned int k = 0; k < n; k++ )
+		{
+			::sprintf( tmp, " %.17g", x[k] );
+			line += tmp;
+		}
+		line += '\n';
+		return d_procs[i]->send( line.data(), line.size() );
+	}
+	bool reply( int i, unsigned n, double& f, double* grad )
+	{
+		child_process* p = d_procs[i];
+		if( d_binary )
+			return p->read_exact( (char*)&f, sizeof(double) ) &&
+				( grad == 0 || n == 0 || p->read_exact( (char*)grad, n * sizeof(double) ) );
+		std::string line;
+		if( !p->read_line( line ) )
+			return false;
+		const char* s = line.c_str();
+		char* end;
+		f = ::strtod( s, &end );
+		if( end == s )
+			return false;
+		if( grad )
+			for( unsigned int k = 0; k < n; k++ )
 			{
-				lua_pushliteral( ctx->L, "grad" );
-				lua_rawget( ctx->L, t );
-				const int gradt = lua_gettop( ctx->L );
-				for( i = 0; i < n; i++ )
-				{
-					lua_rawgeti( ctx->L, gradt, i + 1 );
-					grad[i] = lua_tonumber( ctx->L, -1 );
-					lua_pop( ctx->L, 1 );
-				}
-				lua_pop( ctx->L, 1 );
+				s = end;
+				grad[k] = ::strtod( s, &end );
+				if( end == s )
+					return false;
 			}
-			lua_pop( ctx->L, 1 );
-			return res;
-		}else
+		return true;
+	}
+	void restart( int i )
+	{
+		// the stream is out of sync after a failure
+		d_procs[i]->stop();
+		atomic_increment( &d_restarts );
+	}
+private:
+	int take()
+	{
+		// after a count of d_free was taken
+		lock_guard guard( d_lock );
+		for( size_t i = 0; i < d_busy.size(); i++ )
+			if( !d_busy[i] )
+			{
+				d_busy[i] = 1;
+				return int( i );
+			}
+		return -1; // not reached
+	}
+	external_pool( const external_pool& );
+	external_pool& operator=( const external_pool& );
+};
+
+struct external_context : public func_context
+{
+	external_pool* d_pool;
+
+	external_context( external_pool* pool ):d_pool(pool) {}
+	~external_context() { d_pool->release(); }
+	func_context* clone() const
+	{
+		d_pool->retain();
+		return new external_context( d_pool );
+	}
+	bool eval_batch( unsigned n, int count, double* rows, int stride );
+};
+
+static double external_func( unsigned n, const double* x, double* grad, void* f_data )
+{
+	external_context* ctx = static_cast<external_context*>( static_cast<func_context*>( f_data ) );
+	if( stop_requested() )
+		return s_nan;
+	external_pool* pool = ctx->d_pool;
+	const int i = pool->acquire();
+	if( i < 0 )
+		return s_nan;
+	double f = s_nan;
+	bool ok = false;
+	// a crashed instance is restarted and the request repeated once
+	for( int attempt = 0; attempt < 2 && !ok; attempt++ )
+	{
+		if( !pool->ensure( i ) )
+			break;
+		ok = pool->request( i, n, x, grad != 0 ) && pool->reply( i, n, f, grad );
+		if( !ok )
 		{
-			// stack: t, msg
-			lua_pop( ctx->L, 2 );
-			return 0.0; // RISK: Fehler melden?
+			pool->restart( i );
+			if( cancel_requested() )
+				break;
 		}
-	}else
-		return 0.0; // RISK: Fehler melden?
+	}
+	pool->release( i );
+	if( !ok && cancel_requested() )
+		return s_nan;
+	if( !ok )
+		return callback_failed( "external objective did not reply" );
+	return eval_done( f );
 }
 
-static void* munge_on_destroy( void* f_data )
+bool external_context::eval_batch( unsigned n, int count, double* rows, int stride )
 {
-	callback_context* ctx = static_cast<callback_context*>( f_data );
-	if( ctx )
+	// Row r goes to instance r % k of the k instances idle at the start; each instance gets
+	// up to Window requests ahead of its replies, so all simulators stay busy.
+	const int Window = 8;
+	std::vector<int> inst;
+	d_pool->acquire_idle( inst );
+	const int k = int( inst.size() );
+	std::vector<int> sent( k, 0 ), recv( k, 0 ), tries( k, 0 );
+	int j;
+	bool pending = k > 0;
+	while( pending )
 	{
-		luaL_unref( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
-		delete ctx;
+		pending = false;
+		if( cancel_requested() )
+		{
+			// the rows not received yet stay unevaluated; instances with requests in
+			// flight are out of sync
+			for( j = 0; j < k; j++ )
+			{
+				const int total = ( count - j + k - 1 ) / k;
+				if( sent[j] > recv[j] )
+					d_pool->restart( inst[j] );
+				for( ; recv[j] < total; recv[j]++ )
+					rows[ size_t( j + recv[j] * k ) * stride + n ] = s_nan;
+			}
+			break;
+		}
+		for( j = 0; j < k; j++ )
+		{
+			const int total = ( count - j + k - 1 ) / k;
+			if( recv[j] == total )
+				continue;
+			pending = true;
+			bool ok = d_pool->ensure( inst[j] );
+			while( ok && sent[j] < total && sent[j] - recv[j] < Window )
+			{
+				ok = d_pool->request( inst[j], n, rows + size_t( j + sent[j] * k ) * stride, false );
+				sent[j]++;
+			}
+			double* r = rows + size_t( j + recv[j] * k ) * stride;
+			if( ok )
+				ok = d_pool->reply( inst[j], n, r[n], 0 );
+			if( ok )
+			{
+				recv[j]++;
+				tries[j] = 0;
+				continue;
+			}
+			// requeue what was in flight; the oldest request is given up after a repetition
+			d_pool->restart( inst[j] );
+			if( ++tries[j] > 1 && !cancel_requested() )
+			{
+				r[n] = callback_failed( "external objective did not reply" );
+				recv[j]++;
+				tries[j] = 0;
+			}
+			sent[j] = recv[j];
+		}
 	}
-	return 0;
+	for( j = 0; j < k; j++ )
+		d_pool->release( inst[j] );
+	return true;
 }
 
-static void* munge_on_copy( void* f_data )
+static int external_objective( lua_State *L )
 {
-	callback_context* ctx = static_cast<callback_context*>( f_data );
-	if( ctx )
-	{
-		lua_rawgeti( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
-		const int source = lua_gettop( ctx->L );
-		callback_context* ctx_new = new callback_context;
-		ctx_new->L = ctx->L;
-		lua_newtable( ctx->L );
-		const int t = lua_gettop( ctx->L );
-		lua_pushvalue( ctx->L, t );
-		ctx_new->ref = luaL_ref( ctx->L, LUA_REGISTRYINDEX );
+	// nlopt.external_objective( { cmd = string, protocol = "lines"|"binary", instances = integer, dim = integer,
+	//	timeout = seconds } )
+	static const char* protocols[] = { "lines", "binary", 0 };
+	luaL_checktype( L, 1, LUA_TTABLE );
+	lua_getfield( L, 1, "cmd" );
+	const char* cmd = luaL_checkstring( L, -1 );
+	lua_getfield( L, 1, "protocol" );
+	const int protocol = luaL_checkoption( L, -1, "lines", protocols );
+	const int instances = getfieldint( L, 1, "instances", 1 );
+	const int dim = getfieldint( L, 1, "dim", 0 );
+	lua_getfield( L, 1, "timeout" );
+	const double timeout = lua_tonumber( L, -1 );
+	if( instances < 1 || instances > 1024 )
+		luaL_argerror( L, 1, "invalid number of instances" );
+	if( dim < 0 )
+		luaL_argerror( L, 1, "invalid dimension" );
+
+	native_objective* obj = static_cast<native_objective*>( lua_newuserdata( L, sizeof(native_objective) ) );
+	obj->d_proto = new external_context( new external_pool( cmd, protocol == 1, instances, timeout ) );
+	obj->d_func = external_func;
+	obj->d_dim = (unsigned int)dim;
+	luaL_getmetatable( L, objective_metaName );
+	lua_setmetatable( L, -2 );
+	return 1;
+}
 
-		lua_pushliteral( ctx->L, "f" );
-		lua_pushvalue( ctx->L, -1 );
-		lua_rawget( ctx->L, source );
-		lua_rawset( ctx->L, t );
+// Evaluates registered functions at the rows of a sample_matrix. With more than one thread
+// and a thread-safe optimizer, each thread uses its own clones of the functions, kept for
+// further batches; otherwise the rows are evaluated on the calling thread under the settings
+// of the optimizer.
+class batch_evaluator
+{
+public:
+	batch_evaluator( nlopt_opt_holder* holder, const std::vector<registered_func>& funcs, int threads ):
+		d_holder(holder),d_funcs(funcs),d_pool(0),d_m(0),d_caller(0)
+	{
+		if( threads > 1 && holder->thread_safe() )
+		{
+			d_sets.assign( threads, funcs );
+			for( int t = 0; t < threads; t++ )
+				for( size_t k = 0; k < funcs.size(); k++ )
+					d_sets[t][k].d_data = static_cast<func_context*>( funcs[k].d_data )->clone();
+			d_pool = new thread_pool( threads );
+		}
+	}
+	~batch_evaluator()
+	{
+		delete d_pool;
+		for( size_t t = 0; t < d_sets.size(); t++ )
+			for( size_t k = 0; k < d_sets[t].size(); k++ )
+				delete static_cast<func_context*>( d_sets[t][k].d_data );
+	}
+	void run( sample_matrix* m )
+	{
+#ifndef _WIN32
+		// the pool forks, which is only safe from the thread of the Lua state
+		if( d_holder->d_procPool && !( current_run() && current_run()->d_async ) )
+		{
+			optimize_run run;
+			const bool own = current_run() == 0 || current_run()->d_holder != d_holder;
+			if( own )
+				begin_run( run, d_holder );
+			const bool ok = d_holder->d_procPool->run( d_funcs, d_holder->d_generation, m );
+			if( own )
+				end_run( run );
+			if( ok )
+			{
+				for( int i = 0; i < m->d_rows; i++ )
+					eval_done( m->row( i )[ m->d_n ] );
+				return;
+			}
+		}
+#endif
+		if( d_pool )
+		{
+			optimize_run run;
+			const bool own = current_run() == 0 || current_run()->d_holder != d_holder;
+			if( own )
+				begin_run( run, d_holder );
+			d_m = m;
+			d_caller = current_run();
+			d_pool->run( chunk, this, int( d_sets.size() ) );
+			// the progress of a run is written by its own thread only
+			for( int i = 0; i < m->d_rows; i++ )
+				eval_done( m->row( i )[ m->d_n ] );
+			if( own )
+				end_run( run );
+			return;
+		}
+		optimize_run run;
+		const bool own = current_run() == 0 || current_run()->d_holder != d_holder;
+		if( own )
+			begin_run( run, d_holder );
+		if( d_funcs.size() == 1 && d_funcs[0].d_f &&
+			static_cast<func_context*>( d_funcs[0].d_data )->eval_batch( m->d_n, m->d_rows, &m->d_values[0], m->d_cols ) )
+		{
+			for( int i = 0; i < m->d_rows; i++ )
+				eval_done( m->row( i )[ m->d_n ] );
+		}else
+			for( int i = 0; i < m->d_rows; i++ )
+			{
+				if( d_holder->d_errors && d_holder->d_errorPolicy <= ErrorStop )
+					break;
+				rows( m, d_funcs, i, i + 1 );
+			}
+		if( own )
+			end_run( run );
+	}
+private:
+	static void rows( sample_matrix* m, const std::vector<registered_func>& funcs, int from, int to )
+	{
+		for( int i = from; i < to; i++ )
+		{
+			if( cancel_requested() || error_stopped() )
+				break;
+			double* r = m->row( i );
+			double* res = r + m->d_n;
+			for( size_t k = 0; k < funcs.size(); k++ )
+			{
+				funcs[k].eval( m->d_n, r, res );
+				res += funcs[k].d_m;
+			}
+		}
+	}
+	static void chunk( void* arg, int chunk, int )
+	{
+		// chunk i uses the clones of set i; errors, cancel and deadline are those of the caller
+		batch_evaluator* self = static_cast<batch_evaluator*>( arg );
+		optimize_run run = *self->d_caller;
+		run.d_outer = current_run();
+		run.d_guard = 0;
+		run.d_async = true;
+		run.d_worker = true;
+		set_current_run( &run );
+		const int rows = self->d_m->d_rows;
+		const int chunks = int( self->d_sets.size() );
+		batch_evaluator::rows( self->d_m, self->d_sets[ chunk ], int( ( (long long)rows * chunk ) / chunks ),
+			int( ( (long long)rows * ( chunk + 1 ) ) / chunks ) );
+		set_current_run( run.d_outer );
+	}
+	nlopt_opt_holder* d_holder;
+	std::vector<registered_func> d_funcs;
+	std::vector< std::vector<registered_func> > d_sets; // per thread
+	thread_pool* d_pool;
+	sample_matrix* d_m;
+	optimize_run* d_caller; // of the batch in d_pool
+};
 
-		lua_pushliteral( ctx->L, "f_data" );
-		lua_pushvalue( ctx->L, -1 );
-		lua_rawget( ctx->L, source );
-		lua_rawset( ctx->L, t );
-	
-		lua_pop( ctx->L, 2 ); // source and t
-		return ctx_new;
-	}else
-		return NULL;
+static sample_matrix* check_matrix( lua_State *L, int narg = 1 )
+{
+	sample_matrix* m = *static_cast<sample_matrix**>( luaL_checkudata( L, narg, matrix_metaName ) );
+	if( m == 0 )
+		luaL_argerror( L, narg, "invalid nlopt_matrix" );
+	return m;
 }
 
-static int set_min_objective( lua_State *L )
+static int sample( lua_State *L )
 {
+	// opt:sample( { method = "sobol"|"halton"|"lhs", count = integer, threads = integer, seed = integer } )
+	static const char* methods[] = { "sobol", "halton", "lhs", 0 };
 	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TFUNCTION );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	lua_getfield( L, 2, "method" );
+	const int method = luaL_checkoption( L, -1, "sobol", methods );
+	lua_pop( L, 1 );
+	const int count = getfieldint( L, 2, "count", 0 );
+	if( count < 1 )
+		luaL_argerror( L, 2, "count must be positive" );
+	int threads = getfieldint( L, 2, "threads", 1 );
+	lua_getfield( L, 2, "seed" );
+	const unsigned long long seed = (unsigned long long)lua_tonumber( L, -1 );
+	lua_pop( L, 1 );
+	if( holder->d_objective.d_data == 0 )
+		luaL_error( L, "no objective set" );
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	if( method == 0 && n > s_sobolMaxDim )
+		luaL_error( L, "sobol supports up to %d dimensions", s_sobolMaxDim );
+	std::vector<double> lb( n ), ub( n );
+	if( n > 0 )
+	{
+		nlopt_get_lower_bounds( holder->d_obj, &lb[0] );
+		nlopt_get_upper_bounds( holder->d_obj, &ub[0] );
+	}
+	for( int d = 0; d < n; d++ )
+		if( lb[d] == -HUGE_VAL || ub[d] == HUGE_VAL )
+			luaL_error( L, "sampling requires finite bounds" );
+
+	std::vector<registered_func> funcs;
+	funcs.push_back( holder->d_objective );
+	funcs.insert( funcs.end(), holder->d_inequality.begin(), holder->d_inequality.end() );
+	funcs.insert( funcs.end(), holder->d_equality.begin(), holder->d_equality.end() );
+
+	sample_matrix** ud = static_cast<sample_matrix**>( lua_newuserdata( L, sizeof(sample_matrix*) ) );
+	*ud = 0;
+	luaL_getmetatable( L, matrix_metaName );
+	lua_setmetatable( L, -2 );
+	sample_matrix* m = new sample_matrix;
+	*ud = m;
+	m->d_rows = count;
+	m->d_n = n;
+	m->d_maximize = holder->d_maximize;
+	m->d_inequality = 0;
+	for( size_t k = 1; k < funcs.size(); k++ )
+	{
+		if( k <= holder->d_inequality.size() )
+			m->d_inequality += funcs[k].d_m;
+		m->d_tol.insert( m->d_tol.end(), funcs[k].d_tol.begin(), funcs[k].d_tol.end() );
+	}
+	m->d_cols = n + 1 + int( m->d_tol.size() );
+	m->d_values.assign( size_t( count ) * m->d_cols, s_nan );
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 2 );
-	lua_rawset( L, t );
+	if( method == 0 )
+		sobol_points( n, count, &m->d_values[0], m->d_cols );
+	else if( method == 1 )
+		halton_points( n, count, &m->d_values[0], m->d_cols );
+	else
+	{
+		sample_rng rng( seed );
+		lhs_points( n, count, &m->d_values[0], m->d_cols, rng );
+	}
+	for( int i = 0; i < count; i++ )
+	{
+		double* r = m->row( i );
+		for( int d = 0; d < n; d++ )
+			r[d] = lb[d] + r[d] * ( ub[d] - lb[d] );
+	}
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+	if( threads > count )
+		threads = count;
+	holder->d_error.clear();
+	holder->d_errors = 0;
+	holder->d_exceeded = 0;
+	{
+		batch_evaluator eval( holder, funcs, threads );
+		eval.run( m );
+	}
+	if( holder->d_errors && holder->d_errorPolicy == ErrorRaise )
+	{
+		lua_pushlstring( L, holder->d_error.c_str(), holder->d_error.size() );
+		lua_error( L );
+	}
+	return 1;
+}
 
-	lua_pop( L, 1 ); // t
+static int matrix_gc( lua_State *L )
+{
+	sample_matrix** ud = static_cast<sample_matrix**>( luaL_checkudata( L, 1, matrix_metaName ) );
+	delete *ud;
+	*ud = 0;
+	return 0;
+}
 
-	lua_pushinteger( L, nlopt_set_min_objective( holder->d_obj, func, ctx ) );
+static int matrix_tostring( lua_State *L )
+{
+	sample_matrix* m = check_matrix( L );
+	lua_pushfstring( L, "%s %dx%d", matrix_metaName, m->d_rows, m->d_cols );
+	return 1;
+}
+
+static int matrix_rows( lua_State *L )
+{
+	lua_pushinteger( L, check_matrix( L )->d_rows );
+	return 1;
+}
+
+static int matrix_cols( lua_State *L )
+{
+	lua_pushinteger( L, check_matrix( L )->d_cols );
+	return 1;
+}
+
+static int matrix_dimension( lua_State *L )
+{
+	lua_pushinteger( L, check_matrix( L )->d_n );
+	return 1;
+}
+
+static int matrix_get( lua_State *L )
+{
+	sample_matrix* m = check_matrix( L );
+	const lua_Integer i = luaL_checkinteger( L, 2 );
+	const lua_Integer j = luaL_checkinteger( L, 3 );
+	if( i < 1 || i > m->d_rows )
+		luaL_argerror( L, 2, "row out of range" );
+	if( j < 1 || j > m->d_cols )
+		luaL_argerror( L, 3, "column out of range" );
+	lua_pushnumber( L, m->row( int( i - 1 ) )[ j - 1 ] );
+	return 1;
+}
+
+static int matrix_row( lua_State *L )
+{
+	sample_matrix* m = check_matrix( L );
+	const lua_Integer i = luaL_checkinteger( L, 2 );
+	if( i < 1 || i > m->d_rows )
+		luaL_argerror( L, 2, "row out of range" );
+	const double* r = m->row( int( i - 1 ) );
+	lua_createtable( L, m->d_cols, 0 );
+	for( int j = 0; j < m->d_cols; j++ )
+	{
+		lua_pushnumber( L, r[j] );
+		lua_rawseti( L, -2, j + 1 );
+	}
+	return 1;
+}
+
+static int matrix_feasible( lua_State *L )
+{
+	sample_matrix* m = check_matrix( L );
+	const lua_Integer i = luaL_checkinteger( L, 2 );
+	if( i < 1 || i > m->d_rows )
+		luaL_argerror( L, 2, "row out of range" );
+	lua_pushboolean( L, m->feasible( int( i - 1 ) ) );
+	return 1;
+}
+
+struct sample_order
+{
+	sample_matrix* d_m;
+	bool operator()( int a, int b ) const
+	{
+		const double fa = d_m->row( a )[ d_m->d_n ];
+		const double fb = d_m->row( b )[ d_m->d_n ];
+		if( fa != fb )
+			return ( d_m->d_maximize ) ? fa > fb : fa < fb;
+		return a < b;
+	}
+};
 
-	// NOTE: der call ist asynchron; in munge_on_destroy wieder freigegeben.
+static int matrix_best( lua_State *L )
+{
+	// returns the x of the k best feasible rows, best first, usable as start points
+	sample_matrix* m = check_matrix( L );
+	const int k = int( luaL_optinteger( L, 2, 1 ) );
+	std::vector<int> rows;
+	for( int i = 0; i < m->d_rows; i++ )
+		if( m->feasible( i ) )
+			rows.push_back( i );
+	sample_order order;
+	order.d_m = m;
+	std::sort( rows.begin(), rows.end(), order );
+	if( int( rows.size() ) > k )
+		rows.resize( k );
+	lua_createtable( L, int( rows.size() ), 0 );
+	for( size_t r = 0; r < rows.size(); r++ )
+	{
+		const double* x = m->row( rows[r] );
+		lua_createtable( L, m->d_n, 0 );
+		for( int d = 0; d < m->d_n; d++ )
+		{
+			lua_pushnumber( L, x[d] );
+			lua_rawseti( L, -2, d + 1 );
+		}
+		lua_rawseti( L, -2, int( r ) + 1 );
+	}
 	return 1;
 }
 
-static int set_max_objective( lua_State *L )
+static const luaL_Reg MatrixMethods[] =
+{
+	{ "rows", matrix_rows },
+	{ "cols", matrix_cols },
+	{ "dimension", matrix_dimension },
+	{ "get", matrix_get },
+	{ "row", matrix_row },
+	{ "feasible", matrix_feasible },
+	{ "best", matrix_best },
+	{ NULL,	NULL }
+};
+
+// Surrogate
+
+static int set_surrogate( lua_State *L )
 {
+	// opt:set_surrogate( { model = "quadratic"|"rbf", mode = "screen"|"answer", trust = number,
+	//	neighbors = integer, min_history = integer, validate_every = integer } | nil )
+	static const char* models[] = { "quadratic", "rbf", 0 };
+	static const char* modes[] = { "screen", "answer", 0 };
 	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TFUNCTION );
+	delete holder->d_surrogate;
+	holder->d_surrogate = 0;
+	if( lua_isnoneornil( L, 2 ) )
+		return 0;
+	luaL_checktype( L, 2, LUA_TTABLE );
+	lua_getfield( L, 2, "model" );
+	const int model = luaL_checkoption( L, -1, "quadratic", models );
+	lua_getfield( L, 2, "mode" );
+	const int mode = luaL_checkoption( L, -1, "screen", modes );
+	lua_getfield( L, 2, "trust" );
+	const double trust = luaL_optnumber( L, -1, 0.1 );
+	lua_pop( L, 3 );
+	surrogate* sur = new surrogate;
+	sur->d_model = ( model == 0 ) ? surrogate::Quadratic : surrogate::Rbf;
+	sur->d_mode = ( mode == 0 ) ? surrogate::Screen : surrogate::Answer;
+	sur->d_trust = trust;
+	sur->d_neighbors = getfieldint( L, 2, "neighbors", 0 );
+	sur->d_minHistory = getfieldint( L, 2, "min_history", 0 );
+	sur->d_validate = getfieldint( L, 2, "validate_every", 10 );
+	holder->d_surrogate = sur;
+	return 0;
+}
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+static int get_surrogate_stats( lua_State *L )
+{
+	nlopt_opt_holder* holder = check( L, 1 );
+	const surrogate* sur = holder->d_surrogate;
+	if( sur == 0 )
+		return 0;
+	lua_createtable( L, 0, 8 );
+	lua_pushinteger( L, sur->d_calls );
+	lua_setfield( L, -2, "calls" );
+	lua_pushinteger( L, sur->d_hits );
+	lua_setfield( L, -2, "hits" );
+	lua_pushnumber( L, ( sur->d_calls ) ? double( sur->d_hits ) / sur->d_calls : 0.0 );
+	lua_setfield( L, -2, "hit_rate" );
+	lua_pushinteger( L, sur->d_validations );
+	lua_setfield( L, -2, "validations" );
+	lua_pushnumber( L, ( sur->d_validations ) ? sur->d_absErr / sur->d_validations : 0.0 );
+	lua_setfield( L, -2, "mae" );
+	lua_pushnumber( L, ( sur->d_validations ) ? sur->rmse() : 0.0 );
+	lua_setfield( L, -2, "rmse" );
+	lua_pushnumber( L, sur->relative_error() );
+	lua_setfield( L, -2, "relative_error" );
+	lua_pushinteger( L, sur->history() );
+	lua_setfield( L, -2, "history" );
+	return 1;
+}
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 2 );
-	lua_rawset( L, t );
+// Bayesian optimization (X_BAYESOPT)
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+static double normal_pdf( double z )
+{
+	return 0.3989422804014327 * std::exp( -0.5 * z * z );
+}
 
-	lua_pop( L, 1 ); // t
+static double normal_cdf( double z )
+{
+	// Abramowitz and Stegun 26.2.17, error below 7.5e-8; VS 2005 has no erfc
+	const double t = 1.0 / ( 1.0 + 0.2316419 * std::fabs( z ) );
+	const double p = normal_pdf( z ) * t * ( 0.319381530 + t * ( -0.356563782 + t * ( 1.781477937 +
+		t * ( -1.821255978 + t * 1.330274429 ) ) ) );
+	return ( z >= 0 ) ? 1.0 - p : p;
+}
 
-	lua_pushinteger( L, nlopt_set_max_objective( holder->d_obj, func, ctx ) );
+// Gaussian process with Matern 5/2 kernel and one length scale per dimension, on points
+// scaled to the unit cube. The observations are standardized; the Cholesky factor of the
+// covariance matrix is kept packed by rows, so that an observation appends one row.
+class gaussian_process
+{
+public:
+	explicit gaussian_process( int n = 0, double noise = 1e-6 ):d_n(n),d_len(n,0.3),d_noise(noise),
+		d_mean(0),d_sd(1) {}
+	int size() const { return int( d_y.size() ); }
+	int dim() const { return d_n; }
+	double sd() const { return d_sd; }
+	std::vector<double>& length_scales() { return d_len; }
+	double kernel( const double* a, const double* b ) const
+	{
+		double r2 = 0.0;
+		for( int j = 0; j < d_n; j++ )
+		{
+			const double d = ( a[j] - b[j] ) / d_len[j];
+			r2 += d * d;
+		}
+		const double r5 = std::sqrt( 5.0 * r2 );
+		return ( 1.0 + r5 + 5.0 / 3.0 * r2 ) * std::exp( -r5 );
+	}
+	void add( const double* x, double y )
+	{
+		// O(N^2) instead of refactoring
+		d_x.insert( d_x.end(), x, x + d_n );
+		d_y.push_back( y );
+		append_row( size() - 1 );
+		update_alpha();
+	}
+	void refactor()
+	{
+		// after a change of the length scales
+		d_L.clear();
+		for( int i = 0; i < size(); i++ )
+			append_row( i );
+		update_alpha();
+	}
+	void predict( const double* x, double& mu, double& sigma )
+	{
+		const int N = size();
+		d_v.resize( N );
+		double m = 0.0;
+		for( int i = 0; i < N; i++ )
+		{
+			const double k = kernel( x, &d_x[ size_t( i ) * d_n ] );
+			m += k * d_alpha[i];
+			d_v[i] = k;
+		}
+		double var = 1.0;
+		for( int i = 0; i < N; i++ )
+		{
+			const double* Li = &d_L[ row( i ) ];
+			double s = d_v[i];
+			for( int j = 0; j < i; j++ )
+				s -= Li[j] * d_v[j];
+			d_v[i] = s / Li[i];
+			var -= d_v[i] * d_v[i];
+		}
+		mu = d_mean + d_sd * m;
+		sigma = d_sd * std::sqrt( ( var > 0.0 ) ? var : 0.0 );
+	}
+	double log_likelihood() const
+	{
+		double res = 0.0;
+		for( int i = 0; i < size(); i++ )
+			res -= 0.5 * ( d_y[i] - d_mean ) / d_sd * d_alpha[i] + std::log( d_L[ row( i ) + i ] );
+		return res - 0.5 * size() * std::log( 2.0 * 3.14159265358979323846 );
+	}
+private:
+	static size_t row( int i ) { return size_t( i ) * ( i + 1 ) / 2; }
+	void append_row( int i )
+	{
+		const double* xi = &d_x[ size_t( i ) * d_n ];
+		const size_t base = d_L.size();
+		d_L.resize( base + i + 1 );
+		double d = 1.0 + d_noise;
+		for( int j = 0; j < i; j++ )
+		{
+			const double* Lj = &d_L[ row( j ) ];
+			double s = kernel( xi, &d_x[ size_t( j ) * d_n ] );
+			for( int k = 0; k < j; k++ )
+				s -= d_L[ base + k ] * Lj[k];
+			d_L[ base + j ] = s / Lj[j];
+			d -= d_L[ base + j ] * d_L[ base + j ];
+		}
+		d_L[ base + i ] = std::sqrt( ( d > 1e-12 ) ? d : 1e-12 );
+	}
+	void update_alpha()
+	{
+		const int N = size();
+		d_mean = 0.0;
+		for( int i = 0; i < N; i++ )
+			d_mean += d_y[i];
+		d_mean = ( N ) ? d_mean / N : 0.0;
+		double var = 0.0;
+		for( int i = 0; i < N; i++ )
+			var += ( d_y[i] - d_mean ) * ( d_y[i] - d_mean );
+		d_sd = ( N > 1 && var > 0.0 ) ? std::sqrt( var / ( N - 1 ) ) : 1.0;
+		d_alpha.resize( N );
+		for( int i = 0; i < N; i++ )
+		{
+			const double* Li = &d_L[ row( i ) ];
+			double s = ( d_y[i] - d_mean ) / d_sd;
+			for( int j = 0; j < i; j++ )
+				s -= Li[j] * d_alpha[j];
+			d_alpha[i] = s / Li[i];
+		}
+		for( int i = N - 1; i >= 0; i-- )
+		{
+			double s = d_alpha[i];
+			for( int k = i + 1; k < N; k++ )
+				s -= d_L[ row( k ) + i ] * d_alpha[k];
+			d_alpha[i] = s / d_L[ row( i ) + i ];
+		}
+	}
+	int d_n;
+	std::vector<double> d_len;
+	double d_noise;
+	std::vector<double> d_x;
+	std::vector<double> d_y;
+	std::vector<double> d_L;
+	std::vector<double> d_alpha;
+	double d_mean;
+	double d_sd;
+	std::vector<double> d_v; // scratch
+};
 
-	// NOTE: der call ist asynchron; in munge_on_destroy wieder freigegeben.
-	return 1;
+static nlopt_algorithm local_algorithm( int n )
+{
+	// BOBYQA needs at least two dimensions
+	return ( n >= 2 ) ? NLOPT_LN_BOBYQA : NLOPT_LN_COBYLA;
 }
 
-static int add_inequality_constraint( lua_State *L )
+static double gp_likelihood( unsigned n, const double* logLen, double*, void* data )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TFUNCTION );
+	gaussian_process* gp = static_cast<gaussian_process*>( data );
+	for( unsigned j = 0; j < n; j++ )
+		gp->length_scales()[j] = std::exp( logLen[j] );
+	gp->refactor();
+	return gp->log_likelihood();
+}
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+static void fit_length_scales( gaussian_process& gp )
+{
+	// maximum likelihood, with NLopt
+	const int n = gp.dim();
+	std::vector<double> x( n ), lb( n, std::log( 0.01 ) ), ub( n, std::log( 10.0 ) );
+	for( int j = 0; j < n; j++ )
+		x[j] = std::log( gp.length_scales()[j] );
+	const std::vector<double> start = x;
+	nlopt_opt o = nlopt_create( local_algorithm( n ), n );
+	nlopt_set_lower_bounds( o, &lb[0] );
+	nlopt_set_upper_bounds( o, &ub[0] );
+	nlopt_set_max_objective( o, gp_likelihood, &gp );
+	nlopt_set_maxeval( o, 20 * n + 20 );
+	nlopt_set_xtol_rel( o, 1e-3 );
+	double f;
+	if( nlopt_optimize( o, &x[0], &f ) < 0 || f != f )
+		x = start;
+	nlopt_destroy( o );
+	for( int j = 0; j < n; j++ )
+		gp.length_scales()[j] = std::exp( x[j] );
+	gp.refactor();
+}
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 2 );
-	lua_rawset( L, t );
+struct acquisition
+{
+	gaussian_process* d_gp;
+	double d_best; // lowest observation
+	double d_xi;
+};
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+static double expected_improvement( unsigned, const double* x, double*, void* data )
+{
+	acquisition* a = static_cast<acquisition*>( data );
+	double mu, sigma;
+	a->d_gp->predict( x, mu, sigma );
+	if( sigma < 1e-12 )
+		return 0.0;
+	const double imp = a->d_best - mu - a->d_xi * a->d_gp->sd();
+	const double z = imp / sigma;
+	return imp * normal_cdf( z ) + sigma * normal_pdf( z );
+}
 
-	lua_pop( L, 1 ); // t
+static void propose( gaussian_process& gp, double best, const double* bestU, const bayes_settings& set,
+	sample_rng& rng, double* out )
+{
+	// Maximizes the expected improvement: random candidates, then local optimizations from
+	// the best candidates and the best observation.
+	const int n = gp.dim();
+	acquisition acq;
+	acq.d_gp = &gp;
+	acq.d_best = best;
+	acq.d_xi = set.d_xi;
+	const int count = ( 100 * n < 2000 ) ? 100 * n : 2000;
+	std::vector<double> cand( size_t( count ) * n );
+	std::vector<kd_tree::hit> ranked; // -EI, candidate
+	for( int i = 0; i < count; i++ )
+	{
+		double* c = &cand[ size_t( i ) * n ];
+		for( int j = 0; j < n; j++ )
+			c[j] = rng.next();
+		ranked.push_back( kd_tree::hit( -expected_improvement( n, c, 0, &acq ), i ) );
+	}
+	const int starts = ( set.d_restarts < count ) ? set.d_restarts : count;
+	std::partial_sort( ranked.begin(), ranked.begin() + starts, ranked.end() );
+	double bestEi = -ranked[0].first;
+	std::copy( &cand[ size_t( ranked[0].second ) * n ], &cand[ size_t( ranked[0].second ) * n ] + n, out );
+
+	std::vector<double> lb( n, 0.0 ), ub( n, 1.0 ), x( n );
+	nlopt_opt o = nlopt_create( local_algorithm( n ), n );
+	nlopt_set_lower_bounds( o, &lb[0] );
+	nlopt_set_upper_bounds( o, &ub[0] );
+	nlopt_set_max_objective( o, expected_improvement, &acq );
+	nlopt_set_maxeval( o, 50 * n + 50 );
+	nlopt_set_xtol_rel( o, 1e-6 );
+	for( int s = 0; s <= starts; s++ )
+	{
+		if( s < starts )
+			std::copy( &cand[ size_t( ranked[s].second ) * n ], &cand[ size_t( ranked[s].second ) * n ] + n, x.begin() );
+		else if( bestU )
+			x.assign( bestU, bestU + n );
+		else
+			break;
+		double ei;
+		if( nlopt_optimize( o, &x[0], &ei ) > 0 && ei > bestEi )
+		{
+			bestEi = ei;
+			std::copy( x.begin(), x.end(), out );
+		}
+	}
+	nlopt_destroy( o );
+}
 
-	lua_pushinteger( L, nlopt_add_inequality_constraint( holder->d_obj, func, ctx, lua_tonumber( L, 4 ) ) );
+static nlopt_result bayesopt( nlopt_opt_holder* holder, double* x, double* opt_f )
+{
+	const int n = nlopt_get_dimension( holder->d_obj );
+	const double sign = ( holder->d_maximize ) ? -1.0 : 1.0; // we minimize sign * f
+	*opt_f = sign * HUGE_VAL;
+	if( n == 0 || holder->d_objective.d_data == 0 || !holder->d_inequality.empty() || !holder->d_equality.empty() )
+		return NLOPT_INVALID_ARGS;
+	std::vector<double> lb( n ), ub( n );
+	nlopt_get_lower_bounds( holder->d_obj, &lb[0] );
+	nlopt_get_upper_bounds( holder->d_obj, &ub[0] );
+	for( int j = 0; j < n; j++ )
+		if( !( lb[j] > -HUGE_VAL && ub[j] < HUGE_VAL && lb[j] <= ub[j] ) )
+			return NLOPT_INVALID_ARGS;
+	const double stopval = nlopt_get_stopval( holder->d_obj );
+	const double maxtime = nlopt_get_maxtime( holder->d_obj );
+	int maxeval = nlopt_get_maxeval( holder->d_obj );
+	if( maxeval <= 0 && maxtime <= 0 && ( ( holder->d_maximize ) ? stopval == HUGE_VAL : stopval == -HUGE_VAL ) )
+		maxeval = 100; // there is no other convergence criterion
+	const bayes_settings& set = holder->d_bayes;
+	const double start = now_seconds();
+	nlopt_set_force_stop( holder->d_obj, 0 );
+
+	gaussian_process gp( n, set.d_noise );
+	sample_rng rng( set.d_seed );
+	std::vector<registered_func> funcs( 1, holder->d_objective );
+	batch_evaluator eval( holder, funcs, set.d_threads );
+	sample_matrix m;
+	m.d_n = n;
+	m.d_cols = n + 1;
+	m.d_inequality = 0;
+	m.d_maximize = holder->d_maximize;
+
+	// the initial design is x and a low-discrepancy sequence
+	int q = ( set.d_initial > 0 ) ? set.d_initial : ( ( 2 * n + 1 > 5 ) ? 2 * n + 1 : 5 );
+	std::vector<double> batch( size_t( q ) * n );
+	for( int j = 0; j < n; j++ )
+	{
+		const double u = ( ub[j] > lb[j] ) ? ( x[j] - lb[j] ) / ( ub[j] - lb[j] ) : 0.0;
+		batch[j] = ( u < 0.0 ) ? 0.0 : ( ( u > 1.0 ) ? 1.0 : u );
+	}
+	if( q > 1 )
+	{
+		if( n <= s_sobolMaxDim )
+			sobol_points( n, q - 1, &batch[n], n );
+		else
+			halton_points( n, q - 1, &batch[n], n );
+	}
 
-	return 1;
+	double bestY = HUGE_VAL;
+	std::vector<double> bestU;
+	int evals = 0;
+	int sinceFit = 0;
+	nlopt_result res = NLOPT_MAXEVAL_REACHED;
+	for( ;; )
+	{
+		if( maxeval > 0 && evals + q > maxeval )
+			q = maxeval - evals;
+		m.d_rows = q;
+		m.d_values.assign( size_t( q ) * m.d_cols, s_nan );
+		for( int i = 0; i < q; i++ )
+			for( int j = 0; j < n; j++ )
+				m.row( i )[j] = lb[j] + batch[ size_t( i ) * n + j ] * ( ub[j] - lb[j] );
+		eval.run( &m );
+		evals += q;
+		// in the pool threads, cancel and deadline only end the batch; stops the optimizer
+		// here, and a job of a scheduler gives up its core between batches
+		stop_requested();
+		bool stopvalReached = false;
+		for( int i = 0; i < q; i++ )
+		{
+			const double f = m.row( i )[n];
+			if( f != f )
+				continue;
+			const double* u = &batch[ size_t( i ) * n ];
+			gp.add( u, sign * f );
+			sinceFit++;
+			if( sign * f < bestY )
+			{
+				bestY = sign * f;
+				bestU.assign( u, u + n );
+				std::copy( m.row( i ), m.row( i ) + n, x );
+			}
+			if( ( holder->d_maximize ) ? f >= stopval : f <= stopval )
+				stopvalReached = true;
+		}
+		if( nlopt_get_force_stop( holder->d_obj ) )
+		{
+			res = NLOPT_FORCED_STOP;
+			break;
+		}
+		if( stopvalReached )
+		{
+			res = NLOPT_STOPVAL_REACHED;
+			break;
+		}
+		if( maxeval > 0 && evals >= maxeval )
+		{
+			res = NLOPT_MAXEVAL_REACHED;
+			break;
+		}
+		if( maxtime > 0 && now_seconds() - start >= maxtime )
+		{
+			res = NLOPT_MAXTIME_REACHED;
+			break;
+		}
+		if( sinceFit >= set.d_refit && gp.size() > 2 )
+		{
+			fit_length_scales( gp );
+			sinceFit = 0;
+		}
+		// Batch by the constant liar: each proposal is added with the best value so far
+		q = ( set.d_batch > 0 ) ? set.d_batch : 1;
+		batch.resize( size_t( q ) * n );
+		gaussian_process liar( gp );
+		for( int i = 0; i < q; i++ )
+		{
+			double* u = &batch[ size_t( i ) * n ];
+			propose( liar, bestY, ( bestU.empty() ) ? 0 : &bestU[0], set, rng, u );
+			if( i + 1 < q )
+				liar.add( u, ( bestY < HUGE_VAL ) ? bestY : 0.0 );
+		}
+	}
+	if( bestY < HUGE_VAL )
+		*opt_f = sign * bestY;
+	return res;
 }
 
-static int add_equality_constraint( lua_State *L )
+static int set_bayesopt( lua_State *L )
 {
+	// opt:set_bayesopt( { initial, batch, threads, restarts, refit, noise, xi, seed } )
 	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TFUNCTION );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	bayes_settings& set = holder->d_bayes;
+	set.d_initial = getfieldint( L, 2, "initial", set.d_initial );
+	set.d_batch = getfieldint( L, 2, "batch", set.d_batch );
+	set.d_threads = getfieldint( L, 2, "threads", set.d_threads );
+	set.d_restarts = getfieldint( L, 2, "restarts", set.d_restarts );
+	set.d_refit = getfieldint( L, 2, "refit", set.d_refit );
+	lua_getfield( L, 2, "noise" );
+	set.d_noise = luaL_optnumber( L, -1, set.d_noise );
+	lua_getfield( L, 2, "xi" );
+	set.d_xi = luaL_optnumber( L, -1, set.d_xi );
+	lua_getfield( L, 2, "seed" );
+	if( lua_isnumber( L, -1 ) )
+		set.d_seed = (unsigned long long)lua_tonumber( L, -1 );
+	lua_pop( L, 3 );
+	if( set.d_batch < 1 )
+		set.d_batch = 1;
+	if( set.d_restarts < 1 )
+		set.d_restarts = 1;
+	return 0;
+}
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+// Preconditioned objectives
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 2 );
-	lua_rawset( L, t );
+// Userdata of type nlopt_vector: a view of an array owned by NLopt, passed to Lua
+// preconditioners instead of a table; only valid during the call. Indexed from 1.
+struct vector_view
+{
+	double* d_p;
+	unsigned int d_n;
+	bool d_writable;
+};
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+static vector_view* check_vector( lua_State *L, int narg = 1 )
+{
+	vector_view* v = static_cast<vector_view*>( luaL_checkudata( L, narg, vector_metaName ) );
+	if( v->d_p == 0 )
+		luaL_error( L, "nlopt_vector used outside of its callback" );
+	return v;
+}
 
-	lua_pop( L, 1 ); // t
+static int vector_index( lua_State *L )
+{
+	vector_view* v = check_vector( L );
+	const lua_Integer i = ( lua_type( L, 2 ) == LUA_TNUMBER ) ? lua_tointeger( L, 2 ) : 0;
+	if( i >= 1 && i <= lua_Integer( v->d_n ) )
+		lua_pushnumber( L, v->d_p[ i - 1 ] );
+	else
+		lua_pushnil( L );
+	return 1;
+}
 
-	lua_pushinteger( L, nlopt_add_equality_constraint( holder->d_obj, func, ctx, lua_tonumber( L, 4 ) ) );
+static int vector_newindex( lua_State *L )
+{
+	vector_view* v = check_vector( L );
+	if( !v->d_writable )
+		luaL_error( L, "nlopt_vector is read-only" );
+	const lua_Integer i = luaL_checkinteger( L, 2 );
+	if( i < 1 || i > lua_Integer( v->d_n ) )
+		luaL_argerror( L, 2, "index out of range" );
+	v->d_p[ i - 1 ] = luaL_checknumber( L, 3 );
+	return 0;
+}
 
+static int vector_len( lua_State *L )
+{
+	lua_pushinteger( L, check_vector( L )->d_n );
 	return 1;
 }
 
-static int remove_inequality_constraints( lua_State *L )
+static int vector_tostring( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushinteger( L, nlopt_remove_inequality_constraints( holder->d_obj ) );
+	lua_pushfstring( L, "%s %p", vector_metaName, lua_touserdata( L, 1 ) );
 	return 1;
 }
 
-static int remove_equality_constraints( lua_State *L )
+static void install_vector_class( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushinteger( L, nlopt_remove_equality_constraints( holder->d_obj ) );
-	return 1;
+	// no methods, only the element access
+	if( luaL_newmetatable( L, vector_metaName ) == 0 )
+		luaL_error( L, "metatable '%s' already registered", vector_metaName );
+	lua_pushcfunction( L, vector_index );
+	lua_setfield( L, -2, "__index" );
+	lua_pushcfunction( L, vector_newindex );
+	lua_setfield( L, -2, "__newindex" );
+	lua_pushcfunction( L, vector_len );
+	lua_setfield( L, -2, "__len" );
+	lua_pushcfunction( L, vector_tostring );
+	lua_setfield( L, -2, "__tostring" );
+	lua_pushliteral( L, "nlopt_vector" );
+	lua_setfield( L, -2, "__metatable" );
+	lua_pop( L, 1 );
 }
 
-static void mfunc(unsigned m, double *result, unsigned n, const double* x, double* grad, void* f_data)
+struct precond_objective;
+
+// Computes vpre = H v, where H approximates the Hessian at x and is positive semidefinite
+struct precond_context : public func_context
 {
-	// x points to an array of length n
-	// result, an array of length m
-	// if the argument grad is not NULL, then grad points to an array of length m*n
-	// f_data points to a callback_context
+	virtual void apply( unsigned n, const double* x, const double* v, double* vpre, precond_objective& obj ) = 0;
+};
 
-	callback_context* ctx = static_cast<callback_context*>( f_data );
-	if( ctx )
+// The f_data of a preconditioned objective: the objective and the preconditioner
+struct precond_objective : public func_context
+{
+	nlopt_func d_func;
+	func_context* d_f;
+	precond_context* d_pre;
+	std::vector<double> d_x; // x and gradient of the last evaluation with gradient
+	std::vector<double> d_grad;
+
+	precond_objective():d_func(0),d_f(0),d_pre(0) {}
+	~precond_objective()
 	{
-		lua_rawgeti( ctx->L, LUA_REGISTRYINDEX, ctx->ref );
-		const int t = lua_gettop( ctx->L );
-
-		lua_pushliteral( ctx->L, "f" );
-		lua_rawget( ctx->L, t );
-		if( !lua_isfunction( ctx->L, -1 ) )
+		delete d_f;
+		delete d_pre;
+	}
+	func_context* clone() const
+	{
+		precond_objective* res = new precond_objective;
+		res->d_func = d_func;
+		res->d_f = ( d_f ) ? d_f->clone() : 0;
+		res->d_pre = static_cast<precond_context*>( d_pre->clone() );
+		return res;
+	}
+	bool set_f_data( lua_State* L, int idx )
+	{
+		const bool f = d_f && d_f->set_f_data( L, idx );
+		const bool pre = d_pre->set_f_data( L, idx );
+		return f || pre;
+	}
+	void prepare( unsigned int n, unsigned int m )
+	{
+		if( d_f )
+			d_f->prepare( n, m );
+		d_pre->prepare( n, m );
+		d_x.reserve( n );
+		d_grad.reserve( n );
+	}
+	double eval( unsigned n, const double* x, double* grad )
+	{
+		const double f = d_func( n, x, grad, d_f );
+		if( grad )
 		{
-			lua_pop( ctx->L, 2 ); // t, f
-			return; // RISK: Fehler melden?
+			d_x.assign( x, x + n );
+			d_grad.assign( grad, grad + n );
+		}
+		return f;
+	}
+	const double* gradient( unsigned n, const double* x )
+	{
+		// of the last evaluation if at x, otherwise evaluates again
+		if( d_x.size() != n || ( n > 0 && ::memcmp( &d_x[0], x, n * sizeof(double) ) != 0 ) )
+		{
+			std::vector<double> g( n + 1 );
+			eval( n, x, &g[0] );
 		}
+		return ( n > 0 ) ? &d_grad[0] : 0;
+	}
+};
 
-		lua_pushinteger( ctx->L, m );
+static double precond_func( unsigned n, const double* x, double* grad, void* f_data )
+{
+	return static_cast<precond_objective*>( static_cast<func_context*>( f_data ) )->eval( n, x, grad );
+}
 
-		lua_pushliteral( ctx->L, "result" );
-		lua_rawget( ctx->L, t );
-		if( !lua_istable( ctx->L, -1 ) )
+static void precond_pre( unsigned n, const double* x, const double* v, double* vpre, void* f_data )
+{
+	precond_objective* obj = static_cast<precond_objective*>( static_cast<func_context*>( f_data ) );
+	obj->d_pre->apply( n, x, v, vpre, *obj );
+}
+
+struct lua_precond : public precond_context
+{
+	lua_State *L;
+	int ref; // table with pre, f_data and the views
+	vector_view* d_views[3]; // x, v, vpre; owned by the table
+
+	lua_precond():L(0),ref(LUA_NOREF)
+	{
+		d_views[0] = d_views[1] = d_views[2] = 0;
+	}
+	~lua_precond()
+	{
+		luaL_unref( L, LUA_REGISTRYINDEX, ref );
+	}
+	func_context* clone() const
+	{
+		lua_precond* res = new lua_precond;
+		res->L = L;
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+		lua_newtable( L );
+		lua_getfield( L, -2, "pre" );
+		lua_setfield( L, -2, "pre" );
+		lua_getfield( L, -2, "f_data" );
+		lua_setfield( L, -2, "f_data" );
+		res->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+		lua_pop( L, 1 );
+		return res;
+	}
+	void push_view( int t, int i, const double* p, unsigned n )
+	{
+		if( d_views[i] == 0 )
 		{
-			lua_pop( ctx->L, 1 );
-			lua_newtable( ctx->L );
-			lua_pushliteral( ctx->L, "result" );
-			lua_pushvalue( ctx->L, -2 );
-			lua_rawset( ctx->L, t );
+			d_views[i] = static_cast<vector_view*>( lua_newuserdata( L, sizeof(vector_view) ) );
+			luaL_getmetatable( L, vector_metaName );
+			lua_setmetatable( L, -2 );
+			d_views[i]->d_writable = ( i == 2 );
+			lua_pushvalue( L, -1 );
+			lua_rawseti( L, t, i + 1 );
+		}else
+			lua_rawgeti( L, t, i + 1 );
+		d_views[i]->d_p = const_cast<double*>( p );
+		d_views[i]->d_n = n;
+	}
+	bool set_f_data( lua_State* from, int idx )
+	{
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+		lua_pushvalue( from, idx );
+		if( from != L )
+			lua_xmove( from, L, 1 );
+		lua_setfield( L, -2, "f_data" );
+		lua_pop( L, 1 );
+		return true;
+	}
+	void prepare( unsigned int, unsigned int )
+	{
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+		const int t = lua_gettop( L );
+		for( int i = 0; i < 3; i++ )
+		{
+			push_view( t, i, 0, 0 );
+			lua_pop( L, 1 );
 		}
-		const int resultt = lua_gettop( ctx->L );
-		unsigned int i;
-		for( i = 0; i < m; i++ )
+		lua_pop( L, 1 );
+	}
+	void apply( unsigned n, const double* x, const double* v, double* vpre, precond_objective& )
+	{
+		lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+		const int t = lua_gettop( L );
+		lua_getfield( L, t, "pre" );
+		lua_pushinteger( L, n );
+		push_view( t, 0, x, n );
+		push_view( t, 1, v, n );
+		push_view( t, 2, vpre, n );
+		lua_getfield( L, t, "f_data" );
+		// stack: t, pre, n, x, v, vpre, f_data
+		int rc;
 		{
-			lua_pushnumber( ctx->L, result[i] );
-			lua_rawseti( ctx->L, resultt, i + 1 );
+			eval_guard guard( L );
+			rc = pcall_traceback( L, 5, 0 );
 		}
-		// stack: t, f, m, result
+		for( int i = 0; i < 3; i++ )
+			d_views[i]->d_p = 0;
+		if( rc != 0 )
+		{
+			// stack: t, msg
+			callback_failed( lua_tostring( L, -1 ) );
+			lua_pop( L, 1 );
+			std::copy( v, v + n, vpre );
+		}
+		lua_pop( L, 1 ); // t
+	}
+};
 
-		lua_pushinteger( ctx->L, n );
+struct diagonal_precond : public precond_context
+{
+	std::vector<double> d_diag;
 
-		lua_pushliteral( ctx->L, "x" );
-		lua_rawget( ctx->L, t );
-		if( !lua_istable( ctx->L, -1 ) )
+	func_context* clone() const { return new diagonal_precond( *this ); }
+	void apply( unsigned n, const double*, const double* v, double* vpre, precond_objective& )
+	{
+		for( unsigned i = 0; i < n; i++ )
+			vpre[i] = d_diag[i] * v[i];
+	}
+};
+
+// Compressed sparse rows, zero based
+struct csr_precond : public precond_context
+{
+	std::vector<int> d_rowPtr;
+	std::vector<int> d_col;
+	std::vector<double> d_val;
+
+	func_context* clone() const { return new csr_precond( *this ); }
+	void apply( unsigned n, const double*, const double* v, double* vpre, precond_objective& )
+	{
+		for( unsigned r = 0; r < n; r++ )
 		{
-			lua_pop( ctx->L, 1 );
-			lua_newtable( ctx->L );
-			lua_pushliteral( ctx->L, "x" );
-			lua_pushvalue( ctx->L, -2 );
-			lua_rawset( ctx->L, t );
+			double s = 0.0;
+			for( int k = d_rowPtr[r]; k < d_rowPtr[ r + 1 ]; k++ )
+				s += d_val[k] * v[ d_col[k] ];
+			vpre[r] = s;
 		}
-		const int xt = lua_gettop( ctx->L );
+	}
+};
+
+// Hessian-vector product by a forward difference of the gradient along v; the gradient
+// at x usually is the one of the preceding evaluation.
+struct fd_hessian_precond : public precond_context
+{
+	double d_step;
+	std::vector<double> d_xh;
+	std::vector<double> d_gh;
+
+	fd_hessian_precond():d_step(1e-6) {}
+	func_context* clone() const { return new fd_hessian_precond( *this ); }
+	void apply( unsigned n, const double* x, const double* v, double* vpre, precond_objective& obj )
+	{
+		double xn = 0.0, vn = 0.0;
+		unsigned i;
 		for( i = 0; i < n; i++ )
 		{
-			lua_pushnumber( ctx->L, x[i] );
-			lua_rawseti( ctx->L, xt, i + 1 );
+			xn += x[i] * x[i];
+			vn += v[i] * v[i];
 		}
-		// stack: t, f, m, result, n, x
-		if( grad )
-		{
-			lua_pushliteral( ctx->L, "grad" );
-			lua_rawget( ctx->L, t );
-			if( !lua_istable( ctx->L, -1 ) )
-			{
-				lua_pop( ctx->L, 1 );
-				lua_newtable( ctx->L );
-				lua_pushliteral( ctx->L, "grad" );
-				lua_pushvalue( ctx->L, -2 );
-				lua_rawset( ctx->L, t );
-			}
-			const int gradt = lua_gettop( ctx->L );
-			for( i = 0; i < ( n * m ); i++ )
-			{
-				lua_pushnumber( ctx->L, grad[i] );
-				lua_rawseti( ctx->L, gradt, i + 1 );
-			}
-		}else
+		if( vn == 0.0 )
 		{
-			lua_pushliteral( ctx->L, "grad" );
-			lua_pushnil( ctx->L );
-			lua_rawset( ctx->L, t );
-			lua_pushnil( ctx->L );
+			std::fill( vpre, vpre + n, 0.0 );
+			return;
 		}
-		// stack: t, f, m, result, n, x, grad | nil
-		lua_pushliteral( ctx->L, "f_data" );
-		lua_rawget( ctx->L, t );
-		// stack: t, f, m, result, n, x, grad | nil, f_data | nil
-		if( lua_pcall( ctx->L, 6, 0, 0 ) == 0 )
+		const double h = d_step * ( 1.0 + std::sqrt( xn ) ) / std::sqrt( vn );
+		const double* g0 = obj.gradient( n, x );
+		const std::vector<double> g( g0, g0 + n );
+		d_xh.resize( n );
+		d_gh.resize( n + 1 );
+		for( i = 0; i < n; i++ )
+			d_xh[i] = x[i] + h * v[i];
+		obj.d_func( n, &d_xh[0], &d_gh[0], obj.d_f );
+		for( i = 0; i < n; i++ )
 		{
-			// stack: t
-			lua_pushliteral( ctx->L, "result" );
-			lua_rawget( ctx->L, t );
-			const int resultt = lua_gettop( ctx->L );
-			for( i = 0; i < m; i++ )
+			vpre[i] = ( d_gh[i] - g[i] ) / h;
+			if( !( vpre[i] - vpre[i] == 0.0 ) )
 			{
-				lua_rawgeti( ctx->L, resultt, i + 1 );
-				result[i] = lua_tonumber( ctx->L, -1 );
-				lua_pop( ctx->L, 1 );
-			}
-			if( grad )
-			{
-				lua_pushliteral( ctx->L, "grad" );
-				lua_rawget( ctx->L, t );
-				const int gradt = lua_gettop( ctx->L );
-				for( i = 0; i < ( n * m ); i++ )
-				{
-					lua_rawgeti( ctx->L, gradt, i + 1 );
-					grad[i] = lua_tonumber( ctx->L, -1 );
-					lua_pop( ctx->L, 1 );
-				}
-				lua_pop( ctx->L, 1 );
+				// not finite; no preconditioning
+				std::copy( v, v + n, vpre );
+				return;
 			}
-
-			lua_pop( ctx->L, 1 );
-			return;
-		}else
-		{
-			// stack: t, msg
-			lua_pop( ctx->L, 2 );
-			return; // RISK: Fehler melden?
 		}
-	}else
-		return; // RISK: Fehler melden?
+	}
+};
+
+// Userdata of type nlopt_precond: a preconditioner implemented in C++ which can be passed
+// to set_precond_min_objective/set_precond_max_objective instead of a Lua function
+struct native_precond
+{
+	precond_context* d_proto;
+	unsigned int d_dim; // or 0 if any
+};
+
+static native_precond* to_precond( lua_State *L, int narg )
+{
+	void* p = lua_touserdata( L, narg );
+	if( p == 0 || !lua_getmetatable( L, narg ) )
+		return 0;
+	luaL_getmetatable( L, precond_metaName );
+	const bool ok = lua_rawequal( L, -1, -2 ) != 0;
+	lua_pop( L, 2 );
+	return ( ok ) ? static_cast<native_precond*>( p ) : 0;
 }
 
-static int add_inequality_mconstraint( lua_State *L )
+static void push_precond( lua_State *L, precond_context* proto, unsigned int dim )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const int m = (const int)luaL_checkinteger( L, 2 );
-	luaL_checktype( L, 3, LUA_TFUNCTION );
-	if( !lua_isnil( L, 5 ) && lua_istable( L, 5 ) )
-		luaL_argerror( L, 5, "expecting table or nil" );
+	native_precond* pre = static_cast<native_precond*>( lua_newuserdata( L, sizeof(native_precond) ) );
+	pre->d_proto = proto;
+	pre->d_dim = dim;
+	luaL_getmetatable( L, precond_metaName );
+	lua_setmetatable( L, -2 );
+}
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+static int precond_diagonal( lua_State *L )
+{
+	// nlopt.precond_diagonal( array d[1..n] )
+	luaL_checktype( L, 1, LUA_TTABLE );
+	const int n = int( lua_objlen( L, 1 ) );
+	if( n == 0 )
+		luaL_argerror( L, 1, "expecting a non-empty array" );
+	std::vector<double> d( n );
+	for( int i = 0; i < n; i++ )
+	{
+		lua_rawgeti( L, 1, i + 1 );
+		if( lua_type( L, -1 ) != LUA_TNUMBER )
+			luaL_argerror( L, 1, "expecting an array of numbers" );
+		d[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+		// H must be positive semidefinite
+		if( !( d[i] >= 0.0 ) )
+			luaL_argerror( L, 1, "expecting non-negative numbers" );
+	}
+	diagonal_precond* pre = new diagonal_precond;
+	pre->d_diag.swap( d );
+	push_precond( L, pre, n );
+	return 1;
+}
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+static void read_ints( lua_State *L, int t, std::vector<int>& out )
+{
+	const int len = int( lua_objlen( L, t ) );
+	out.resize( len );
+	for( int i = 0; i < len; i++ )
+	{
+		lua_rawgeti( L, t, i + 1 );
+		out[i] = int( lua_tointeger( L, -1 ) ) - 1;
+		lua_pop( L, 1 );
+	}
+}
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 4 );
-	lua_rawset( L, t );
+static int precond_csr( lua_State *L )
+{
+	// nlopt.precond_csr( integer n, array row_ptr[1..n+1], array col[], array val[] ), one based
+	const int n = int( luaL_checkinteger( L, 1 ) );
+	luaL_checktype( L, 2, LUA_TTABLE );
+	luaL_checktype( L, 3, LUA_TTABLE );
+	luaL_checktype( L, 4, LUA_TTABLE );
+	if( n < 1 )
+		luaL_argerror( L, 1, "expecting positive integer" );
+	csr_precond pre;
+	read_ints( L, 2, pre.d_rowPtr );
+	read_ints( L, 3, pre.d_col );
+	const int nnz = int( lua_objlen( L, 4 ) );
+	pre.d_val.resize( nnz );
+	for( int i = 0; i < nnz; i++ )
+	{
+		lua_rawgeti( L, 4, i + 1 );
+		if( lua_type( L, -1 ) != LUA_TNUMBER )
+			luaL_argerror( L, 4, "expecting an array of numbers" );
+		pre.d_val[i] = lua_tonumber( L, -1 );
+		lua_pop( L, 1 );
+	}
+	if( int( pre.d_rowPtr.size() ) != n + 1 || pre.d_rowPtr[0] != 0 || pre.d_rowPtr[n] != nnz ||
+			int( pre.d_col.size() ) != nnz )
+		luaL_error( L, "inconsistent CSR matrix" );
+	for( int r = 0; r < n; r++ )
+		if( pre.d_rowPtr[ r + 1 ] < pre.d_rowPtr[r] )
+			luaL_error( L, "row_ptr must be ascending" );
+	for( int k = 0; k < nnz; k++ )
+		if( pre.d_col[k] < 0 || pre.d_col[k] >= n )
+			luaL_error( L, "column index out of range" );
+	push_precond( L, new csr_precond( pre ), n );
+	return 1;
+}
 
-	lua_pop( L, 1 ); // t
+static int precond_fd_hessian( lua_State *L )
+{
+	// nlopt.precond_fd_hessian( [double step] )
+	fd_hessian_precond* pre = new fd_hessian_precond;
+	pre->d_step = luaL_optnumber( L, 1, pre->d_step );
+	if( !( pre->d_step > 0.0 ) )
+	{
+		delete pre;
+		luaL_argerror( L, 1, "expecting positive step" );
+	}
+	push_precond( L, pre, 0 );
+	return 1;
+}
 
-	const double *tol = 0;
+static int precond_gc( lua_State *L )
+{
+	native_precond* pre = static_cast<native_precond*>( luaL_checkudata( L, 1, precond_metaName ) );
+	delete pre->d_proto;
+	pre->d_proto = 0;
+	return 0;
+}
 
-	if( lua_isnil( L, 5 ) )
-		lua_pushinteger( L, nlopt_add_inequality_mconstraint( holder->d_obj, m, mfunc, ctx, 0 ) );
+static int precond_tostring( lua_State *L )
+{
+	lua_pushfstring( L, "%s %p", precond_metaName, lua_touserdata( L, 1 ) );
+	return 1;
+}
+
+static int precond_dimension( lua_State *L )
+{
+	native_precond* pre = static_cast<native_precond*>( luaL_checkudata( L, 1, precond_metaName ) );
+	lua_pushinteger( L, pre->d_dim );
+	return 1;
+}
+
+static const luaL_Reg PrecondMethods[] =
+{
+	{ "dimension", precond_dimension },
+	{ NULL,	NULL }
+};
+
+static int set_precond_objective( lua_State *L, bool maximize )
+{
+	// opt:set_precond_min_objective( f, pre, f_data ); f and pre are Lua functions or native
+	nlopt_opt_holder* holder = check( L, 1 );
+	holder->d_generation++;
+	const unsigned int dim = nlopt_get_dimension( holder->d_obj );
+	native_objective* nf = to_objective( L, 2 );
+	if( nf == 0 )
+		luaL_checktype( L, 2, LUA_TFUNCTION );
+	native_precond* np = to_precond( L, 3 );
+	if( np == 0 )
+		luaL_checktype( L, 3, LUA_TFUNCTION );
+	else if( np->d_dim != 0 && np->d_dim != dim )
+		luaL_error( L, "preconditioner expects %d parameters, but optimizer has dimension %d",
+			int( np->d_dim ), int( dim ) );
+
+	precond_objective* ctx = new precond_objective;
+	if( nf )
+	{
+		ctx->d_func = nf->d_func;
+		ctx->d_f = clone_objective( L, holder, nf );
+	}else
+	{
+		callback_context* f = new callback_context;
+		f->L = L;
+		lua_newtable( L );
+		lua_pushvalue( L, 2 );
+		lua_setfield( L, -2, "f" );
+		lua_pushvalue( L, 4 );
+		lua_setfield( L, -2, "f_data" );
+		f->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+		ctx->d_func = func;
+		ctx->d_f = f;
+	}
+	if( np )
+		ctx->d_pre = static_cast<precond_context*>( np->d_proto->clone() );
 	else
 	{
-		std::vector<double> tol( m );
-		for( int i = 0; i < m; i++ )
-		{
-			lua_pushinteger( L, i + 1 );
-			lua_gettable( L, 5 );
-			tol[i] = lua_tonumber( L, -1 );
-			lua_pop( L, 1 );
-		}
-		lua_pushinteger( L, nlopt_add_inequality_mconstraint( holder->d_obj, lua_tonumber( L, 2 ), mfunc, ctx, &tol[0] ) );
+		lua_precond* pre = new lua_precond;
+		pre->L = L;
+		lua_newtable( L );
+		lua_pushvalue( L, 3 );
+		lua_setfield( L, -2, "pre" );
+		lua_pushvalue( L, 4 );
+		lua_setfield( L, -2, "f_data" );
+		pre->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+		ctx->d_pre = pre;
 	}
 
+	holder->d_maximize = maximize;
+	forget_history( holder );
+	holder->d_luaObjective = nf == 0 || np == 0;
+	holder->d_objective = registered_func( precond_func, static_cast<func_context*>( ctx ) );
+	if( maximize )
+		lua_pushinteger( L, nlopt_set_precond_max_objective( holder->d_obj, precond_func, precond_pre,
+			static_cast<func_context*>( ctx ) ) );
+	else
+		lua_pushinteger( L, nlopt_set_precond_min_objective( holder->d_obj, precond_func, precond_pre,
+			static_cast<func_context*>( ctx ) ) );
 	return 1;
 }
 
-static int add_equality_mconstraint( lua_State *L )
+static int set_precond_min_objective( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const int m = (const int)luaL_checkinteger( L, 2 );
-	luaL_checktype( L, 3, LUA_TFUNCTION );
-	if( !lua_isnil( L, 5 ) && lua_istable( L, 5 ) )
-		luaL_argerror( L, 5, "expecting table or nil" );
+	return set_precond_objective( L, false );
+}
 
-	callback_context* ctx = new callback_context;
-	ctx->L = L;
-	lua_newtable( L );
-	const int t = lua_gettop( L );
-	lua_pushvalue( L, t );
-	ctx->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+static int set_precond_max_objective( lua_State *L )
+{
+	return set_precond_objective( L, true );
+}
 
-	lua_pushliteral( L, "f" );
-	lua_pushvalue( L, 3 );
-	lua_rawset( L, t );
+// Frozen variables: an optimizer of the free variables runs instead, the registered
+// functions still get the full x
 
-	lua_pushliteral( L, "f_data" );
-	lua_pushvalue( L, 4 );
-	lua_rawset( L, t );
+struct frozen_run
+{
+	nlopt_opt_holder* d_holder;
+	nlopt_opt d_reduced;
+	std::vector<int> d_free; // reduced index -> full index
+	std::vector<double> d_x; // full, with the frozen values
+	std::vector<double> d_grad; // full, m * n
+	std::vector<double> d_v; // full, for the preconditioner
+	std::vector<double> d_vpre;
+	int d_evals; // of the objective
+
+	void scatter( const double* xr )
+	{
+		for( size_t j = 0; j < d_free.size(); j++ )
+			d_x[ d_free[j] ] = xr[j];
+	}
+	void gather( unsigned m, double* grad ) const
+	{
+		const size_t n = d_x.size(), k = d_free.size();
+		for( unsigned i = 0; i < m; i++ )
+			for( size_t j = 0; j < k; j++ )
+				grad[ i * k + j ] = d_grad[ i * n + d_free[j] ];
+	}
+	void sync_stop()
+	{
+		// callback_failed and stop_requested stop the full optimizer
+		if( const int stop = nlopt_get_force_stop( d_holder->d_obj ) )
+			nlopt_set_force_stop( d_reduced, stop );
+	}
+};
 
-	lua_pop( L, 1 ); // t
+struct frozen_func
+{
+	registered_func d_f;
+	frozen_run* d_run;
+	bool d_objective;
 
-	const double *tol = 0;
+	frozen_func():d_run(0),d_objective(false) {}
+};
 
-	if( lua_isnil( L, 5 ) )
-		lua_pushinteger( L, nlopt_add_equality_mconstraint( holder->d_obj, m, mfunc, ctx, 0 ) );
+static double frozen_eval( unsigned, const double* xr, double* grad, void* data )
+{
+	frozen_func* ff = static_cast<frozen_func*>( data );
+	frozen_run* r = ff->d_run;
+	r->scatter( xr );
+	const unsigned n = unsigned( r->d_x.size() );
+	const double res = ff->d_f.d_f( n, &r->d_x[0], ( grad ) ? &r->d_grad[0] : 0, ff->d_f.d_data );
+	if( ff->d_objective )
+		r->d_evals++;
+	if( grad )
+		r->gather( 1, grad );
+	r->sync_stop();
+	return res;
+}
+
+static void frozen_pre( unsigned, const double* xr, const double* vr, double* vpre, void* data )
+{
+	// H restricted to the free variables: the frozen entries of v are zero
+	frozen_func* ff = static_cast<frozen_func*>( data );
+	frozen_run* r = ff->d_run;
+	r->scatter( xr );
+	const size_t k = r->d_free.size();
+	size_t j;
+	for( j = 0; j < k; j++ )
+		r->d_v[ r->d_free[j] ] = vr[j];
+	precond_pre( unsigned( r->d_x.size() ), &r->d_x[0], &r->d_v[0], &r->d_vpre[0], ff->d_f.d_data );
+	for( j = 0; j < k; j++ )
+		vpre[j] = r->d_vpre[ r->d_free[j] ];
+	r->sync_stop();
+}
+
+static void frozen_meval( unsigned m, double* result, unsigned, const double* xr, double* grad, void* data )
+{
+	frozen_func* ff = static_cast<frozen_func*>( data );
+	frozen_run* r = ff->d_run;
+	r->scatter( xr );
+	const unsigned n = unsigned( r->d_x.size() );
+	if( grad && r->d_grad.size() < size_t( m ) * n )
+		r->d_grad.resize( size_t( m ) * n );
+	ff->d_f.d_mf( m, result, n, &r->d_x[0], ( grad ) ? &r->d_grad[0] : 0, ff->d_f.d_data );
+	if( grad )
+		r->gather( m, grad );
+	r->sync_stop();
+}
+
+static void add_frozen_constraint( frozen_run& r, frozen_func& ff, bool equality )
+{
+	const registered_func& f = ff.d_f;
+	if( f.d_mf && equality )
+		nlopt_add_equality_mconstraint( r.d_reduced, f.d_m, frozen_meval, &ff, &f.d_tol[0] );
+	else if( f.d_mf )
+		nlopt_add_inequality_mconstraint( r.d_reduced, f.d_m, frozen_meval, &ff, &f.d_tol[0] );
+	else if( equality )
+		nlopt_add_equality_constraint( r.d_reduced, frozen_eval, &ff, f.d_tol[0] );
 	else
+		nlopt_add_inequality_constraint( r.d_reduced, frozen_eval, &ff, f.d_tol[0] );
+}
+
+static nlopt_result run_frozen( nlopt_opt_holder* holder, double* x, double* opt_f, int* evals )
+{
+	nlopt_opt full = holder->d_obj;
+	const unsigned n = nlopt_get_dimension( full );
+	frozen_run r;
+	r.d_holder = holder;
+	r.d_evals = 0;
+	unsigned i;
+	for( i = 0; i < n; i++ )
 	{
-		std::vector<double> tol( m );
-		for( int i = 0; i < m; i++ )
+		if( holder->d_frozen[i] != holder->d_frozen[i] )
+			r.d_free.push_back( i );
+		else
+			x[i] = holder->d_frozen[i];
+	}
+	r.d_x.assign( x, x + n );
+	r.d_grad.assign( n, 0.0 );
+	const unsigned k = unsigned( r.d_free.size() );
+	if( holder->d_objective.d_data == 0 || holder->d_algorithm == X_BAYESOPT )
+		return NLOPT_INVALID_ARGS;
+	if( k == 0 )
+	{
+		// nothing to optimize
+		*opt_f = holder->d_objective.d_f( n, x, 0, holder->d_objective.d_data );
+		if( evals )
+			*evals = 1;
+		return NLOPT_SUCCESS;
+	}
+
+	// The reduced optimizer is made from the current settings on each run, so that later
+	// changes of the full optimizer apply.
+	r.d_reduced = nlopt_create( nlopt_get_algorithm( full ), k );
+	nlopt_set_force_stop( full, 0 );
+	std::vector<double> v( n ), vr( k ), xr( k );
+	nlopt_get_lower_bounds( full, &v[0] );
+	for( i = 0; i < k; i++ )
+		vr[i] = v[ r.d_free[i] ];
+	nlopt_set_lower_bounds( r.d_reduced, &vr[0] );
+	nlopt_get_upper_bounds( full, &v[0] );
+	for( i = 0; i < k; i++ )
+		vr[i] = v[ r.d_free[i] ];
+	nlopt_set_upper_bounds( r.d_reduced, &vr[0] );
+	nlopt_get_initial_step( full, x, &v[0] );
+	for( i = 0; i < k; i++ )
+		vr[i] = v[ r.d_free[i] ];
+	nlopt_set_initial_step( r.d_reduced, &vr[0] );
+	copy_stop_criteria( full, r.d_reduced, &r.d_free );
+	if( holder->d_local )
+	{
+		// AUGLAG and MLSL need it; NLopt copies it, bounds and steps come from r.d_reduced
+		nlopt_opt local = nlopt_create( nlopt_get_algorithm( holder->d_local ), k );
+		copy_stop_criteria( holder->d_local, local, &r.d_free );
+		const nlopt_result lres = nlopt_set_local_optimizer( r.d_reduced, local );
+		nlopt_destroy( local );
+		if( lres < 0 )
 		{
-			lua_pushinteger( L, i + 1 );
-			lua_gettable( L, 5 );
-			tol[i] = lua_tonumber( L, -1 );
-			lua_pop( L, 1 );
+			nlopt_destroy( r.d_reduced );
+			return lres;
 		}
-		lua_pushinteger( L, nlopt_add_equality_mconstraint( holder->d_obj, lua_tonumber( L, 2 ), mfunc, ctx, &tol[0] ) );
 	}
 
-	return 1;
-}
+	// stable addresses for the f_data of the reduced optimizer
+	std::vector<frozen_func> funcs( 1 + holder->d_inequality.size() + holder->d_equality.size() );
+	size_t f = 0;
+	funcs[f].d_f = holder->d_objective;
+	funcs[f].d_run = &r;
+	funcs[f].d_objective = true;
+	if( holder->d_objective.d_f == precond_func )
+	{
+		r.d_v.assign( n, 0.0 );
+		r.d_vpre.assign( n, 0.0 );
+		if( holder->d_maximize )
+			nlopt_set_precond_max_objective( r.d_reduced, frozen_eval, frozen_pre, &funcs[f] );
+		else
+			nlopt_set_precond_min_objective( r.d_reduced, frozen_eval, frozen_pre, &funcs[f] );
+	}else if( holder->d_maximize )
+		nlopt_set_max_objective( r.d_reduced, frozen_eval, &funcs[f] );
+	else
+		nlopt_set_min_objective( r.d_reduced, frozen_eval, &funcs[f] );
+	size_t j;
+	for( j = 0; j < holder->d_inequality.size(); j++ )
+	{
+		funcs[++f].d_f = holder->d_inequality[j];
+		funcs[f].d_run = &r;
+		add_frozen_constraint( r, funcs[f], false );
+	}
+	for( j = 0; j < holder->d_equality.size(); j++ )
+	{
+		funcs[++f].d_f = holder->d_equality[j];
+		funcs[f].d_run = &r;
+		add_frozen_constraint( r, funcs[f], true );
+	}
 
-static int set_stopval( lua_State *L )
-{
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double val = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_stopval( holder->d_obj, val ) );
-	return 1;
+	for( i = 0; i < k; i++ )
+		xr[i] = x[ r.d_free[i] ];
+	const nlopt_result res = nlopt_optimize( r.d_reduced, &xr[0], opt_f );
+	for( i = 0; i < k; i++ )
+		x[ r.d_free[i] ] = xr[i];
+	nlopt_destroy( r.d_reduced );
+	if( evals )
+		*evals = r.d_evals;
+	return res;
 }
 
-static int get_stopval( lua_State *L )
+static int freeze( lua_State *L )
 {
+	// opt:freeze{ [i] = value, ... }; opt:freeze() unfreezes all
 	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_stopval( holder->d_obj ) );
-	return 1;
+	if( lua_isnoneornil( L, 2 ) )
+	{
+		holder->d_frozen.clear();
+		return 0;
+	}
+	luaL_checktype( L, 2, LUA_TTABLE );
+	const int n = nlopt_get_dimension( holder->d_obj );
+	std::vector<double> frozen( n, s_nan );
+	bool any = false;
+	lua_pushnil( L );
+	while( lua_next( L, 2 ) != 0 )
+	{
+		const lua_Number i = ( lua_type( L, -2 ) == LUA_TNUMBER ) ? lua_tonumber( L, -2 ) : 0;
+		if( i < 1 || i > n || i != lua_Number( int( i ) ) )
+			luaL_argerror( L, 2, "expecting variable numbers 1..n as keys" );
+		if( lua_type( L, -1 ) != LUA_TNUMBER )
+			luaL_argerror( L, 2, "expecting numbers as values" );
+		frozen[ int( i ) - 1 ] = lua_tonumber( L, -1 );
+		any = true;
+		lua_pop( L, 1 );
+	}
+	if( any )
+		holder->d_frozen.swap( frozen );
+	else
+		holder->d_frozen.clear();
+	return 0;
 }
 
-static int set_ftol_rel( lua_State *L )
+// Block-coordinate descent: sweeps over disjoint groups of variables, each optimized by a
+// copy of the optimizer with the other variables frozen
+
+struct block_job
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double val = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_ftol_rel( holder->d_obj, val ) );
-	return 1;
-}
+	nlopt_opt_holder* d_holder; // copy, owns its nlopt_opt
+	std::vector<int> d_vars;
+	std::vector<double> d_x; // full x, the start of the block and then its result
+	double d_f;
+	nlopt_result d_res;
+	bool d_async;
+	int d_evals; // totals
+	double d_seconds;
+	double d_lastSeconds;
+	std::vector<double> d_gains; // improvement of f per sweep
+	double d_move; // largest change of a variable in the last sweep
+	bool d_converged;
+
+	block_job():d_holder(0),d_f(0),d_res(NLOPT_SUCCESS),d_async(false),d_evals(0),d_seconds(0),
+		d_lastSeconds(0),d_move(0),d_converged(false) {}
+};
 
-static int get_ftol_rel( lua_State *L )
+static void free_blocks( std::vector<block_job>& blocks )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_ftol_rel( holder->d_obj ) );
-	return 1;
+	for( size_t b = 0; b < blocks.size(); b++ )
+	{
+		if( blocks[b].d_holder == 0 )
+			continue;
+		nlopt_destroy( blocks[b].d_holder->d_obj );
+		delete blocks[b].d_holder;
+		blocks[b].d_holder = 0;
+	}
 }
 
-static int set_ftol_abs( lua_State *L )
+static void run_block( block_job& b )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double val = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_ftol_abs( holder->d_obj, val ) );
-	return 1;
+	const double start = now_seconds();
+	optimize_run run;
+	begin_run( run, b.d_holder );
+	run.d_async = b.d_async;
+	int evals = 0;
+	b.d_res = run_frozen( b.d_holder, &b.d_x[0], &b.d_f, &evals );
+	end_run( run );
+	b.d_evals += evals;
+	b.d_lastSeconds = now_seconds() - start;
+	b.d_seconds += b.d_lastSeconds;
 }
 
-static int get_ftol_abs( lua_State *L )
+static void block_task( void* arg, int chunk, int )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_ftol_abs( holder->d_obj ) );
-	return 1;
+	run_block( ( *static_cast<std::vector<block_job>*>( arg ) )[ chunk ] );
 }
 
-static int set_xtol_rel( lua_State *L )
+static bool x_converged( nlopt_opt obj, const double* x, const double* prev, const std::vector<int>& vars,
+	const std::vector<double>& xtolAbs )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double val = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_xtol_rel( holder->d_obj, val ) );
-	return 1;
+	// the xtol criteria of NLopt for the given variables; false if none is set
+	const double rel = nlopt_get_xtol_rel( obj );
+	bool any = rel > 0;
+	for( size_t j = 0; j < vars.size(); j++ )
+	{
+		const int i = vars[j];
+		const double d = std::fabs( x[i] - prev[i] );
+		any = any || xtolAbs[i] > 0;
+		if( !( ( rel > 0 && d <= rel * std::fabs( x[i] ) ) || ( xtolAbs[i] > 0 && d <= xtolAbs[i] ) ) )
+			return false;
+	}
+	return any;
 }
 
-static int get_xtol_rel( lua_State *L )
+static bool better( bool maximize, double a, double b )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_xtol_rel( holder->d_obj ) );
-	return 1;
+	return ( maximize ) ? a > b : a < b;
 }
 
-static int set_xtol_abs( lua_State *L )
+static int block_coordinate( lua_State *L )
 {
+	// nlopt.block_coordinate( opt, groups, { x = array, threads = 1, sweeps = 10,
+	//	mode = "jacobi" | "gauss_seidel" } ) returns result, f, stats
 	nlopt_opt_holder* holder = check( L, 1 );
 	luaL_checktype( L, 2, LUA_TTABLE );
+	luaL_checktype( L, 3, LUA_TTABLE );
 	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	for( int i = 0; i < n; i++ )
+	if( holder->d_objective.d_data == 0 )
+		luaL_error( L, "optimizer has no objective" );
+	lua_getfield( L, 3, "x" );
+	if( !lua_istable( L, -1 ) )
+		luaL_argerror( L, 3, "expecting options.x" );
+	const int xt = lua_gettop( L );
+	std::vector<double> x( n + 1 );
+	int i;
+	for( i = 0; i < n; i++ )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		lb[i] = lua_tonumber( L, -1 );
+		lua_rawgeti( L, xt, i + 1 );
+		x[i] = lua_tonumber( L, -1 );
 		lua_pop( L, 1 );
 	}
-	lua_pushinteger( L, nlopt_set_xtol_abs( holder->d_obj, &lb[0] ) );
-	return 1;
-}
+	int threads = getfieldint( L, 3, "threads", 1 );
+	const int sweeps = getfieldint( L, 3, "sweeps", 10 );
+	static const char* modes[] = { "jacobi", "gauss_seidel", 0 };
+	lua_getfield( L, 3, "mode" );
+	const bool jacobi = ( lua_isnil( L, -1 ) ) ? threads > 1 : luaL_checkoption( L, -1, 0, modes ) == 0;
+	lua_pop( L, 1 );
+
+	// the groups, disjoint
+	std::vector<block_job> blocks( lua_objlen( L, 2 ) );
+	std::vector<char> used( n, 0 );
+	for( size_t b = 0; b < blocks.size(); b++ )
+	{
+		lua_rawgeti( L, 2, int( b ) + 1 );
+		if( !lua_istable( L, -1 ) )
+			luaL_argerror( L, 2, "expecting arrays of variable numbers" );
+		const int len = int( lua_objlen( L, -1 ) );
+		for( int j = 0; j < len; j++ )
+		{
+			lua_rawgeti( L, -1, j + 1 );
+			const int v = int( lua_tointeger( L, -1 ) ) - 1;
+			lua_pop( L, 1 );
+			if( v < 0 || v >= n || used[v] )
+				luaL_argerror( L, 2, "groups must be disjoint sets of variable numbers 1..n" );
+			used[v] = 1;
+			blocks[b].d_vars.push_back( v );
+		}
+		lua_pop( L, 1 );
+	}
+	if( blocks.empty() )
+		luaL_argerror( L, 2, "expecting at least one group" );
+	if( threads < 1 || !jacobi || !holder->thread_safe() )
+		threads = 1; // Lua callbacks only run on this thread
+	if( threads > int( blocks.size() ) )
+		threads = int( blocks.size() );
+
+	std::vector<double> xtolAbs( n + 1 );
+	nlopt_get_xtol_abs( holder->d_obj, &xtolAbs[0] );
+	for( size_t b = 0; b < blocks.size(); b++ )
+	{
+		std::map<void*,void*> clones;
+		nlopt_opt obj = copy_opt( holder->d_obj, clones );
+		if( obj == NULL )
+		{
+			free_blocks( blocks );
+			luaL_error( L, "nlopt_copy out of memory" );
+		}
+		blocks[b].d_holder = new nlopt_opt_holder( obj );
+		blocks[b].d_holder->copy_settings( *holder, clones );
+		blocks[b].d_async = threads > 1;
+	}
 
-static int get_xtol_abs( lua_State *L )
-{
-	nlopt_opt_holder* holder = check( L, 1 );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> lb( n );
-	lua_pushinteger( L, nlopt_get_xtol_abs( holder->d_obj, &lb[0] ) );
-	lua_createtable( L, n, 0 );
-	for( int i = 0; i < n; i++ )
+	holder->d_error.clear();
+	holder->d_errors = 0;
+	holder->d_exceeded = 0;
+	const double ftolRel = nlopt_get_ftol_rel( holder->d_obj );
+	const double ftolAbs = nlopt_get_ftol_abs( holder->d_obj );
+	const double stopval = nlopt_get_stopval( holder->d_obj );
+	const bool maximize = holder->d_maximize;
+	double f;
 	{
-		lua_pushnumber( L, lb[i] );
-		lua_rawseti( L, -2, i + 1 );
+		optimize_run run;
+		begin_run( run, holder );
+		f = holder->d_objective.d_f( n, &x[0], 0, holder->d_objective.d_data );
+		end_run( run );
 	}
-	return 2;
-}
+	nlopt_result res = NLOPT_SUCCESS;
+	std::vector<double> prev( n + 1 );
+	std::vector<int> all( n );
+	for( i = 0; i < n; i++ )
+		all[i] = i;
+	int sweep = 0;
+	int failed = -1; // the first group whose optimizer failed
+	double busy = 0.0, wall = 0.0;
+	{
+		thread_pool pool( threads );
+		while( sweep < sweeps && res == NLOPT_SUCCESS )
+		{
+			sweep++;
+			prev = x;
+			const double fPrev = f;
+			size_t b;
+			for( b = 0; b < blocks.size(); b++ )
+			{
+				block_job& bj = blocks[b];
+				const double fStart = f;
+				bj.d_holder->d_frozen.assign( x.begin(), x.begin() + n );
+				for( size_t j = 0; j < bj.d_vars.size(); j++ )
+					bj.d_holder->d_frozen[ bj.d_vars[j] ] = s_nan;
+				bj.d_x = x;
+				if( !jacobi )
+				{
+					run_block( bj );
+					busy += bj.d_lastSeconds;
+					wall += bj.d_lastSeconds;
+					if( bj.d_res > 0 && !better( maximize, f, bj.d_f ) )
+					{
+						x = bj.d_x;
+						f = bj.d_f;
+					}
+					bj.d_gains.push_back( ( maximize ) ? f - fStart : fStart - f );
+				}
+			}
+			if( jacobi )
+			{
+				const double start = now_seconds();
+				pool.run( block_task, &blocks, int( blocks.size() ) );
+				const double w = now_seconds() - start;
+				wall += w;
+				// merge; falls back to the best single block if the merged point is worse
+				for( b = 0; b < blocks.size(); b++ )
+				{
+					busy += blocks[b].d_lastSeconds;
+					if( blocks[b].d_res > 0 )
+						for( size_t j = 0; j < blocks[b].d_vars.size(); j++ )
+							x[ blocks[b].d_vars[j] ] = blocks[b].d_x[ blocks[b].d_vars[j] ];
+				}
+				double fm;
+				{
+					optimize_run run;
+					begin_run( run, holder );
+					fm = holder->d_objective.d_f( n, &x[0], 0, holder->d_objective.d_data );
+					end_run( run );
+				}
+				int best = -1;
+				for( b = 0; b < blocks.size(); b++ )
+				{
+					const double g = ( maximize ) ? blocks[b].d_f - fPrev : fPrev - blocks[b].d_f;
+					blocks[b].d_gains.push_back( ( blocks[b].d_res > 0 ) ? g : 0.0 );
+					if( blocks[b].d_res > 0 && ( best < 0 || better( maximize, blocks[b].d_f, blocks[best].d_f ) ) )
+						best = int( b );
+				}
+				if( best >= 0 && !( fm == fm && !better( maximize, blocks[best].d_f, fm ) ) )
+				{
+					x = blocks[best].d_x;
+					fm = blocks[best].d_f;
+				}
+				if( fm == fm && !better( maximize, fPrev, fm ) )
+					f = fm;
+				else
+					x = prev;
+			}
 
-static int set_xtol_abs1( lua_State *L )
-{
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double tol = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_xtol_abs1( holder->d_obj, tol ) );
-	return 1;
+			// per block and overall convergence, the criteria of the full optimizer
+			bool stopped = false;
+			for( b = 0; b < blocks.size(); b++ )
+			{
+				block_job& bj = blocks[b];
+				bj.d_move = 0.0;
+				for( size_t j = 0; j < bj.d_vars.size(); j++ )
+				{
+					const double d = std::fabs( x[ bj.d_vars[j] ] - prev[ bj.d_vars[j] ] );
+					if( d > bj.d_move )
+						bj.d_move = d;
+				}
+				bj.d_converged = x_converged( holder->d_obj, &x[0], &prev[0], bj.d_vars, xtolAbs );
+				if( bj.d_res == NLOPT_FORCED_STOP || bj.d_res < 0 )
+					stopped = true;
+				if( bj.d_res < 0 && bj.d_res != NLOPT_FORCED_STOP && failed < 0 )
+					failed = int( b );
+				if( bj.d_holder->d_errors )
+				{
+					if( holder->d_errors == 0 )
+						holder->d_error = bj.d_holder->d_error;
+					holder->d_errors += bj.d_holder->d_errors;
+					holder->d_exceeded += bj.d_holder->d_exceeded;
+					bj.d_holder->d_errors = 0;
+				}
+			}
+			const double df = std::fabs( f - fPrev );
+			if( stopped || ( holder->d_cancel && holder->d_cancel->cancelled() ) )
+				res = NLOPT_FORCED_STOP;
+			else if( ( maximize ) ? f >= stopval : f <= stopval )
+				res = NLOPT_STOPVAL_REACHED;
+			else if( ( ftolAbs > 0 && df <= ftolAbs ) || ( ftolRel > 0 && df <= ftolRel * std::fabs( f ) ) )
+				res = NLOPT_FTOL_REACHED;
+			else if( x_converged( holder->d_obj, &x[0], &prev[0], all, xtolAbs ) )
+				res = NLOPT_XTOL_REACHED;
+		}
+	}
+	if( failed >= 0 )
+	{
+		const int code = blocks[failed].d_res;
+		free_blocks( blocks );
+		raise_run_error( L, holder );
+		luaL_error( L, "optimization of group %d failed with result %d", failed + 1, code );
+	}
+
+	for( i = 0; i < n; i++ )
+	{
+		lua_pushnumber( L, x[i] );
+		lua_rawseti( L, xt, i + 1 );
+	}
+	lua_pushinteger( L, res );
+	lua_pushnumber( L, f );
+	lua_createtable( L, 0, 6 );
+	lua_pushinteger( L, sweep );
+	lua_setfield( L, -2, "sweeps" );
+	lua_pushinteger( L, threads );
+	lua_setfield( L, -2, "threads" );
+	lua_pushnumber( L, wall );
+	lua_setfield( L, -2, "wall_seconds" );
+	lua_pushnumber( L, busy );
+	lua_setfield( L, -2, "busy_seconds" );
+	// busy time of the blocks relative to the time the threads were available
+	lua_pushnumber( L, ( wall > 0 ) ? busy / ( wall * threads ) : 1.0 );
+	lua_setfield( L, -2, "parallel_efficiency" );
+	lua_createtable( L, int( blocks.size() ), 0 );
+	for( size_t b = 0; b < blocks.size(); b++ )
+	{
+		const block_job& bj = blocks[b];
+		lua_createtable( L, 0, 8 );
+		lua_pushinteger( L, int( bj.d_vars.size() ) );
+		lua_setfield( L, -2, "size" );
+		lua_pushinteger( L, bj.d_evals );
+		lua_setfield( L, -2, "evals" );
+		lua_pushnumber( L, bj.d_seconds );
+		lua_setfield( L, -2, "seconds" );
+		lua_pushinteger( L, bj.d_res );
+		lua_setfield( L, -2, "result" );
+		lua_pushnumber( L, bj.d_move );
+		lua_setfield( L, -2, "last_move" );
+		lua_pushboolean( L, bj.d_converged );
+		lua_setfield( L, -2, "converged" );
+		lua_createtable( L, int( bj.d_gains.size() ), 0 );
+		for( size_t k = 0; k < bj.d_gains.size(); k++ )
+		{
+			lua_pushnumber( L, bj.d_gains[k] );
+			lua_rawseti( L, -2, int( k ) + 1 );
+		}
+		lua_setfield( L, -2, "gains" );
+		lua_rawseti( L, -2, int( b ) + 1 );
+	}
+	lua_setfield( L, -2, "blocks" );
+	free_blocks( blocks );
+	raise_run_error( L, holder );
+	return 3;
 }
 
-static int set_maxeval( lua_State *L )
+// Process pools
+
+static int set_process_pool( lua_State *L )
 {
+	// opt:set_process_pool( { workers, slots } | false )
 	nlopt_opt_holder* holder = check( L, 1 );
-	const int val = luaL_checkinteger( L, 2 );
-	lua_pushinteger( L, nlopt_set_maxeval( holder->d_obj, val ) );
-	return 1;
+	destroy_process_pool( holder->d_procPool );
+	holder->d_procPool = 0;
+	if( lua_isnoneornil( L, 2 ) || ( lua_isboolean( L, 2 ) && !lua_toboolean( L, 2 ) ) )
+		return 0;
+#ifdef _WIN32
+	luaL_error( L, "process pools are not supported on this platform" );
+#else
+	int workers = hardware_cores();
+	int slots = 0;
+	if( lua_istable( L, 2 ) )
+	{
+		workers = getfieldint( L, 2, "workers", workers );
+		slots = getfieldint( L, 2, "slots", slots );
+	}
+	if( workers < 1 )
+		luaL_argerror( L, 2, "expecting at least one worker" );
+	if( slots < workers )
+		slots = 2 * workers;
+	holder->d_procPool = new process_pool( workers, slots );
+#endif
+	return 0;
 }
 
-static int get_maxeval( lua_State *L )
+static int get_process_pool_stats( lua_State *L )
 {
 	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushinteger( L, nlopt_get_maxeval( holder->d_obj ) );
-	return 1;
+#ifndef _WIN32
+	if( process_pool* pool = holder->d_procPool )
+	{
+		lua_createtable( L, 0, 6 );
+		lua_pushinteger( L, pool->d_workers );
+		lua_setfield( L, -2, "workers" );
+		lua_pushinteger( L, pool->d_slots );
+		lua_setfield( L, -2, "slots" );
+		lua_pushnumber( L, pool->d_evals );
+		lua_setfield( L, -2, "evaluations" );
+		lua_pushinteger( L, pool->d_restarts );
+		lua_setfield( L, -2, "restarts" );
+		lua_pushinteger( L, pool->d_requeued );
+		lua_setfield( L, -2, "requeued" );
+		lua_pushinteger( L, pool->d_failed );
+		lua_setfield( L, -2, "failed" );
+		return 1;
+	}
+#endif
+	(void)holder;
+	return 0;
 }
 
-static int set_maxtime( lua_State *L )
+// Evaluation stores
+
+static int set_eval_store( lua_State *L )
 {
+	// opt:set_eval_store( path | false, { model = string, capacity = integer } )
 	nlopt_opt_holder* holder = check( L, 1 );
-	const double val = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_maxtime( holder->d_obj, val ) );
-	return 1;
+	delete holder->d_store;
+	holder->d_store = 0;
+	if( lua_isnoneornil( L, 2 ) || ( lua_isboolean( L, 2 ) && !lua_toboolean( L, 2 ) ) )
+		return 0;
+	const char* path = luaL_checkstring( L, 2 );
+	std::string model = "default";
+	int capacity = 1 << 16;
+	if( lua_istable( L, 3 ) )
+	{
+		lua_getfield( L, 3, "model" );
+		if( lua_isstring( L, -1 ) )
+			model = lua_tostring( L, -1 );
+		lua_pop( L, 1 );
+		capacity = getfieldint( L, 3, "capacity", capacity );
+	}
+	if( capacity < 1 )
+		luaL_argerror( L, 3, "capacity must be positive" );
+	// room for the values and gradients of the functions registered so far
+	const unsigned int n = nlopt_get_dimension( holder->d_obj );
+	unsigned int m = 1;
+	size_t i;
+	for( i = 0; i < holder->d_inequality.size(); i++ )
+		m = std::max( m, holder->d_inequality[i].d_m );
+	for( i = 0; i < holder->d_equality.size(); i++ )
+		m = std::max( m, holder->d_equality[i].d_m );
+	eval_store* store = new eval_store;
+	if( const char* err = store->open( path, model, n, m * ( n + 1 ), (unsigned long long)capacity ) )
+	{
+		delete store;
+		luaL_error( L, "set_eval_store %s: %s", path, err );
+	}
+	holder->d_store = store;
+	return 0;
 }
 
-static int get_maxtime( lua_State *L )
+static int get_eval_store_stats( lua_State *L )
 {
 	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_maxtime( holder->d_obj ) );
+	eval_store* store = holder->d_store;
+	if( store == 0 )
+		return 0;
+	double hits, misses, stored, full;
+	{
+		lock_guard guard( s_storeLock );
+		hits = store->d_hits;
+		misses = store->d_misses;
+		stored = store->d_stored;
+		full = store->d_full;
+	}
+	lua_createtable( L, 0, 8 );
+	lua_pushstring( L, store->d_path.c_str() );
+	lua_setfield( L, -2, "path" );
+	lua_pushstring( L, store->d_model.c_str() );
+	lua_setfield( L, -2, "model" );
+	lua_pushnumber( L, hits );
+	lua_setfield( L, -2, "hits" );
+	lua_pushnumber( L, misses );
+	lua_setfield( L, -2, "misses" );
+	lua_pushnumber( L, stored );
+	lua_setfield( L, -2, "stored" );
+	lua_pushnumber( L, full );
+	lua_setfield( L, -2, "full" );
+	// written by other processes too
+	lua_pushnumber( L, double( store->head()->d_count ) );
+	lua_setfield( L, -2, "records" );
+	lua_pushnumber( L, double( store->head()->d_capacity ) );
+	lua_setfield( L, -2, "capacity" );
 	return 1;
 }
 
-static int force_stop( lua_State *L )
+// Reuse of nearby evaluations
+
+static int set_eval_reuse( lua_State *L )
 {
+	// opt:set_eval_reuse( { tol = number, strict = boolean, max_points = integer } | nil )
 	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_force_stop( holder->d_obj ) );
-	return 1;
+	delete holder->d_reuse;
+	holder->d_reuse = 0;
+	if( lua_isnoneornil( L, 2 ) )
+		return 0;
+	luaL_checktype( L, 2, LUA_TTABLE );
+	lua_getfield( L, 2, "tol" );
+	const double tol = luaL_optnumber( L, -1, 1e-9 );
+	lua_getfield( L, 2, "strict" );
+	const bool strict = lua_isnil( L, -1 ) || lua_toboolean( L, -1 );
+	lua_pop( L, 2 );
+	if( !( tol >= 0 ) )
+		luaL_argerror( L, 2, "tol must not be negative" );
+	eval_reuse* reuse = new eval_reuse;
+	reuse->d_tol = tol;
+	reuse->d_strict = strict;
+	reuse->d_maxPoints = std::max( 1, getfieldint( L, 2, "max_points", reuse->d_maxPoints ) );
+	holder->d_reuse = reuse;
+	return 0;
 }
 
-static int set_force_stop( lua_State *L )
+static int get_eval_reuse_stats( lua_State *L )
 {
 	nlopt_opt_holder* holder = check( L, 1 );
-	const int val = luaL_checkinteger( L, 2 );
-	lua_pushinteger( L, nlopt_set_force_stop( holder->d_obj, val ) );
+	const eval_reuse* reuse = holder->d_reuse;
+	if( reuse == 0 )
+		return 0;
+	lua_createtable( L, 0, 8 );
+	lua_pushinteger( L, reuse->d_hits );
+	lua_setfield( L, -2, "hits" );
+	lua_pushinteger( L, reuse->d_misses );
+	lua_setfield( L, -2, "misses" );
+	lua_pushnumber( L, ( reuse->d_hits + reuse->d_misses ) ? double( reuse->d_hits ) / ( reuse->d_hits + reuse->d_misses ) : 0.0 );
+	lua_setfield( L, -2, "hit_rate" );
+	lua_pushinteger( L, reuse->d_bins[0] );
+	lua_setfield( L, -2, "exact" );
+	lua_pushnumber( L, ( reuse->d_hits ) ? reuse->d_sumDist / reuse->d_hits : 0.0 );
+	lua_setfield( L, -2, "mean_distance" );
+	lua_pushnumber( L, reuse->d_maxDist );
+	lua_setfield( L, -2, "max_distance" );
+	lua_pushinteger( L, reuse->points() );
+	lua_setfield( L, -2, "points" );
+	// hits by distance, the upper bound of each bin and its count
+	lua_createtable( L, eval_reuse::Bins - 1, 0 );
+	double bound = reuse->d_tol;
+	for( int i = 1; i < eval_reuse::Bins; i++ )
+	{
+		lua_createtable( L, 0, 2 );
+		lua_pushnumber( L, bound );
+		lua_setfield( L, -2, "upper" );
+		lua_pushinteger( L, reuse->d_bins[i] );
+		lua_setfield( L, -2, "count" );
+		lua_rawseti( L, -2, i );
+		bound *= 0.1;
+	}
+	lua_setfield( L, -2, "distances" );
 	return 1;
 }
 
-static int get_force_stop( lua_State *L )
+// Timeline profiles
+
+static std::string s_profilePath;
+
+static int profile_start( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushinteger( L, nlopt_get_force_stop( holder->d_obj ) );
-	return 1;
+	// nlopt.profile_start( path ); the trace is written by profile_stop
+	const char* path = luaL_checkstring( L, 1 );
+	lock_guard guard( s_profileLock );
+	atomic_exchange( &s_profiling, 0 );
+	for( profile_buffer* b = s_profileBuffers; b; b = b->d_next )
+	{
+		atomic_exchange( &b->d_count, 0 );
+		atomic_exchange( &b->d_dropped, 0 );
+	}
+	s_profilePath = path;
+	s_profileStart = now_seconds();
+	atomic_exchange( &s_profiling, 1 );
+	return 0;
 }
 
-static int optimize( lua_State *L )
+static int profile_stop( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TTABLE );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> x( n );
-	int i;
-	for( i = 0; i < n; i++ )
+	// returns a table with spans, dropped and threads, or nil and a message if the file cannot be written
+	if( !s_profiling )
+		return 0;
+	atomic_exchange( &s_profiling, 0 );
+	double spans = 0, dropped = 0;
+	int threads = 0;
+	bool ok;
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		x[i] = lua_tonumber( L, -1 );
-		lua_pop( L, 1 );
+		lock_guard guard( s_profileLock );
+		FILE* f = ::fopen( s_profilePath.c_str(), "w" );
+		ok = f != 0;
+		if( ok )
+		{
+			::fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+			const char* sep = "\n";
+			for( profile_buffer* b = s_profileBuffers; b; b = b->d_next )
+			{
+				const long count = atomic_load( &b->d_count );
+				if( count == 0 )
+					continue;
+				threads++;
+				::fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+					sep, b->d_tid, b->d_tid );
+				sep = ",\n";
+				for( long i = 0; i < count; i++ )
+				{
+					const profile_span& sp = b->d_spans[i];
+					const double ts = std::max( 0.0, sp.d_start - s_profileStart ) * 1e6;
+					::fprintf( f, ",\n{\"name\":\"%s\",\"cat\":\"nlopt\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+						sp.d_name, b->d_tid, ts, std::max( 0.0, sp.d_end - sp.d_start ) * 1e6 );
+				}
+				spans += count;
+				dropped += atomic_load( &b->d_dropped );
+			}
+			::fprintf( f, "\n]}\n" );
+			ok = ::fclose( f ) == 0;
+		}
 	}
-	double opt_f;
-	lua_pushinteger( L, nlopt_optimize( holder->d_obj, &x[0], &opt_f ) );
-	lua_pushnumber( L, opt_f );
-	for( i = 0; i < n; i++ )
+	if( !ok )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_pushnumber( L, x[i] );
-		lua_settable( L, 2 );
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s", s_profilePath.c_str() );
+		return 2;
 	}
-	return 2;
+	lua_createtable( L, 0, 3 );
+	lua_pushnumber( L, spans );
+	lua_setfield( L, -2, "spans" );
+	lua_pushnumber( L, dropped );
+	lua_setfield( L, -2, "dropped" );
+	lua_pushinteger( L, threads );
+	lua_setfield( L, -2, "threads" );
+	return 1;
 }
 
-static int set_local_optimizer( lua_State *L )
+// Live metrics
+
+static int set_metrics( lua_State *L )
 {
+	// opt:set_metrics( string label | false ); returns the name of the shared memory segment
 	nlopt_opt_holder* holder = check( L, 1 );
-	nlopt_opt_holder* local_opt = check( L, 2 );
-	lua_pushinteger( L, nlopt_set_local_optimizer(holder->d_obj, local_opt->d_obj ) );
+	metrics_release( holder->d_metrics );
+	holder->d_metrics = 0;
+	if( lua_isnoneornil( L, 2 ) || ( lua_isboolean( L, 2 ) && !lua_toboolean( L, 2 ) ) )
+		return 0;
+	const char* label = luaL_checkstring( L, 2 );
+#ifdef _WIN32
+	luaL_error( L, "live metrics are not supported on this platform" );
+#else
+	holder->d_metrics = metrics_claim( label );
+	if( holder->d_metrics == 0 )
+		luaL_error( L, ( s_metrics ) ? "no free metrics slot" : "cannot create the metrics segment" );
+#endif
+	lua_pushstring( L, s_metricsName );
 	return 1;
 }
 
-static int set_initial_step( lua_State *L )
+static int metrics_dump( lua_State *L )
 {
-	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TTABLE );
-	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> dx( n );
-	for( int i = 0; i < n; i++ )
+	// nlopt.metrics_dump( path ): the metrics in the Prometheus text exposition format; the file
+	// is replaced atomically, as the textfile collector of node_exporter expects
+	const char* path = luaL_checkstring( L, 1 );
+	std::string tmp = std::string( path ) + ".tmp";
+	FILE* f = ::fopen( tmp.c_str(), "w" );
+	if( f == 0 )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		dx[i] = lua_tonumber( L, -1 );
-		lua_pop( L, 1 );
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s", tmp.c_str() );
+		return 2;
+	}
+	static const char* names[] =
+	{
+		"luanlopt_evaluations_total", "counter", "Successful evaluations of the objective",
+		"luanlopt_callback_errors_total", "counter", "Evaluations which failed",
+		"luanlopt_runs_total", "counter", "Optimizations started",
+		"luanlopt_running", "gauge", "Optimizations running",
+		"luanlopt_best_f", "gauge", "Best value of the current or last optimization",
+		"luanlopt_seconds_since_improvement", "gauge", "Time since the best value was last improved",
+		0
+	};
+	const double now = now_seconds();
+	for( int k = 0; names[k]; k += 3 )
+	{
+		::fprintf( f, "# HELP %s %s\n# TYPE %s %s\n", names[k], names[k + 2], names[k], names[k + 1] );
+		for( int i = 0; s_metrics && i < s_metricsSlots; i++ )
+		{
+			metrics_slot s;
+			metrics_read( &s_metrics->d_slot[i], s );
+			if( !s.d_used )
+				continue;
+			double v;
+			switch( k / 3 )
+			{
+			case 0:
+				v = double( s.d_evals );
+				break;
+			case 1:
+				v = double( s.d_errors );
+				break;
+			case 2:
+				v = double( s.d_runs );
+				break;
+			case 3:
+				v = double( s.d_running );
+				break;
+			case 4:
+				v = s.d_best;
+				break;
+			default:
+				v = now - s.d_lastImprovement;
+				break;
+			}
+			::fprintf( f, "%s{label=\"", names[k] );
+			for( const char* c = s.d_label; *c; c++ )
+			{
+				if( *c == '"' || *c == '\\' )
+					::fputc( '\\', f );
+				::fputc( ( *c == '\n' ) ? ' ' : *c, f );
+			}
+			if( v != v )
+				::fprintf( f, "\",slot=\"%d\"} NaN\n", i );
+			else
+				::fprintf( f, "\",slot=\"%d\"} %.17g\n", i, v );
+		}
 	}
-	lua_pushinteger( L, nlopt_set_initial_step( holder->d_obj, &dx[0] ) );
+	const bool ok = ::fclose( f ) == 0;
+#ifdef _WIN32
+	const bool moved = ok && MoveFileExA( tmp.c_str(), path, MOVEFILE_REPLACE_EXISTING );
+#else
+	const bool moved = ok && ::rename( tmp.c_str(), path ) == 0;
+#endif
+	if( !moved )
+	{
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s", path );
+		return 2;
+	}
+	lua_pushboolean( L, 1 );
 	return 1;
 }
 
-static int set_initial_step1( lua_State *L )
-{
-	nlopt_opt_holder* holder = check( L, 1 );
-	const double dx = luaL_checknumber( L, 2 );
-	lua_pushinteger( L, nlopt_set_initial_step1( holder->d_obj, dx ) );
-	return 1;
-}
+// Warm-started re-solves
 
-static int get_initial_step( lua_State *L )
+static int resolve( lua_State *L )
 {
+	// opt:resolve( new_f_data, { x = array | nil, step = "adaptive" | "keep" | "default" } )
 	nlopt_opt_holder* holder = check( L, 1 );
-	luaL_checktype( L, 2, LUA_TTABLE );
+	const int opts = 3;
 	const int n = nlopt_get_dimension( holder->d_obj );
-	std::vector<double> x( n );
+	warm_start& w = holder->d_warm;
+	if( !lua_isnoneornil( L, 2 ) && holder->d_objective.d_data )
+	{
+		if( !static_cast<func_context*>( holder->d_objective.d_data )->set_f_data( L, 2 ) )
+			luaL_argerror( L, 2, "the objective has no f_data" );
+		forget_history( holder );
+		holder->d_generation++;
+	}
+	static const char* steps[] = { "adaptive", "keep", "default", 0 };
+	int step = 0;
+	bool hasX = false;
+	if( lua_istable( L, opts ) )
+	{
+		lua_getfield( L, opts, "step" );
+		if( !lua_isnil( L, -1 ) )
+			step = luaL_checkoption( L, -1, 0, steps );
+		lua_pop( L, 1 );
+		lua_getfield( L, opts, "x" );
+		hasX = lua_istable( L, -1 );
+		lua_pop( L, 1 );
+	}else if( !lua_isnoneornil( L, opts ) )
+		luaL_typerror( L, opts, "table" );
+	if( !hasX && w.d_solves == 0 )
+		luaL_error( L, "no previous solution; pass options.x" );
+	if( w.d_x.size() != size_t( n + 1 ) )
+	{
+		// once; later re-solves don't allocate
+		w.d_x.assign( n + 1, 0.0 );
+		w.d_prev.assign( n + 1, 0.0 );
+		w.d_step.assign( n + 1, 0.0 );
+	}
 	int i;
+	// the last move, before the solutions are shifted
 	for( i = 0; i < n; i++ )
+		w.d_step[i] = 2.0 * std::fabs( w.d_x[i] - w.d_prev[i] );
+	std::copy( w.d_x.begin(), w.d_x.end(), w.d_prev.begin() );
+	if( hasX )
 	{
-		lua_pushinteger( L, i + 1 );
-		lua_gettable( L, 2 );
-		x[i] = lua_tonumber( L, -1 );
+		lua_getfield( L, opts, "x" );
+		const int xt = lua_gettop( L );
+		if( holder->d_small )
+			holder->d_small->read( L, xt, &w.d_x[0] );
+		else
+			for( i = 0; i < n; i++ )
+			{
+				lua_rawgeti( L, xt, i + 1 );
+				w.d_x[i] = lua_tonumber( L, -1 );
+				lua_pop( L, 1 );
+			}
 		lua_pop( L, 1 );
 	}
-	std::vector<double> dx( n );
-	lua_pushinteger( L, nlopt_get_initial_step( holder->d_obj, &x[0], &dx[0] ) );
-	lua_createtable( L, n, 0 );
-	for( i = 0; i < n; i++ )
+	if( step == 0 )
 	{
-		lua_pushnumber( L, dx[i] );
-		lua_rawseti( L, -2, i + 1 );
+		if( w.d_step0.empty() )
+		{
+			// the estimate of NLopt or the step set by the user
+			w.d_step0.assign( n + 1, 0.0 );
+			nlopt_get_initial_step( holder->d_obj, &w.d_x[0], &w.d_step0[0] );
+		}
+		if( w.d_solves > 1 )
+		{
+			// twice the last move, but at least 1/1000 of the initial estimate
+			for( i = 0; i < n; i++ )
+			{
+				const double lo = 1e-3 * w.d_step0[i];
+				if( w.d_step[i] < lo )
+					w.d_step[i] = lo;
+				else if( w.d_step[i] > w.d_step0[i] )
+					w.d_step[i] = w.d_step0[i];
+			}
+		}
+		// NLopt rejects zero steps, e.g. of fixed variables; then the initial estimate is used,
+		// and if even that is rejected the default of NLopt
+		if( ( w.d_solves <= 1 || nlopt_set_initial_step( holder->d_obj, &w.d_step[0] ) <= 0 ) &&
+				nlopt_set_initial_step( holder->d_obj, &w.d_step0[0] ) <= 0 )
+			nlopt_set_initial_step( holder->d_obj, 0 );
+	}else if( step == 2 )
+		nlopt_set_initial_step( holder->d_obj, 0 );
+	double opt_f;
+	const nlopt_result res = optimize_holder( L, holder, &w.d_x[0], &opt_f );
+	w.d_solves++;
+	if( step != 1 )
+		nlopt_set_initial_step( holder->d_obj, ( w.d_user.empty() ) ? 0 : &w.d_user[0] );
+	lua_pushinteger( L, res );
+	lua_pushnumber( L, opt_f );
+	if( hasX )
+	{
+		lua_getfield( L, opts, "x" );
+		if( holder->d_small )
+			holder->d_small->write( L, lua_gettop( L ), &w.d_x[0] );
+		else
+			for( i = 0; i < n; i++ )
+			{
+				lua_pushnumber( L, w.d_x[i] );
+				lua_rawseti( L, -2, i + 1 );
+			}
+		lua_pop( L, 1 );
 	}
+	raise_run_error( L, holder );
 	return 2;
 }
 
-static int set_population( lua_State *L )
-{
-	nlopt_opt_holder* holder = check( L, 1 );
-	const lua_Integer pop = luaL_checkinteger( L, 2 );
-	if( pop < 0 )
-		luaL_argerror( L, 2, "expecting unsigned integer" );
-	lua_pushinteger( L, nlopt_set_population( holder->d_obj, (unsigned int)pop ) );
-	return 1;
-}
+// Real-time mode
 
-static int set_vector_storage( lua_State *L )
+static int set_realtime( lua_State *L )
 {
+	// opt:set_realtime( { gc = "none" | "pause" | "step", gc_step } | false )
 	nlopt_opt_holder* holder = check( L, 1 );
-	const lua_Integer M = luaL_checkinteger( L, 2 );
-	if( M < 0 )
-		luaL_argerror( L, 2, "expecting unsigned integer" );
-	lua_pushinteger( L, nlopt_set_vector_storage( holder->d_obj, (unsigned int)M ) );
-	return 1;
+	if( lua_isboolean( L, 2 ) && !lua_toboolean( L, 2 ) )
+	{
+		holder->d_rt.d_on = false;
+		return 0;
+	}
+	realtime_settings rt;
+	rt.d_on = true;
+	if( lua_istable( L, 2 ) )
+	{
+		lua_getfield( L, 2, "gc" );
+		if( !lua_isnil( L, -1 ) )
+			rt.d_gc = luaL_checkoption( L, -1, 0, s_gcModes );
+		lua_pop( L, 1 );
+		rt.d_gcStep = getfieldint( L, 2, "gc_step", rt.d_gcStep );
+	}
+	holder->d_rt = rt;
+	holder->d_rtStats = realtime_stats();
+	prepare_realtime( holder );
+	return 0;
 }
 
-static int get_vector_storage( lua_State *L )
+static int get_realtime_stats( lua_State *L )
 {
 	nlopt_opt_holder* holder = check( L, 1 );
-	lua_pushnumber( L, nlopt_get_vector_storage( holder->d_obj ) );
+	const realtime_stats& st = holder->d_rtStats;
+	lua_createtable( L, 0, 5 );
+	lua_pushnumber( L, st.d_allocs );
+	lua_setfield( L, -2, "allocations" );
+	lua_pushnumber( L, st.d_bytes );
+	lua_setfield( L, -2, "bytes" );
+	lua_pushinteger( L, st.d_runs );
+	lua_setfield( L, -2, "runs" );
+	lua_pushnumber( L, st.d_lastSeconds );
+	lua_setfield( L, -2, "last_seconds" );
+	lua_pushnumber( L, st.d_maxSeconds );
+	lua_setfield( L, -2, "max_seconds" );
 	return 1;
 }
 
-// Everything implemented but "Preconditioning with approximate Hessians" which is 
-// described as "somewhat experimental" by the authors of NLopt
+// Everything of the NLopt API is implemented
 
 static const luaL_Reg Methods[] =
 {
+	{ "set_cancel_token", set_cancel_token },
+	{ "set_error_policy", set_error_policy },
+	{ "get_error_policy", get_error_policy },
+	{ "last_error", last_error },
+	{ "set_eval_limits", set_eval_limits },
+	{ "optimize_async", optimize_async },
+	{ "sample", sample },
+	{ "set_surrogate", set_surrogate },
+	{ "get_surrogate_stats", get_surrogate_stats },
+	{ "set_bayesopt", set_bayesopt },
+	{ "set_precond_min_objective", set_precond_min_objective },
+	{ "set_precond_max_objective", set_precond_max_objective },
+	{ "set_realtime", set_realtime },
+	{ "resolve", resolve },
+	{ "freeze", freeze },
+	{ "set_process_pool", set_process_pool },
+	{ "get_process_pool_stats", get_process_pool_stats },
+	{ "set_eval_store", set_eval_store },
+	{ "get_eval_store_stats", get_eval_store_stats },
+	{ "set_eval_reuse", set_eval_reuse },
+	{ "get_eval_reuse_stats", get_eval_reuse_stats },
+	{ "set_metrics", set_metrics },
+	{ "get_realtime_stats", get_realtime_stats },
+	{ "get_eval_limits", get_eval_limits },
+	{ "set_incremental", set_incremental },
 	{ "get_vector_storage", get_vector_storage },
 	{ "set_vector_storage", set_vector_storage },
 	{ "set_population", set_population },
@@ -1020,6 +9297,7 @@ static const luaL_Reg Methods[] =
 	{ "add_inequality_constraint", add_inequality_constraint },
 	{ "set_max_objective", set_max_objective },
 	{ "set_min_objective", set_min_objective },
+	{ "set_min_objective_sum", set_min_objective_sum },
 	{ "get_upper_bounds", get_upper_bounds },
 	{ "get_lower_bounds", get_lower_bounds },
 	{ "set_upper_bounds1", set_upper_bounds1 },
@@ -1032,12 +9310,12 @@ static const luaL_Reg Methods[] =
 	{ NULL,	NULL }
 };
 
-static void install_nlopt_opt_s( lua_State *L, const luaL_reg* ms )
+static void install_class( lua_State *L, const char* metaName, const luaL_reg* ms, lua_CFunction gc, lua_CFunction ts )
 {
     const int stackTest = lua_gettop(L);
 
-    if( luaL_newmetatable( L, nlopt_metaName ) == 0 )
-		luaL_error( L, "metatable '%s' already registered", nlopt_metaName );
+    if( luaL_newmetatable( L, metaName ) == 0 )
+		luaL_error( L, "metatable '%s' already registered", metaName );
 
 	const int metaTable = lua_gettop(L);
 
@@ -1045,7 +9323,7 @@ static void install_nlopt_opt_s( lua_State *L, const luaL_reg* ms )
 	const int methodTable = lua_gettop(L);
 
     // Mache die methodTable unter dem publicName global zugnglich.
-	lua_pushstring(L, nlopt_metaName );
+	lua_pushstring(L, metaName );
 	lua_pushvalue(L, methodTable );
 	lua_settable(L, LUA_GLOBALSINDEX ); // TODO: ev. stattdessen als Modul einer Tabelle zuweisen
 
@@ -1061,11 +9339,11 @@ static void install_nlopt_opt_s( lua_State *L, const luaL_reg* ms )
 	lua_settable(L, metaTable);
 
 	lua_pushliteral(L, "__gc");
-	lua_pushcfunction(L , finalize_nlopt_opt_s );
+	lua_pushcfunction(L , gc );
 	lua_rawset(L, metaTable);
 
     lua_pushliteral(L, "__tostring");
-	lua_pushcfunction(L, tostring );
+	lua_pushcfunction(L, ts );
 	lua_rawset(L, metaTable);
 
 	for( const luaL_reg* l = ms; l && l->name; l++ )
@@ -1088,6 +9366,16 @@ __declspec(dllexport)
 #endif
 int luaopen_LuaNLopt(lua_State *L)
 {
+#ifdef _WIN32
+	if( s_runSlot == TLS_OUT_OF_INDEXES )
+		s_runSlot = TlsAlloc();
+	if( s_profileSlot == TLS_OUT_OF_INDEXES )
+		s_profileSlot = TlsAlloc();
+	if( s_clonesSlot == TLS_OUT_OF_INDEXES )
+		s_clonesSlot = TlsAlloc();
+	if( s_sinkSlot == TLS_OUT_OF_INDEXES )
+		s_sinkSlot = TlsAlloc();
+#endif
     luaL_register( L, LIBNAME, Reg );
     lua_pushliteral( L, "libversion" );			
     lua_pushliteral( L, LIBVERSION );
@@ -1136,6 +9424,7 @@ int luaopen_LuaNLopt(lua_State *L)
 	setfieldint( L, "LD_SLSQP", NLOPT_LD_SLSQP );
 	setfieldint( L, "LD_CCSAQ", NLOPT_LD_CCSAQ );
 	setfieldint( L, "NUM_ALGORITHMS", NLOPT_NUM_ALGORITHMS );
+	setfieldint( L, "X_BAYESOPT", X_BAYESOPT );
 	lua_setfield( L, -2, "algorithm" );
 
 	lua_newtable( L );
@@ -1152,7 +9441,23 @@ int luaopen_LuaNLopt(lua_State *L)
 	setfieldint( L, "MAXTIME_REACHED", NLOPT_MAXTIME_REACHED );
 	lua_setfield( L, -2, "result" );
 
-	install_nlopt_opt_s( L, Methods );
+	lua_newtable( L );
+	for( const luaL_reg* l = DatasetReg; l->name; l++ )
+	{
+		lua_pushcfunction( L, l->func );
+		lua_setfield( L, -2, l->name );
+	}
+	lua_setfield( L, -2, "dataset" );
+
+	install_class( L, nlopt_metaName, Methods, finalize_nlopt_opt_s, tostring );
+	install_class( L, dataset_metaName, DatasetMethods, dataset_gc, dataset_tostring );
+	install_class( L, objective_metaName, ObjectiveMethods, objective_gc, objective_tostring );
+	install_class( L, token_metaName, TokenMethods, token_gc, token_tostring );
+	install_class( L, async_metaName, AsyncMethods, async_gc, async_tostring );
+	install_class( L, scheduler_metaName, SchedulerMethods, scheduler_gc, scheduler_tostring );
+	install_class( L, matrix_metaName, MatrixMethods, matrix_gc, matrix_tostring );
+	install_class( L, precond_metaName, PrecondMethods, precond_gc, precond_tostring );
+	install_vector_class( L );
 
     return 1;
 }
@@ -0,0 +1,49 @@
+-- Benchmark of the delta-only marshalling of x (user-029): SBPLX and PRAXIS at n = 1000.
+-- usage: lua marshal_sbplx_praxis.lua [ n [ maxeval ] ]
+-- Reports the time per evaluation and the writes into the "x" table: n per evaluation
+-- without delta marshalling, the number of changed elements with it. The changed elements
+-- are counted in Lua against a copy of the previous x.
+
+local nlopt = require "LuaNLopt"
+
+local n = tonumber( arg and arg[1] ) or 1000
+local maxeval = tonumber( arg and arg[2] ) or 20000
+
+local function run( name, algorithm )
+	local opt = nlopt.create( algorithm, n )
+	local lb, ub, x, prev = {}, {}, {}, {}
+	for i = 1, n do
+		lb[i] = -2
+		ub[i] = 2
+		x[i] = 1
+		prev[i] = 0 / 0
+	end
+	opt:set_lower_bounds( lb )
+	opt:set_upper_bounds( ub )
+	opt:set_maxeval( maxeval )
+	local evals, changed = 0, 0
+	opt:set_min_objective( function( n, x )
+		evals = evals + 1
+		local f = 0
+		for i = 1, n do
+			local xi = x[i]
+			if xi ~= prev[i] then
+				changed = changed + 1
+				prev[i] = xi
+			end
+			local d = xi - i / n
+			f = f + d * d
+		end
+		return f
+	end )
+	local t = os.clock()
+	local res, f = opt:optimize( x )
+	t = os.clock() - t
+	print( string.format( "%-6s n=%d result=%d f=%.6g evals=%d %.1f us/eval", name, n, res, f, evals,
+		1e6 * t / math.max( evals, 1 ) ) )
+	print( string.format( "       x writes: %d full, %d delta (%.1f%%), %.1f per evaluation",
+		evals * n, changed, 100 * changed / math.max( evals * n, 1 ), changed / math.max( evals, 1 ) ) )
+end
+
+run( "SBPLX", nlopt.algorithm.LN_SBPLX )
+run( "PRAXIS", nlopt.algorithm.LN_PRAXIS )
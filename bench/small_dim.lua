@@ -0,0 +1,57 @@
+-- Benchmark of the fixed-dimension fast paths (user-039): many tiny optimizations.
+-- usage: lua small_dim.lua [ count [ n ] ]
+-- Runs count optimizations of a quadratic in n dimensions (default 1000000, 2) with the
+-- objective taking the x table and with the unpacked objective f( x1, ..., xn, f_data, need_grad ),
+-- and for comparison the table objective at n = 17, which has no fast path.
+
+local nlopt = require "LuaNLopt"
+
+local count = tonumber( arg and arg[1] ) or 1000000
+local n = tonumber( arg and arg[2] ) or 2
+local maxeval = 20
+
+local function table_objective( n, x )
+	local f = 0
+	for i = 1, n do
+		local d = x[i] - 0.5
+		f = f + d * d
+	end
+	return f
+end
+
+local unpacked =
+{
+	function( x1 ) return ( x1 - 0.5 ) ^ 2 end,
+	function( x1, x2 ) return ( x1 - 0.5 ) ^ 2 + ( x2 - 0.5 ) ^ 2 end,
+	function( x1, x2, x3 ) return ( x1 - 0.5 ) ^ 2 + ( x2 - 0.5 ) ^ 2 + ( x3 - 0.5 ) ^ 2 end,
+	function( x1, x2, x3, x4 ) return ( x1 - 0.5 ) ^ 2 + ( x2 - 0.5 ) ^ 2 + ( x3 - 0.5 ) ^ 2 + ( x4 - 0.5 ) ^ 2 end,
+}
+
+local function run( name, dim, func, options )
+	local opt = nlopt.create( nlopt.algorithm.LN_NELDERMEAD, dim )
+	local lb, ub, x = {}, {}, {}
+	for i = 1, dim do
+		lb[i] = -1
+		ub[i] = 1
+	end
+	opt:set_lower_bounds( lb )
+	opt:set_upper_bounds( ub )
+	opt:set_maxeval( maxeval )
+	opt:set_min_objective( func, nil, options )
+	local t = os.clock()
+	for k = 1, count do
+		for i = 1, dim do
+			x[i] = 0
+		end
+		opt:optimize( x )
+	end
+	t = os.clock() - t
+	print( string.format( "%-24s n=%-2d %d optimizations %.2f s, %.2f us/optimization, %.3f us/evaluation",
+		name, dim, count, t, 1e6 * t / count, 1e6 * t / ( count * maxeval ) ) )
+end
+
+run( "table objective", n, table_objective )
+if unpacked[n] then
+	run( "unpacked objective", n, unpacked[n], { unpacked = true } )
+end
+run( "table objective, generic", 17, table_objective )
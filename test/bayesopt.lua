@@ -0,0 +1,36 @@
+-- Smoke test of nlopt.algorithm.X_BAYESOPT (user-037).
+-- usage: lua bayesopt.lua
+
+local nlopt = require "LuaNLopt"
+
+local function run( settings )
+	local opt = nlopt.create( nlopt.algorithm.X_BAYESOPT, 2 )
+	assert( opt:get_algorithm() == nlopt.algorithm.X_BAYESOPT )
+	opt:set_lower_bounds{ -2, -2 }
+	opt:set_upper_bounds{ 2, 2 }
+	local calls = 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		return ( x[1] - 0.5 ) ^ 2 + ( x[2] + 0.3 ) ^ 2
+	end )
+	opt:set_bayesopt( settings )
+	opt:set_maxeval( 30 )
+	local x = { 1.5, 1.5 }
+	local res, f = opt:optimize( x )
+	assert( res > 0 and calls <= 30, "optimize" )
+	assert( f < 0.05, "minimum missed: " .. f )
+	return f, x
+end
+
+print( nlopt.algorithm_name( nlopt.algorithm.X_BAYESOPT ) )
+local f1, x1 = run{ seed = 1 }
+local f2, x2 = run{ seed = 1 }
+assert( f1 == f2 and x1[1] == x2[1], "not reproducible by seed" )
+run{ seed = 2, batch = 3, initial = 8 }
+
+-- unbounded problems are rejected
+local opt = nlopt.create( nlopt.algorithm.X_BAYESOPT, 1 )
+opt:set_min_objective( function( n, x ) return x[1] ^ 2 end )
+local ok, res = pcall( opt.optimize, opt, { 0 } )
+assert( not ok or res < 0 )
+print( "ok" )
@@ -0,0 +1,57 @@
+-- Smoke test of nlopt.block_coordinate (user-043).
+-- usage: lua block_coordinate.lua
+
+local nlopt = require "LuaNLopt"
+
+local n = 6
+local function f( n, x, grad )
+	-- weakly coupled neighbours
+	local s = 0
+	for i = 1, n do
+		s = s + ( x[i] - i ) ^ 2
+		if grad then
+			grad[i] = 2 * ( x[i] - i )
+		end
+	end
+	for i = 1, n - 1 do
+		s = s + 0.1 * x[i] * x[i + 1]
+		if grad then
+			grad[i] = grad[i] + 0.1 * x[i + 1]
+			grad[i + 1] = grad[i + 1] + 0.1 * x[i]
+		end
+	end
+	return s
+end
+
+local reference
+do
+	local opt = nlopt.create( nlopt.algorithm.LD_MMA, n )
+	opt:set_min_objective( f )
+	opt:set_xtol_rel( 1e-10 )
+	opt:set_maxeval( 2000 )
+	local _, fmin = opt:optimize{ 0, 0, 0, 0, 0, 0 }
+	reference = fmin
+end
+
+for _, mode in ipairs( { "gauss_seidel", "jacobi" } ) do
+	local opt = nlopt.create( nlopt.algorithm.LD_MMA, n )
+	opt:set_min_objective( f )
+	opt:set_xtol_rel( 1e-8 )
+	opt:set_maxeval( 200 )
+	local x = { 0, 0, 0, 0, 0, 0 }
+	local res, fmin, stats = nlopt.block_coordinate( opt, { { 1, 2 }, { 3, 4 }, { 5, 6 } },
+		{ x = x, mode = mode, sweeps = 30 } )
+	assert( res > 0, mode .. ": result " .. res )
+	assert( math.abs( fmin - reference ) < 1e-4, mode .. ": minimum missed" )
+	assert( stats.sweeps >= 1 and #stats.blocks == 3 and stats.blocks[1].size == 2 )
+	print( string.format( "%-12s %d sweeps, f %.8g (%.8g)", mode, stats.sweeps, fmin, reference ) )
+end
+
+-- a failing group optimization raises an error naming the group
+local opt = nlopt.create( nlopt.algorithm.LD_MMA, n )
+opt:set_min_objective( f )
+opt:set_lower_bounds1( 1 )
+opt:set_upper_bounds1( 0 )
+local ok, msg = pcall( nlopt.block_coordinate, opt, { { 1, 2 }, { 3 } }, { x = { 0, 0, 0, 0, 0, 0 } } )
+assert( not ok and tostring( msg ):find( "group" ), "invalid group optimization: " .. tostring( msg ) )
+print( "ok" )
@@ -0,0 +1,36 @@
+-- Smoke test of nlopt.cancel_token (user-030).
+-- usage: lua cancel_token.lua
+
+local nlopt = require "LuaNLopt"
+
+local token = nlopt.cancel_token()
+assert( not token:cancelled() )
+local shared = nlopt.cancel_token( token:id() )
+assert( shared:id() == token:id() )
+
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+local calls = 0
+opt:set_min_objective( function( n, x )
+	calls = calls + 1
+	if calls == 10 then
+		shared:cancel()
+	end
+	return x[1] ^ 2 + x[2] ^ 2
+end )
+opt:set_cancel_token( token )
+opt:set_maxeval( 1000 )
+local res = opt:optimize( { 1, 1 } )
+assert( res == nlopt.result.FORCED_STOP and calls == 10, "not cancelled" )
+assert( token:cancelled() )
+
+token:reset()
+assert( not shared:cancelled() )
+calls = 11
+res = opt:optimize( { 1, 1 } )
+assert( res > 0, "the reset token still cancels" )
+
+opt:set_cancel_token( nil )
+token:cancel()
+res = opt:optimize( { 1, 1 } )
+assert( res > 0, "the removed token still cancels" )
+print( "ok" )
@@ -0,0 +1,78 @@
+-- Smoke test of the dataset-backed native models (user-026).
+-- usage: lua datasets.lua
+-- Fits each model kind to synthetic data written as CSV, converted to a binary dataset and
+-- loaded both ways; checks the gradient against finite differences and that the result does
+-- not depend on the number of threads.
+
+local nlopt = require "LuaNLopt"
+
+local csv = os.tmpname()
+local bin = os.tmpname()
+local f = assert( io.open( csv, "w" ) )
+f:write( "x,y,w\n" )
+local rows = 2000
+for i = 1, rows do
+	local x = ( i - 1 ) / ( rows - 1 ) * 10
+	local y = 3 * math.exp( -0.5 * x ) + 1 + 2 * math.exp( -( x - 5 ) ^ 2 / 2 )
+	f:write( string.format( "%.17g,%.17g,%.17g\n", x, y, 1 + ( i % 3 ) ) )
+end
+f:close()
+
+local r, c = nlopt.dataset.convert_csv( csv, bin )
+assert( r == rows and c == 3, "convert_csv" )
+local text = nlopt.dataset.load( csv )
+local mapped = nlopt.dataset.load( bin )
+assert( text:rows() == rows and mapped:rows() == rows and mapped:cols() == 3 )
+for i = 1, rows, 97 do
+	for j = 1, 3 do
+		assert( text:get( i, j ) == mapped:get( i, j ), "csv and binary dataset differ" )
+	end
+end
+
+local function check_gradient( obj, x )
+	local f0, g = obj:eval( x )
+	for i = 1, #x do
+		local h = 1e-6 * ( 1 + math.abs( x[i] ) )
+		local xp = {}
+		for j = 1, #x do
+			xp[j] = x[j]
+		end
+		xp[i] = x[i] + h
+		local fp = obj:eval( xp )
+		xp[i] = x[i] - h
+		local fm = obj:eval( xp )
+		local fd = ( fp - fm ) / ( 2 * h )
+		assert( math.abs( fd - g[i] ) <= 1e-4 * ( 1 + math.abs( fd ) ), "gradient of parameter " .. i )
+	end
+	return f0
+end
+
+local models = {
+	{ "linear", nil, { 1, -0.1 } },
+	{ "polynomial", { degree = 3 }, { 1, 0.1, 0.01, 0.001 } },
+	{ "exp_decay", nil, { 2, 0.4, 0.5 } },
+	{ "lorentzian", { peaks = 1, baseline = true }, { 1.5, 4.5, 1.2, 0.5 } },
+	{ "gaussian", { peaks = 1, baseline = true }, { 1.5, 4.5, 1.2, 0.5 } },
+}
+for _, m in ipairs( models ) do
+	local kind, options, x = m[1], m[2] or {}, m[3]
+	options.weight = 3
+	options.threads = 1
+	local single = mapped:model( kind, options )
+	options.threads = 4
+	local threaded = mapped:model( kind, options )
+	local f1 = check_gradient( single, x )
+	assert( f1 == threaded:eval( x ), kind .. ": result depends on the number of threads" )
+
+	local opt = nlopt.create( nlopt.algorithm.LD_MMA, #x )
+	opt:set_min_objective( threaded )
+	opt:set_xtol_rel( 1e-6 )
+	opt:set_maxeval( 200 )
+	local res, fmin = opt:optimize( x )
+	assert( res > 0 and fmin <= f1, kind .. ": optimize" )
+	print( string.format( "%-10s f %.6g -> %.6g", kind, f1, fmin ) )
+end
+
+os.remove( csv )
+os.remove( bin )
+print( "ok" )
@@ -0,0 +1,38 @@
+-- Smoke test of the reused x table (user-029).
+-- usage: lua delta_marshalling.lua
+-- The tables passed to the objective are the same from call to call and always hold the
+-- point requested by NLopt, also after the objective was set again.
+
+local nlopt = require "LuaNLopt"
+
+local n = 50
+for round = 1, 2 do
+	local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, n )
+	local seen, calls = nil, 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		if seen then
+			assert( rawequal( seen, x ), "x table not reused" )
+		end
+		seen = x
+		assert( #x == n )
+		local f = 0
+		for i = 1, n do
+			f = f + ( x[i] - 0.5 ) ^ 2
+		end
+		return f
+	end )
+	opt:set_maxeval( 2000 )
+	local x = {}
+	for i = 1, n do
+		x[i] = 0
+	end
+	local res, f = opt:optimize( x )
+	assert( res > 0 and f < 1e-2, "optimize" )
+	local g = 0
+	for i = 1, n do
+		g = g + ( x[i] - 0.5 ) ^ 2
+	end
+	assert( g == f, "x returned does not match f" )
+end
+print( "ok" )
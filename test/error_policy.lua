@@ -0,0 +1,67 @@
+-- Smoke test of nlopt_opt:set_error_policy and last_error (user-031).
+-- usage: lua error_policy.lua
+
+local nlopt = require "LuaNLopt"
+
+local function make( policy, penalty )
+	local opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+	local calls = 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		if calls % 5 == 0 then
+			error( "bad point" )
+		end
+		return ( x[1] - 1 ) ^ 2 + ( x[2] - 2 ) ^ 2
+	end )
+	opt:set_maxeval( 200 )
+	if policy then
+		opt:set_error_policy( policy, penalty )
+	end
+	return opt, function() return calls end
+end
+
+-- raise: optimize raises the first error after writing back the best x
+local opt, calls = make()
+assert( opt:get_error_policy() == "raise" )
+local x = { 0, 0 }
+local ok, msg = pcall( opt.optimize, opt, x )
+assert( not ok and tostring( msg ):find( "bad point" ) and calls() == 5, "raise" )
+local m, count = opt:last_error()
+assert( m:find( "bad point" ) and count == 1 )
+
+-- stop: FORCED_STOP instead of an error, without further evaluations
+opt, calls = make( "stop" )
+assert( opt:optimize( { 0, 0 } ) == nlopt.result.FORCED_STOP and calls() == 5, "stop" )
+
+-- nan and penalty: the optimization goes on and counts the errors
+for _, policy in ipairs( { "nan", "penalty" } ) do
+	opt, calls = make( policy, 1e10 )
+	local p, penalty = opt:get_error_policy()
+	assert( p == policy )
+	local res = opt:optimize( { 0, 0 } )
+	m, count = opt:last_error()
+	assert( res ~= nlopt.result.FORCED_STOP and count > 1, policy )
+end
+
+-- penalty: a failing constraint counts as violated
+opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+opt:set_min_objective( function( n, x ) return x[1] ^ 2 + x[2] ^ 2 end )
+opt:add_inequality_constraint( function( n, x )
+	if x[1] > 0.5 then
+		error( "outside" )
+	end
+	return 0.25 - x[1]
+end, nil, 1e-8 )
+opt:set_error_policy( "penalty" )
+opt:set_maxeval( 500 )
+x = { 0.3, 1 }
+local res = opt:optimize( x )
+assert( res > 0 and x[1] >= 0.25 - 1e-4 and x[1] <= 0.5, "constraint under the penalty policy" )
+
+-- a successful run clears last_error
+opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 1 )
+opt:set_min_objective( function( n, x ) return x[1] ^ 2 end )
+opt:set_maxeval( 20 )
+opt:optimize( { 1 } )
+assert( opt:last_error() == nil )
+print( "ok" )
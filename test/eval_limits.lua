@@ -0,0 +1,38 @@
+-- Smoke test of nlopt_opt:set_eval_limits (user-032).
+-- usage: lua eval_limits.lua
+-- Evaluations which loop are aborted by the instruction and time limits; the optimization
+-- goes on and the aborted evaluations are counted.
+
+local nlopt = require "LuaNLopt"
+
+local function run( limits )
+	local opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+	local calls = 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		if calls % 7 == 0 then
+			while true do end
+		end
+		return ( x[1] - 1 ) ^ 2 + x[2] ^ 2
+	end )
+	opt:add_inequality_constraint( function( n, x )
+		if calls % 11 == 0 then
+			while true do end
+		end
+		return x[1] - 2
+	end, nil, 0 )
+	opt:set_eval_limits( limits )
+	opt:set_maxeval( 100 )
+	local x = { 0, 1 }
+	local res, f = opt:optimize( x )
+	local stats = opt:get_eval_limits()
+	assert( stats.exceeded > 0, "no evaluation aborted" )
+	return res, x, stats
+end
+
+local res, x, stats = run{ max_instructions = 100000 }
+assert( stats.max_instructions == 100000 )
+local t = os.clock()
+res, x, stats = run{ max_seconds = 0.05 }
+assert( os.clock() - t < 10, "time limit not applied" )
+print( "ok", stats.exceeded )
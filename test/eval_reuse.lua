@@ -0,0 +1,42 @@
+-- Smoke test of nlopt_opt:set_eval_reuse (user-047).
+-- usage: lua eval_reuse.lua
+
+local nlopt = require "LuaNLopt"
+
+local opt = nlopt.create( nlopt.algorithm.LN_NELDERMEAD, 2 )
+local calls = 0
+opt:set_min_objective( function( n, x )
+	calls = calls + 1
+	return ( x[1] - 1 ) ^ 2 + ( x[2] - 1 ) ^ 2
+end )
+opt:set_eval_reuse{ tol = 1e-4 }
+opt:set_maxeval( 1000 )
+opt:set_ftol_abs( 0 )
+opt:set_xtol_abs1( 0 )
+opt:set_stopval( -1 )
+local x = { 0, 0 }
+local res, f = opt:optimize( x )
+local st = opt:get_eval_reuse_stats()
+assert( st.misses == calls, "misses" )
+assert( st.hits > 0 and st.max_distance <= 1e-4 and st.exact <= st.hits, "no reuse" )
+assert( math.abs( x[1] - 1 ) < 1e-2, "reused values misled the search" )
+print( string.format( "%d of %d requests reused, hit rate %.2f", st.hits, st.hits + st.misses, st.hit_rate ) )
+
+-- strict: requests with gradient are only answered for identical points
+local lbfgs = nlopt.create( nlopt.algorithm.LD_LBFGS, 2 )
+lbfgs:set_min_objective( function( n, x, grad )
+	if grad then
+		grad[1] = 2 * ( x[1] - 1 )
+		grad[2] = 2 * ( x[2] - 1 )
+	end
+	return ( x[1] - 1 ) ^ 2 + ( x[2] - 1 ) ^ 2
+end )
+lbfgs:set_eval_reuse{ tol = 1e-3, strict = true }
+lbfgs:set_maxeval( 100 )
+res, f = lbfgs:optimize{ 0, 0 }
+assert( res > 0 and f < 1e-10 )
+assert( lbfgs:get_eval_reuse_stats().max_distance == 0 )
+
+opt:set_eval_reuse( nil )
+assert( opt:get_eval_reuse_stats() == nil )
+print( "ok" )
@@ -0,0 +1,39 @@
+-- Smoke test of nlopt_opt:set_eval_store (user-046).
+-- usage: lua eval_store.lua
+-- A second run with the same store must be answered from the file without calling Lua.
+
+local nlopt = require "LuaNLopt"
+
+local path = os.tmpname()
+os.remove( path )
+
+local function run( model )
+	local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 3 )
+	local calls = 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		return ( x[1] - 1 ) ^ 2 + ( x[2] - 2 ) ^ 2 + ( x[3] - 3 ) ^ 2
+	end )
+	opt:set_eval_store( path, { model = model, capacity = 1000 } )
+	opt:set_maxeval( 300 )
+	local x = { 0, 0, 0 }
+	local res, f = opt:optimize( x )
+	assert( res > 0 )
+	return f, calls, opt:get_eval_store_stats()
+end
+
+local f1, calls1, st1 = run( "a" )
+assert( calls1 > 0 and st1.misses == calls1 and st1.stored == calls1 and st1.capacity == 1024 )
+local f2, calls2, st2 = run( "a" )
+assert( f2 == f1 and calls2 == 0 and st2.misses == 0, "second run not served by the store" )
+assert( st2.records == st1.records and st2.path == path and st2.model == "a" )
+local f3, calls3 = run( "b" )
+assert( calls3 == calls1, "the model doesn't separate the records" )
+
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 4 )
+opt:set_min_objective( function( n, x ) return 0 end )
+assert( not pcall( opt.set_eval_store, opt, path ), "a store of another dimension was accepted" )
+opt:set_eval_store( false )
+assert( opt:get_eval_store_stats() == nil )
+os.remove( path )
+print( "ok" )
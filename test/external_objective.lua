@@ -0,0 +1,44 @@
+-- Smoke test of nlopt.external_objective (user-045).
+-- usage: lua external_objective.lua
+-- Uses awk as the simulator; needs a POSIX shell.
+
+local nlopt = require "LuaNLopt"
+
+if package.config:sub( 1, 1 ) == "\\" then
+	print( "skipped: the simulator is an awk script" )
+	return
+end
+
+-- f = (x1 - 1)^2 + (x2 + 2)^2 and its gradient if the flag is 1
+local sim = [[awk '{ f = ($2 - 1)^2 + ($3 + 2)^2; if( $1 == 1 ) printf "%.17g %.17g %.17g\n", f, 2 * ($2 - 1), 2 * ($3 + 2); else printf "%.17g\n", f; fflush() }']]
+
+local obj = nlopt.external_objective{ cmd = sim, instances = 2, dim = 2, timeout = 10 }
+assert( obj:dimension() == 2 )
+local f, g = obj:eval{ 0, 0 }
+assert( f == 5 and g[1] == -2 and g[2] == 4, "eval" )
+
+for _, algorithm in ipairs( { nlopt.algorithm.LN_SBPLX, nlopt.algorithm.LD_MMA } ) do
+	local opt = nlopt.create( algorithm, 2 )
+	opt:set_min_objective( obj )
+	opt:set_xtol_abs1( 1e-8 )
+	opt:set_maxeval( 500 )
+	local x = { 0, 0 }
+	local res, fmin = opt:optimize( x )
+	assert( res > 0 and fmin < 1e-8 and math.abs( x[2] + 2 ) < 1e-3, "optimize" )
+end
+
+-- pipelined batches over the instances
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+opt:set_lower_bounds1( -3 )
+opt:set_upper_bounds1( 3 )
+opt:set_min_objective( obj )
+local m = opt:sample{ count = 64, threads = 2 }
+for i = 1, 64 do
+	local r = m:row( i )
+	assert( r[3] == ( r[1] - 1 ) ^ 2 + ( r[2] + 2 ) ^ 2, "sample row " .. i )
+end
+
+-- a simulator which doesn't reply raises its message outside of an optimization
+local silent = nlopt.external_objective{ cmd = "cat > /dev/null", timeout = 0.5 }
+assert( not pcall( silent.eval, silent, { 0 } ) )
+print( "ok" )
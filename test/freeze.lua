@@ -0,0 +1,64 @@
+-- Smoke test of nlopt_opt:freeze (user-042).
+-- usage: lua freeze.lua
+
+local nlopt = require "LuaNLopt"
+
+local function f( n, x, grad )
+	local s = 0
+	for i = 1, n do
+		s = s + i * ( x[i] - 1 ) ^ 2
+		if grad then
+			grad[i] = 2 * i * ( x[i] - 1 )
+		end
+	end
+	return s
+end
+
+for _, algorithm in ipairs( { nlopt.algorithm.LN_SBPLX, nlopt.algorithm.LD_MMA } ) do
+	local opt = nlopt.create( algorithm, 4 )
+	opt:set_min_objective( function( n, x, grad )
+		assert( n == 4 and #x == 4, "the objective gets the full x" )
+		return f( n, x, grad )
+	end )
+	opt:set_xtol_rel( 1e-8 )
+	opt:set_maxeval( 2000 )
+	opt:freeze{ [2] = 0.5, [4] = -1 }
+	local x = { 0, 0, 0, 0 }
+	local res, fmin = opt:optimize( x )
+	assert( res > 0 and x[2] == 0.5 and x[4] == -1, "frozen values" )
+	assert( math.abs( x[1] - 1 ) < 1e-4 and math.abs( x[3] - 1 ) < 1e-4, "free values" )
+	opt:freeze()
+	res, fmin = opt:optimize( x )
+	assert( res > 0 and fmin < 1e-8, "released" )
+end
+
+-- a local optimizer is reduced as well
+local opt = nlopt.create( nlopt.algorithm.AUGLAG, 3 )
+local inner = nlopt.create( nlopt.algorithm.LN_SBPLX, 3 )
+inner:set_xtol_rel( 1e-8 )
+inner:set_maxeval( 500 )
+opt:set_local_optimizer( inner )
+opt:set_min_objective( f )
+opt:add_inequality_constraint( function( n, x ) return x[1] + x[3] - 1 end, nil, 1e-8 )
+opt:set_maxeval( 5000 )
+opt:freeze{ [2] = 2 }
+local x = { 0, 0, 0 }
+assert( opt:optimize( x ) > 0 and x[2] == 2 and x[1] + x[3] <= 1 + 1e-4 )
+
+-- a preconditioner is restricted to the free variables
+opt = nlopt.create( nlopt.algorithm.LD_CCSAQ, 3 )
+opt:set_precond_min_objective( f, nlopt.precond_diagonal{ 2, 4, 6 } )
+opt:set_xtol_rel( 1e-8 )
+opt:set_maxeval( 500 )
+opt:freeze{ [1] = 3 }
+x = { 0, 0, 0 }
+assert( opt:optimize( x ) > 0 and x[1] == 3 and math.abs( x[2] - 1 ) < 1e-4 )
+
+-- not supported with X_BAYESOPT
+opt = nlopt.create( nlopt.algorithm.X_BAYESOPT, 2 )
+opt:set_lower_bounds1( -1 )
+opt:set_upper_bounds1( 1 )
+opt:set_min_objective( f )
+opt:freeze{ [1] = 0 }
+assert( opt:optimize{ 0, 0 } == nlopt.result.INVALID_ARGS )
+print( "ok" )
@@ -0,0 +1,38 @@
+-- Smoke test of nlopt_opt:set_incremental (user-028).
+-- usage: lua incremental.lua
+-- Checks the changed indices and prev_f passed to the objective against a copy of x.
+
+local nlopt = require "LuaNLopt"
+
+local n = 6
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, n )
+local prev, prevf, calls = nil, nil, 0
+opt:set_min_objective( function( n, x, grad, data, changed, prev_f )
+	calls = calls + 1
+	if prev == nil then
+		assert( changed == nil and prev_f == nil, "changed on the first call" )
+		prev = {}
+	else
+		assert( prev_f == prevf, "prev_f is not the previous value" )
+		local listed = {}
+		for _, i in ipairs( changed ) do
+			listed[i] = true
+		end
+		for i = 1, n do
+			assert( ( x[i] ~= prev[i] ) == ( listed[i] == true ), "changed is wrong at " .. i )
+		end
+	end
+	local f = 0
+	for i = 1, n do
+		prev[i] = x[i]
+		f = f + ( x[i] - i ) ^ 2
+	end
+	prevf = f
+	return f
+end )
+opt:set_incremental( true )
+opt:set_maxeval( 500 )
+local x = { 0, 0, 0, 0, 0, 0 }
+local res, f = opt:optimize( x )
+assert( res > 0 and calls > 1 )
+print( "ok", calls, f )
@@ -0,0 +1,45 @@
+-- Smoke test of nlopt_opt:set_metrics and nlopt.metrics_dump (user-050).
+-- usage: lua metrics.lua
+-- While it runs, tracing/nlopt-top shows the metrics of the process. Skipped on Windows.
+
+local nlopt = require "LuaNLopt"
+
+if package.config:sub( 1, 1 ) == "\\" then
+	print( "skipped: live metrics are not available on Windows" )
+	return
+end
+
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+local calls = 0
+opt:set_min_objective( function( n, x )
+	calls = calls + 1
+	return ( x[1] - 1 ) ^ 2 + x[2] ^ 2 + 1
+end )
+opt:set_maxeval( 300 )
+local name = opt:set_metrics( "smoke" )
+assert( name:find( "^/luanlopt%." ), name )
+opt:optimize{ 0, 0 }
+opt:optimize{ 2, 2 }
+
+local path = os.tmpname()
+assert( nlopt.metrics_dump( path ) )
+local f = assert( io.open( path ) )
+local text = f:read( "*a" )
+f:close()
+os.remove( path )
+local function value( metric )
+	local v = text:match( metric .. '{[^}]*label="smoke"[^}]*} ([^\n]+)' )
+	return tonumber( v )
+end
+assert( value( "luanlopt_evaluations_total" ) == calls, "evaluations" )
+assert( value( "luanlopt_runs_total" ) == 2 and value( "luanlopt_running" ) == 0, "runs" )
+assert( math.abs( value( "luanlopt_best_f" ) - 1 ) < 1e-6, "best_f" )
+
+opt:set_metrics( false )
+assert( nlopt.metrics_dump( path ) )
+f = assert( io.open( path ) )
+text = f:read( "*a" )
+f:close()
+os.remove( path )
+assert( not text:find( 'label="smoke"', 1, true ), "still published" )
+print( "ok" )
@@ -0,0 +1,52 @@
+-- Smoke test of nlopt_opt:set_min_objective_sum (user-027).
+-- usage: lua objective_sum.lua
+-- The sum of terms must not depend on the number of threads; aborted evaluations must not
+-- keep the optimization from converging; the worker states only see f_data, not globals.
+
+local nlopt = require "LuaNLopt"
+
+local n, terms = 4, 64
+local data = {}
+for i = 1, terms do
+	data[i] = ( i % n ) + 1
+end
+
+local function term( i, n, x, grad, d )
+	local j = ( i % n ) + 1
+	local r = x[j] - d[i] / 10
+	if grad then
+		grad[j] = 2 * r
+	end
+	return r * r
+end
+
+local function run( options, algorithm )
+	local opt = nlopt.create( algorithm or nlopt.algorithm.LN_SBPLX, n )
+	options.f_data = data
+	opt:set_min_objective_sum( term, terms, options )
+	opt:set_maxeval( 2000 )
+	opt:set_ftol_abs( 1e-12 )
+	local x = { 0, 0, 0, 0 }
+	local res, f = opt:optimize( x )
+	assert( res > 0, "optimize returned " .. res )
+	return f, x
+end
+
+local f1, x1 = run( { threads = 1 } )
+local f4, x4 = run( { threads = 4 } )
+assert( f1 == f4, "the sum depends on the number of threads" )
+for i = 1, n do
+	assert( x1[i] == x4[i] )
+end
+local fa = run( { threads = 2, abort_above_best = true, round = 8 }, nlopt.algorithm.LN_NELDERMEAD )
+assert( math.abs( fa - f1 ) < 1e-6, "aborted evaluations changed the minimum" )
+run( { threads = 1 }, nlopt.algorithm.LD_MMA )
+
+-- a term using a global fails in the worker states with a hint at f_data
+scale = 2
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, n )
+opt:set_min_objective_sum( function( i, n, x ) return scale * x[1] ^ 2 end, terms, { threads = 2 } )
+opt:set_maxeval( 10 )
+local ok, msg = pcall( opt.optimize, opt, { 1, 1, 1, 1 } )
+assert( not ok and tostring( msg ):find( "f_data" ), "missing hint at f_data: " .. tostring( msg ) )
+print( "ok" )
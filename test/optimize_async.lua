@@ -0,0 +1,55 @@
+-- Smoke test of nlopt_opt:optimize_async (user-033).
+-- usage: lua optimize_async.lua
+
+local nlopt = require "LuaNLopt"
+
+local function term( i, n, x, grad )
+	local r = x[1 + ( i % n )] - i / 100
+	if grad then
+		grad[1 + ( i % n )] = 2 * r
+	end
+	return r * r
+end
+
+-- chained Rosenbrock terms, slow to converge
+local function rosenbrock( i, n, x, grad )
+	local j = 1 + ( i % ( n - 1 ) )
+	local a, b = 1 - x[j], x[j + 1] - x[j] * x[j]
+	if grad then
+		grad[j] = -2 * a - 400 * x[j] * b
+		grad[j + 1] = 200 * b
+	end
+	return a * a + 100 * b * b
+end
+
+local opt = nlopt.create( nlopt.algorithm.LD_MMA, 3 )
+opt:set_min_objective_sum( term, 300, { threads = 2 } )
+opt:set_xtol_rel( 1e-8 )
+opt:set_maxeval( 500 )
+local x = { 0, 0, 0 }
+local h = opt:optimize_async( x )
+assert( x[1] == 0, "x was modified" )
+assert( h:wait( 60 ), "not done" )
+assert( h:done() )
+local res, f, xa = h:result()
+local evals, best = h:progress()
+assert( res > 0 and evals > 0 and best >= f and h:stats().evals == evals )
+local res2, f2 = opt:optimize( x )
+assert( f2 == f and x[1] == xa[1], "async result differs from optimize" )
+
+-- cancel stops the background run with FORCED_STOP
+local slow = nlopt.create( nlopt.algorithm.LD_MMA, 3 )
+slow:set_min_objective_sum( rosenbrock, 200000, { threads = 2 } )
+slow:set_maxtime( 60 )
+h = slow:optimize_async( { -1, 1, -1 } )
+h:cancel()
+res = h:result()
+assert( res == nlopt.result.FORCED_STOP, "cancel" )
+
+-- a Lua objective runs before optimize_async returns
+local lua = nlopt.create( nlopt.algorithm.LN_SBPLX, 1 )
+lua:set_min_objective( function( n, x ) return ( x[1] - 3 ) ^ 2 end )
+lua:set_maxeval( 100 )
+h = lua:optimize_async( { 0 } )
+assert( h:done() )
+print( "ok" )
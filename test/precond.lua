@@ -0,0 +1,51 @@
+-- Smoke test of the preconditioned objectives (user-038).
+-- usage: lua precond.lua
+-- LD_CCSAQ on an ill-conditioned quadratic with the exact Hessian given as Lua function,
+-- diagonal, sparse matrix and finite differences.
+
+local nlopt = require "LuaNLopt"
+
+local n = 4
+local h = { 1, 10, 100, 1000 }
+local function f( n, x, grad )
+	local s = 0
+	for i = 1, n do
+		s = s + 0.5 * h[i] * ( x[i] - 1 ) ^ 2
+		if grad then
+			grad[i] = h[i] * ( x[i] - 1 )
+		end
+	end
+	return s
+end
+
+local function run( pre )
+	local opt = nlopt.create( nlopt.algorithm.LD_CCSAQ, n )
+	assert( opt:set_precond_min_objective( f, pre ) > 0 )
+	opt:set_xtol_rel( 1e-8 )
+	opt:set_maxeval( 500 )
+	local x = { 0, 0, 0, 0 }
+	local res, fmin = opt:optimize( x )
+	assert( res > 0 and fmin < 1e-8, "optimize" )
+	for i = 1, n do
+		assert( math.abs( x[i] - 1 ) < 1e-4 )
+	end
+end
+
+run( function( n, x, v, vpre )
+	assert( #v == n and #vpre == n )
+	for i = 1, n do
+		vpre[i] = h[i] * v[i]
+	end
+end )
+local d = nlopt.precond_diagonal( h )
+assert( d:dimension() == n )
+run( d )
+run( nlopt.precond_csr( n, { 1, 2, 3, 4, 5 }, { 1, 2, 3, 4 }, h ) )
+run( nlopt.precond_fd_hessian() )
+
+-- invalid entries are rejected
+assert( not pcall( nlopt.precond_diagonal, { 1, -1 } ) )
+assert( not pcall( nlopt.precond_diagonal, { 1, "x" } ) )
+assert( not pcall( nlopt.precond_diagonal, { 1, 0 / 0 } ) )
+assert( not pcall( nlopt.precond_csr, 2, { 1, 2, 3 }, { 1, 2 }, { 1, "x" } ) )
+print( "ok" )
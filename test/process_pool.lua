@@ -0,0 +1,60 @@
+-- Smoke test of nlopt_opt:set_process_pool (user-044).
+-- usage: lua process_pool.lua
+-- Samples with a Lua objective in forked workers, one of which crashes; the results must
+-- equal those evaluated in the calling process. Skipped on Windows.
+
+local nlopt = require "LuaNLopt"
+
+if package.config:sub( 1, 1 ) == "\\" then
+	print( "skipped: process pools are not available on Windows" )
+	return
+end
+
+local function make()
+	local opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+	opt:set_lower_bounds{ 0, 0 }
+	opt:set_upper_bounds{ 1, 1 }
+	opt:set_min_objective( function( n, x ) return ( x[1] - 0.25 ) ^ 2 + x[2] end )
+	return opt
+end
+
+local plain = make():sample{ count = 32 }
+local opt = make()
+opt:set_process_pool{ workers = 3 }
+local pooled = opt:sample{ count = 32 }
+for i = 1, 32 do
+	assert( pooled:get( i, 3 ) == plain:get( i, 3 ), "row " .. i )
+end
+local st = opt:get_process_pool_stats()
+assert( st.workers == 3 and st.evaluations == 32 and st.failed == 0 )
+
+-- a crashing worker is restarted; the point which crashes every time fails with NaN
+local c1, c2 = plain:get( 3, 1 ), plain:get( 3, 2 )
+opt:set_min_objective( function( n, x )
+	if x[1] == c1 and x[2] == c2 then
+		os.exit( 1 )
+	end
+	return x[1]
+end )
+opt:set_error_policy( "nan" )
+local m = opt:sample{ count = 8 }
+local nan = 0
+for i = 1, 8 do
+	local f = m:get( i, 3 )
+	if f ~= f then
+		nan = nan + 1
+	end
+end
+st = opt:get_process_pool_stats()
+assert( nan == 1 and m:get( 3, 3 ) ~= m:get( 3, 3 ), "crash handling" )
+assert( st.restarts >= 3 and st.failed == 1 )
+
+-- errors in the workers go to the error policy of the caller
+opt:set_min_objective( function( n, x ) error( "worker error" ) end )
+opt:set_error_policy( "raise" )
+assert( not pcall( opt.sample, opt, { count = 4 } ) )
+assert( opt:last_error():find( "worker error" ) )
+
+opt:set_process_pool( false )
+assert( opt:get_process_pool_stats() == nil )
+print( "ok" )
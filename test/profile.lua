@@ -0,0 +1,33 @@
+-- Smoke test of nlopt.profile_start and profile_stop (user-049).
+-- usage: lua profile.lua [ trace.json ]
+-- Writes a timeline of optimizations on threads and in Lua; open it with chrome://tracing
+-- or Perfetto.
+
+local nlopt = require "LuaNLopt"
+
+local path = arg and arg[1] or os.tmpname()
+assert( nlopt.profile_stop() == nil, "stopped without start" )
+nlopt.profile_start( path )
+
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+opt:set_min_objective( function( n, x ) return ( x[1] - 1 ) ^ 2 + x[2] ^ 2 end )
+opt:set_maxeval( 200 )
+opt:optimize{ 0, 0 }
+
+local sum = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+sum:set_min_objective_sum( function( i, n, x ) return ( x[1] - i / 100 ) ^ 2 + x[2] ^ 2 end, 100, { threads = 3 } )
+sum:set_maxeval( 100 )
+sum:optimize_async{ 0, 0 }:result()
+
+local st = assert( nlopt.profile_stop() )
+assert( st.spans > 200 and st.threads >= 2 and st.dropped == 0, "spans" )
+local f = assert( io.open( path ) )
+local json = f:read( "*a" )
+f:close()
+for _, name in ipairs( { "optimize", "func", "marshal", "task" } ) do
+	assert( json:find( '"name":"' .. name .. '"', 1, true ), "no " .. name .. " span" )
+end
+if not ( arg and arg[1] ) then
+	os.remove( path )
+end
+print( "ok", st.spans, st.threads )
@@ -0,0 +1,47 @@
+-- Smoke test of nlopt_opt:set_realtime (user-040).
+-- usage: lua realtime.lua
+-- Repeated re-solves in real-time mode must not allocate in Lua once warmed up.
+
+local nlopt = require "LuaNLopt"
+
+local n = 6
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, n )
+local target = 0
+opt:set_min_objective( function( n, x )
+	local f = 0
+	for i = 1, n do
+		local d = x[i] - target
+		f = f + d * d
+	end
+	return f
+end )
+opt:set_lower_bounds1( -10 )
+opt:set_upper_bounds1( 10 )
+opt:set_maxeval( 200 )
+opt:set_realtime{ gc = "pause" }
+local x = {}
+for k = 1, 50 do
+	target = k / 50
+	for i = 1, n do
+		x[i] = 0
+	end
+	local res = opt:optimize( x )
+	assert( res > 0 )
+	local _, lb = opt:get_lower_bounds()
+	assert( lb[n] == -10 )
+end
+local st = opt:get_realtime_stats()
+assert( st.runs == 50 and st.max_seconds >= st.last_seconds, "stats" )
+print( "allocations", st.allocations, "bytes", st.bytes )
+
+-- the bound and step functions work the same in real-time mode
+opt:set_xtol_abs1( 1e-6 )
+local _, tol = opt:get_xtol_abs()
+assert( tol[1] == 1e-6 )
+opt:set_initial_step1( 0.5 )
+local _, dx = opt:get_initial_step( x )
+assert( dx[n] == 0.5 )
+
+opt:set_realtime( false )
+assert( opt:optimize( x ) > 0 )
+print( "ok" )
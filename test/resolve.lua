@@ -0,0 +1,37 @@
+-- Smoke test of nlopt_opt:resolve (user-041).
+-- usage: lua resolve.lua
+-- A stream of slowly moving targets; each re-solve starts from the previous solution and
+-- must find the new minimum.
+
+local nlopt = require "LuaNLopt"
+
+local n = 3
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, n )
+opt:set_min_objective( function( n, x, grad, target )
+	local f = 0
+	for i = 1, n do
+		f = f + ( x[i] - target[i] ) ^ 2
+	end
+	return f
+end, { 0, 0, 0 } )
+opt:set_xtol_abs1( 1e-7 )
+opt:set_maxeval( 1000 )
+local x = { 1, 1, 1 }
+assert( opt:optimize( x ) > 0 )
+
+for _, step in ipairs( { "adaptive", "keep", "default" } ) do
+	for k = 1, 10 do
+		local target = { k / 100, -k / 100, 0.5 }
+		local out = { 0, 0, 0 }
+		local res, f = opt:resolve( target, ( k % 2 == 0 ) and { step = step, x = out } or { step = step } )
+		assert( res > 0 and f < 1e-8, step .. ": re-solve " .. k )
+		if k % 2 == 0 then
+			assert( math.abs( out[1] - target[1] ) < 1e-3, step .. ": solution not written to options.x" )
+		end
+	end
+end
+
+-- without f_data the registered one is kept
+local res, f = opt:resolve()
+assert( res > 0 and f < 1e-8 )
+print( "ok" )
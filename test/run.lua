@@ -0,0 +1,36 @@
+-- Runs the smoke tests of this directory, each in its own interpreter.
+-- usage (in this directory): lua run.lua [ name ... ]
+-- Needs LuaNLopt on the package.cpath of the interpreter running this script.
+
+local tests = {
+	"datasets", "objective_sum", "incremental", "delta_marshalling", "cancel_token",
+	"error_policy", "eval_limits", "optimize_async", "scheduler", "sample",
+	"surrogate", "bayesopt", "precond", "unpacked", "realtime",
+	"resolve", "freeze", "block_coordinate", "process_pool", "external_objective",
+	"eval_store", "eval_reuse", "tracepoints", "profile", "metrics",
+}
+if arg and arg[1] then
+	tests = { unpack( arg ) }
+end
+
+-- the interpreter which runs this script
+local lua = "lua"
+if arg then
+	local i = -1
+	while arg[i] do
+		lua = arg[i]
+		i = i - 1
+	end
+end
+
+local failed = {}
+for _, name in ipairs( tests ) do
+	io.write( name, ": " )
+	io.flush()
+	local rc = os.execute( string.format( '%s %s.lua', lua, name ) )
+	if rc ~= 0 and rc ~= true then
+		failed[#failed + 1] = name
+	end
+end
+print( string.format( "%d of %d tests failed %s", #failed, #tests, table.concat( failed, " " ) ) )
+os.exit( ( #failed == 0 ) and 0 or 1 )
@@ -0,0 +1,41 @@
+-- Smoke test of nlopt_opt:sample (user-035).
+-- usage: lua sample.lua
+
+local nlopt = require "LuaNLopt"
+
+local opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+opt:set_lower_bounds{ -1, -1 }
+opt:set_upper_bounds{ 1, 2 }
+opt:set_min_objective( function( n, x ) return ( x[1] - 0.5 ) ^ 2 + ( x[2] - 1 ) ^ 2 end )
+opt:add_inequality_constraint( function( n, x ) return x[1] + x[2] - 1.5 end, nil, 0 )
+opt:set_xtol_rel( 1e-6 )
+opt:set_maxeval( 200 )
+
+for _, method in ipairs( { "sobol", "halton", "lhs" } ) do
+	local m = opt:sample{ count = 64, method = method, seed = 7 }
+	assert( m:rows() == 64 and m:cols() == 4 and m:dimension() == 2, method )
+	for i = 1, m:rows() do
+		local r = m:row( i )
+		assert( r[1] >= -1 and r[1] <= 1 and r[2] >= -1 and r[2] <= 2, method .. ": outside the bounds" )
+		assert( r[3] == ( r[1] - 0.5 ) ^ 2 + ( r[2] - 1 ) ^ 2 and m:get( i, 4 ) == r[4] )
+		assert( m:feasible( i ) == ( r[4] <= 0 ) )
+	end
+	local best = m:best( 3 )
+	assert( #best >= 1 and #best[1] == 2 )
+	local x = best[1]
+	local res = opt:optimize( x )
+	assert( res > 0, method .. ": optimize from the best sample" )
+end
+
+-- lhs is reproducible by seed
+local a = opt:sample{ count = 16, method = "lhs", seed = 3 }
+local b = opt:sample{ count = 16, method = "lhs", seed = 3 }
+for i = 1, 16 do
+	assert( a:get( i, 1 ) == b:get( i, 1 ) )
+end
+
+-- unbounded boxes are rejected
+local free = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+free:set_min_objective( function( n, x ) return 0 end )
+assert( not pcall( free.sample, free, { count = 4 } ) )
+print( "ok" )
@@ -0,0 +1,54 @@
+-- Smoke test of nlopt.scheduler (user-034).
+-- usage: lua scheduler.lua
+
+local nlopt = require "LuaNLopt"
+
+local function term( i, n, x, grad )
+	local j = 1 + ( i % n )
+	local r = x[j] - j
+	if grad then
+		grad[j] = 2 * r
+	end
+	return r * r
+end
+
+-- chained Rosenbrock terms, slow to converge
+local function rosenbrock( i, n, x, grad )
+	local j = 1 + ( i % ( n - 1 ) )
+	local a, b = 1 - x[j], x[j + 1] - x[j] * x[j]
+	if grad then
+		grad[j] = -2 * a - 400 * x[j] * b
+		grad[j + 1] = 200 * b
+	end
+	return a * a + 100 * b * b
+end
+
+local s = nlopt.scheduler{ cores = 2 }
+local jobs = {}
+for k = 1, 6 do
+	local opt = nlopt.create( nlopt.algorithm.LD_MMA, 4 )
+	opt:set_min_objective_sum( term, 100, { threads = 2 } )
+	opt:set_xtol_rel( 1e-8 )
+	opt:set_maxeval( 300 )
+	jobs[k] = s:submit( opt, { 0, 0, 0, 0 }, { priority = k % 3 } )
+end
+for k = 1, #jobs do
+	local res, f = jobs[k]:result()
+	assert( res > 0, "job " .. k )
+	local st = jobs[k]:stats()
+	assert( st.evals > 0 and st.queue_wait >= 0 and st.priority == k % 3 )
+end
+local st = s:stats()
+assert( st.cores == 2 and st.submitted == 6 and st.finished == 6 )
+
+-- a job still running at its deadline is stopped
+local opt = nlopt.create( nlopt.algorithm.LD_MMA, 4 )
+opt:set_min_objective_sum( rosenbrock, 200000, { threads = 2 } )
+local res = s:submit( opt, { -1, 1, -1, 1 }, { deadline = 0.2 } ):result()
+assert( res == nlopt.result.FORCED_STOP, "deadline" )
+
+-- Lua objectives can't run on the scheduler's threads
+local lua = nlopt.create( nlopt.algorithm.LN_SBPLX, 1 )
+lua:set_min_objective( function( n, x ) return x[1] ^ 2 end )
+assert( not pcall( s.submit, s, lua, { 1 } ) )
+print( "ok" )
@@ -0,0 +1,36 @@
+-- Smoke test of nlopt_opt:set_surrogate (user-036).
+-- usage: lua surrogate.lua
+-- A smooth derivative-free problem; the model must answer some of the requests, and the
+-- minimum found must be close to the one found without surrogate.
+
+local nlopt = require "LuaNLopt"
+
+local function run( options )
+	local opt = nlopt.create( nlopt.algorithm.LN_NELDERMEAD, 3 )
+	local calls = 0
+	opt:set_min_objective( function( n, x )
+		calls = calls + 1
+		return ( x[1] - 1 ) ^ 2 + 2 * ( x[2] + 1 ) ^ 2 + 3 * x[3] ^ 2 + 1
+	end )
+	opt:set_surrogate( options )
+	opt:set_maxeval( 600 )
+	opt:set_ftol_abs( 1e-10 )
+	local x = { 0, 0, 1 }
+	local res, f = opt:optimize( x )
+	assert( res > 0 )
+	return f, calls, opt:get_surrogate_stats()
+end
+
+local f0, calls0, none = run( nil )
+assert( none == nil )
+for _, model in ipairs( { "quadratic", "rbf" } ) do
+	for _, mode in ipairs( { "screen", "answer" } ) do
+		local f, calls, st = run{ model = model, mode = mode }
+		assert( st.calls > 0 and st.hits >= 0 and st.validations >= 0 and st.history <= calls )
+		assert( st.calls == st.hits + calls, model .. "/" .. mode .. ": calls" )
+		assert( f - 1 < 1e-3, model .. "/" .. mode .. ": minimum missed" )
+		print( string.format( "%-9s %-6s %d of %d evaluations, hit rate %.2f, f %.8g (%.8g without)",
+			model, mode, calls, st.calls, st.hit_rate, f, f0 ) )
+	end
+end
+print( "ok" )
@@ -0,0 +1,28 @@
+-- Smoke test of the USDT tracepoints (user-048).
+-- usage: lua tracepoints.lua
+-- The probes are nops unless a tracer is attached; this checks that the instrumented paths
+-- still work, including failing callbacks. To watch the probes run e.g.
+--   bpftrace ../tracing/luanlopt_latency.bt -c "lua tracepoints.lua"
+
+local nlopt = require "LuaNLopt"
+
+local opt = nlopt.create( nlopt.algorithm.LN_COBYLA, 2 )
+local calls = 0
+opt:set_min_objective( function( n, x )
+	calls = calls + 1
+	if calls % 10 == 0 then
+		error( "probe error" )
+	end
+	return x[1] ^ 2 + x[2] ^ 2
+end )
+opt:add_inequality_mconstraint( 1, function( m, result, n, x )
+	result[1] = 1 - x[1] - x[2]
+end, nil, { 1e-8 } )
+opt:set_error_policy( "nan" )
+opt:set_maxeval( 200 )
+for k = 1, 3 do
+	local res = opt:optimize{ 1, 1 }
+	assert( res ~= nil )
+end
+assert( select( 2, opt:last_error() ) > 0 )
+print( "ok" )
@@ -0,0 +1,62 @@
+-- Smoke test of the unpacked objectives of set_min_objective (user-039).
+-- usage: lua unpacked.lua
+-- The unpacked and the table objective must give the same result for each dimension.
+
+local nlopt = require "LuaNLopt"
+
+local function table_objective( n, x, grad )
+	local f = 0
+	for i = 1, n do
+		local d = x[i] - i / 10
+		f = f + d * d
+		if grad then
+			grad[i] = 2 * d
+		end
+	end
+	return f
+end
+
+-- f( x1, ..., xn, f_data, need_grad ) written generically to cover all dimensions
+local function unpacked_objective( n )
+	return function( ... )
+		local args = { ... }
+		local need_grad = args[n + 2]
+		local f, g = 0, {}
+		for i = 1, n do
+			local d = args[i] - i / 10
+			f = f + d * d
+			g[i] = 2 * d
+		end
+		if need_grad then
+			return f, unpack( g, 1, n )
+		end
+		return f
+	end
+end
+
+for n = 1, 16 do
+	for _, algorithm in ipairs( { nlopt.algorithm.LN_SBPLX, nlopt.algorithm.LD_MMA } ) do
+		local results = {}
+		for k, setup in ipairs( {
+			function( opt ) opt:set_min_objective( table_objective ) end,
+			function( opt ) opt:set_min_objective( unpacked_objective( n ), nil, { unpacked = true } ) end } ) do
+			local opt = nlopt.create( algorithm, n )
+			setup( opt )
+			opt:set_xtol_rel( 1e-8 )
+			opt:set_maxeval( 300 )
+			local x = {}
+			for i = 1, n do
+				x[i] = 0
+			end
+			local res, f = opt:optimize( x )
+			assert( res > 0 )
+			results[k] = f
+		end
+		assert( results[1] == results[2], "n = " .. n .. ": unpacked result differs" )
+	end
+end
+
+-- the function is checked when it is set
+local opt = nlopt.create( nlopt.algorithm.LN_SBPLX, 2 )
+assert( not pcall( opt.set_min_objective, opt, 42, nil, { unpacked = true } ) )
+print( "ok" )
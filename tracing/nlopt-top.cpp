@@ -0,0 +1,172 @@
+/*
+* nlopt-top: shows the live metrics which the optimizers of a process publish with
+* opt:set_metrics of LuaNLopt; Linux and other POSIX systems.
+*
+* Build: g++ -O2 -o nlopt-top nlopt-top.cpp (add -lrt with glibc before 2.17)
+* Usage: nlopt-top [ pid | /segment ] [ interval seconds ]
+* Without pid the first segment found in /dev/shm is shown.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Layout as in LuaNLopt.cpp
+typedef long atomic_t;
+
+struct metrics_slot
+{
+	volatile atomic_t d_seq; // odd while the fields after d_errors are written
+	volatile atomic_t d_used;
+	volatile atomic_t d_evals;
+	volatile atomic_t d_errors;
+	long d_runs;
+	long d_running;
+	double d_best;
+	double d_lastImprovement; // CLOCK_MONOTONIC seconds
+	double d_started;
+	char d_label[64];
+};
+
+struct metrics_segment
+{
+	char d_magic[8]; // "NLMETR1"
+	long d_pid;
+	long d_slots;
+	long d_slotSize;
+	metrics_slot d_slot[1]; // d_slots
+};
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
+}
+
+static void read_slot( const metrics_slot* s, metrics_slot& copy )
+{
+	// the mapping is read-only, so plain reads with barriers instead of atomic operations
+	for( ;; )
+	{
+		const long seq = s->d_seq;
+		__sync_synchronize();
+		if( seq & 1 )
+			continue;
+		::memcpy( &copy, const_cast<const metrics_slot*>( s ), sizeof(copy) );
+		__sync_synchronize();
+		if( s->d_seq == seq )
+			return;
+	}
+}
+
+static std::string find_segment()
+{
+	DIR* d = ::opendir( "/dev/shm" );
+	if( d == 0 )
+		return std::string();
+	std::string res;
+	while( struct dirent* e = ::readdir( d ) )
+		if( ::strncmp( e->d_name, "luanlopt.", 9 ) == 0 )
+		{
+			res = std::string( "/" ) + e->d_name;
+			break;
+		}
+	::closedir( d );
+	return res;
+}
+
+static void print_duration( double s )
+{
+	if( s < 60 )
+		::printf( "%8.1fs", s );
+	else if( s < 3600 )
+		::printf( "%8.1fm", s / 60 );
+	else
+		::printf( "%8.1fh", s / 3600 );
+}
+
+int main( int argc, char** argv )
+{
+	std::string name;
+	if( argc > 1 )
+		name = ( argv[1][0] == '/' ) ? std::string( argv[1] ) : std::string( "/luanlopt." ) + argv[1];
+	else
+		name = find_segment();
+	const double interval = ( argc > 2 ) ? ::atof( argv[2] ) : 1.0;
+	if( name.empty() || interval <= 0 )
+	{
+		::fprintf( stderr, "usage: nlopt-top [ pid | /segment ] [ interval seconds ]\n" );
+		return 2;
+	}
+	const int fd = ::shm_open( name.c_str(), O_RDONLY, 0 );
+	struct stat st;
+	if( fd < 0 || ::fstat( fd, &st ) != 0 || size_t( st.st_size ) < sizeof(metrics_segment) )
+	{
+		::fprintf( stderr, "nlopt-top: cannot open %s\n", name.c_str() );
+		return 1;
+	}
+	void* p = ::mmap( 0, size_t( st.st_size ), PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	const metrics_segment* seg = static_cast<const metrics_segment*>( p );
+	if( p == MAP_FAILED || ::memcmp( seg->d_magic, "NLMETR1", 8 ) != 0 ||
+		seg->d_slotSize != long( sizeof(metrics_slot) ) ||
+		sizeof(metrics_segment) + ( seg->d_slots - 1 ) * sizeof(metrics_slot) > size_t( st.st_size ) )
+	{
+		::fprintf( stderr, "nlopt-top: %s is not a LuaNLopt metrics segment of this version\n", name.c_str() );
+		return 1;
+	}
+
+	std::vector<long> prevEvals( seg->d_slots, -1 );
+	std::vector<long> prevErrors( seg->d_slots, 0 );
+	double prevTime = now_seconds();
+	for( ;; )
+	{
+		if( ::kill( pid_t( seg->d_pid ), 0 ) != 0 )
+		{
+			::printf( "process %ld has exited\n", seg->d_pid );
+			return 0;
+		}
+		const double now = now_seconds();
+		const double dt = now - prevTime;
+		prevTime = now;
+		::printf( "\033[H\033[2J%s  pid %ld\n\n", name.c_str(), seg->d_pid );
+		::printf( "%-24s %4s %12s %10s %22s %9s %9s %8s\n", "label", "run", "evals", "evals/s", "best f",
+			"since imp", "elapsed", "errors" );
+		for( long i = 0; i < seg->d_slots; i++ )
+		{
+			metrics_slot s;
+			read_slot( &seg->d_slot[i], s );
+			if( !s.d_used )
+			{
+				prevEvals[i] = -1;
+				continue;
+			}
+			const double rate = ( prevEvals[i] >= 0 && dt > 0 ) ? ( s.d_evals - prevEvals[i] ) / dt : 0.0;
+			const long newErrors = ( prevEvals[i] >= 0 ) ? s.d_errors - prevErrors[i] : 0;
+			const long newEvals = ( prevEvals[i] >= 0 ) ? s.d_evals - prevEvals[i] : 0;
+			prevEvals[i] = s.d_evals;
+			prevErrors[i] = s.d_errors;
+			s.d_label[ sizeof(s.d_label) - 1 ] = 0;
+			::printf( "%-24.24s %4s %12ld %10.1f %22.15g ", s.d_label, ( s.d_running ) ? "yes" : "no",
+				long( s.d_evals ), rate, s.d_best );
+			print_duration( now - s.d_lastImprovement );
+			::printf( " " );
+			print_duration( now - s.d_started );
+			// the error rate of the last interval
+			::printf( " %8ld %5.1f%%\n", long( s.d_errors ),
+				( newEvals + newErrors > 0 ) ? 100.0 * newErrors / ( newEvals + newErrors ) : 0.0 );
+		}
+		::fflush( stdout );
+		::usleep( useconds_t( interval * 1e6 ) );
+	}
+}